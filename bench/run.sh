@@ -0,0 +1,249 @@
+#!/usr/bin/env bash
+#
+# Overhead benchmark. Runs pgbench workloads against a throwaway cluster
+# once per pgtrace configuration and writes TPS and latency percentiles as
+# JSON.
+#
+# Usage: bench/run.sh    (after "make install"; "make bench" runs this)
+#
+# Environment:
+#   PG_CONFIG   pg_config to use (default pg_config)
+#   PGPORT      port of the throwaway cluster (default 54330)
+#   DURATION    seconds per run (default 30)
+#   CLIENTS     pgbench clients (default 4)
+#   JOBS        pgbench threads (default 4)
+#   SCALE       pgbench scale factor (default 10)
+#   CONFIGS     configurations to run (default: all of them, see below)
+#   WORKLOADS   workloads to run (default: select1 point tpcb orm plpgsql)
+#   OUTPUT      result file (default bench_output.json)
+#   SCRAPE_INTERVAL  seconds between reads of the pgtrace views during each
+#               run, as a monitoring agent would (default 0: no reads)
+
+set -euo pipefail
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$("$PG_CONFIG" --bindir)
+PGPORT=${PGPORT:-54330}
+DURATION=${DURATION:-30}
+CLIENTS=${CLIENTS:-4}
+JOBS=${JOBS:-4}
+SCALE=${SCALE:-10}
+CONFIGS=${CONFIGS:-"baseline off core audit capture_text capture_plan capture_analyze audit_log exporter all"}
+WORKLOADS=${WORKLOADS:-"select1 point tpcb orm plpgsql"}
+OUTPUT=${OUTPUT:-bench_output.json}
+SCRAPE_INTERVAL=${SCRAPE_INTERVAL:-0}
+
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+WORKDIR=$(mktemp -d -t pgtrace-bench.XXXXXX)
+PGDATA="$WORKDIR/data"
+RESULTS="$WORKDIR/results"
+
+cleanup()
+{
+    "$BINDIR/pg_ctl" -D "$PGDATA" -m immediate stop >/dev/null 2>&1 || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# Settings for each configuration, written to an included file. "core" is
+# pgtrace with every optional feature off; the single-feature
+# configurations add one feature on top of it.
+config_settings()
+{
+    local core="shared_preload_libraries = 'pgtrace'
+pgtrace.audit = off
+pgtrace.slow_query_capture = off"
+
+    case "$1" in
+        baseline)
+            echo "shared_preload_libraries = ''"
+            ;;
+        off)
+            echo "shared_preload_libraries = 'pgtrace'"
+            echo "pgtrace.enabled = off"
+            ;;
+        core)
+            echo "$core"
+            ;;
+        audit)
+            echo "$core"
+            echo "pgtrace.audit = on"
+            ;;
+        capture_text)
+            echo "$core"
+            echo "pgtrace.slow_query_capture = text"
+            echo "pgtrace.slow_query_ms = 0"
+            ;;
+        capture_plan)
+            echo "$core"
+            echo "pgtrace.slow_query_capture = plan"
+            echo "pgtrace.slow_query_ms = 0"
+            ;;
+        capture_analyze)
+            echo "$core"
+            echo "pgtrace.slow_query_capture = plan"
+            echo "pgtrace.slow_query_capture_analyze = on"
+            ;;
+        audit_log)
+            echo "$core"
+            echo "pgtrace.audit = on"
+            echo "pgtrace.audit_log = on"
+            ;;
+        exporter)
+            echo "$core"
+            echo "pgtrace.metrics_socket = '$WORKDIR/metrics.sock'"
+            ;;
+        all)
+            echo "shared_preload_libraries = 'pgtrace'"
+            echo "pgtrace.slow_query_capture = plan"
+            echo "pgtrace.slow_query_capture_analyze = on"
+            echo "pgtrace.audit_log = on"
+            echo "pgtrace.metrics_socket = '$WORKDIR/metrics.sock'"
+            ;;
+        *)
+            echo "unknown configuration: $1" >&2
+            exit 1
+            ;;
+    esac
+}
+
+workload_args()
+{
+    case "$1" in
+        select1|point|orm|plpgsql)
+            echo "-f $BENCHDIR/workloads/$1.sql -D scale=$SCALE"
+            ;;
+        tpcb)
+            echo "-b tpcb-like"
+            ;;
+        *)
+            echo "unknown workload: $1" >&2
+            exit 1
+            ;;
+    esac
+}
+
+start_cluster()
+{
+    "$BINDIR/pg_ctl" -D "$PGDATA" -l "$WORKDIR/server.log" -w \
+        -o "-p $PGPORT -k $WORKDIR -c listen_addresses=''" start >/dev/null
+}
+
+stop_cluster()
+{
+    "$BINDIR/pg_ctl" -D "$PGDATA" -w stop >/dev/null
+}
+
+psql_bench()
+{
+    "$BINDIR/psql" -X -q -v ON_ERROR_STOP=1 -h "$WORKDIR" -p "$PGPORT" -d bench "$@"
+}
+
+# Read every per-entry view until killed, like a monitoring agent would.
+scrape_loop()
+{
+    while :; do
+        psql_bench -o /dev/null \
+            -c "SELECT * FROM pgtrace_query_stats" \
+            -c "SELECT * FROM pgtrace_query_breakdown" \
+            -c "SELECT * FROM pgtrace_failing_queries" \
+            -c "SELECT * FROM pgtrace_slow_queries" \
+            -c "SELECT * FROM pgtrace_audit_events" || true
+        sleep "$SCRAPE_INTERVAL"
+    done
+}
+
+# Times a recording backend waited for the query table lock since startup.
+query_hash_lock_waits()
+{
+    psql_bench -At -c "SELECT value::bigint FROM pgtrace_self_stats
+                       WHERE category = 'lock_waits' AND name = 'pgtrace_query_hash'"
+}
+
+# Latency statistics in milliseconds from pgbench per-transaction logs,
+# where the third field is the transaction time in microseconds.
+latency_json()
+{
+    cat "$@" | awk '{print $3}' | sort -n | awk '
+        { v[NR] = $1; sum += $1 }
+        function pct(p,    i) { i = int(NR * p + 0.999999); if (i < 1) i = 1; return v[i] / 1000.0 }
+        END {
+            if (NR == 0) { print "null"; exit }
+            printf "{\"avg\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+                   sum / NR / 1000.0, pct(0.50), pct(0.95), pct(0.99), v[NR] / 1000.0
+        }'
+}
+
+"$BINDIR/initdb" -D "$PGDATA" -A trust >/dev/null
+echo "include 'bench.conf'" >>"$PGDATA/postgresql.conf"
+: >"$PGDATA/bench.conf"
+
+start_cluster
+"$BINDIR/createdb" -h "$WORKDIR" -p "$PGPORT" bench
+"$BINDIR/pgbench" -i -q -s "$SCALE" -h "$WORKDIR" -p "$PGPORT" bench >/dev/null 2>&1
+psql_bench -f "$BENCHDIR/setup.sql"
+stop_cluster
+
+mkdir -p "$RESULTS"
+first=1
+{
+    printf '{\n  "meta": {"duration": %d, "clients": %d, "jobs": %d, "scale": %d, "scrape_interval": %s, "server_version": "%s"},\n' \
+        "$DURATION" "$CLIENTS" "$JOBS" "$SCALE" "$SCRAPE_INTERVAL" "$("$BINDIR/postgres" --version)"
+    printf '  "results": [\n'
+} >"$OUTPUT"
+
+for config in $CONFIGS; do
+    config_settings "$config" >"$PGDATA/bench.conf"
+    start_cluster
+
+    traced=0
+    if [ "$config" != baseline ]; then
+        traced=1
+        psql_bench -c "CREATE EXTENSION IF NOT EXISTS pgtrace"
+    fi
+
+    for workload in $WORKLOADS; do
+        echo "running $config/$workload" >&2
+        logdir="$RESULTS/$config-$workload"
+        mkdir -p "$logdir"
+
+        waits_before=0
+        [ "$traced" -eq 0 ] || waits_before=$(query_hash_lock_waits)
+
+        # The scraper runs in its own process group, so that killing it also
+        # stops the psql or sleep it is waiting on.
+        scraper=
+        if [ "$traced" -eq 1 ] && [ "$SCRAPE_INTERVAL" != 0 ]; then
+            set -m
+            scrape_loop &
+            scraper=$!
+            set +m
+        fi
+
+        # shellcheck disable=SC2046
+        summary=$(cd "$logdir" && "$BINDIR/pgbench" -n -h "$WORKDIR" -p "$PGPORT" \
+            -c "$CLIENTS" -j "$JOBS" -T "$DURATION" -l $(workload_args "$workload") bench)
+
+        if [ -n "$scraper" ]; then
+            kill -- -"$scraper" 2>/dev/null || true
+            wait "$scraper" 2>/dev/null || true
+        fi
+
+        lock_waits=null
+        [ "$traced" -eq 0 ] || lock_waits=$(($(query_hash_lock_waits) - waits_before))
+
+        tps=$(sed -n 's/^tps = \([0-9.]*\).*/\1/p' <<<"$summary" | head -n 1)
+        xacts=$(sed -n 's/^number of transactions actually processed: \([0-9]*\).*/\1/p' <<<"$summary")
+        latency=$(latency_json "$logdir"/pgbench_log.*)
+
+        [ "$first" -eq 1 ] || printf ',\n' >>"$OUTPUT"
+        first=0
+        printf '    {"config": "%s", "workload": "%s", "tps": %s, "transactions": %s, "latency_ms": %s, "query_hash_lock_waits": %s}' \
+            "$config" "$workload" "${tps:-null}" "${xacts:-null}" "$latency" "$lock_waits" >>"$OUTPUT"
+    done
+
+    stop_cluster
+done
+
+printf '\n  ]\n}\n' >>"$OUTPUT"
+echo "results written to $OUTPUT" >&2
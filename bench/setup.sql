@@ -0,0 +1,17 @@
+-- Objects used by the bench workloads, created after pgbench -i.
+
+CREATE OR REPLACE FUNCTION bench_nested(depth int, aid int)
+RETURNS bigint
+LANGUAGE plpgsql
+AS $$
+DECLARE
+    balance bigint;
+BEGIN
+    SELECT abalance INTO balance FROM pgbench_accounts WHERE pgbench_accounts.aid = bench_nested.aid;
+    PERFORM 1 FROM pgbench_branches WHERE bid = 1;
+    IF depth > 0 THEN
+        balance := balance + bench_nested(depth - 1, aid + 1);
+    END IF;
+    RETURN balance;
+END;
+$$;
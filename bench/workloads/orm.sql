@@ -0,0 +1,22 @@
+\set aid random(1, 100000 * :scale - 20)
+SELECT "pgbench_accounts"."aid" AS "pgbench_accounts_aid",
+       "pgbench_accounts"."bid" AS "pgbench_accounts_bid",
+       "pgbench_accounts"."abalance" AS "pgbench_accounts_abalance",
+       "pgbench_accounts"."filler" AS "pgbench_accounts_filler",
+       "pgbench_branches"."bid" AS "pgbench_branches_bid",
+       "pgbench_branches"."bbalance" AS "pgbench_branches_bbalance",
+       "pgbench_branches"."filler" AS "pgbench_branches_filler",
+       "pgbench_tellers"."tid" AS "pgbench_tellers_tid",
+       "pgbench_tellers"."tbalance" AS "pgbench_tellers_tbalance",
+       "pgbench_tellers"."filler" AS "pgbench_tellers_filler"
+FROM "pgbench_accounts"
+INNER JOIN "pgbench_branches" ON ("pgbench_accounts"."bid" = "pgbench_branches"."bid")
+LEFT OUTER JOIN "pgbench_tellers" ON ("pgbench_tellers"."bid" = "pgbench_branches"."bid"
+                                      AND "pgbench_tellers"."tid" = "pgbench_branches"."bid")
+WHERE "pgbench_accounts"."aid" IN (:aid, :aid + 1, :aid + 2, :aid + 3, :aid + 4,
+                                   :aid + 5, :aid + 6, :aid + 7, :aid + 8, :aid + 9,
+                                   :aid + 10, :aid + 11, :aid + 12, :aid + 13, :aid + 14,
+                                   :aid + 15, :aid + 16, :aid + 17, :aid + 18, :aid + 19)
+  AND "pgbench_accounts"."abalance" >= -1000000
+ORDER BY "pgbench_accounts"."aid" ASC
+LIMIT 20 OFFSET 0;
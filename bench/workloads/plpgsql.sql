@@ -0,0 +1,2 @@
+\set aid random(1, 100000 * :scale - 10)
+SELECT bench_nested(4, :aid);
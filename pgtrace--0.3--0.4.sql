@@ -0,0 +1,604 @@
+/* PgTrace 0.3 -> 0.4 upgrade */
+
+/* Event ring health */
+
+CREATE FUNCTION pgtrace_internal_ring_stats()
+RETURNS TABLE (
+  ring text,
+  capacity bigint,
+  events_written bigint,
+  overwritten bigint,
+  dropped bigint
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_ring_stats'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_ring_stats AS SELECT * FROM pgtrace_internal_ring_stats();
+
+/* Audit log shipping (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_audit_log_stats()
+RETURNS TABLE (
+  enabled boolean,
+  events_logged bigint,
+  events_lost bigint,
+  backlog bigint,
+  files_written bigint,
+  bytes_written bigint,
+  current_file text,
+  last_flush timestamptz
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_audit_log_stats'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_audit_log_stats AS SELECT * FROM pgtrace_internal_audit_log_stats();
+
+CREATE FUNCTION pgtrace_audit_log_files()
+RETURNS TABLE (
+  filename text,
+  size bigint,
+  modified timestamptz
+)
+AS 'MODULE_PATHNAME', 'pgtrace_audit_log_files'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgtrace_read_audit_log(filename text)
+RETURNS TABLE (
+  position bigint,
+  fingerprint bigint,
+  operation text,
+  db_user text,
+  database text,
+  rows_affected bigint,
+  duration_ms double precision,
+  event_timestamp timestamptz
+)
+AS 'MODULE_PATHNAME', 'pgtrace_read_audit_log'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pgtrace_audit_log_files() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pgtrace_read_audit_log(text) FROM PUBLIC;
+
+/* Slow query samples: text and plan (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_slow_query_samples()
+RETURNS TABLE (
+  fingerprint bigint,
+  captured_at timestamptz,
+  duration_ms double precision,
+  captures bigint,
+  suppressed bigint,
+  normalized_query text,
+  example_query text,
+  plan text,
+  plan_analyzed boolean
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_slow_query_samples'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_slow_query_samples AS
+SELECT * FROM pgtrace_internal_slow_query_samples()
+ORDER BY captured_at DESC;
+
+REVOKE ALL ON FUNCTION pgtrace_internal_slow_query_samples() FROM PUBLIC;
+REVOKE ALL ON pgtrace_slow_query_samples FROM PUBLIC;
+
+/* Global metrics: cancelled statements, parallel workers */
+
+DROP VIEW pgtrace_metrics;
+DROP FUNCTION pgtrace_internal_metrics();
+
+CREATE FUNCTION pgtrace_internal_metrics()
+RETURNS TABLE (
+  queries_total bigint,
+  queries_failed bigint,
+  slow_queries bigint,
+  queries_cancelled bigint,
+  parallel_queries bigint,
+  workers_planned bigint,
+  workers_launched bigint
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_metrics'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_metrics AS SELECT * FROM pgtrace_internal_metrics();
+
+/* Per-query breakdown by role, database and application (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_query_breakdown()
+RETURNS TABLE (
+  fingerprint bigint,
+  db_user text,
+  database text,
+  application_name text,
+  calls bigint,
+  calls_error bigint,
+  total_time_ms double precision,
+  time_error_ms double precision
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_query_breakdown'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_query_breakdown AS SELECT * FROM pgtrace_internal_query_breakdown()
+ORDER BY fingerprint, total_time_ms DESC;
+
+/* Query table capacity and untracked workload (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_capacity()
+RETURNS TABLE (
+  tracked_queries bigint,
+  max_queries bigint,
+  total_calls bigint,
+  total_time_ms double precision,
+  untracked_calls bigint,
+  untracked_time_ms double precision,
+  untracked_time_pct double precision,
+  promotions bigint,
+  sketch_agings bigint,
+  stats_since timestamptz
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_capacity'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_capacity AS SELECT * FROM pgtrace_internal_capacity();
+
+CREATE FUNCTION pgtrace_internal_untracked_queries()
+RETURNS TABLE (
+  fingerprint bigint,
+  est_calls bigint,
+  est_time_ms double precision
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_untracked_queries'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_untracked_queries AS SELECT * FROM pgtrace_internal_untracked_queries()
+ORDER BY est_time_ms DESC;
+
+/* Per-query latency baselines (v0.4) */
+
+DROP VIEW pgtrace_alien_queries;
+DROP VIEW pgtrace_query_stats;
+DROP FUNCTION pgtrace_internal_query_stats();
+
+CREATE FUNCTION pgtrace_internal_query_stats()
+RETURNS TABLE (
+  fingerprint bigint,
+  calls bigint,
+  errors bigint,
+  total_time_ms double precision,
+  avg_time_ms double precision,
+  max_time_ms double precision,
+  first_seen timestamptz,
+  last_seen timestamptz,
+  is_new boolean,
+  is_anomalous boolean,
+  empty_app_count bigint,
+  scan_ratio double precision,
+  total_rows_returned bigint,
+  last_app_name text,
+  last_user text,
+  last_database text,
+  last_request_id text,
+  p95_ms double precision,
+  p99_ms double precision,
+  baseline_ms double precision,
+  baseline_stddev_ms double precision,
+  anomalous_calls bigint,
+  calls_per_sec_1m double precision,
+  errors_per_sec_1m double precision,
+  mean_ms_1m double precision,
+  p99_ms_1m double precision,
+  calls_per_sec_5m double precision,
+  errors_per_sec_5m double precision,
+  mean_ms_5m double precision,
+  p99_ms_5m double precision,
+  calls_per_sec_15m double precision,
+  errors_per_sec_15m double precision,
+  mean_ms_15m double precision,
+  p99_ms_15m double precision
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_query_stats'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_query_stats AS
+SELECT * FROM pgtrace_internal_query_stats()
+ORDER BY total_time_ms DESC;
+
+/* Alien/Shadow Query Detection View */
+CREATE VIEW pgtrace_alien_queries AS
+SELECT 
+  fingerprint,
+  calls,
+  avg_time_ms,
+  max_time_ms,
+  is_new,
+  is_anomalous,
+  anomalous_calls,
+  baseline_ms,
+  baseline_stddev_ms,
+  empty_app_count,
+  scan_ratio,
+  total_rows_returned,
+  last_app_name,
+  last_user,
+  last_database,
+  last_request_id,
+  p95_ms,
+  p99_ms,
+  first_seen,
+  last_seen
+FROM pgtrace_internal_query_stats()
+WHERE is_new OR is_anomalous
+ORDER BY 
+  is_new DESC,
+  is_anomalous DESC,
+  avg_time_ms DESC;
+
+/* Log-linear latency histogram (v0.4) */
+
+DROP VIEW pgtrace_latency_histogram;
+DROP FUNCTION pgtrace_internal_latency();
+
+CREATE FUNCTION pgtrace_internal_latency()
+RETURNS TABLE (
+  le_ms double precision,
+  queries bigint,
+  bucket_queries bigint
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_latency'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_latency_histogram AS
+SELECT * FROM pgtrace_internal_latency()
+ORDER BY le_ms;
+
+CREATE FUNCTION pgtrace_internal_latency_by_database()
+RETURNS TABLE (
+  datid oid,
+  database text,
+  le_ms double precision,
+  queries bigint,
+  bucket_queries bigint
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_latency_by_database'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_latency_histogram_by_database AS
+SELECT * FROM pgtrace_internal_latency_by_database()
+ORDER BY datid NULLS LAST, le_ms;
+
+CREATE FUNCTION pgtrace_latency_quantile(q double precision)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'pgtrace_latency_quantile'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgtrace_latency_quantile(q double precision, datid oid)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'pgtrace_latency_quantile'
+LANGUAGE C STRICT;
+
+/* Fingerprint of a query text, as shown in the views (v0.4) */
+
+CREATE FUNCTION pgtrace_fingerprint(query text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pgtrace_fingerprint'
+LANGUAGE C STRICT IMMUTABLE;
+
+/* Microbenchmarks of the hot-path components (v0.4) */
+
+CREATE FUNCTION pgtrace_bench(component text, iterations integer DEFAULT 100000)
+RETURNS TABLE (
+  kernel text,
+  fill_factor double precision,
+  ops bigint,
+  ns_min double precision,
+  ns_p50 double precision,
+  ns_p90 double precision,
+  ns_p99 double precision,
+  ns_max double precision,
+  cycles_min double precision,
+  cycles_p50 double precision,
+  cycles_p90 double precision,
+  cycles_p99 double precision,
+  cycles_max double precision
+)
+AS 'MODULE_PATHNAME', 'pgtrace_bench'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION pgtrace_bench(text, integer) FROM PUBLIC;
+
+/* pgtrace's own cost and health (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_self_stats()
+RETURNS TABLE (
+  category text,
+  name text,
+  value double precision,
+  time_ms double precision
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_self_stats'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_self_stats AS SELECT * FROM pgtrace_internal_self_stats();
+
+/* Active session history (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_ash()
+RETURNS TABLE (
+  fingerprint bigint,
+  wait_event_type text,
+  wait_event text,
+  samples bigint,
+  approx_time_ms double precision,
+  last_sample timestamptz
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_ash'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_ash AS SELECT * FROM pgtrace_internal_ash()
+ORDER BY samples DESC;
+
+CREATE FUNCTION pgtrace_internal_ash_history()
+RETURNS TABLE (
+  sample_time timestamptz,
+  pid integer,
+  fingerprint bigint,
+  nesting_level integer,
+  wait_event_type text,
+  wait_event text
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_ash_history'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_ash_history AS SELECT * FROM pgtrace_internal_ash_history()
+ORDER BY sample_time;
+
+/* In-flight statements (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_active_queries()
+RETURNS TABLE (
+  pid integer,
+  fingerprint bigint,
+  query_start timestamptz,
+  elapsed_ms double precision,
+  request_id text,
+  nested_statements bigint,
+  nested_rows bigint,
+  concurrent_executions integer
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_active_queries'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_active_queries AS SELECT * FROM pgtrace_internal_active_queries()
+ORDER BY elapsed_ms DESC;
+
+/* Plan-shape statistics (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_query_plans()
+RETURNS TABLE (
+  fingerprint bigint,
+  plan_hash bigint,
+  calls bigint,
+  errors bigint,
+  total_time_ms double precision,
+  mean_time_ms double precision,
+  first_seen timestamptz,
+  last_seen timestamptz
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_query_plans'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_query_plans AS SELECT * FROM pgtrace_internal_query_plans()
+ORDER BY fingerprint, last_seen DESC;
+
+/* Fingerprints run with more than one plan: the latest plan against the one before it. */
+CREATE VIEW pgtrace_plan_changes AS
+WITH ranked AS (
+  SELECT p.*,
+         row_number() OVER (PARTITION BY fingerprint ORDER BY last_seen DESC) AS recency,
+         count(*) OVER (PARTITION BY fingerprint) AS plan_count
+  FROM pgtrace_internal_query_plans() p
+)
+SELECT cur.fingerprint,
+       cur.plan_count,
+       prev.plan_hash AS previous_plan_hash,
+       cur.plan_hash AS current_plan_hash,
+       cur.first_seen AS changed_at,
+       prev.calls AS previous_calls,
+       prev.mean_time_ms AS previous_mean_ms,
+       cur.calls AS current_calls,
+       cur.mean_time_ms AS current_mean_ms,
+       cur.mean_time_ms / NULLIF(prev.mean_time_ms, 0) AS slowdown
+FROM ranked cur
+JOIN ranked prev ON prev.fingerprint = cur.fingerprint AND prev.recency = 2
+WHERE cur.recency = 1
+ORDER BY changed_at DESC;
+
+/* Transaction spans (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_xact_spans()
+RETURNS TABLE (
+  pid integer,
+  request_id text,
+  xact_start timestamptz,
+  xact_end timestamptz,
+  duration_ms double precision,
+  statements integer,
+  statement_time_ms double precision,
+  idle_time_ms double precision,
+  committed boolean,
+  shape bigint,
+  fingerprints bigint[]
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_xact_spans'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_xact_spans AS SELECT * FROM pgtrace_internal_xact_spans()
+ORDER BY xact_end DESC;
+
+CREATE FUNCTION pgtrace_internal_xact_shapes()
+RETURNS TABLE (
+  shape bigint,
+  commits bigint,
+  aborts bigint,
+  mean_statements double precision,
+  total_time_ms double precision,
+  mean_time_ms double precision,
+  statement_time_ms double precision,
+  idle_time_ms double precision,
+  last_seen timestamptz,
+  fingerprints bigint[]
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_xact_shapes'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_xact_shapes AS SELECT * FROM pgtrace_internal_xact_shapes()
+ORDER BY total_time_ms DESC;
+
+/* Recent executions by request id (v0.4) */
+
+CREATE FUNCTION pgtrace_request(request_id text)
+RETURNS TABLE (
+  executed_at timestamptz,
+  pid integer,
+  fingerprint bigint,
+  duration_ms double precision,
+  rows_returned bigint,
+  failed boolean,
+  toplevel boolean
+)
+AS 'MODULE_PATHNAME', 'pgtrace_request'
+LANGUAGE C STRICT;
+
+/* Trace context and spans (v0.4) */
+
+CREATE FUNCTION pgtrace_internal_spans()
+RETURNS TABLE (
+  trace_id text,
+  span_id text,
+  parent_span_id text,
+  fingerprint bigint,
+  operation text,
+  start_time timestamptz,
+  end_time timestamptz,
+  duration_ms double precision,
+  rows bigint,
+  pid integer,
+  sqlstate text,
+  database text,
+  tracestate text
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_spans'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_spans AS SELECT * FROM pgtrace_internal_spans()
+ORDER BY end_time DESC;
+
+CREATE FUNCTION pgtrace_internal_span_export_stats()
+RETURNS TABLE (
+  enabled boolean,
+  spans_exported bigint,
+  spans_lost bigint,
+  backlog bigint,
+  files_written bigint,
+  last_export timestamptz
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_span_export_stats'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_span_export_stats AS SELECT * FROM pgtrace_internal_span_export_stats();
+
+/* Per-component and per-fingerprint resets (v0.4) */
+
+CREATE FUNCTION pgtrace_reset(component text)
+RETURNS void
+AS 'MODULE_PATHNAME', 'pgtrace_reset_component'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgtrace_reset_query(fingerprint bigint)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pgtrace_reset_query'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pgtrace_reset() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pgtrace_reset(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pgtrace_reset_query(bigint) FROM PUBLIC;
+
+CREATE FUNCTION pgtrace_internal_stats_resets()
+RETURNS TABLE (
+  component text,
+  stats_since timestamptz,
+  resets bigint
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_stats_resets'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_stats_resets AS SELECT * FROM pgtrace_internal_stats_resets();
+
+/* Columnar export (v0.4) */
+CREATE FUNCTION pgtrace_export(path text, what text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pgtrace_export'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgtrace_export_bytea(what text)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pgtrace_export_bytea'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pgtrace_export(text, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pgtrace_export_bytea(text) FROM PUBLIC;
+
+/* Portable state dumps and fleet-wide imported statistics (v0.4) */
+CREATE FUNCTION pgtrace_dump_state()
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pgtrace_dump_state'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pgtrace_merge_state(dump bytea)
+RETURNS integer
+AS 'MODULE_PATHNAME', 'pgtrace_merge_state'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pgtrace_merge_state(bytea) FROM PUBLIC;
+
+CREATE FUNCTION pgtrace_internal_imported_stats()
+RETURNS TABLE (
+  fingerprint bigint,
+  nodes integer,
+  calls bigint,
+  errors bigint,
+  total_time_ms double precision,
+  avg_time_ms double precision,
+  max_time_ms double precision,
+  p95_ms double precision,
+  p99_ms double precision,
+  first_seen timestamptz,
+  last_seen timestamptz,
+  rows_scanned bigint,
+  rows_returned bigint
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_imported_stats'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_imported_stats AS
+SELECT * FROM pgtrace_internal_imported_stats()
+ORDER BY total_time_ms DESC;
+
+CREATE FUNCTION pgtrace_internal_imported_nodes()
+RETURNS TABLE (
+  node_id bigint,
+  system_identifier bigint,
+  node_name text,
+  local boolean,
+  dumped_at timestamptz,
+  merged_at timestamptz,
+  queries bigint,
+  dropped bigint
+)
+AS 'MODULE_PATHNAME', 'pgtrace_internal_imported_nodes'
+LANGUAGE C STRICT;
+
+CREATE VIEW pgtrace_imported_nodes AS
+SELECT * FROM pgtrace_internal_imported_nodes()
+ORDER BY merged_at DESC;
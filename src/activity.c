@@ -0,0 +1,257 @@
+#include <postgres.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <access/xact.h>
+#include <storage/ipc.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+static PgTraceActiveSlot *active_slots = NULL;
+
+static PgTraceActiveQuery *my_active_query = NULL;
+
+/* Run/Finish calls of tracked statements this backend is inside. */
+static int my_active_depth = 0;
+
+/*
+ * Same protocol as pgstat_begin_write_activity() and friends. The critical
+ * section turns any error between the two increments into a PANIC, so a
+ * slot can never be left with an odd count.
+ */
+#define ACTIVE_BEGIN_WRITE(slot) \
+    do { \
+        START_CRIT_SECTION(); \
+        (slot)->changecount++; \
+        pg_write_barrier(); \
+    } while (0)
+
+#define ACTIVE_END_WRITE(slot) \
+    do { \
+        pg_write_barrier(); \
+        (slot)->changecount++; \
+        Assert(((slot)->changecount & 1) == 0); \
+        END_CRIT_SECTION(); \
+    } while (0)
+
+#define ACTIVE_READ_RETRIES 1000
+
+void pgtrace_activity_request_shmem(void)
+{
+    RequestAddinShmemSpace(mul_size(MaxBackends, sizeof(PgTraceActiveSlot)));
+}
+
+void pgtrace_activity_startup(void)
+{
+    bool found;
+    Size size = mul_size(MaxBackends, sizeof(PgTraceActiveSlot));
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    active_slots = ShmemInitStruct("pgtrace_active_queries", size, &found);
+    if (!found)
+        memset(active_slots, 0, size);
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+activity_detach(int code, Datum arg)
+{
+    ACTIVE_BEGIN_WRITE(my_active_query);
+    my_active_query->fingerprint = 0;
+    my_active_query->pid = 0;
+    ACTIVE_END_WRITE(my_active_query);
+
+    my_active_query = NULL;
+}
+
+static PgTraceActiveQuery *
+activity_my_slot(void)
+{
+    int procno;
+
+    if (likely(my_active_query != NULL) || !active_slots)
+        return my_active_query;
+
+    procno = pgtrace_my_procno();
+    if (procno < 0)
+        return NULL;
+
+    my_active_query = &active_slots[procno].query;
+
+    ACTIVE_BEGIN_WRITE(my_active_query);
+    my_active_query->pid = MyProcPid;
+    my_active_query->fingerprint = 0;
+    ACTIVE_END_WRITE(my_active_query);
+
+    before_shmem_exit(activity_detach, (Datum)0);
+
+    return my_active_query;
+}
+
+void pgtrace_activity_enter(uint64 fingerprint)
+{
+    PgTraceActiveQuery *slot;
+
+    if (my_active_depth++ > 0)
+        return;
+
+    slot = activity_my_slot();
+    if (!slot)
+        return;
+
+    ACTIVE_BEGIN_WRITE(slot);
+    slot->fingerprint = fingerprint;
+    slot->query_start = GetCurrentStatementStartTimestamp();
+    slot->nested_statements = 0;
+    slot->nested_rows = 0;
+    if (pgtrace_request_id)
+        strlcpy(slot->request_id, pgtrace_request_id, sizeof(slot->request_id));
+    else
+        slot->request_id[0] = '\0';
+    ACTIVE_END_WRITE(slot);
+}
+
+void pgtrace_activity_leave(void)
+{
+    PgTraceActiveQuery *slot = my_active_query;
+
+    if (my_active_depth > 0 && --my_active_depth > 0)
+        return;
+
+    if (!slot)
+        return;
+
+    ACTIVE_BEGIN_WRITE(slot);
+    slot->fingerprint = 0;
+    ACTIVE_END_WRITE(slot);
+}
+
+/* A statement nested in the running one has completed. */
+void pgtrace_activity_progress(uint64 rows)
+{
+    PgTraceActiveQuery *slot = my_active_query;
+
+    if (my_active_depth == 0 || !slot)
+        return;
+
+    ACTIVE_BEGIN_WRITE(slot);
+    slot->nested_statements++;
+    slot->nested_rows += rows;
+    ACTIVE_END_WRITE(slot);
+}
+
+/*
+ * Consistent copy of a slot, or false if it kept changing; a backend runs
+ * at most a handful of statements while we retry, so that means it is
+ * not worth reporting anyway.
+ */
+static bool
+activity_read_slot(volatile PgTraceActiveQuery *slot, PgTraceActiveQuery *dst)
+{
+    int attempt;
+
+    for (attempt = 0; attempt < ACTIVE_READ_RETRIES; attempt++)
+    {
+        int before = slot->changecount;
+        int after;
+
+        pg_read_barrier();
+        memcpy(dst, (PgTraceActiveQuery *)slot, sizeof(PgTraceActiveQuery));
+        pg_read_barrier();
+        after = slot->changecount;
+
+        if (before == after && (before & 1) == 0)
+            return true;
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    return false;
+}
+
+typedef struct PgTraceActiveRow
+{
+    PgTraceActiveQuery query;
+    uint32 concurrent;
+} PgTraceActiveRow;
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_active_queries);
+
+PGDLLEXPORT Datum pgtrace_internal_active_queries(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceActiveRow *rows;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+        uint32 i;
+        uint32 j;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_active_queries must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        rows = palloc0(MaxBackends * sizeof(PgTraceActiveRow));
+
+        for (i = 0; active_slots && i < (uint32)MaxBackends; i++)
+        {
+            PgTraceActiveQuery *dst = &rows[count].query;
+
+            if (activity_read_slot(&active_slots[i].query, dst) &&
+                dst->fingerprint != 0 && dst->pid != 0)
+                count++;
+        }
+
+        /* Concurrent executions of the same fingerprint, a quadratic pass over active backends only. */
+        for (i = 0; i < count; i++)
+            for (j = 0; j < count; j++)
+                if (rows[j].query.fingerprint == rows[i].query.fingerprint)
+                    rows[i].concurrent++;
+
+        funcctx->user_fctx = rows;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    rows = (PgTraceActiveRow *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[8];
+        bool nulls[8] = {false, false, false, false, false, false, false, false};
+        PgTraceActiveRow *row = &rows[funcctx->call_cntr];
+        long secs;
+        int usecs;
+        HeapTuple tuple;
+
+        TimestampDifference(row->query.query_start, GetCurrentTimestamp(), &secs, &usecs);
+
+        values[0] = Int32GetDatum(row->query.pid);
+        values[1] = UInt64GetDatum(row->query.fingerprint);
+        values[2] = TimestampTzGetDatum(row->query.query_start);
+        values[3] = Float8GetDatum((double)secs * 1000.0 + (double)usecs / 1000.0);
+        values[4] = CStringGetTextDatum(row->query.request_id);
+        values[5] = UInt64GetDatum(row->query.nested_statements);
+        values[6] = UInt64GetDatum(row->query.nested_rows);
+        values[7] = Int32GetDatum((int32)row->concurrent);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <utils/timestamp.h>
+#include "query_hash.h"
+
+/*
+ * In-flight statements. Each backend owns one slot, written only by itself
+ * with the change-count protocol of PgBackendStatus: the count is odd while
+ * a write is in progress, and a reader retries until it sees the same even
+ * count before and after its copy. Readers take no lock and writers never
+ * wait.
+ *
+ * A slot describes the top-level statement while it is inside ExecutorRun
+ * or ExecutorFinish. Nested statements that complete meanwhile (functions,
+ * triggers) advance its progress counters.
+ */
+typedef struct PgTraceActiveQuery
+{
+    int changecount;
+    int pid;
+    uint64 fingerprint; /* 0 when no statement is running */
+    TimestampTz query_start;
+    uint64 nested_statements;
+    uint64 nested_rows;
+    char request_id[PGTRACE_REQUEST_ID_LEN];
+} PgTraceActiveQuery;
+
+typedef union PgTraceActiveSlot
+{
+    PgTraceActiveQuery query;
+    char pad[TYPEALIGN(PG_CACHE_LINE_SIZE, sizeof(PgTraceActiveQuery))];
+} PgTraceActiveSlot;
+
+void pgtrace_activity_request_shmem(void);
+void pgtrace_activity_startup(void);
+void pgtrace_activity_enter(uint64 fingerprint);
+void pgtrace_activity_leave(void);
+void pgtrace_activity_progress(uint64 rows);
+
+PGDLLEXPORT Datum pgtrace_internal_active_queries(PG_FUNCTION_ARGS);
@@ -0,0 +1,556 @@
+#include <postgres.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <common/hashfn.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/proc.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/memutils.h>
+#include <utils/timestamp.h>
+#include <utils/wait_event.h>
+#include "pgtrace.h"
+
+PgTraceAsh *pgtrace_ash_state = NULL;
+
+static PgTraceAshBackendSlot *ash_backends = NULL;
+
+/* This backend's slot, and how many executor runs it is nested in. */
+static PgTraceAshBackend *my_ash_backend = NULL;
+static uint32 my_nesting_level = 0;
+
+void pgtrace_ash_request_shmem(void)
+{
+    if (!pgtrace_ash)
+        return;
+
+    RequestAddinShmemSpace(sizeof(PgTraceAsh));
+    RequestAddinShmemSpace(mul_size(MaxBackends, sizeof(PgTraceAshBackendSlot)));
+    RequestNamedLWLockTranche("pgtrace_ash", 1);
+}
+
+void pgtrace_ash_startup(void)
+{
+    bool found;
+    int i;
+
+    if (!pgtrace_ash)
+        return;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    pgtrace_ash_state = ShmemInitStruct("pgtrace_ash", sizeof(PgTraceAsh), &found);
+    if (!found)
+    {
+        memset(pgtrace_ash_state, 0, sizeof(PgTraceAsh));
+        pgtrace_ring_init(&pgtrace_ash_state->ring, PGTRACE_ASH_HISTORY);
+        for (i = 0; i < PGTRACE_ASH_HISTORY; i++)
+            pg_atomic_init_u64(&pgtrace_ash_state->history[i].seq, 0);
+        pgtrace_ash_state->stats_since = GetCurrentTimestamp();
+    }
+
+    ash_backends = ShmemInitStruct("pgtrace_ash_backends",
+                                   mul_size(MaxBackends, sizeof(PgTraceAshBackendSlot)),
+                                   &found);
+    if (!found)
+    {
+        for (i = 0; i < MaxBackends; i++)
+        {
+            pg_atomic_init_u64(&ash_backends[i].backend.fingerprint, 0);
+            pg_atomic_init_u32(&ash_backends[i].backend.nesting_level, 0);
+        }
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+void pgtrace_ash_register(void)
+{
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgtrace");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgtrace_ash_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pgtrace ash sampler");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pgtrace ash sampler");
+
+    RegisterBackgroundWorker(&worker);
+}
+
+/* A backend that exits mid-statement must not leave its fingerprint behind. */
+static void
+ash_backend_detach(int code, Datum arg)
+{
+    pg_atomic_write_u64(&my_ash_backend->fingerprint, 0);
+    pg_atomic_write_u32(&my_ash_backend->nesting_level, 0);
+    my_ash_backend = NULL;
+}
+
+static PgTraceAshBackend *
+ash_my_backend(void)
+{
+    int procno;
+
+    if (likely(my_ash_backend != NULL) || !ash_backends)
+        return my_ash_backend;
+
+    procno = pgtrace_my_procno();
+    if (procno < 0)
+        return NULL;
+
+    my_ash_backend = &ash_backends[procno].backend;
+    pg_atomic_write_u64(&my_ash_backend->fingerprint, 0);
+    pg_atomic_write_u32(&my_ash_backend->nesting_level, 0);
+    before_shmem_exit(ash_backend_detach, (Datum)0);
+
+    return my_ash_backend;
+}
+
+/*
+ * Publish fingerprint as the statement this backend is executing and
+ * return the one it replaces, to be restored by pgtrace_ash_pop().
+ */
+uint64
+pgtrace_ash_push(uint64 fingerprint)
+{
+    PgTraceAshBackend *backend = ash_my_backend();
+    uint64 outer;
+
+    if (!backend)
+        return 0;
+
+    outer = pg_atomic_read_u64(&backend->fingerprint);
+    my_nesting_level++;
+    pg_atomic_write_u64(&backend->fingerprint, fingerprint);
+    pg_atomic_write_u32(&backend->nesting_level, my_nesting_level);
+
+    return outer;
+}
+
+void pgtrace_ash_pop(uint64 outer)
+{
+    PgTraceAshBackend *backend = my_ash_backend;
+
+    if (!backend)
+        return;
+
+    if (my_nesting_level > 0)
+        my_nesting_level--;
+    pg_atomic_write_u64(&backend->fingerprint, outer);
+    pg_atomic_write_u32(&backend->nesting_level, my_nesting_level);
+}
+
+static PgTraceAshEntry *
+ash_find_or_create(uint64 fingerprint, uint32 wait_event_info)
+{
+    uint64 bucket = hash_combine64(fingerprint, wait_event_info) % PGTRACE_ASH_HASH_SIZE;
+    uint64 i;
+
+    for (i = 0; i < PGTRACE_ASH_HASH_SIZE; i++)
+    {
+        PgTraceAshEntry *entry = &pgtrace_ash_state->entries[(bucket + i) % PGTRACE_ASH_HASH_SIZE];
+
+        if (!entry->valid)
+        {
+            if (pgtrace_ash_state->num_entries >= PGTRACE_ASH_ENTRIES)
+                break;
+
+            memset(entry, 0, sizeof(PgTraceAshEntry));
+            entry->fingerprint = fingerprint;
+            entry->wait_event_info = wait_event_info;
+            entry->valid = true;
+            pgtrace_ash_state->num_entries++;
+            return entry;
+        }
+
+        if (entry->fingerprint == fingerprint && entry->wait_event_info == wait_event_info)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Deletes the entry at idx, shifting later entries of its cluster back. */
+static void
+ash_delete_entry(uint64 idx)
+{
+    uint64 hole = idx;
+    uint64 next = (idx + 1) % PGTRACE_ASH_HASH_SIZE;
+
+    for (;;)
+    {
+        PgTraceAshEntry *entry = &pgtrace_ash_state->entries[next];
+        uint64 home;
+        bool movable;
+
+        if (!entry->valid)
+            break;
+
+        home = hash_combine64(entry->fingerprint, entry->wait_event_info) % PGTRACE_ASH_HASH_SIZE;
+        if (hole < next)
+            movable = (home <= hole || home > next);
+        else
+            movable = (home <= hole && home > next);
+
+        if (movable)
+        {
+            pgtrace_ash_state->entries[hole] = *entry;
+            hole = next;
+        }
+
+        next = (next + 1) % PGTRACE_ASH_HASH_SIZE;
+    }
+
+    memset(&pgtrace_ash_state->entries[hole], 0, sizeof(PgTraceAshEntry));
+    pgtrace_ash_state->num_entries--;
+}
+
+/* Evicts the least recently sampled of a few entries sampled from evict_hand. */
+static bool
+ash_evict(void)
+{
+    PgTraceAshEntry *victim = NULL;
+    int sampled = 0;
+    uint64 i;
+
+    for (i = 0; i < PGTRACE_ASH_HASH_SIZE && sampled < PGTRACE_EVICTION_SAMPLE; i++)
+    {
+        PgTraceAshEntry *entry = &pgtrace_ash_state->entries[pgtrace_ash_state->evict_hand];
+
+        pgtrace_ash_state->evict_hand = (pgtrace_ash_state->evict_hand + 1) % PGTRACE_ASH_HASH_SIZE;
+
+        if (entry->valid)
+        {
+            if (victim == NULL || entry->last_sample < victim->last_sample)
+                victim = entry;
+            sampled++;
+        }
+    }
+
+    if (victim == NULL)
+        return false;
+
+    ash_delete_entry(victim - pgtrace_ash_state->entries);
+    pgtrace_ash_state->evictions++;
+    return true;
+}
+
+/*
+ * One sampling pass. Slots are read without any lock: a backend may move
+ * on between reading its fingerprint and its wait event, which at worst
+ * attributes one sample to the neighbouring statement.
+ */
+static void
+ash_sample(PgTraceAshSample *samples, double interval_ms)
+{
+    TimestampTz now = GetCurrentTimestamp();
+    LWLockPadded *lock;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < MaxBackends; i++)
+    {
+        PgTraceAshBackend *backend = &ash_backends[i].backend;
+        uint64 fingerprint = pg_atomic_read_u64(&backend->fingerprint);
+        PGPROC *proc;
+        PgTraceAshSample *sample;
+
+        if (fingerprint == 0)
+            continue;
+
+        proc = GetPGProcByNumber(i);
+        if (proc->pid == 0)
+            continue;
+
+        sample = &samples[count++];
+        sample->sample_time = now;
+        sample->fingerprint = fingerprint;
+        sample->pid = proc->pid;
+        sample->wait_event_info = UINT32_ACCESS_ONCE(proc->wait_event_info);
+        sample->nesting_level = pg_atomic_read_u32(&backend->nesting_level);
+    }
+
+    lock = GetNamedLWLockTranche("pgtrace_ash");
+    pgtrace_lock_acquire(PGTRACE_LOCK_ASH, &lock->lock, LW_EXCLUSIVE);
+
+    pgtrace_ash_state->ticks++;
+    for (i = 0; i < count; i++)
+    {
+        PgTraceAshEntry *entry = ash_find_or_create(samples[i].fingerprint,
+                                                    samples[i].wait_event_info);
+
+        if (!entry && ash_evict())
+            entry = ash_find_or_create(samples[i].fingerprint, samples[i].wait_event_info);
+        if (!entry)
+            pgtrace_ash_state->dropped++;
+        else
+        {
+            entry->samples++;
+            entry->time_ms += interval_ms;
+            entry->last_sample = now;
+        }
+    }
+
+    LWLockRelease(&lock->lock);
+
+    for (i = 0; i < count; i++)
+    {
+        uint64 pos = pgtrace_ring_reserve(&pgtrace_ash_state->ring);
+        PgTraceAshHistorySlot *slot = &pgtrace_ash_state->history[pos % PGTRACE_ASH_HISTORY];
+
+        if (!pgtrace_ring_begin_write(&pgtrace_ash_state->ring, &slot->seq, pos))
+            continue;
+
+        slot->sample = samples[i];
+        pgtrace_ring_end_write(&slot->seq, pos);
+    }
+}
+
+void pgtrace_ash_main(Datum main_arg)
+{
+    PgTraceAshSample *samples;
+    TimestampTz next_tick;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+    BackgroundWorkerUnblockSignals();
+
+    if (!pgtrace_ash_state)
+        proc_exit(0);
+
+    samples = MemoryContextAlloc(TopMemoryContext, MaxBackends * sizeof(PgTraceAshSample));
+    next_tick = GetCurrentTimestamp();
+
+    while (!ShutdownRequestPending)
+    {
+        int interval_ms;
+        TimestampTz now;
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        interval_ms = Max(1000 / pgtrace_ash_sample_rate, 1);
+
+        now = GetCurrentTimestamp();
+        if (now >= next_tick)
+        {
+            ash_sample(samples, (double)interval_ms);
+
+            /* Stay on the tick grid unless a whole interval was missed. */
+            next_tick = TimestampTzPlusMilliseconds(next_tick, interval_ms);
+            if (next_tick <= now)
+                next_tick = TimestampTzPlusMilliseconds(now, interval_ms);
+        }
+
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        Max(TimestampDifferenceMilliseconds(GetCurrentTimestamp(), next_tick), 1),
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    proc_exit(0);
+}
+
+void pgtrace_ash_reset(void)
+{
+    LWLockPadded *lock;
+
+    if (!pgtrace_ash_state)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_ash");
+    pgtrace_lock_acquire(PGTRACE_LOCK_ASH, &lock->lock, LW_EXCLUSIVE);
+    memset(pgtrace_ash_state->entries, 0, sizeof(pgtrace_ash_state->entries));
+    pgtrace_ash_state->num_entries = 0;
+    pgtrace_ash_state->dropped = 0;
+    pgtrace_ash_state->evictions = 0;
+    pgtrace_ash_state->evict_hand = 0;
+    pgtrace_ash_state->stats_since = GetCurrentTimestamp();
+    LWLockRelease(&lock->lock);
+}
+
+/* Wait event type and name for a sample; "CPU" and NULL when not waiting. */
+static void
+ash_wait_event_datums(uint32 wait_event_info, Datum *values, bool *nulls)
+{
+    const char *type;
+    const char *event;
+
+    if (wait_event_info == 0)
+    {
+        values[0] = CStringGetTextDatum("CPU");
+        nulls[1] = true;
+        return;
+    }
+
+    type = pgstat_get_wait_event_type(wait_event_info);
+    event = pgstat_get_wait_event(wait_event_info);
+
+    if (type)
+        values[0] = CStringGetTextDatum(type);
+    else
+        nulls[0] = true;
+
+    if (event)
+        values[1] = CStringGetTextDatum(event);
+    else
+        nulls[1] = true;
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_ash);
+
+PGDLLEXPORT Datum pgtrace_internal_ash(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceAshEntry *snapshot;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+        uint32 i;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_ash must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        snapshot = palloc(PGTRACE_ASH_ENTRIES * sizeof(PgTraceAshEntry));
+
+        if (pgtrace_ash_state)
+        {
+            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_ash");
+
+            pgtrace_lock_acquire(PGTRACE_LOCK_ASH, &lock->lock, LW_SHARED);
+            for (i = 0; i < PGTRACE_ASH_HASH_SIZE && count < PGTRACE_ASH_ENTRIES; i++)
+            {
+                if (pgtrace_ash_state->entries[i].valid)
+                    snapshot[count++] = pgtrace_ash_state->entries[i];
+            }
+            LWLockRelease(&lock->lock);
+        }
+
+        funcctx->user_fctx = snapshot;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    snapshot = (PgTraceAshEntry *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[6];
+        bool nulls[6] = {false, false, false, false, false, false};
+        PgTraceAshEntry *entry = &snapshot[funcctx->call_cntr];
+        HeapTuple tuple;
+
+        values[0] = UInt64GetDatum(entry->fingerprint);
+        ash_wait_event_datums(entry->wait_event_info, &values[1], &nulls[1]);
+        values[3] = UInt64GetDatum(entry->samples);
+        values[4] = Float8GetDatum(entry->time_ms);
+        values[5] = TimestampTzGetDatum(entry->last_sample);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_ash_history);
+
+PGDLLEXPORT Datum pgtrace_internal_ash_history(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceAshSample *snapshot;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+        uint32 i;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_ash_history must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        snapshot = palloc(PGTRACE_ASH_HISTORY * sizeof(PgTraceAshSample));
+
+        for (i = 0; pgtrace_ash_state && i < PGTRACE_ASH_HISTORY; i++)
+        {
+            PgTraceAshHistorySlot *slot = &pgtrace_ash_state->history[i];
+            int attempt;
+
+            for (attempt = 0; attempt < PGTRACE_RING_READ_RETRIES; attempt++)
+            {
+                uint64 seq = pgtrace_ring_read_begin(&slot->seq);
+
+                if (seq == 0)
+                    break;
+
+                memcpy(&snapshot[count], &slot->sample, sizeof(PgTraceAshSample));
+
+                if (pgtrace_ring_read_valid(&slot->seq, seq))
+                {
+                    count++;
+                    break;
+                }
+            }
+        }
+
+        funcctx->user_fctx = snapshot;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    snapshot = (PgTraceAshSample *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[6];
+        bool nulls[6] = {false, false, false, false, false, false};
+        PgTraceAshSample *sample = &snapshot[funcctx->call_cntr];
+        HeapTuple tuple;
+
+        values[0] = TimestampTzGetDatum(sample->sample_time);
+        values[1] = Int32GetDatum(sample->pid);
+        values[2] = UInt64GetDatum(sample->fingerprint);
+        values[3] = Int32GetDatum((int32)sample->nesting_level);
+        ash_wait_event_datums(sample->wait_event_info, &values[4], &nulls[4]);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
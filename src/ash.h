@@ -0,0 +1,90 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <port/atomics.h>
+#include <utils/timestamp.h>
+#include "ring.h"
+
+/*
+ * Active session history. While a statement runs, the executor hooks
+ * publish its fingerprint and nesting level (1 for a top-level statement)
+ * in the backend's slot. A background worker reads every slot together
+ * with the backend's PGPROC wait_event_info pgtrace.ash_sample_rate times
+ * per second, counts samples per (fingerprint, wait event) and keeps the
+ * most recent samples in a ring. A sample without a wait event was taken
+ * while the backend was on CPU.
+ */
+
+typedef struct PgTraceAshBackend
+{
+    pg_atomic_uint64 fingerprint;
+    pg_atomic_uint32 nesting_level;
+} PgTraceAshBackend;
+
+typedef union PgTraceAshBackendSlot
+{
+    PgTraceAshBackend backend;
+    char pad[TYPEALIGN(PG_CACHE_LINE_SIZE, sizeof(PgTraceAshBackend))];
+} PgTraceAshBackendSlot;
+
+typedef struct PgTraceAshEntry
+{
+    uint64 fingerprint;
+    uint32 wait_event_info;
+    bool valid;
+    uint64 samples;
+    double time_ms;
+    TimestampTz last_sample;
+} PgTraceAshEntry;
+
+typedef struct PgTraceAshSample
+{
+    TimestampTz sample_time;
+    uint64 fingerprint;
+    int32 pid;
+    uint32 wait_event_info;
+    uint32 nesting_level;
+} PgTraceAshSample;
+
+typedef struct PgTraceAshHistorySlot
+{
+    pg_atomic_uint64 seq;
+    PgTraceAshSample sample;
+} PgTraceAshHistorySlot;
+
+#define PGTRACE_ASH_ENTRIES 4096
+#define PGTRACE_ASH_HASH_SIZE (PGTRACE_ASH_ENTRIES * 2)
+#define PGTRACE_ASH_HISTORY 16384
+
+/*
+ * The aggregate table is written by the sampler only, under the
+ * pgtrace_ash lock; the history ring needs no lock. When the table is
+ * full, a new (fingerprint, wait event) pair evicts the least recently
+ * sampled of a few entries sampled from evict_hand, as the plan table does.
+ */
+typedef struct PgTraceAsh
+{
+    uint32 num_entries;
+    uint64 dropped;
+    uint64 evictions;
+    uint64 evict_hand;
+    uint64 ticks;
+    TimestampTz stats_since;
+    PgTraceAshEntry entries[PGTRACE_ASH_HASH_SIZE];
+    PgTraceRing ring;
+    PgTraceAshHistorySlot history[PGTRACE_ASH_HISTORY];
+} PgTraceAsh;
+
+extern PgTraceAsh *pgtrace_ash_state;
+
+void pgtrace_ash_request_shmem(void);
+void pgtrace_ash_startup(void);
+void pgtrace_ash_register(void);
+void pgtrace_ash_reset(void);
+uint64 pgtrace_ash_push(uint64 fingerprint);
+void pgtrace_ash_pop(uint64 outer);
+
+PGDLLEXPORT void pgtrace_ash_main(Datum main_arg);
+PGDLLEXPORT Datum pgtrace_internal_ash(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_ash_history(PG_FUNCTION_ARGS);
@@ -1,16 +1,48 @@
 #include <postgres.h>
+#include <signal.h>
+#include <access/xact.h>
+#include <storage/ipc.h>
 #include <storage/shmem.h>
 #include <storage/lwlock.h>
+#include <utils/timeout.h>
 #include <utils/timestamp.h>
 #include <miscadmin.h>
-#include "audit.h"
+#include "pgtrace.h"
 
 AuditEventBuffer *pgtrace_audit_buffer = NULL;
 
+#define AUDIT_FILL(block_pos, nevents, used) \
+    ((((uint64)(uint32)(block_pos)) << 32) | ((uint64)(nevents) << 16) | (uint64)(used))
+#define AUDIT_FILL_BLOCK(fill) ((uint32)((fill) >> 32))
+#define AUDIT_FILL_EVENTS(fill) ((uint32)(((fill) >> 16) & 0xFFFF))
+#define AUDIT_FILL_USED(fill) ((uint32)((fill)&0xFFFF))
+
+/* The block this backend owns and appends to, if any. */
+static AuditEventBuffer *open_buffer = NULL;
+static AuditBlock *open_block = NULL;
+static uint64 open_block_pos;
+static uint32 open_nevents;
+static uint32 open_used;
+static uint64 open_last_pos;
+static TimestampTz open_last_time;
+static bool callbacks_registered = false;
+
+/*
+ * Set while this backend appends to or seals its block, so that the idle
+ * timeout, which runs in a signal handler, leaves the block alone.
+ */
+static volatile sig_atomic_t audit_busy = false;
+static TimeoutId audit_idle_timeout;
+
+/* Dictionary id of the last user and database recorded. */
+static AuditEventBuffer *dict_buffer = NULL;
+static char dict_user[32];
+static char dict_database[64];
+static uint32 dict_id;
+
 void pgtrace_audit_request_shmem(void)
 {
     RequestAddinShmemSpace(sizeof(AuditEventBuffer));
-    RequestNamedLWLockTranche("pgtrace_audit", 1);
 }
 
 void pgtrace_audit_startup(void)
@@ -25,73 +57,620 @@ void pgtrace_audit_startup(void)
         &found);
 
     if (!found)
+        pgtrace_audit_init(pgtrace_audit_buffer);
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+void pgtrace_audit_init(AuditEventBuffer *buffer)
+{
+    uint32 i;
+
+    memset(buffer, 0, sizeof(AuditEventBuffer));
+    pgtrace_ring_init(&buffer->ring, PGTRACE_AUDIT_BUFFER_SIZE);
+    pgtrace_ring_init(&buffer->blocks, PGTRACE_AUDIT_BLOCKS);
+    pg_atomic_init_u64(&buffer->overwritten, 0);
+    SpinLockInit(&buffer->log.mutex);
+    pg_atomic_init_u64(&buffer->log.drained, 0);
+    pg_atomic_init_u64(&buffer->log.lost, 0);
+    SpinLockInit(&buffer->dict.mutex);
+    pg_atomic_init_u32(&buffer->dict.count, 0);
+    for (i = 0; i < PGTRACE_AUDIT_BLOCKS; i++)
     {
-        memset(pgtrace_audit_buffer, 0, sizeof(AuditEventBuffer));
+        pg_atomic_init_u64(&buffer->block[i].seq, 0);
+        pg_atomic_init_u64(&buffer->block[i].fill, 0);
+        pg_atomic_init_u64(&buffer->block[i].logged, 0);
     }
+}
 
-    LWLockRelease(AddinShmemInitLock);
+/* Block position a claimed or sealed block's sequence number belongs to. */
+static inline uint64
+audit_block_pos(uint64 seq)
+{
+    return (seq - 1) / 2;
+}
+
+static inline uint64
+zigzag_encode(int64 v)
+{
+    return ((uint64)v << 1) ^ (uint64)(v >> 63);
+}
+
+static inline int64
+zigzag_decode(uint64 v)
+{
+    return (int64)(v >> 1) ^ -(int64)(v & 1);
+}
+
+static inline char *
+put_varint(char *p, uint64 v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+static inline bool
+get_varint(const char **p, const char *end, uint64 *v)
+{
+    uint64 result = 0;
+    int shift;
+
+    for (shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+        uint8 b = (uint8)*(*p)++;
+
+        result |= (uint64)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+        {
+            *v = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static inline char *
+put_name(char *p, const char *name, Size size)
+{
+    uint8 len = (uint8)strnlen(name, size - 1);
+
+    *p++ = (char)len;
+    memcpy(p, name, len);
+    return p + len;
+}
+
+static inline bool
+get_name(const char **p, const char *end, char *name, Size size)
+{
+    uint8 len;
+
+    if (*p >= end)
+        return false;
+
+    len = (uint8)*(*p)++;
+    if (len >= size || end - *p < len)
+        return false;
+
+    memcpy(name, *p, len);
+    name[len] = '\0';
+    *p += len;
+    return true;
+}
+
+/*
+ * Dictionary id of a user and database, or 0 if the dictionary is full. The
+ * last pair is cached, so a backend normally interns its pair once.
+ */
+static uint32
+audit_dict_id(AuditEventBuffer *buffer, const char *user, const char *database)
+{
+    AuditDict *dict = &buffer->dict;
+    uint32 count;
+    uint32 i;
+
+    if (dict_buffer == buffer &&
+        strncmp(user, dict_user, sizeof(dict_user) - 1) == 0 &&
+        strncmp(database, dict_database, sizeof(dict_database) - 1) == 0)
+        return dict_id;
+
+    strlcpy(dict_user, user, sizeof(dict_user));
+    strlcpy(dict_database, database, sizeof(dict_database));
+    dict_buffer = buffer;
+    dict_id = 0;
+
+    SpinLockAcquire(&dict->mutex);
+
+    count = pg_atomic_read_u32(&dict->count);
+    for (i = 0; i < count; i++)
+    {
+        if (strcmp(dict->entries[i].user, dict_user) == 0 &&
+            strcmp(dict->entries[i].database, dict_database) == 0)
+        {
+            dict_id = i + 1;
+            break;
+        }
+    }
+
+    if (dict_id == 0 && count < PGTRACE_AUDIT_DICT_SIZE)
+    {
+        strlcpy(dict->entries[count].user, dict_user, sizeof(dict->entries[count].user));
+        strlcpy(dict->entries[count].database, dict_database, sizeof(dict->entries[count].database));
+        pg_write_barrier();
+        pg_atomic_write_u32(&dict->count, count + 1);
+        dict_id = count + 1;
+    }
+
+    SpinLockRelease(&dict->mutex);
+
+    return dict_id;
+}
+
+static Size
+audit_encode(char *dst, uint64 pos_delta, int64 time_delta, uint64 fingerprint,
+             AuditOpType op_type, uint32 id, const char *user, const char *database,
+             int64 rows_affected, double duration_ms)
+{
+    char *p = dst;
+    double duration_us = duration_ms * 1000.0 + 0.5;
+
+    p = put_varint(p, pos_delta);
+    p = put_varint(p, zigzag_encode(time_delta));
+    memcpy(p, &fingerprint, sizeof(uint64));
+    p += sizeof(uint64);
+    p = put_varint(p, ((uint64)id << 3) | (uint64)op_type);
+    if (id == 0)
+    {
+        p = put_name(p, user, sizeof(((AuditEvent *)NULL)->user));
+        p = put_name(p, database, sizeof(((AuditEvent *)NULL)->database));
+    }
+    p = put_varint(p, zigzag_encode(rows_affected));
+    p = put_varint(p, duration_us > 0 ? (uint64)duration_us : 0);
+
+    return p - dst;
+}
+
+/* Publish the open block as complete. Caller has audit_busy set, or is the idle timeout. */
+static void
+audit_seal_block(void)
+{
+    if (!open_block)
+        return;
+
+    pgtrace_ring_end_write(&open_block->seq, open_block_pos);
+    open_block = NULL;
+    open_buffer = NULL;
+}
+
+void pgtrace_audit_seal(void)
+{
+    audit_busy = true;
+    pg_compiler_barrier();
+    audit_seal_block();
+    pg_compiler_barrier();
+    audit_busy = false;
+}
+
+static void
+audit_seal_at_exit(int code, Datum arg)
+{
+    pgtrace_audit_seal();
+}
+
+/* Hand the block back once the backend has been idle for a while. */
+static void
+audit_idle_timeout_handler(void)
+{
+    if (!audit_busy)
+        audit_seal_block();
+}
+
+static void
+audit_xact_callback(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PREPARE:
+        if (open_block)
+            enable_timeout_after(audit_idle_timeout, PGTRACE_AUDIT_IDLE_SEAL_MS);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Account for the events of a block that is about to be reused. */
+static void
+audit_retire_block(AuditEventBuffer *buffer, AuditBlock *block, uint64 old_seq)
+{
+    uint64 old_pos = audit_block_pos(old_seq);
+    uint64 fill = pg_atomic_read_u64(&block->fill);
+    uint32 nevents;
+
+    if (AUDIT_FILL_BLOCK(fill) != (uint32)old_pos)
+        return;
+
+    nevents = AUDIT_FILL_EVENTS(fill);
+    pg_atomic_fetch_add_u64(&buffer->overwritten, nevents);
+
+    /*
+     * The writer may have consumed only part of a block it passed while the
+     * block was still owned; what was appended since is lost too.
+     */
+    if (pgtrace_audit_log)
+    {
+        uint64 logged = pg_atomic_read_u64(&block->logged);
+        uint32 consumed = 0;
+
+        if (AUDIT_FILL_BLOCK(logged) == (uint32)old_pos)
+            consumed = AUDIT_FILL_EVENTS(logged);
+        if (nevents > consumed)
+            pg_atomic_fetch_add_u64(&buffer->log.lost, nevents - consumed);
+    }
+}
+
+/*
+ * Claim the next block for this backend, starting it at the given event.
+ * Blocks still owned by another backend are skipped, up to a few times.
+ */
+static bool
+audit_claim_block(AuditEventBuffer *buffer, uint64 pos, TimestampTz now)
+{
+    int attempt;
+
+    for (attempt = 0; attempt < PGTRACE_AUDIT_CLAIM_ATTEMPTS; attempt++)
+    {
+        uint64 block_pos = pgtrace_ring_reserve(&buffer->blocks);
+        AuditBlock *block = &buffer->block[block_pos % PGTRACE_AUDIT_BLOCKS];
+        uint64 old = pg_atomic_read_u64(&block->seq);
+        Latch *writer_latch;
+        uint64 drained;
+
+        /* Owned by a backend from an earlier lap, or already overtaken. */
+        if ((old & 1) || old > 2 * block_pos ||
+            !pg_atomic_compare_exchange_u64(&block->seq, &old, 2 * block_pos + 1))
+        {
+            pg_atomic_fetch_add_u64(&buffer->blocks.dropped, 1);
+            continue;
+        }
+
+        if (old != 0)
+            audit_retire_block(buffer, block, old);
+
+        block->first_pos = pos;
+        block->first_time = now;
+        pg_write_barrier();
+        pg_atomic_write_u64(&block->fill, AUDIT_FILL(block_pos, 0, 0));
+
+        open_buffer = buffer;
+        open_block = block;
+        open_block_pos = block_pos;
+        open_nevents = 0;
+        open_used = 0;
+        open_last_pos = pos;
+        open_last_time = now;
+
+        if (!callbacks_registered)
+        {
+            before_shmem_exit(audit_seal_at_exit, (Datum)0);
+            audit_idle_timeout = RegisterTimeout(USER_TIMEOUT, audit_idle_timeout_handler);
+            RegisterXactCallback(audit_xact_callback, NULL);
+            callbacks_registered = true;
+        }
+
+        /*
+         * Wake the writer at any claim past half the blocks, not just at the
+         * half mark: claimers that skip owned blocks can jump over it.
+         * SetLatch is cheap while the latch is already set.
+         */
+        writer_latch = buffer->log.writer_latch;
+        drained = pg_atomic_read_u64(&buffer->log.drained);
+        if (writer_latch && block_pos >= drained &&
+            block_pos - drained >= PGTRACE_AUDIT_BLOCKS / 2)
+            SetLatch(writer_latch);
+
+        return true;
+    }
+
+    return false;
+}
+
+static void
+audit_append(AuditEventBuffer *buffer, uint64 fingerprint, AuditOpType op_type,
+             const char *user, const char *database,
+             int64 rows_affected, double duration_ms)
+{
+    char encoded[PGTRACE_AUDIT_MAX_EVENT_BYTES];
+    TimestampTz now;
+    uint64 pos;
+    uint32 id;
+    Size len = 0;
+
+    pos = pgtrace_ring_reserve(&buffer->ring);
+    now = GetCurrentTimestamp();
+
+    if (!user)
+        user = "";
+    if (!database)
+        database = "";
+    id = audit_dict_id(buffer, user, database);
+
+    /* A block of a buffer we have since switched away from is not ours to seal. */
+    if (open_block && open_buffer != buffer)
+        open_block = NULL;
+
+    if (open_block)
+    {
+        len = audit_encode(encoded, pos - open_last_pos, now - open_last_time,
+                           fingerprint, op_type, id, user, database,
+                           rows_affected, duration_ms);
+        if (open_used + len > PGTRACE_AUDIT_BLOCK_BYTES)
+            audit_seal_block();
+    }
+
+    if (!open_block)
+    {
+        if (!audit_claim_block(buffer, pos, now))
+        {
+            pg_atomic_fetch_add_u64(&buffer->ring.dropped, 1);
+            return;
+        }
+
+        len = audit_encode(encoded, 0, 0, fingerprint, op_type, id, user, database,
+                           rows_affected, duration_ms);
+    }
+
+    memcpy(open_block->data + open_used, encoded, len);
+    open_used += len;
+    open_nevents++;
+    open_last_pos = pos;
+    open_last_time = now;
+
+    pg_write_barrier();
+    pg_atomic_write_u64(&open_block->fill, AUDIT_FILL(open_block_pos, open_nevents, open_used));
 }
 
 void pgtrace_audit_record(uint64 fingerprint, AuditOpType op_type,
                           const char *user, const char *database,
                           int64 rows_affected, double duration_ms)
 {
-    AuditEvent *entry;
-    LWLockPadded *lock;
-
     if (!pgtrace_audit_buffer)
         return;
 
-    lock = GetNamedLWLockTranche("pgtrace_audit");
-    LWLockAcquire(&lock->lock, LW_EXCLUSIVE);
+    audit_busy = true;
+    pg_compiler_barrier();
+    audit_append(pgtrace_audit_buffer, fingerprint, op_type, user, database,
+                 rows_affected, duration_ms);
+    pg_compiler_barrier();
+    audit_busy = false;
+}
+
+/*
+ * Copy the published part of a block without taking a lock. A block its
+ * owner is still appending to can be copied too; only a reuse of the block
+ * while we copy it makes us retry.
+ */
+bool
+pgtrace_audit_read_block(uint32 index, AuditBlockCopy *dst)
+{
+    AuditBlock *block = &pgtrace_audit_buffer->block[index];
+    int attempt;
+
+    for (attempt = 0; attempt < PGTRACE_RING_READ_RETRIES; attempt++)
+    {
+        uint64 seq = pgtrace_ring_read_begin(&block->seq);
+        uint64 fill;
 
-    entry = &pgtrace_audit_buffer->entries[pgtrace_audit_buffer->write_pos];
+        if (seq == 0)
+            return false;
 
-    entry->fingerprint = fingerprint;
-    entry->op_type = op_type;
-    entry->rows_affected = rows_affected;
-    entry->duration_ms = duration_ms;
-    entry->timestamp = GetCurrentTimestamp();
-    entry->valid = true;
+        fill = pg_atomic_read_u64(&block->fill);
+        pg_read_barrier();
 
-    if (user)
-        snprintf(entry->user, sizeof(entry->user), "%s", user);
-    else
-        entry->user[0] = '\0';
+        dst->seq = seq;
+        dst->used = (AUDIT_FILL_BLOCK(fill) == (uint32)audit_block_pos(seq)) ? AUDIT_FILL_USED(fill) : 0;
+        dst->first_pos = block->first_pos;
+        dst->first_time = block->first_time;
+        memcpy(dst->data, block->data, dst->used);
+
+        pg_read_barrier();
+        if (pg_atomic_read_u64(&block->seq) == seq)
+            return true;
+    }
+
+    return false;
+}
+
+void pgtrace_audit_cursor_init(const AuditBlockCopy *block, AuditCursor *cursor)
+{
+    cursor->offset = 0;
+    cursor->events = 0;
+    cursor->pos = block->first_pos;
+    cursor->time = block->first_time;
+}
+
+/* Decode the event at the cursor and move past it; false at the end of the block. */
+bool
+pgtrace_audit_decode(const AuditBlockCopy *block, AuditCursor *cursor, AuditEvent *event)
+{
+    const char *p = block->data + cursor->offset;
+    const char *end = block->data + block->used;
+    uint64 pos_delta;
+    uint64 time_delta;
+    uint64 code;
+    uint64 rows;
+    uint64 duration_us;
+    uint32 id;
+
+    if (!get_varint(&p, end, &pos_delta) ||
+        !get_varint(&p, end, &time_delta) ||
+        end - p < (ptrdiff_t)sizeof(uint64))
+        return false;
+
+    memcpy(&event->fingerprint, p, sizeof(uint64));
+    p += sizeof(uint64);
+
+    if (!get_varint(&p, end, &code))
+        return false;
+
+    event->op_type = (AuditOpType)(code & 7);
+    id = (uint32)(code >> 3);
 
-    if (database)
-        snprintf(entry->database, sizeof(entry->database), "%s", database);
+    if (id == 0)
+    {
+        if (!get_name(&p, end, event->user, sizeof(event->user)) ||
+            !get_name(&p, end, event->database, sizeof(event->database)))
+            return false;
+    }
+    else if (id <= pg_atomic_read_u32(&pgtrace_audit_buffer->dict.count))
+    {
+        AuditDictEntry *entry = &pgtrace_audit_buffer->dict.entries[id - 1];
+
+        pg_read_barrier();
+        strlcpy(event->user, entry->user, sizeof(event->user));
+        strlcpy(event->database, entry->database, sizeof(event->database));
+    }
     else
-        entry->database[0] = '\0';
+        return false;
+
+    if (!get_varint(&p, end, &rows) || !get_varint(&p, end, &duration_us))
+        return false;
 
-    pgtrace_audit_buffer->total_events++;
+    cursor->offset = p - block->data;
+    cursor->events++;
+    cursor->pos += pos_delta;
+    cursor->time += zigzag_decode(time_delta);
 
-    pgtrace_audit_buffer->write_pos =
-        (pgtrace_audit_buffer->write_pos + 1) % PGTRACE_AUDIT_BUFFER_SIZE;
+    event->rows_affected = zigzag_decode(rows);
+    event->duration_ms = (double)duration_us / 1000.0;
+    event->timestamp = cursor->time;
 
-    LWLockRelease(&lock->lock);
+    return true;
 }
 
-uint32
-pgtrace_audit_count(void)
+/* Record how many events of a block the audit log writer has consumed. */
+void pgtrace_audit_mark_logged(uint64 block_pos, uint32 events)
+{
+    AuditBlock *block = &pgtrace_audit_buffer->block[block_pos % PGTRACE_AUDIT_BLOCKS];
+
+    pg_atomic_write_u64(&block->logged, AUDIT_FILL(block_pos, events, 0));
+}
+
+/*
+ * Decode every event written since the last reset into dst, or only count
+ * them when dst is NULL.
+ */
+static uint32
+audit_scan(AuditEvent *dst, uint32 max_events)
 {
+    AuditBlockCopy *block;
+    AuditEvent scratch;
+    uint64 reset;
     uint32 count = 0;
     uint32 i;
-    LWLockPadded *lock;
 
     if (!pgtrace_audit_buffer)
         return 0;
 
-    lock = GetNamedLWLockTranche("pgtrace_audit");
-    LWLockAcquire(&lock->lock, LW_SHARED);
+    block = palloc(sizeof(AuditBlockCopy));
+    reset = pg_atomic_read_u64(&pgtrace_audit_buffer->ring.reset);
 
-    for (i = 0; i < PGTRACE_AUDIT_BUFFER_SIZE; i++)
+    for (i = 0; i < PGTRACE_AUDIT_BLOCKS && count < max_events; i++)
     {
-        if (pgtrace_audit_buffer->entries[i].valid)
-            count++;
-    }
+        AuditCursor cursor;
+
+        if (!pgtrace_audit_read_block(i, block))
+            continue;
 
-    LWLockRelease(&lock->lock);
+        pgtrace_audit_cursor_init(block, &cursor);
+        while (count < max_events &&
+               pgtrace_audit_decode(block, &cursor, dst ? &dst[count] : &scratch))
+        {
+            if (cursor.pos >= reset)
+                count++;
+        }
+    }
 
+    pfree(block);
     return count;
 }
+
+uint32
+pgtrace_audit_snapshot(AuditEvent *dst, uint32 max_events)
+{
+    return audit_scan(dst, max_events);
+}
+
+uint32
+pgtrace_audit_count(void)
+{
+    return audit_scan(NULL, PG_UINT32_MAX);
+}
+
+/* Events lost to block reuse. */
+uint64
+pgtrace_audit_overwritten(void)
+{
+    if (!pgtrace_audit_buffer)
+        return 0;
+
+    return pg_atomic_read_u64(&pgtrace_audit_buffer->overwritten);
+}
+
+/*
+ * Events in the blocks the audit log writer has not reached yet. Events
+ * appended since to blocks it passed while they were still owned are not
+ * counted.
+ */
+uint64
+pgtrace_audit_backlog(void)
+{
+    uint64 head;
+    uint64 block_pos;
+    uint64 backlog = 0;
+
+    if (!pgtrace_audit_buffer)
+        return 0;
+
+    head = pgtrace_ring_written(&pgtrace_audit_buffer->blocks);
+    block_pos = pg_atomic_read_u64(&pgtrace_audit_buffer->log.drained);
+    if (head - block_pos > PGTRACE_AUDIT_BLOCKS)
+        block_pos = head - PGTRACE_AUDIT_BLOCKS;
+
+    for (; block_pos < head; block_pos++)
+    {
+        uint64 fill = pg_atomic_read_u64(&pgtrace_audit_buffer->block[block_pos % PGTRACE_AUDIT_BLOCKS].fill);
+
+        if (AUDIT_FILL_BLOCK(fill) == (uint32)block_pos)
+            backlog += AUDIT_FILL_EVENTS(fill);
+    }
+
+    return backlog;
+}
+
+const char *
+pgtrace_audit_op_name(AuditOpType op_type)
+{
+    switch (op_type)
+    {
+    case AUDIT_SELECT:
+        return "SELECT";
+    case AUDIT_INSERT:
+        return "INSERT";
+    case AUDIT_UPDATE:
+        return "UPDATE";
+    case AUDIT_DELETE:
+        return "DELETE";
+    case AUDIT_DDL:
+        return "DDL";
+    default:
+        return "UNKNOWN";
+    }
+}
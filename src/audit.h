@@ -1,7 +1,10 @@
 #pragma once
 
 #include <postgres.h>
+#include <storage/latch.h>
+#include <storage/spin.h>
 #include <utils/timestamp.h>
+#include "ring.h"
 
 typedef enum AuditOpType
 {
@@ -22,23 +25,147 @@ typedef struct AuditEvent
     int64 rows_affected;
     double duration_ms;
     TimestampTz timestamp;
-    bool valid;
 } AuditEvent;
 
-#define PGTRACE_AUDIT_BUFFER_SIZE 5000
+/*
+ * Audit events are kept compressed, in blocks of PGTRACE_AUDIT_BLOCK_BYTES.
+ * A backend claims a whole block and is its only writer, so appending an
+ * event takes no lock and no atomic operation beyond reserving its ring
+ * position. Each event is encoded against the previous one in the block
+ * (the first against the block's first position and time):
+ *
+ *   varint   ring position delta
+ *   varint   timestamp delta in microseconds, zigzag encoded
+ *   8 bytes  fingerprint
+ *   varint   dictionary id << 3 | operation
+ *   varint   rows affected, zigzag encoded
+ *   varint   duration in microseconds
+ *
+ * User and database names are interned in a small shared dictionary. Id 0
+ * means the pair did not fit there, and the names follow inline as a
+ * length byte plus the bytes each. A typical event takes 14-20 bytes
+ * instead of the 140 of an AuditEvent; durations lose precision below a
+ * microsecond.
+ *
+ * Blocks are claimed round robin with the ring protocol of ring.h over
+ * block positions; a block stays odd ("being written") while its backend
+ * owns it, and claimers skip blocks that are still owned. A backend gives
+ * its block up when the block is full, when it exits, and once it has not
+ * ended a transaction for PGTRACE_AUDIT_IDLE_SEAL_MS, so idle connections
+ * do not pin blocks. Readers copy a block up to its published length and
+ * decode it in local memory.
+ */
+#define PGTRACE_AUDIT_BLOCK_BYTES 1024
+#define PGTRACE_AUDIT_BLOCKS 640
+#define PGTRACE_AUDIT_MIN_EVENT_BYTES 13
+#define PGTRACE_AUDIT_MAX_EVENT_BYTES 160
+#define PGTRACE_AUDIT_DICT_SIZE 128
+#define PGTRACE_AUDIT_CLAIM_ATTEMPTS 8
+#define PGTRACE_AUDIT_IDLE_SEAL_MS 1000
 
+/* Most events the blocks can hold, for sizing snapshots. */
+#define PGTRACE_AUDIT_BUFFER_SIZE \
+    (PGTRACE_AUDIT_BLOCKS * (PGTRACE_AUDIT_BLOCK_BYTES / PGTRACE_AUDIT_MIN_EVENT_BYTES))
+
+/*
+ * fill packs what the owner has published: the low 32 bits of the block
+ * position, the event count and the byte count. The position lets a reader
+ * tell a fill left over from the block's previous lap, which it treats as
+ * empty. logged packs the block position and the number of its events the
+ * audit log writer has consumed, so that a claimer reusing the block can
+ * count the rest as lost.
+ */
+typedef struct AuditBlock
+{
+    pg_atomic_uint64 seq;
+    pg_atomic_uint64 fill;
+    pg_atomic_uint64 logged;
+    uint64 first_pos;
+    TimestampTz first_time;
+    char data[PGTRACE_AUDIT_BLOCK_BYTES];
+} AuditBlock;
+
+/* Plain copy of a block, and a position within it, for decoding. */
+typedef struct AuditBlockCopy
+{
+    uint64 seq;
+    uint32 used;
+    uint64 first_pos;
+    TimestampTz first_time;
+    char data[PGTRACE_AUDIT_BLOCK_BYTES];
+} AuditBlockCopy;
+
+typedef struct AuditCursor
+{
+    uint32 offset;
+    uint32 events; /* decoded so far */
+    uint64 pos;
+    TimestampTz time;
+} AuditCursor;
+
+typedef struct AuditDictEntry
+{
+    char user[32];
+    char database[64];
+} AuditDictEntry;
+
+/* Entries are appended under the mutex and never change once counted. */
+typedef struct AuditDict
+{
+    slock_t mutex;
+    pg_atomic_uint32 count;
+    AuditDictEntry entries[PGTRACE_AUDIT_DICT_SIZE];
+} AuditDict;
+
+/*
+ * Consumer side of the audit ring, owned by the audit log writer. drained
+ * is the first block position it has not reached yet; claimers wake it up
+ * once the backlog reaches half the blocks. Events of a block overwritten
+ * before it consumed them count as lost.
+ */
+typedef struct AuditLogState
+{
+    slock_t mutex;
+    Latch *writer_latch;
+    pg_atomic_uint64 drained;
+    pg_atomic_uint64 lost;
+    uint64 events_logged;
+    uint64 files_written;
+    uint64 bytes_written;
+    TimestampTz last_flush;
+    char current_file[MAXPGPATH];
+} AuditLogState;
+
+/*
+ * ring counts event positions (written, dropped for want of a block, and
+ * the reset position); blocks counts block claims, and its dropped counter
+ * the owned blocks claimers had to skip.
+ */
 typedef struct AuditEventBuffer
 {
-    AuditEvent entries[PGTRACE_AUDIT_BUFFER_SIZE];
-    uint32 write_pos;
-    uint64 total_events;
+    PgTraceRing ring;
+    PgTraceRing blocks;
+    pg_atomic_uint64 overwritten;
+    AuditLogState log;
+    AuditDict dict;
+    AuditBlock block[PGTRACE_AUDIT_BLOCKS];
 } AuditEventBuffer;
 
 extern AuditEventBuffer *pgtrace_audit_buffer;
 
 void pgtrace_audit_request_shmem(void);
 void pgtrace_audit_startup(void);
+void pgtrace_audit_init(AuditEventBuffer *buffer);
 void pgtrace_audit_record(uint64 fingerprint, AuditOpType op_type,
                           const char *user, const char *database,
                           int64 rows_affected, double duration_ms);
+void pgtrace_audit_seal(void);
+bool pgtrace_audit_read_block(uint32 index, AuditBlockCopy *dst);
+void pgtrace_audit_cursor_init(const AuditBlockCopy *block, AuditCursor *cursor);
+bool pgtrace_audit_decode(const AuditBlockCopy *block, AuditCursor *cursor, AuditEvent *event);
+void pgtrace_audit_mark_logged(uint64 block_pos, uint32 events);
+uint32 pgtrace_audit_snapshot(AuditEvent *dst, uint32 max_events);
 uint32 pgtrace_audit_count(void);
+uint64 pgtrace_audit_overwritten(void);
+uint64 pgtrace_audit_backlog(void);
+const char *pgtrace_audit_op_name(AuditOpType op_type);
@@ -0,0 +1,670 @@
+#include <postgres.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <pgtime.h>
+#include <nodes/pg_list.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/fd.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/spin.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+#define AUDIT_LOG_HEADER_LEN 16
+#define AUDIT_LOG_FIXED_LEN 43
+#define AUDIT_LOG_MAX_RECORD (AUDIT_LOG_FIXED_LEN + 255 + 255)
+#define AUDIT_LOG_BATCH_BYTES (256 * 1024)
+#define AUDIT_LOG_STALL_PASSES 3
+
+typedef struct AuditLogWriter
+{
+    int fd;
+    uint64 size;
+    TimestampTz opened_at;
+    char *batch;
+    Size batch_len;
+    uint64 batch_first_pos;
+    uint64 batch_events;
+    uint64 stall_pos;
+    int stall_passes;
+    AuditBlockCopy *block;
+    List *open_blocks;
+} AuditLogWriter;
+
+static AuditLogWriter writer = {.fd = -1};
+
+void pgtrace_audit_log_register(void)
+{
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgtrace");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgtrace_audit_log_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pgtrace audit log writer");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pgtrace audit log writer");
+
+    RegisterBackgroundWorker(&worker);
+}
+
+static void
+audit_log_ensure_dir(const char *path)
+{
+    if (MakePGDirectory(path) < 0 && errno != EEXIST)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create directory \"%s\": %m", path)));
+}
+
+static Size
+audit_log_encode(char *dst, uint64 pos, const AuditEvent *event)
+{
+    char *p = dst;
+    uint8 op_type = (uint8)event->op_type;
+    uint8 user_len = (uint8)strnlen(event->user, sizeof(event->user) - 1);
+    uint8 database_len = (uint8)strnlen(event->database, sizeof(event->database) - 1);
+
+    memcpy(p, &pos, sizeof(uint64));
+    p += sizeof(uint64);
+    memcpy(p, &event->fingerprint, sizeof(uint64));
+    p += sizeof(uint64);
+    memcpy(p, &event->timestamp, sizeof(int64));
+    p += sizeof(int64);
+    memcpy(p, &event->rows_affected, sizeof(int64));
+    p += sizeof(int64);
+    memcpy(p, &event->duration_ms, sizeof(double));
+    p += sizeof(double);
+    *p++ = (char)op_type;
+    *p++ = (char)user_len;
+    *p++ = (char)database_len;
+    memcpy(p, event->user, user_len);
+    p += user_len;
+    memcpy(p, event->database, database_len);
+    p += database_len;
+
+    return p - dst;
+}
+
+static void
+audit_log_set_current_file(const char *path)
+{
+    AuditLogState *log = &pgtrace_audit_buffer->log;
+
+    SpinLockAcquire(&log->mutex);
+    strlcpy(log->current_file, path, sizeof(log->current_file));
+    if (path[0] != '\0')
+        log->files_written++;
+    SpinLockRelease(&log->mutex);
+}
+
+static void
+audit_log_write(const char *data, Size len)
+{
+    errno = 0;
+    if (write(writer.fd, data, len) != (ssize_t)len)
+    {
+        /* if write didn't set errno, assume problem is no disk space */
+        if (errno == 0)
+            errno = ENOSPC;
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write audit log file: %m")));
+    }
+
+    writer.size += len;
+}
+
+static void
+audit_log_open(uint64 first_pos)
+{
+    char path[MAXPGPATH];
+    char timestr[32];
+    char header[AUDIT_LOG_HEADER_LEN];
+    uint32 version = PGTRACE_AUDIT_LOG_VERSION;
+    uint32 reserved = 0;
+    pg_time_t now = (pg_time_t)time(NULL);
+    struct stat st;
+
+    pg_strftime(timestr, sizeof(timestr), "%Y%m%d-%H%M%S",
+                pg_localtime(&now, log_timezone));
+    snprintf(path, sizeof(path), "%s/audit-%s-" UINT64_FORMAT ".bin",
+             PGTRACE_AUDIT_LOG_DIR, timestr, first_pos);
+
+    writer.fd = OpenTransientFile(path, O_WRONLY | O_CREAT | O_APPEND | PG_BINARY);
+    if (writer.fd < 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open audit log file \"%s\": %m", path)));
+
+    if (fstat(writer.fd, &st) < 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not stat audit log file \"%s\": %m", path)));
+
+    writer.size = st.st_size;
+    writer.opened_at = GetCurrentTimestamp();
+
+    /* A restarted writer may reopen a file it already started. */
+    if (writer.size == 0)
+    {
+        memcpy(header, PGTRACE_AUDIT_LOG_MAGIC, 8);
+        memcpy(header + 8, &version, sizeof(uint32));
+        memcpy(header + 12, &reserved, sizeof(uint32));
+        audit_log_write(header, sizeof(header));
+    }
+
+    audit_log_set_current_file(path);
+}
+
+static void
+audit_log_close(void)
+{
+    if (writer.fd < 0)
+        return;
+
+    if (pgtrace_audit_log_fsync != PGTRACE_FSYNC_OFF && pg_fsync(writer.fd) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not fsync audit log file: %m")));
+
+    CloseTransientFile(writer.fd);
+    writer.fd = -1;
+    writer.size = 0;
+
+    audit_log_set_current_file("");
+}
+
+static void
+audit_log_rotate_if_due(void)
+{
+    if (writer.fd < 0)
+        return;
+
+    if (TimestampDifferenceExceeds(writer.opened_at, GetCurrentTimestamp(),
+                                   pgtrace_audit_log_rotation_age * 1000))
+        audit_log_close();
+}
+
+/* Write the pending batch and mark every block before drained_pos passed. */
+static void
+audit_log_flush(uint64 drained_pos)
+{
+    AuditLogState *log = &pgtrace_audit_buffer->log;
+
+    if (writer.batch_len > 0)
+    {
+        if (writer.fd >= 0 && writer.size > AUDIT_LOG_HEADER_LEN &&
+            writer.size + writer.batch_len > (uint64)pgtrace_audit_log_rotation_size * 1024)
+            audit_log_close();
+
+        if (writer.fd < 0)
+            audit_log_open(writer.batch_first_pos);
+
+        audit_log_write(writer.batch, writer.batch_len);
+
+        if (pgtrace_audit_log_fsync == PGTRACE_FSYNC_BATCH && pg_fsync(writer.fd) != 0)
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not fsync audit log file: %m")));
+
+        SpinLockAcquire(&log->mutex);
+        log->bytes_written += writer.batch_len;
+        log->events_logged += writer.batch_events;
+        log->last_flush = GetCurrentTimestamp();
+        SpinLockRelease(&log->mutex);
+
+        writer.batch_len = 0;
+        writer.batch_events = 0;
+    }
+
+    pg_atomic_write_u64(&log->drained, drained_pos);
+}
+
+/*
+ * A block that was still owned when the drain passed it, or that had not
+ * been claimed yet (started is false until its first events are read).
+ */
+typedef struct AuditLogOpenBlock
+{
+    uint64 block_pos;
+    bool started;
+    AuditCursor cursor;
+} AuditLogOpenBlock;
+
+static void
+audit_log_watch(uint64 block_pos, const AuditCursor *cursor)
+{
+    MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    AuditLogOpenBlock *open = palloc0(sizeof(AuditLogOpenBlock));
+
+    open->block_pos = block_pos;
+    open->started = cursor != NULL;
+    if (cursor)
+        open->cursor = *cursor;
+    writer.open_blocks = lappend(writer.open_blocks, open);
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Add the events of a block from the cursor on to the batch. Returns
+ * whether its owner may still append more.
+ */
+static bool
+audit_log_consume(uint64 block_pos, AuditCursor *cursor, bool resume, uint64 drained_pos)
+{
+    AuditBlockCopy *block = writer.block;
+    AuditEvent event;
+
+    if (!pgtrace_audit_read_block(block_pos % PGTRACE_AUDIT_BLOCKS, block) ||
+        (block->seq - 1) / 2 != block_pos)
+        return false;
+
+    if (!resume)
+        pgtrace_audit_cursor_init(block, cursor);
+
+    while (pgtrace_audit_decode(block, cursor, &event))
+    {
+        if (writer.batch_len + AUDIT_LOG_MAX_RECORD > AUDIT_LOG_BATCH_BYTES)
+            audit_log_flush(drained_pos);
+
+        if (writer.batch_len == 0)
+            writer.batch_first_pos = cursor->pos;
+
+        writer.batch_len += audit_log_encode(writer.batch + writer.batch_len, cursor->pos, &event);
+        writer.batch_events++;
+    }
+
+    pgtrace_audit_mark_logged(block_pos, cursor->events);
+
+    return (block->seq & 1) != 0;
+}
+
+/*
+ * Consume every block between the drain position and the block head, then
+ * whatever was appended since to blocks passed while still owned. Blocks
+ * reused before we consumed them were counted as lost by their claimer. A
+ * block still owned from an earlier lap is passed, since its claimer most
+ * likely gave up on it; a sealed one whose claimer has not taken it yet
+ * stalls the pass, and is passed after a few passes. A passed position is
+ * watched like an open block, so that a claim landing late is still
+ * consumed. Records are in block order, so positions within a file are
+ * not sorted.
+ */
+static void
+audit_log_drain(void)
+{
+    AuditLogState *log = &pgtrace_audit_buffer->log;
+    uint64 block_pos = pg_atomic_read_u64(&log->drained);
+    uint64 head = pgtrace_ring_written(&pgtrace_audit_buffer->blocks);
+    ListCell *lc;
+
+    foreach(lc, writer.open_blocks)
+    {
+        AuditLogOpenBlock *open = (AuditLogOpenBlock *)lfirst(lc);
+        bool resume = open->started;
+
+        if (!open->started)
+        {
+            AuditBlock *block = &pgtrace_audit_buffer->block[open->block_pos % PGTRACE_AUDIT_BLOCKS];
+
+            /* Not claimed yet; its claimer may still take it. */
+            if (pg_atomic_read_u64(&block->seq) < 2 * open->block_pos + 1)
+                continue;
+            open->started = true;
+        }
+
+        if (audit_log_consume(open->block_pos, &open->cursor, resume, block_pos))
+            continue;
+
+        writer.open_blocks = foreach_delete_current(writer.open_blocks, lc);
+        pfree(open);
+    }
+
+    if (head - block_pos > PGTRACE_AUDIT_BLOCKS)
+        block_pos = head - PGTRACE_AUDIT_BLOCKS;
+
+    while (block_pos < head)
+    {
+        AuditBlock *block = &pgtrace_audit_buffer->block[block_pos % PGTRACE_AUDIT_BLOCKS];
+        uint64 seq = pgtrace_ring_read_begin(&block->seq);
+        AuditCursor cursor;
+
+        if (seq < 2 * block_pos + 1)
+        {
+            /* Still owned from an earlier lap, so its claimer likely gave up on it. */
+            if (seq & 1)
+            {
+                audit_log_watch(block_pos, NULL);
+                block_pos++;
+                continue;
+            }
+
+            if (writer.stall_pos != block_pos)
+            {
+                writer.stall_pos = block_pos;
+                writer.stall_passes = 0;
+            }
+
+            if (++writer.stall_passes < AUDIT_LOG_STALL_PASSES)
+                break;
+
+            audit_log_watch(block_pos, NULL);
+            block_pos++;
+            continue;
+        }
+
+        if (audit_log_consume(block_pos, &cursor, false, block_pos))
+            audit_log_watch(block_pos, &cursor);
+
+        block_pos++;
+    }
+
+    audit_log_flush(block_pos);
+}
+
+static void
+audit_log_detach(int code, Datum arg)
+{
+    AuditLogState *log = &pgtrace_audit_buffer->log;
+
+    SpinLockAcquire(&log->mutex);
+    log->writer_latch = NULL;
+    log->current_file[0] = '\0';
+    SpinLockRelease(&log->mutex);
+}
+
+void pgtrace_audit_log_main(Datum main_arg)
+{
+    AuditLogState *log;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+    BackgroundWorkerUnblockSignals();
+
+    if (!pgtrace_audit_buffer)
+        proc_exit(0);
+
+    log = &pgtrace_audit_buffer->log;
+
+    audit_log_ensure_dir(PGTRACE_DATA_DIR);
+    audit_log_ensure_dir(PGTRACE_AUDIT_LOG_DIR);
+
+    writer.batch = MemoryContextAlloc(TopMemoryContext, AUDIT_LOG_BATCH_BYTES);
+    writer.block = MemoryContextAlloc(TopMemoryContext, sizeof(AuditBlockCopy));
+
+    before_shmem_exit(audit_log_detach, (Datum)0);
+
+    SpinLockAcquire(&log->mutex);
+    log->writer_latch = MyLatch;
+    SpinLockRelease(&log->mutex);
+
+    while (!ShutdownRequestPending)
+    {
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        audit_log_rotate_if_due();
+        audit_log_drain();
+
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        pgtrace_audit_log_flush_ms,
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    audit_log_drain();
+    audit_log_close();
+
+    proc_exit(0);
+}
+
+static char *
+audit_log_path(text *filename)
+{
+    char *name = text_to_cstring(filename);
+
+    if (strncmp(name, "audit-", 6) != 0 ||
+        strchr(name, '/') != NULL || strchr(name, '\\') != NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid audit log file name \"%s\"", name),
+                 errhint("Use pgtrace_audit_log_files() to list available files.")));
+
+    return psprintf("%s/%s", PGTRACE_AUDIT_LOG_DIR, name);
+}
+
+static bool
+audit_log_read_record(FILE *file, const char *path, uint64 *pos, AuditEvent *event)
+{
+    char fixed[AUDIT_LOG_FIXED_LEN];
+    const char *p = fixed;
+    uint8 user_len;
+    uint8 database_len;
+    size_t nread;
+
+    nread = fread(fixed, 1, sizeof(fixed), file);
+    if (nread == 0 && feof(file))
+        return false;
+
+    memset(event, 0, sizeof(AuditEvent));
+
+    if (nread == sizeof(fixed))
+    {
+        memcpy(pos, p, sizeof(uint64));
+        p += sizeof(uint64);
+        memcpy(&event->fingerprint, p, sizeof(uint64));
+        p += sizeof(uint64);
+        memcpy(&event->timestamp, p, sizeof(int64));
+        p += sizeof(int64);
+        memcpy(&event->rows_affected, p, sizeof(int64));
+        p += sizeof(int64);
+        memcpy(&event->duration_ms, p, sizeof(double));
+        p += sizeof(double);
+        event->op_type = (AuditOpType)(uint8)*p++;
+        user_len = (uint8)*p++;
+        database_len = (uint8)*p++;
+
+        if (user_len < sizeof(event->user) && database_len < sizeof(event->database) &&
+            fread(event->user, 1, user_len, file) == user_len &&
+            fread(event->database, 1, database_len, file) == database_len)
+            return true;
+    }
+
+    /* A writer that died mid-batch leaves a partial record at the end. */
+    ereport(WARNING,
+            (errcode(ERRCODE_DATA_CORRUPTED),
+             errmsg("audit log file \"%s\" ends with an incomplete record", path)));
+    return false;
+}
+
+typedef struct AuditLogReadState
+{
+    FILE *file;
+    char *path;
+} AuditLogReadState;
+
+PG_FUNCTION_INFO_V1(pgtrace_read_audit_log);
+
+PGDLLEXPORT Datum pgtrace_read_audit_log(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    AuditLogReadState *state;
+    uint64 pos;
+    AuditEvent event;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        char header[AUDIT_LOG_HEADER_LEN];
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_read_audit_log must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        state = palloc0(sizeof(AuditLogReadState));
+        state->path = audit_log_path(PG_GETARG_TEXT_PP(0));
+        state->file = AllocateFile(state->path, PG_BINARY_R);
+        if (state->file == NULL)
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not open audit log file \"%s\": %m", state->path)));
+
+        if (fread(header, 1, sizeof(header), state->file) != sizeof(header) ||
+            memcmp(header, PGTRACE_AUDIT_LOG_MAGIC, 8) != 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATA_CORRUPTED),
+                     errmsg("\"%s\" is not a pgtrace audit log file", state->path)));
+
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (AuditLogReadState *)funcctx->user_fctx;
+
+    if (audit_log_read_record(state->file, state->path, &pos, &event))
+    {
+        Datum values[8];
+        bool nulls[8] = {false, false, false, false, false, false, false, false};
+        HeapTuple tuple;
+
+        values[0] = UInt64GetDatum(pos);
+        values[1] = UInt64GetDatum(event.fingerprint);
+        values[2] = PointerGetDatum(cstring_to_text(pgtrace_audit_op_name(event.op_type)));
+        values[3] = PointerGetDatum(cstring_to_text(event.user));
+        values[4] = PointerGetDatum(cstring_to_text(event.database));
+        values[5] = Int64GetDatum(event.rows_affected);
+        values[6] = Float8GetDatum(event.duration_ms);
+        values[7] = TimestampTzGetDatum(event.timestamp);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    FreeFile(state->file);
+    SRF_RETURN_DONE(funcctx);
+}
+
+typedef struct AuditLogFile
+{
+    char *name;
+    int64 size;
+    TimestampTz modified;
+} AuditLogFile;
+
+static int
+audit_log_file_cmp(const ListCell *a, const ListCell *b)
+{
+    AuditLogFile *fa = (AuditLogFile *)lfirst(a);
+    AuditLogFile *fb = (AuditLogFile *)lfirst(b);
+
+    return strcmp(fa->name, fb->name);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_audit_log_files);
+
+PGDLLEXPORT Datum pgtrace_audit_log_files(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    List *files;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        DIR *dir;
+        struct dirent *de;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_audit_log_files must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        files = NIL;
+        dir = AllocateDir(PGTRACE_AUDIT_LOG_DIR);
+
+        /* Nothing has been written yet if the directory does not exist. */
+        if (dir != NULL || errno != ENOENT)
+        {
+            while ((de = ReadDir(dir, PGTRACE_AUDIT_LOG_DIR)) != NULL)
+            {
+                AuditLogFile *file;
+                struct stat st;
+                char *path;
+
+                if (strncmp(de->d_name, "audit-", 6) != 0)
+                    continue;
+
+                path = psprintf("%s/%s", PGTRACE_AUDIT_LOG_DIR, de->d_name);
+                if (stat(path, &st) < 0)
+                    continue;
+
+                file = palloc(sizeof(AuditLogFile));
+                file->name = pstrdup(de->d_name);
+                file->size = st.st_size;
+                file->modified = time_t_to_timestamptz(st.st_mtime);
+                files = lappend(files, file);
+            }
+
+            FreeDir(dir);
+        }
+
+        list_sort(files, audit_log_file_cmp);
+
+        funcctx->user_fctx = files;
+        funcctx->max_calls = list_length(files);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    files = (List *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[3];
+        bool nulls[3] = {false, false, false};
+        HeapTuple tuple;
+        AuditLogFile *file = (AuditLogFile *)list_nth(files, funcctx->call_cntr);
+
+        values[0] = PointerGetDatum(cstring_to_text(file->name));
+        values[1] = Int64GetDatum(file->size);
+        values[2] = TimestampTzGetDatum(file->modified);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
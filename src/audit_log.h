@@ -0,0 +1,35 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+
+/*
+ * Audit log files are written by a background worker to
+ * $PGDATA/pg_pgtrace/audit, one file per rotation period.
+ *
+ * File layout (host byte order):
+ *
+ *   header    "PGTRAUD1" magic, uint32 format version, uint32 reserved
+ *   record*   uint64 ring position
+ *             uint64 fingerprint
+ *             int64  timestamp (TimestampTz)
+ *             int64  rows affected
+ *             float8 duration in milliseconds
+ *             uint8  operation (AuditOpType)
+ *             uint8  user name length, uint8 database name length
+ *             user name bytes, database name bytes (not terminated)
+ *
+ * Records follow the order of the audit blocks they were drained from, so
+ * ring positions increase within a backend's events but not across a file.
+ * Durations have microsecond precision.
+ */
+#define PGTRACE_DATA_DIR "pg_pgtrace"
+#define PGTRACE_AUDIT_LOG_DIR PGTRACE_DATA_DIR "/audit"
+#define PGTRACE_AUDIT_LOG_MAGIC "PGTRAUD1"
+#define PGTRACE_AUDIT_LOG_VERSION 1
+
+void pgtrace_audit_log_register(void);
+PGDLLEXPORT void pgtrace_audit_log_main(Datum main_arg);
+
+PGDLLEXPORT Datum pgtrace_read_audit_log(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_audit_log_files(PG_FUNCTION_ARGS);
@@ -0,0 +1,420 @@
+#include <postgres.h>
+#include <funcapi.h>
+#include <math.h>
+#include <miscadmin.h>
+#include <common/hashfn.h>
+#include <portability/instr_time.h>
+#include <utils/builtins.h>
+#include <utils/memutils.h>
+#include "pgtrace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PGTRACE_BENCH_HAVE_CYCLES 1
+#endif
+
+/* Spreads consecutive operations over the whole fingerprint set. */
+#define PGTRACE_BENCH_STRIDE 7919
+
+/* Table fill levels for hash_record, as a fraction of PGTRACE_MAX_QUERIES. */
+static const double bench_fill_factors[] = {0.1, 0.5, 0.9, 1.0};
+
+/* Statements for the fingerprint kernel, from trivial to ORM-sized. */
+static const char *const bench_queries[] = {
+    "SELECT 1",
+    "SELECT abalance FROM pgbench_accounts WHERE aid = 48213",
+    "UPDATE pgbench_accounts SET abalance = abalance + -4211 WHERE aid = 48213",
+    "SELECT o.id, o.created_at, o.total, c.name, c.email FROM orders o "
+    "JOIN customers c ON c.id = o.customer_id "
+    "WHERE o.status IN ('new', 'paid', 'shipped') AND o.created_at > '2024-01-01' "
+    "AND c.region_id IN (1, 2, 3, 4, 5, 6, 7, 8, 9, 10) "
+    "ORDER BY o.created_at DESC LIMIT 50 OFFSET 100",
+};
+
+/*
+ * Stand-ins for the shared structures, allocated in one private chunk. stats
+ * takes the probe and dropped insert counts, so the kernels leave this
+ * backend's pgtrace_self_stats slot alone.
+ */
+typedef struct BenchScratch
+{
+    PgTraceQueryHash hash;
+    AuditEventBuffer audit;
+    PgTraceHistogram histogram;
+    QueryStats query;
+    PgTraceBackendStats stats;
+} BenchScratch;
+
+typedef void (*BenchKernel)(BenchScratch *scratch, uint64 first, uint64 count);
+
+typedef struct BenchResult
+{
+    const char *component;
+    double fill_factor; /* negative when not applicable */
+    uint64 iterations;
+    double ns[PGTRACE_BENCH_BATCHES];
+    double cycles[PGTRACE_BENCH_BATCHES];
+} BenchResult;
+
+typedef struct BenchResults
+{
+    BenchResult *rows;
+    int count;
+} BenchResults;
+
+/* Keeps the compiler from discarding kernel results. */
+static volatile uint64 bench_sink;
+
+/* Fingerprints populated into the scratch query table. */
+static uint64 bench_tracked;
+
+static inline uint64
+bench_cycles(void)
+{
+#ifdef PGTRACE_BENCH_HAVE_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline uint64
+bench_fingerprint(uint64 i)
+{
+    return hash_bytes_uint32_extended((uint32)i, 0);
+}
+
+static void
+kernel_fingerprint(BenchScratch *scratch, uint64 first, uint64 count)
+{
+    uint64 i;
+
+    for (i = first; i < first + count; i++)
+        bench_sink += pgtrace_compute_fingerprint(bench_queries[i % lengthof(bench_queries)]);
+}
+
+static void
+kernel_hash_record(BenchScratch *scratch, uint64 first, uint64 count)
+{
+    uint64 i;
+
+    for (i = first; i < first + count; i++)
+        pgtrace_hash_record_locked(bench_fingerprint((i * PGTRACE_BENCH_STRIDE) % bench_tracked),
+                                   1.0, false, "pgtrace_bench", "bench", "bench",
+                                   GetUserId(), MyDatabaseId, NULL, 10, 1);
+}
+
+static void
+kernel_audit_record(BenchScratch *scratch, uint64 first, uint64 count)
+{
+    uint64 i;
+
+    for (i = first; i < first + count; i++)
+        pgtrace_audit_record(bench_fingerprint(i), AUDIT_SELECT, "bench", "bench", 1, 1.0);
+}
+
+static void
+kernel_percentile(BenchScratch *scratch, uint64 first, uint64 count)
+{
+    uint64 i;
+    double p95_ms;
+    double p99_ms;
+
+    for (i = 0; i < count; i++)
+    {
+        pgtrace_query_percentiles(&scratch->query, &p95_ms, &p99_ms);
+        bench_sink += (uint64)p99_ms;
+    }
+}
+
+static void
+kernel_latency_quantile(BenchScratch *scratch, uint64 first, uint64 count)
+{
+    PgTraceHistogramSnapshot snap;
+    uint64 i;
+
+    for (i = 0; i < count; i++)
+    {
+        pgtrace_histogram_read(&scratch->histogram, &snap);
+        bench_sink += (uint64)pgtrace_histogram_quantile(&snap, 0.99);
+    }
+}
+
+/*
+ * Run one untimed warm-up batch, then PGTRACE_BENCH_BATCHES timed ones.
+ * Allocations made by the kernel are released after every batch.
+ */
+static void
+bench_run(BenchKernel kernel, BenchScratch *scratch, uint64 per_batch, BenchResult *result)
+{
+    MemoryContext bench_cxt;
+    MemoryContext oldcxt;
+    uint64 op = 0;
+    int b;
+
+    bench_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                      "pgtrace bench",
+                                      ALLOCSET_DEFAULT_SIZES);
+    oldcxt = MemoryContextSwitchTo(bench_cxt);
+
+    kernel(scratch, op, per_batch);
+    op += per_batch;
+
+    for (b = 0; b < PGTRACE_BENCH_BATCHES; b++)
+    {
+        instr_time start;
+        instr_time elapsed;
+        uint64 start_cycles;
+        uint64 end_cycles;
+
+        CHECK_FOR_INTERRUPTS();
+        MemoryContextReset(bench_cxt);
+
+        INSTR_TIME_SET_CURRENT(start);
+        start_cycles = bench_cycles();
+        kernel(scratch, op, per_batch);
+        end_cycles = bench_cycles();
+        INSTR_TIME_SET_CURRENT(elapsed);
+        INSTR_TIME_SUBTRACT(elapsed, start);
+
+        result->ns[b] = INSTR_TIME_GET_DOUBLE(elapsed) * 1e9 / (double)per_batch;
+        result->cycles[b] = (double)(end_cycles - start_cycles) / (double)per_batch;
+        op += per_batch;
+    }
+
+    result->iterations = per_batch * PGTRACE_BENCH_BATCHES;
+
+    MemoryContextSwitchTo(oldcxt);
+    MemoryContextDelete(bench_cxt);
+}
+
+static BenchResult *
+bench_next_row(BenchResults *results, const char *component, double fill_factor)
+{
+    BenchResult *row = &results->rows[results->count++];
+
+    row->component = component;
+    row->fill_factor = fill_factor;
+    return row;
+}
+
+/*
+ * Fill the scratch query table to the given fraction of its capacity.
+ * pgtrace_query_hash already points at the scratch copy, which only this
+ * backend sees, so the kernels record into it without the table lock.
+ */
+static void
+bench_fill_hash(BenchScratch *scratch, double fill_factor)
+{
+    uint64 i;
+
+    memset(&scratch->hash, 0, sizeof(PgTraceQueryHash));
+    scratch->hash.stats_since = GetCurrentTimestamp();
+
+    bench_tracked = Max((uint64)(fill_factor * PGTRACE_MAX_QUERIES), 1);
+    for (i = 0; i < bench_tracked; i++)
+        pgtrace_hash_record_locked(bench_fingerprint(i), 1.0, false, "pgtrace_bench", "bench", "bench",
+                                   GetUserId(), MyDatabaseId, NULL, 10, 1);
+}
+
+static void
+bench_prepare_read_paths(BenchScratch *scratch)
+{
+    uint32 i;
+
+    memset(&scratch->query, 0, sizeof(QueryStats));
+    for (i = 0; i < PGTRACE_LATENCY_BUCKETS; i++)
+        scratch->query.latency_samples[i] = (double)(bench_fingerprint(i) % 100000) / 1000.0;
+    scratch->query.sample_count = PGTRACE_LATENCY_BUCKETS;
+
+    pgtrace_histogram_init(&scratch->histogram);
+    for (i = 0; i < 10000; i++)
+        pgtrace_histogram_add(&scratch->histogram, bench_fingerprint(i) % 1000000);
+}
+
+static bool
+bench_wants(const char *component, const char *name)
+{
+    return strcmp(component, name) == 0 || strcmp(component, "all") == 0;
+}
+
+static void
+bench_components(const char *component, uint64 per_batch, BenchScratch *scratch,
+                 BenchResults *results)
+{
+    int i;
+
+    if (bench_wants(component, "fingerprint"))
+        bench_run(kernel_fingerprint, scratch, per_batch,
+                  bench_next_row(results, "fingerprint", -1.0));
+
+    if (bench_wants(component, "hash_record"))
+    {
+        for (i = 0; i < lengthof(bench_fill_factors); i++)
+        {
+            bench_fill_hash(scratch, bench_fill_factors[i]);
+            bench_run(kernel_hash_record, scratch, per_batch,
+                      bench_next_row(results, "hash_record", bench_fill_factors[i]));
+        }
+    }
+
+    if (bench_wants(component, "audit_record"))
+    {
+        pgtrace_audit_init(&scratch->audit);
+        bench_run(kernel_audit_record, scratch, per_batch,
+                  bench_next_row(results, "audit_record", -1.0));
+    }
+
+    if (bench_wants(component, "percentile"))
+        bench_run(kernel_percentile, scratch, per_batch,
+                  bench_next_row(results, "percentile", -1.0));
+
+    if (bench_wants(component, "latency_quantile"))
+        bench_run(kernel_latency_quantile, scratch, per_batch,
+                  bench_next_row(results, "latency_quantile", -1.0));
+}
+
+static double
+bench_rank(double *sorted, double q)
+{
+    int idx = (int)ceil(q * PGTRACE_BENCH_BATCHES) - 1;
+
+    return sorted[Max(idx, 0)];
+}
+
+static int
+compare_bench_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * pgtrace_bench(component, iterations): time a hot-path component and
+ * return ns/op and cycles/op per batch as min, p50, p90, p99 and max. The
+ * kernels write to scratch copies in backend-local memory; the global
+ * pointers, including this backend's self-stats slot, are switched to them
+ * for the duration of the call, in this backend only.
+ */
+PG_FUNCTION_INFO_V1(pgtrace_bench);
+
+PGDLLEXPORT Datum pgtrace_bench(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    BenchResults *results;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        char *component = text_to_cstring(PG_GETARG_TEXT_PP(0));
+        int32 iterations = PG_GETARG_INT32(1);
+        PgTraceQueryHash *saved_hash = pgtrace_query_hash;
+        AuditEventBuffer *saved_audit = pgtrace_audit_buffer;
+        PgTraceBackendStats *saved_stats = pgtrace_my_backend_stats;
+        BenchScratch *scratch;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_bench must be called in a context that accepts a record")));
+
+        if (strcmp(component, "fingerprint") != 0 &&
+            strcmp(component, "hash_record") != 0 &&
+            strcmp(component, "audit_record") != 0 &&
+            strcmp(component, "percentile") != 0 &&
+            strcmp(component, "latency_quantile") != 0 &&
+            strcmp(component, "all") != 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("unknown benchmark component \"%s\"", component),
+                     errhint("Valid components are fingerprint, hash_record, audit_record, percentile, latency_quantile and all.")));
+
+        if (iterations <= 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("iterations must be positive")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        results = palloc0(sizeof(BenchResults));
+        results->rows = palloc0(sizeof(BenchResult) * (lengthof(bench_fill_factors) + 4));
+
+        /* Larger than MaxAllocSize, and than a container's default /dev/shm. */
+        scratch = palloc_extended(sizeof(BenchScratch), MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+
+        /* This backend's audit block belongs to the buffer being switched out. */
+        pgtrace_audit_seal();
+
+        PG_TRY();
+        {
+            pgtrace_query_hash = &scratch->hash;
+            pgtrace_audit_buffer = &scratch->audit;
+            pgtrace_my_backend_stats = &scratch->stats;
+            bench_prepare_read_paths(scratch);
+            bench_components(component, Max(iterations / PGTRACE_BENCH_BATCHES, 1),
+                             scratch, results);
+        }
+        PG_FINALLY();
+        {
+            pgtrace_audit_seal();
+            pgtrace_query_hash = saved_hash;
+            pgtrace_audit_buffer = saved_audit;
+            pgtrace_my_backend_stats = saved_stats;
+        }
+        PG_END_TRY();
+
+        pfree(scratch);
+
+        funcctx->user_fctx = results;
+        funcctx->max_calls = results->count;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    results = (BenchResults *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[13];
+        bool nulls[13] = {false, false, false, false, false, false, false, false, false, false, false, false, false};
+        BenchResult *row = &results->rows[funcctx->call_cntr];
+        HeapTuple tuple;
+
+        qsort(row->ns, PGTRACE_BENCH_BATCHES, sizeof(double), compare_bench_doubles);
+        qsort(row->cycles, PGTRACE_BENCH_BATCHES, sizeof(double), compare_bench_doubles);
+
+        values[0] = PointerGetDatum(cstring_to_text(row->component));
+        if (row->fill_factor >= 0.0)
+            values[1] = Float8GetDatum(row->fill_factor);
+        else
+            nulls[1] = true;
+        values[2] = Int64GetDatum((int64)row->iterations);
+
+        values[3] = Float8GetDatum(row->ns[0]);
+        values[4] = Float8GetDatum(bench_rank(row->ns, 0.50));
+        values[5] = Float8GetDatum(bench_rank(row->ns, 0.90));
+        values[6] = Float8GetDatum(bench_rank(row->ns, 0.99));
+        values[7] = Float8GetDatum(row->ns[PGTRACE_BENCH_BATCHES - 1]);
+
+#ifdef PGTRACE_BENCH_HAVE_CYCLES
+        values[8] = Float8GetDatum(row->cycles[0]);
+        values[9] = Float8GetDatum(bench_rank(row->cycles, 0.50));
+        values[10] = Float8GetDatum(bench_rank(row->cycles, 0.90));
+        values[11] = Float8GetDatum(bench_rank(row->cycles, 0.99));
+        values[12] = Float8GetDatum(row->cycles[PGTRACE_BENCH_BATCHES - 1]);
+#else
+        nulls[8] = nulls[9] = nulls[10] = nulls[11] = nulls[12] = true;
+#endif
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
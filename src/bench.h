@@ -0,0 +1,15 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+
+/*
+ * In-database microbenchmarks of the hot-path components. Kernels run in
+ * the calling backend against scratch copies of the shared structures,
+ * allocated in its own memory, so the real statistics are untouched.
+ * Iterations are split into PGTRACE_BENCH_BATCHES equal batches that are
+ * timed separately; the reported distribution is over per-batch averages.
+ */
+#define PGTRACE_BENCH_BATCHES 100
+
+PGDLLEXPORT Datum pgtrace_bench(PG_FUNCTION_ARGS);
@@ -1,8 +1,9 @@
 #include <postgres.h>
 #include <storage/shmem.h>
 #include <storage/lwlock.h>
+#include <common/hashfn.h>
 #include <utils/timestamp.h>
-#include "error_track.h"
+#include "pgtrace.h"
 
 ErrorTrackBuffer *pgtrace_error_buffer = NULL;
 
@@ -31,29 +32,44 @@ void pgtrace_error_startup(void)
     LWLockRelease(AddinShmemInitLock);
 }
 
+static inline uint32
+error_bucket(uint64 fingerprint, uint32 sqlstate)
+{
+    return (uint32)(hash_combine64(fingerprint, sqlstate) & (PGTRACE_ERROR_HASH_SIZE - 1));
+}
+
 static ErrorTrackEntry *
 find_or_create_error_entry(uint64 fingerprint, uint32 sqlstate)
 {
+    uint32 bucket = error_bucket(fingerprint, sqlstate);
     uint32 i;
 
-    for (i = 0; i < pgtrace_error_buffer->num_entries; i++)
+    for (i = 0; i < PGTRACE_ERROR_HASH_SIZE; i++)
     {
-        ErrorTrackEntry *entry = &pgtrace_error_buffer->entries[i];
-        if (entry->fingerprint == fingerprint && entry->sqlstate == sqlstate)
+        uint32 idx = (bucket + i) & (PGTRACE_ERROR_HASH_SIZE - 1);
+        ErrorTrackEntry *entry = &pgtrace_error_buffer->entries[idx];
+
+        if (!entry->valid)
+        {
+            if (pgtrace_error_buffer->num_entries >= PGTRACE_ERROR_BUFFER_SIZE)
+                break;
+
+            PGTRACE_SEQ_BEGIN_WRITE(pgtrace_error_buffer->changecount[idx]);
+            entry->fingerprint = fingerprint;
+            entry->sqlstate = sqlstate;
+            entry->error_count = 0;
+            entry->last_error_at = 0;
+            entry->valid = true;
+            PGTRACE_SEQ_END_WRITE(pgtrace_error_buffer->changecount[idx]);
+            pgtrace_error_buffer->num_entries++;
             return entry;
-    }
+        }
 
-    if (pgtrace_error_buffer->num_entries < PGTRACE_ERROR_BUFFER_SIZE)
-    {
-        ErrorTrackEntry *entry = &pgtrace_error_buffer->entries[pgtrace_error_buffer->num_entries];
-        entry->fingerprint = fingerprint;
-        entry->sqlstate = sqlstate;
-        entry->error_count = 0;
-        entry->valid = true;
-        pgtrace_error_buffer->num_entries++;
-        return entry;
+        if (entry->fingerprint == fingerprint && entry->sqlstate == sqlstate)
+            return entry;
     }
 
+    pgtrace_error_buffer->dropped++;
     return NULL;
 }
 
@@ -66,31 +82,181 @@ void pgtrace_error_record(uint64 fingerprint, uint32 sqlstate)
         return;
 
     lock = GetNamedLWLockTranche("pgtrace_error_track");
-    LWLockAcquire(&lock->lock, LW_EXCLUSIVE);
+    pgtrace_lock_acquire(PGTRACE_LOCK_ERROR_TRACK, &lock->lock, LW_EXCLUSIVE);
 
     entry = find_or_create_error_entry(fingerprint, sqlstate);
     if (entry)
     {
+        uint32 *count = &pgtrace_error_buffer->changecount[entry - pgtrace_error_buffer->entries];
+        TimestampTz now = GetCurrentTimestamp();
+
+        PGTRACE_SEQ_BEGIN_WRITE(*count);
         entry->error_count++;
-        entry->last_error_at = GetCurrentTimestamp();
+        entry->last_error_at = now;
+        PGTRACE_SEQ_END_WRITE(*count);
     }
 
     LWLockRelease(&lock->lock);
 }
 
+uint64
+pgtrace_error_dropped(void)
+{
+    if (!pgtrace_error_buffer)
+        return 0;
+
+    return ((volatile ErrorTrackBuffer *)pgtrace_error_buffer)->dropped;
+}
+
 uint32
 pgtrace_error_count(void)
 {
-    uint32 count;
+    if (!pgtrace_error_buffer)
+        return 0;
+
+    return ((volatile ErrorTrackBuffer *)pgtrace_error_buffer)->num_entries;
+}
+
+static inline uint64
+read_deletions(void)
+{
+    pg_read_barrier();
+    return ((volatile ErrorTrackBuffer *)pgtrace_error_buffer)->deletions;
+}
+
+/* Copy the tracked (fingerprint, SQLSTATE) pairs without taking the lock. */
+uint32
+pgtrace_error_snapshot(ErrorTrackEntry *dst, uint32 max_entries)
+{
+    uint32 count = 0;
+    int attempt;
+
+    if (!pgtrace_error_buffer)
+        return 0;
+
+    for (attempt = 0; attempt < PGTRACE_SEQ_SCAN_RETRIES; attempt++)
+    {
+        uint64 deletions = read_deletions();
+        uint32 i;
+
+        count = 0;
+        for (i = 0; i < PGTRACE_ERROR_HASH_SIZE && count < max_entries; i++)
+        {
+            if (pgtrace_seq_read(&pgtrace_error_buffer->changecount[i],
+                                 &pgtrace_error_buffer->entries[i],
+                                 &dst[count], sizeof(ErrorTrackEntry)) &&
+                dst[count].valid)
+                count++;
+        }
+
+        if ((deletions & 1) == 0 && read_deletions() == deletions)
+            break;
+    }
+
+    return count;
+}
+
+/* Backward-shift deletion, as in the query hash. Caller holds the lock. */
+static void
+error_delete_entry(uint32 idx)
+{
+    const uint32 mask = PGTRACE_ERROR_HASH_SIZE - 1;
+    uint32 hole = idx;
+    uint32 next = (idx + 1) & mask;
+
+    PGTRACE_DELETION_BEGIN(pgtrace_error_buffer->deletions);
+
+    for (;;)
+    {
+        ErrorTrackEntry *entry = &pgtrace_error_buffer->entries[next];
+        uint32 home;
+        bool movable;
+
+        if (!entry->valid)
+            break;
+
+        home = error_bucket(entry->fingerprint, entry->sqlstate);
+        if (hole < next)
+            movable = (home <= hole || home > next);
+        else
+            movable = (home <= hole && home > next);
+
+        if (movable)
+        {
+            PGTRACE_SEQ_BEGIN_WRITE(pgtrace_error_buffer->changecount[hole]);
+            pgtrace_error_buffer->entries[hole] = *entry;
+            PGTRACE_SEQ_END_WRITE(pgtrace_error_buffer->changecount[hole]);
+            hole = next;
+        }
+
+        next = (next + 1) & mask;
+    }
+
+    PGTRACE_SEQ_BEGIN_WRITE(pgtrace_error_buffer->changecount[hole]);
+    memset(&pgtrace_error_buffer->entries[hole], 0, sizeof(ErrorTrackEntry));
+    PGTRACE_SEQ_END_WRITE(pgtrace_error_buffer->changecount[hole]);
+    pgtrace_error_buffer->num_entries--;
+    PGTRACE_DELETION_END(pgtrace_error_buffer->deletions);
+}
+
+/* Entries are cleared one at a time under their change counts, which must survive. */
+void pgtrace_error_reset(void)
+{
+    LWLockPadded *lock;
+    uint32 i;
+
+    if (!pgtrace_error_buffer)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_error_track");
+    pgtrace_lock_acquire(PGTRACE_LOCK_ERROR_TRACK, &lock->lock, LW_EXCLUSIVE);
+    PGTRACE_DELETION_BEGIN(pgtrace_error_buffer->deletions);
+
+    for (i = 0; i < PGTRACE_ERROR_HASH_SIZE; i++)
+    {
+        if (!pgtrace_error_buffer->entries[i].valid)
+            continue;
+
+        PGTRACE_SEQ_BEGIN_WRITE(pgtrace_error_buffer->changecount[i]);
+        memset(&pgtrace_error_buffer->entries[i], 0, sizeof(ErrorTrackEntry));
+        PGTRACE_SEQ_END_WRITE(pgtrace_error_buffer->changecount[i]);
+    }
+    pgtrace_error_buffer->num_entries = 0;
+    pgtrace_error_buffer->dropped = 0;
+    PGTRACE_DELETION_END(pgtrace_error_buffer->deletions);
+
+    LWLockRelease(&lock->lock);
+}
+
+/* Remove every SQLSTATE recorded for a fingerprint. Returns how many. */
+uint32
+pgtrace_error_reset_fingerprint(uint64 fingerprint)
+{
     LWLockPadded *lock;
+    uint32 removed = 0;
+    uint32 i = 0;
 
     if (!pgtrace_error_buffer)
         return 0;
 
     lock = GetNamedLWLockTranche("pgtrace_error_track");
-    LWLockAcquire(&lock->lock, LW_SHARED);
-    count = pgtrace_error_buffer->num_entries;
+    pgtrace_lock_acquire(PGTRACE_LOCK_ERROR_TRACK, &lock->lock, LW_EXCLUSIVE);
+
+    while (i < PGTRACE_ERROR_HASH_SIZE)
+    {
+        ErrorTrackEntry *entry = &pgtrace_error_buffer->entries[i];
+
+        /* A deletion may shift a later entry into slot i, so look again. */
+        if (entry->valid && entry->fingerprint == fingerprint)
+        {
+            error_delete_entry(i);
+            removed++;
+            continue;
+        }
+        i++;
+    }
+
     LWLockRelease(&lock->lock);
 
-    return count;
+    return removed;
 }
@@ -2,6 +2,7 @@
 
 #include <postgres.h>
 #include <utils/timestamp.h>
+#include "seqlock.h"
 
 typedef struct ErrorTrackEntry
 {
@@ -13,11 +14,20 @@ typedef struct ErrorTrackEntry
 } ErrorTrackEntry;
 
 #define PGTRACE_ERROR_BUFFER_SIZE 1000
+#define PGTRACE_ERROR_HASH_SIZE 2048
 
+/*
+ * Open-addressed table keyed by (fingerprint, sqlstate). It is never filled
+ * beyond PGTRACE_ERROR_BUFFER_SIZE entries, so probe sequences stay short.
+ * Readers take no lock; see the query hash for the protocol.
+ */
 typedef struct ErrorTrackBuffer
 {
-    ErrorTrackEntry entries[PGTRACE_ERROR_BUFFER_SIZE];
+    ErrorTrackEntry entries[PGTRACE_ERROR_HASH_SIZE];
+    uint32 changecount[PGTRACE_ERROR_HASH_SIZE];
+    uint64 deletions;
     uint32 num_entries;
+    uint64 dropped;
 } ErrorTrackBuffer;
 
 extern ErrorTrackBuffer *pgtrace_error_buffer;
@@ -26,3 +36,7 @@ void pgtrace_error_request_shmem(void);
 void pgtrace_error_startup(void);
 void pgtrace_error_record(uint64 fingerprint, uint32 sqlstate);
 uint32 pgtrace_error_count(void);
+uint32 pgtrace_error_snapshot(ErrorTrackEntry *dst, uint32 max_entries);
+uint64 pgtrace_error_dropped(void);
+void pgtrace_error_reset(void);
+uint32 pgtrace_error_reset_fingerprint(uint64 fingerprint);
@@ -0,0 +1,314 @@
+#include <postgres.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <miscadmin.h>
+#include <catalog/pg_authid.h>
+#include <lib/stringinfo.h>
+#include <storage/fd.h>
+#include <utils/acl.h>
+#include <utils/builtins.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+typedef struct PgTraceExport
+{
+    StringInfoData buf;
+    uint64 rows;
+    uint32 columns;
+    int columns_offset; /* where the header's column count goes */
+} PgTraceExport;
+
+static void
+export_pad(PgTraceExport *ex)
+{
+    static const char zeros[8] = {0};
+
+    appendBinaryStringInfo(&ex->buf, zeros, (8 - ex->buf.len % 8) % 8);
+}
+
+static void
+export_begin(PgTraceExport *ex, const char *table, uint64 rows)
+{
+    uint32 version = PGTRACE_EXPORT_VERSION;
+    uint32 columns = 0;
+    TimestampTz now = GetCurrentTimestamp();
+    uint8 len = (uint8)strlen(table);
+
+    initStringInfo(&ex->buf);
+    ex->rows = rows;
+    ex->columns = 0;
+
+    appendBinaryStringInfo(&ex->buf, PGTRACE_EXPORT_MAGIC, 8);
+    appendBinaryStringInfo(&ex->buf, (char *)&version, sizeof(uint32));
+    ex->columns_offset = ex->buf.len;
+    appendBinaryStringInfo(&ex->buf, (char *)&columns, sizeof(uint32));
+    appendBinaryStringInfo(&ex->buf, (char *)&rows, sizeof(uint64));
+    appendBinaryStringInfo(&ex->buf, (char *)&now, sizeof(int64));
+    appendStringInfoChar(&ex->buf, (char)len);
+    appendBinaryStringInfo(&ex->buf, table, len);
+}
+
+static void
+export_finish(PgTraceExport *ex)
+{
+    export_pad(ex);
+    memcpy(ex->buf.data + ex->columns_offset, &ex->columns, sizeof(uint32));
+}
+
+static void
+export_column_header(PgTraceExport *ex, const char *name, PgTraceColumnType type)
+{
+    uint8 len = (uint8)strlen(name);
+
+    export_pad(ex);
+    appendStringInfoChar(&ex->buf, (char)type);
+    appendStringInfoChar(&ex->buf, (char)len);
+    appendBinaryStringInfo(&ex->buf, name, len);
+    export_pad(ex);
+    ex->columns++;
+}
+
+/* Start a fixed-width column and return its (8-byte aligned) value array. */
+static void *
+export_fixed_column(PgTraceExport *ex, const char *name, PgTraceColumnType type, Size width)
+{
+    Size len = width * ex->rows;
+    char *data;
+
+    export_column_header(ex, name, type);
+
+    enlargeStringInfo(&ex->buf, (int)len);
+    data = ex->buf.data + ex->buf.len;
+    ex->buf.len += (int)len;
+    ex->buf.data[ex->buf.len] = '\0';
+
+    return data;
+}
+
+static void
+export_text_column(PgTraceExport *ex, const char *name, const char **values)
+{
+    uint32 *offsets;
+    uint32 offset = 0;
+    uint64 i;
+
+    /* Row count offsets here, and the end offset appended after them. */
+    offsets = export_fixed_column(ex, name, PGTRACE_COLUMN_TEXT, sizeof(uint32));
+    for (i = 0; i < ex->rows; i++)
+    {
+        offsets[i] = offset;
+        offset += (uint32)strlen(values[i]);
+    }
+    appendBinaryStringInfo(&ex->buf, (char *)&offset, sizeof(uint32));
+
+    for (i = 0; i < ex->rows; i++)
+        appendBinaryStringInfo(&ex->buf, values[i], (int)strlen(values[i]));
+}
+
+/*
+ * Column whose value for row i is expr; the caller declares uint64 i and
+ * the row arrays expr refers to.
+ */
+#define EXPORT_COLUMN(ex, name, type, ctype, expr) \
+    do { \
+        ctype *col_ = export_fixed_column((ex), (name), (type), sizeof(ctype)); \
+        for (i = 0; i < (ex)->rows; i++) \
+            col_[i] = (ctype)(expr); \
+    } while (0)
+
+#define EXPORT_TEXT(ex, name, expr) \
+    do { \
+        const char **values_ = palloc(Max((ex)->rows, 1) * sizeof(char *)); \
+        for (i = 0; i < (ex)->rows; i++) \
+            values_[i] = (expr); \
+        export_text_column((ex), (name), values_); \
+        pfree(values_); \
+    } while (0)
+
+static void
+export_queries(PgTraceExport *ex)
+{
+    QueryStats *rows = palloc(PGTRACE_MAX_QUERIES * sizeof(QueryStats));
+    uint32 count = pgtrace_hash_snapshot(rows, PGTRACE_MAX_QUERIES);
+    double *p95 = palloc(Max(count, 1) * sizeof(double));
+    double *p99 = palloc(Max(count, 1) * sizeof(double));
+    uint64 i;
+
+    for (i = 0; i < count; i++)
+        pgtrace_query_percentiles(&rows[i], &p95[i], &p99[i]);
+
+    export_begin(ex, "queries", count);
+    EXPORT_COLUMN(ex, "fingerprint", PGTRACE_COLUMN_INT64, int64, rows[i].fingerprint);
+    EXPORT_COLUMN(ex, "calls", PGTRACE_COLUMN_INT64, int64, rows[i].calls);
+    EXPORT_COLUMN(ex, "errors", PGTRACE_COLUMN_INT64, int64, rows[i].errors);
+    EXPORT_COLUMN(ex, "total_time_ms", PGTRACE_COLUMN_FLOAT8, double, rows[i].total_time_ms);
+    EXPORT_COLUMN(ex, "max_time_ms", PGTRACE_COLUMN_FLOAT8, double, rows[i].max_time_ms);
+    EXPORT_COLUMN(ex, "p95_ms", PGTRACE_COLUMN_FLOAT8, double, p95[i]);
+    EXPORT_COLUMN(ex, "p99_ms", PGTRACE_COLUMN_FLOAT8, double, p99[i]);
+    EXPORT_COLUMN(ex, "baseline_mean_ms", PGTRACE_COLUMN_FLOAT8, double, rows[i].baseline_mean_ms);
+    EXPORT_COLUMN(ex, "anomalous_calls", PGTRACE_COLUMN_INT64, int64, rows[i].anomalous_calls);
+    EXPORT_COLUMN(ex, "rows_scanned", PGTRACE_COLUMN_INT64, int64, rows[i].total_rows_scanned);
+    EXPORT_COLUMN(ex, "rows_returned", PGTRACE_COLUMN_INT64, int64, rows[i].total_rows_returned);
+    EXPORT_COLUMN(ex, "first_seen", PGTRACE_COLUMN_TIMESTAMPTZ, int64, rows[i].first_seen);
+    EXPORT_COLUMN(ex, "last_seen", PGTRACE_COLUMN_TIMESTAMPTZ, int64, rows[i].last_seen);
+    EXPORT_TEXT(ex, "last_request_id", rows[i].last_request_id);
+    EXPORT_TEXT(ex, "last_app_name", rows[i].last_app_name);
+    EXPORT_TEXT(ex, "last_user", rows[i].last_user);
+    EXPORT_TEXT(ex, "last_database", rows[i].last_database);
+    export_finish(ex);
+
+    pfree(rows);
+    pfree(p95);
+    pfree(p99);
+}
+
+static void
+export_errors(PgTraceExport *ex)
+{
+    ErrorTrackEntry *rows = palloc(PGTRACE_ERROR_BUFFER_SIZE * sizeof(ErrorTrackEntry));
+    uint32 count = pgtrace_error_snapshot(rows, PGTRACE_ERROR_BUFFER_SIZE);
+    char(*sqlstates)[6] = palloc(Max(count, 1) * sizeof(*sqlstates));
+    uint64 i;
+
+    for (i = 0; i < count; i++)
+        strlcpy(sqlstates[i], unpack_sql_state((int)rows[i].sqlstate), sizeof(sqlstates[i]));
+
+    export_begin(ex, "errors", count);
+    EXPORT_COLUMN(ex, "fingerprint", PGTRACE_COLUMN_INT64, int64, rows[i].fingerprint);
+    EXPORT_TEXT(ex, "sqlstate", sqlstates[i]);
+    EXPORT_COLUMN(ex, "error_count", PGTRACE_COLUMN_INT64, int64, rows[i].error_count);
+    EXPORT_COLUMN(ex, "last_error_at", PGTRACE_COLUMN_TIMESTAMPTZ, int64, rows[i].last_error_at);
+    export_finish(ex);
+
+    pfree(rows);
+    pfree(sqlstates);
+}
+
+static void
+export_slow_queries(PgTraceExport *ex)
+{
+    SlowQueryEntry *rows = palloc(PGTRACE_SLOW_QUERY_BUFFER_SIZE * sizeof(SlowQueryEntry));
+    uint32 count = pgtrace_slow_query_snapshot(rows, PGTRACE_SLOW_QUERY_BUFFER_SIZE);
+    uint64 i;
+
+    export_begin(ex, "slow_queries", count);
+    EXPORT_COLUMN(ex, "fingerprint", PGTRACE_COLUMN_INT64, int64, rows[i].fingerprint);
+    EXPORT_COLUMN(ex, "duration_ms", PGTRACE_COLUMN_FLOAT8, double, rows[i].duration_ms);
+    EXPORT_COLUMN(ex, "query_time", PGTRACE_COLUMN_TIMESTAMPTZ, int64, rows[i].timestamp);
+    EXPORT_TEXT(ex, "application_name", rows[i].application_name);
+    EXPORT_TEXT(ex, "db_user", rows[i].user);
+    EXPORT_COLUMN(ex, "rows_processed", PGTRACE_COLUMN_INT64, int64, rows[i].rows_processed);
+    export_finish(ex);
+
+    pfree(rows);
+}
+
+static void
+export_audit(PgTraceExport *ex)
+{
+    AuditEvent *rows = palloc(PGTRACE_AUDIT_BUFFER_SIZE * sizeof(AuditEvent));
+    uint32 count = pgtrace_audit_snapshot(rows, PGTRACE_AUDIT_BUFFER_SIZE);
+    uint64 i;
+
+    export_begin(ex, "audit", count);
+    EXPORT_COLUMN(ex, "fingerprint", PGTRACE_COLUMN_INT64, int64, rows[i].fingerprint);
+    EXPORT_TEXT(ex, "operation", pgtrace_audit_op_name(rows[i].op_type));
+    EXPORT_TEXT(ex, "db_user", rows[i].user);
+    EXPORT_TEXT(ex, "database", rows[i].database);
+    EXPORT_COLUMN(ex, "rows_affected", PGTRACE_COLUMN_INT64, int64, rows[i].rows_affected);
+    EXPORT_COLUMN(ex, "duration_ms", PGTRACE_COLUMN_FLOAT8, double, rows[i].duration_ms);
+    EXPORT_COLUMN(ex, "event_time", PGTRACE_COLUMN_TIMESTAMPTZ, int64, rows[i].timestamp);
+    export_finish(ex);
+
+    pfree(rows);
+}
+
+static void
+export_build(PgTraceExport *ex, text *what_text)
+{
+    char *what = text_to_cstring(what_text);
+
+    if (strcmp(what, "queries") == 0)
+        export_queries(ex);
+    else if (strcmp(what, "errors") == 0)
+        export_errors(ex);
+    else if (strcmp(what, "slow_queries") == 0)
+        export_slow_queries(ex);
+    else if (strcmp(what, "audit") == 0)
+        export_audit(ex);
+    else
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("unknown pgtrace export table \"%s\"", what),
+                 errhint("Valid tables are queries, errors, slow_queries and audit.")));
+}
+
+/*
+ * Write one table to a server file, like COPY TO a file: the caller needs
+ * pg_write_server_files, and relative paths are relative to the data
+ * directory. The file is written under a temporary name and renamed into
+ * place. Returns the number of rows.
+ */
+PG_FUNCTION_INFO_V1(pgtrace_export);
+
+PGDLLEXPORT Datum pgtrace_export(PG_FUNCTION_ARGS)
+{
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    char *tmppath;
+    PgTraceExport ex;
+    int fd;
+
+    if (!has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("permission denied to export pgtrace statistics to a file"),
+                 errdetail("Only roles with privileges of the \"%s\" role may write server files.",
+                           "pg_write_server_files")));
+
+    export_build(&ex, PG_GETARG_TEXT_PP(1));
+
+    tmppath = psprintf("%s.tmp", path);
+    fd = OpenTransientFile(tmppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+    if (fd < 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open export file \"%s\": %m", tmppath)));
+
+    errno = 0;
+    if (write(fd, ex.buf.data, ex.buf.len) != ex.buf.len)
+    {
+        /* if write didn't set errno, assume problem is no disk space */
+        if (errno == 0)
+            errno = ENOSPC;
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write export file \"%s\": %m", tmppath)));
+    }
+
+    if (CloseTransientFile(fd) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not close export file \"%s\": %m", tmppath)));
+
+    (void)durable_rename(tmppath, path, ERROR);
+
+    PG_RETURN_INT64((int64)ex.rows);
+}
+
+/* The same export returned to the client. */
+PG_FUNCTION_INFO_V1(pgtrace_export_bytea);
+
+PGDLLEXPORT Datum pgtrace_export_bytea(PG_FUNCTION_ARGS)
+{
+    PgTraceExport ex;
+    bytea *result;
+
+    export_build(&ex, PG_GETARG_TEXT_PP(0));
+
+    result = palloc(VARHDRSZ + ex.buf.len);
+    SET_VARSIZE(result, VARHDRSZ + ex.buf.len);
+    memcpy(VARDATA(result), ex.buf.data, ex.buf.len);
+    pfree(ex.buf.data);
+
+    PG_RETURN_BYTEA_P(result);
+}
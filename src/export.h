@@ -0,0 +1,41 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+
+/*
+ * Columnar bulk export of one statistics table, for loading into a data
+ * warehouse without going through the text output of the views. Entries
+ * are copied out of shared memory once and laid out column by column.
+ *
+ * File layout (host byte order; every section starts 8-byte aligned):
+ *
+ *   header    "PGTRCOL1" magic, uint32 format version, uint32 column count,
+ *             uint64 row count, int64 export time (TimestampTz),
+ *             uint8 table name length, table name bytes, padding
+ *   column*   uint8 type, uint8 name length, name bytes, padding,
+ *             then the column data:
+ *               int64, float8, timestamptz   row count 8-byte values
+ *               bool                          row count bytes (0 or 1), padding
+ *               text                          uint32 offsets[row count + 1]
+ *                                             into the bytes that follow,
+ *                                             the bytes, padding
+ *
+ * Timestamps are microseconds since 2000-01-01 UTC, as in TimestampTz.
+ * Columns have no NULLs. Numeric columns can be mapped straight into an
+ * array (numpy.frombuffer, an Arrow buffer) at their offset.
+ */
+#define PGTRACE_EXPORT_MAGIC "PGTRCOL1"
+#define PGTRACE_EXPORT_VERSION 1
+
+typedef enum PgTraceColumnType
+{
+    PGTRACE_COLUMN_INT64 = 1,
+    PGTRACE_COLUMN_FLOAT8 = 2,
+    PGTRACE_COLUMN_TIMESTAMPTZ = 3,
+    PGTRACE_COLUMN_BOOL = 4,
+    PGTRACE_COLUMN_TEXT = 5
+} PgTraceColumnType;
+
+PGDLLEXPORT Datum pgtrace_export(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_export_bytea(PG_FUNCTION_ARGS);
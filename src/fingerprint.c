@@ -15,7 +15,7 @@ pgtrace_normalize_query(const char *query_text)
     char *dst = normalized;
     bool in_string = false;
     bool in_number = false;
-    bool prev_space = false;
+    bool prev_space = true; /* drops leading whitespace */
 
     while (*src)
     {
@@ -39,6 +39,49 @@ pgtrace_normalize_query(const char *query_text)
             continue;
         }
 
+        /*
+         * Comments carry per-request data (sqlcommenter tags, trace ids), so
+         * they are dropped; each one separates tokens like a space would.
+         * Block comments nest, as in the server's lexer.
+         */
+        if ((c == '-' && src[1] == '-') || (c == '/' && src[1] == '*'))
+        {
+            if (c == '-')
+            {
+                while (*src && *src != '\n')
+                    src++;
+            }
+            else
+            {
+                int depth = 0;
+
+                while (*src)
+                {
+                    if (src[0] == '/' && src[1] == '*')
+                    {
+                        depth++;
+                        src += 2;
+                    }
+                    else if (src[0] == '*' && src[1] == '/')
+                    {
+                        src += 2;
+                        if (--depth == 0)
+                            break;
+                    }
+                    else
+                        src++;
+                }
+            }
+
+            in_number = false;
+            if (!prev_space)
+            {
+                *dst++ = ' ';
+                prev_space = true;
+            }
+            continue;
+        }
+
         if (isdigit((unsigned char)c))
         {
             if (!in_number)
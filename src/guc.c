@@ -1,10 +1,45 @@
 #include <postgres.h>
+#include <limits.h>
 #include "pgtrace.h"
 #include "utils/guc.h"
 
 bool pgtrace_enabled = true;
 int pgtrace_slow_query_ms = 200;
 char *pgtrace_request_id = NULL;
+int pgtrace_request_log_window = 300;
+char *pgtrace_traceparent = NULL;
+bool pgtrace_audit = true;
+bool pgtrace_xact_spans = true;
+bool pgtrace_audit_log = false;
+int pgtrace_audit_log_rotation_size = 10240;
+int pgtrace_audit_log_rotation_age = 3600;
+int pgtrace_audit_log_flush_ms = 200;
+int pgtrace_audit_log_fsync = PGTRACE_FSYNC_ROTATE;
+int pgtrace_slow_query_capture = PGTRACE_CAPTURE_PLAN;
+bool pgtrace_slow_query_capture_analyze = false;
+int pgtrace_slow_query_capture_interval = 60;
+double pgtrace_anomaly_sigma = 3.0;
+int pgtrace_anomaly_warmup = 30;
+double pgtrace_anomaly_alpha = 0.05;
+int pgtrace_metrics_port = 0;
+char *pgtrace_metrics_socket = NULL;
+int pgtrace_metrics_cache_ttl = 1000;
+bool pgtrace_ash = false;
+int pgtrace_ash_sample_rate = 10;
+bool pgtrace_span_export = false;
+int pgtrace_span_export_interval = 1000;
+
+static const struct config_enum_entry audit_log_fsync_options[] = {
+    {"off", PGTRACE_FSYNC_OFF, false},
+    {"rotate", PGTRACE_FSYNC_ROTATE, false},
+    {"batch", PGTRACE_FSYNC_BATCH, false},
+    {NULL, 0, false}};
+
+static const struct config_enum_entry slow_query_capture_options[] = {
+    {"off", PGTRACE_CAPTURE_OFF, false},
+    {"text", PGTRACE_CAPTURE_TEXT, false},
+    {"plan", PGTRACE_CAPTURE_PLAN, false},
+    {NULL, 0, false}};
 
 void pgtrace_init_guc(void)
 {
@@ -30,6 +65,75 @@ void pgtrace_init_guc(void)
         0,
         NULL, NULL, NULL);
 
+    DefineCustomEnumVariable(
+        "pgtrace.slow_query_capture",
+        "What to capture for queries slower than pgtrace.slow_query_ms",
+        "text keeps the normalized text and one example, plan also keeps the EXPLAIN output.",
+        &pgtrace_slow_query_capture,
+        PGTRACE_CAPTURE_PLAN,
+        slow_query_capture_options,
+        PGC_SUSET,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomBoolVariable(
+        "pgtrace.slow_query_capture_analyze",
+        "Collect per-node row counts so captured plans include actual rows",
+        "Adds row instrumentation (without timing) to every statement.",
+        &pgtrace_slow_query_capture_analyze,
+        false,
+        PGC_SUSET,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.slow_query_capture_interval",
+        "Minimum time between two captures of the same fingerprint",
+        NULL,
+        &pgtrace_slow_query_capture_interval,
+        60,
+        0,
+        INT_MAX / 1000,
+        PGC_SUSET,
+        GUC_UNIT_S,
+        NULL, NULL, NULL);
+
+    DefineCustomRealVariable(
+        "pgtrace.anomaly_sigma",
+        "Standard deviations above a query's latency baseline that flag an execution as anomalous",
+        NULL,
+        &pgtrace_anomaly_sigma,
+        3.0,
+        1.0,
+        100.0,
+        PGC_SUSET,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.anomaly_warmup",
+        "Executions of a query before its latency baseline is used",
+        NULL,
+        &pgtrace_anomaly_warmup,
+        30,
+        2,
+        INT_MAX,
+        PGC_SUSET,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomRealVariable(
+        "pgtrace.anomaly_alpha",
+        "Weight of each new execution in a query's latency baseline",
+        "Smaller values give a longer memory; the baseline covers roughly the last 1/alpha executions.",
+        &pgtrace_anomaly_alpha,
+        0.05,
+        0.0001,
+        1.0,
+        PGC_SUSET,
+        0,
+        NULL, NULL, NULL);
+
     DefineCustomStringVariable(
         "pgtrace.request_id",
         "Context propagation request ID for correlation",
@@ -39,4 +143,181 @@ void pgtrace_init_guc(void)
         PGC_USERSET,
         0,
         NULL, NULL, NULL);
+
+    DefineCustomStringVariable(
+        "pgtrace.traceparent",
+        "W3C traceparent for statements without a traceparent comment",
+        NULL,
+        &pgtrace_traceparent,
+        NULL,
+        PGC_USERSET,
+        0,
+        pgtrace_traceparent_check, pgtrace_traceparent_assign, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.request_log_window",
+        "How long executions stay visible to pgtrace_request()",
+        "Executions are also dropped once 16384 newer ones have been logged. 0 disables the log.",
+        &pgtrace_request_log_window,
+        300,
+        0,
+        86400,
+        PGC_SIGHUP,
+        GUC_UNIT_S,
+        NULL, NULL, NULL);
+
+    DefineCustomBoolVariable(
+        "pgtrace.audit",
+        "Record an audit event for every successful statement",
+        NULL,
+        &pgtrace_audit,
+        true,
+        PGC_SUSET,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomBoolVariable(
+        "pgtrace.xact_spans",
+        "Group top-level statements into transaction spans",
+        NULL,
+        &pgtrace_xact_spans,
+        true,
+        PGC_SUSET,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomBoolVariable(
+        "pgtrace.audit_log",
+        "Start a background worker that writes audit events to files",
+        "Files are written to the pg_pgtrace/audit directory of the data directory.",
+        &pgtrace_audit_log,
+        false,
+        PGC_POSTMASTER,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.audit_log_rotation_size",
+        "Start a new audit log file after this much data",
+        NULL,
+        &pgtrace_audit_log_rotation_size,
+        10240,
+        64,
+        INT_MAX / 1024,
+        PGC_SIGHUP,
+        GUC_UNIT_KB,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.audit_log_rotation_age",
+        "Start a new audit log file after this much time",
+        NULL,
+        &pgtrace_audit_log_rotation_age,
+        3600,
+        1,
+        INT_MAX / 1000,
+        PGC_SIGHUP,
+        GUC_UNIT_S,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.audit_log_flush_interval",
+        "Time between audit log writer passes over the audit ring",
+        NULL,
+        &pgtrace_audit_log_flush_ms,
+        200,
+        10,
+        60000,
+        PGC_SIGHUP,
+        GUC_UNIT_MS,
+        NULL, NULL, NULL);
+
+    DefineCustomEnumVariable(
+        "pgtrace.audit_log_fsync",
+        "When the audit log writer forces files to disk",
+        "off never syncs, rotate syncs when a file is closed, batch syncs after every write.",
+        &pgtrace_audit_log_fsync,
+        PGTRACE_FSYNC_ROTATE,
+        audit_log_fsync_options,
+        PGC_SIGHUP,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.metrics_port",
+        "TCP port on 127.0.0.1 where a background worker serves OpenMetrics",
+        "0 disables the exporter unless pgtrace.metrics_socket is set.",
+        &pgtrace_metrics_port,
+        0,
+        0,
+        65535,
+        PGC_POSTMASTER,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomStringVariable(
+        "pgtrace.metrics_socket",
+        "Unix socket path where a background worker serves OpenMetrics",
+        "Takes precedence over pgtrace.metrics_port when set.",
+        &pgtrace_metrics_socket,
+        "",
+        PGC_POSTMASTER,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.metrics_cache_ttl",
+        "How long a rendered metrics page is reused for further scrapes",
+        NULL,
+        &pgtrace_metrics_cache_ttl,
+        1000,
+        0,
+        60000,
+        PGC_SIGHUP,
+        GUC_UNIT_MS,
+        NULL, NULL, NULL);
+
+    DefineCustomBoolVariable(
+        "pgtrace.ash",
+        "Start a background worker that samples what every backend is waiting on",
+        "Samples are attributed to the fingerprint of the statement being executed.",
+        &pgtrace_ash,
+        false,
+        PGC_POSTMASTER,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.ash_sample_rate",
+        "Active session history samples per second",
+        NULL,
+        &pgtrace_ash_sample_rate,
+        10,
+        1,
+        1000,
+        PGC_SIGHUP,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomBoolVariable(
+        "pgtrace.span_export",
+        "Start a background worker that exports statement spans as OTLP/JSON files",
+        "Files are written to the pg_pgtrace/spans directory of the data directory.",
+        &pgtrace_span_export,
+        false,
+        PGC_POSTMASTER,
+        0,
+        NULL, NULL, NULL);
+
+    DefineCustomIntVariable(
+        "pgtrace.span_export_interval",
+        "Time between two span export files",
+        NULL,
+        &pgtrace_span_export_interval,
+        1000,
+        10,
+        60000,
+        PGC_SIGHUP,
+        GUC_UNIT_MS,
+        NULL, NULL, NULL);
 }
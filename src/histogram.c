@@ -0,0 +1,129 @@
+#include <postgres.h>
+#include <port/pg_bitutils.h>
+#include "histogram.h"
+
+void pgtrace_histogram_init(PgTraceHistogram *hist)
+{
+    int i;
+
+    for (i = 0; i < PGTRACE_HIST_BUCKETS; i++)
+        pg_atomic_init_u64(&hist->buckets[i], 0);
+    pg_atomic_init_u64(&hist->sum_us, 0);
+}
+
+/*
+ * Zero a live histogram. An add that lands mid-reset may keep its bucket
+ * count but lose its sum, or the reverse.
+ */
+void pgtrace_histogram_reset(PgTraceHistogram *hist)
+{
+    int i;
+
+    for (i = 0; i < PGTRACE_HIST_BUCKETS; i++)
+        pg_atomic_write_u64(&hist->buckets[i], 0);
+    pg_atomic_write_u64(&hist->sum_us, 0);
+}
+
+int pgtrace_histogram_bucket(uint64 us)
+{
+    int octave;
+    int bucket;
+
+    if (us < PGTRACE_HIST_SUB_BUCKETS)
+        return (int)us;
+
+    octave = pg_leftmost_one_pos64(us);
+    bucket = PGTRACE_HIST_SUB_BUCKETS * (octave - PGTRACE_HIST_SUB_BITS + 1) +
+             (int)((us >> (octave - PGTRACE_HIST_SUB_BITS)) & (PGTRACE_HIST_SUB_BUCKETS - 1));
+
+    return Min(bucket, PGTRACE_HIST_BUCKETS - 1);
+}
+
+uint64
+pgtrace_histogram_lower_us(int bucket)
+{
+    int shift;
+
+    if (bucket < PGTRACE_HIST_SUB_BUCKETS)
+        return (uint64)bucket;
+
+    shift = bucket / PGTRACE_HIST_SUB_BUCKETS - 1;
+    return (uint64)(PGTRACE_HIST_SUB_BUCKETS + bucket % PGTRACE_HIST_SUB_BUCKETS) << shift;
+}
+
+/* Exclusive upper bound; the last bucket has none and returns PG_UINT64_MAX. */
+uint64
+pgtrace_histogram_upper_us(int bucket)
+{
+    if (bucket >= PGTRACE_HIST_BUCKETS - 1)
+        return PG_UINT64_MAX;
+
+    return pgtrace_histogram_lower_us(bucket + 1);
+}
+
+void pgtrace_histogram_add(PgTraceHistogram *hist, uint64 us)
+{
+    pg_atomic_fetch_add_u64(&hist->buckets[pgtrace_histogram_bucket(us)], 1);
+    pg_atomic_fetch_add_u64(&hist->sum_us, us);
+}
+
+/*
+ * Buckets are read one at a time while writers keep adding, so the copy is
+ * not an exact point-in-time view, but every bucket is individually exact
+ * and the count is derived from them so cumulative values stay monotonic.
+ */
+void pgtrace_histogram_read(PgTraceHistogram *hist, PgTraceHistogramSnapshot *snap)
+{
+    int i;
+
+    snap->count = 0;
+    for (i = 0; i < PGTRACE_HIST_BUCKETS; i++)
+    {
+        snap->buckets[i] = pg_atomic_read_u64(&hist->buckets[i]);
+        snap->count += snap->buckets[i];
+    }
+    snap->sum_us = pg_atomic_read_u64(&hist->sum_us);
+}
+
+/*
+ * Quantile q (0..1) in microseconds, interpolated linearly inside the
+ * bucket holding the target rank. Returns -1 for an empty histogram.
+ */
+double
+pgtrace_histogram_quantile(PgTraceHistogramSnapshot *snap, double q)
+{
+    double rank;
+    uint64 seen = 0;
+    int i;
+
+    if (snap->count == 0)
+        return -1.0;
+
+    rank = q * (double)snap->count;
+
+    for (i = 0; i < PGTRACE_HIST_BUCKETS; i++)
+    {
+        uint64 n = snap->buckets[i];
+        double lower;
+        double upper;
+
+        if (n == 0)
+            continue;
+
+        if ((double)(seen + n) >= rank)
+        {
+            lower = (double)pgtrace_histogram_lower_us(i);
+
+            /* Nothing is known about the spread of the open-ended last bucket. */
+            if (i == PGTRACE_HIST_BUCKETS - 1)
+                return lower;
+
+            upper = (double)pgtrace_histogram_upper_us(i);
+            return lower + (upper - lower) * Max(rank - (double)seen, 0.0) / (double)n;
+        }
+
+        seen += n;
+    }
+
+    return (double)pgtrace_histogram_lower_us(PGTRACE_HIST_BUCKETS - 1);
+}
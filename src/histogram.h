@@ -0,0 +1,50 @@
+#pragma once
+
+#include <postgres.h>
+#include <port/atomics.h>
+
+/*
+ * Log-linear latency histogram in microseconds.
+ *
+ * Values below 4us get a bucket each; above that every power of two is
+ * split into 4 equal sub-buckets, so a bucket is at most 25% wide relative
+ * to its lower bound. 128 buckets reach 2^33us (about 2.4 hours); the last
+ * bucket also takes everything above. Buckets are updated with atomic
+ * adds, so recording takes no lock.
+ */
+
+#define PGTRACE_HIST_BUCKETS 128
+#define PGTRACE_HIST_SUB_BITS 2
+#define PGTRACE_HIST_SUB_BUCKETS (1 << PGTRACE_HIST_SUB_BITS)
+
+/* Databases with their own histogram; later ones share an overflow histogram. */
+#define PGTRACE_HIST_DATABASES 32
+
+typedef struct PgTraceHistogram
+{
+    pg_atomic_uint64 buckets[PGTRACE_HIST_BUCKETS];
+    pg_atomic_uint64 sum_us;
+} PgTraceHistogram;
+
+typedef struct PgTraceDbHistogram
+{
+    pg_atomic_uint32 dbid;
+    PgTraceHistogram hist;
+} PgTraceDbHistogram;
+
+/* Plain copy of a histogram for readers. */
+typedef struct PgTraceHistogramSnapshot
+{
+    uint64 buckets[PGTRACE_HIST_BUCKETS];
+    uint64 count;
+    uint64 sum_us;
+} PgTraceHistogramSnapshot;
+
+void pgtrace_histogram_init(PgTraceHistogram *hist);
+void pgtrace_histogram_reset(PgTraceHistogram *hist);
+int pgtrace_histogram_bucket(uint64 us);
+uint64 pgtrace_histogram_lower_us(int bucket);
+uint64 pgtrace_histogram_upper_us(int bucket);
+void pgtrace_histogram_add(PgTraceHistogram *hist, uint64 us);
+void pgtrace_histogram_read(PgTraceHistogram *hist, PgTraceHistogramSnapshot *snap);
+double pgtrace_histogram_quantile(PgTraceHistogramSnapshot *snap, double q);
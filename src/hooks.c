@@ -1,118 +1,484 @@
 #include <postgres.h>
+#include <access/parallel.h>
 #include <executor/executor.h>
+#include <executor/instrument.h>
 #include <utils/timestamp.h>
 #include <tcop/utility.h>
 #include <miscadmin.h>
 #include <catalog/pg_authid.h>
 #include <commands/dbcommands.h>
+#include <lib/ilist.h>
+#include <nodes/execnodes.h>
+#include <nodes/nodeFuncs.h>
 #include <nodes/parsenodes.h>
+#include <utils/elog.h>
+#include <utils/memutils.h>
 #include "pgtrace.h"
 
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
 
-static TimestampTz query_start_time;
-static uint64 current_fingerprint = 0;
+/*
+ * Per-execution state, allocated in the executor's query context so it
+ * disappears with the QueryDesc whether the statement ends normally or is
+ * torn down by an error. Cursors and nested statements make executions
+ * interleave, so states are found by QueryDesc rather than kept on a stack.
+ */
+typedef struct PgTraceExecState
+{
+    QueryDesc *queryDesc;
+    uint64 fingerprint;
+    uint64 plan_hash;
+    PgTraceContext trace;
+    uint64 span_id;
+    bool recorded;
+    dlist_node node;
+    MemoryContextCallback callback;
+} PgTraceExecState;
+
+static dlist_head exec_states = DLIST_STATIC_INIT(exec_states);
+
+/*
+ * The execution whose Run or Finish we are inside, if any. Statements that
+ * end while it is set are nested; statements that start while it is set
+ * inherit its trace context.
+ */
+static PgTraceExecState *exec_current = NULL;
+
+typedef struct PgTraceExecFrame
+{
+    PgTraceExecState *state;
+    PgTraceExecState *outer;
+    uint64 ash_outer;
+} PgTraceExecFrame;
+
+/*
+ * Names are resolved while the executor starts, because a failed statement
+ * is recorded from an error handler where catalog access is not safe.
+ */
+static Oid cached_user_id = InvalidOid;
+static char cached_user_name[NAMEDATALEN];
+static char cached_db_name[NAMEDATALEN];
 
 static void
-pgtrace_ExecutorStart(QueryDesc *queryDesc, int eflags)
+refresh_names(void)
 {
-    query_start_time = GetCurrentTimestamp();
+    Oid user_id = GetUserId();
 
-    if (queryDesc->sourceText)
-        current_fingerprint = pgtrace_compute_fingerprint(queryDesc->sourceText);
-    else
-        current_fingerprint = 0;
+    if (user_id != cached_user_id)
+    {
+        char *name = GetUserNameFromId(user_id, true);
+
+        strlcpy(cached_user_name, name ? name : "", sizeof(cached_user_name));
+        cached_user_id = user_id;
+    }
 
-    pgtrace_set_current_fingerprint(current_fingerprint);
+    if (cached_db_name[0] == '\0' && OidIsValid(MyDatabaseId))
+    {
+        char *name = get_database_name(MyDatabaseId);
 
-    if (prev_ExecutorStart)
-        prev_ExecutorStart(queryDesc, eflags);
-    else
-        standard_ExecutorStart(queryDesc, eflags);
+        if (name)
+            strlcpy(cached_db_name, name, sizeof(cached_db_name));
+    }
 }
 
 static void
-pgtrace_ExecutorEnd(QueryDesc *queryDesc)
+exec_state_release(void *arg)
+{
+    PgTraceExecState *state = (PgTraceExecState *)arg;
+
+    dlist_delete(&state->node);
+}
+
+static void
+exec_state_attach(const PgTraceExecState *pending)
+{
+    QueryDesc *queryDesc = pending->queryDesc;
+    MemoryContext query_cxt = queryDesc->estate->es_query_cxt;
+    PgTraceExecState *state;
+
+    state = MemoryContextAlloc(query_cxt, sizeof(PgTraceExecState));
+    *state = *pending;
+    state->callback.func = exec_state_release;
+    state->callback.arg = state;
+    MemoryContextRegisterResetCallback(query_cxt, &state->callback);
+    dlist_push_head(&exec_states, &state->node);
+
+    if (queryDesc->totaltime == NULL)
+    {
+        MemoryContext oldcxt = MemoryContextSwitchTo(query_cxt);
+
+        queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_TIMER, false);
+        MemoryContextSwitchTo(oldcxt);
+    }
+}
+
+static PgTraceExecState *
+exec_state_find(QueryDesc *queryDesc)
+{
+    dlist_iter iter;
+
+    dlist_foreach(iter, &exec_states)
+    {
+        PgTraceExecState *state = dlist_container(PgTraceExecState, node, iter.cur);
+
+        if (state->queryDesc == queryDesc)
+            return state;
+    }
+
+    return NULL;
+}
+
+/* Executor time so far, including a Run or Finish interrupted by an error. */
+static double
+exec_elapsed_ms(QueryDesc *queryDesc)
+{
+    Instrumentation *instr = queryDesc->totaltime;
+    instr_time elapsed;
+
+    if (!instr)
+        return 0.0;
+
+    elapsed = instr->counter;
+    if (!INSTR_TIME_IS_ZERO(instr->starttime))
+    {
+        instr_time now;
+
+        INSTR_TIME_SET_CURRENT(now);
+        INSTR_TIME_ACCUM_DIFF(elapsed, now, instr->starttime);
+    }
+
+    return instr->total * 1000.0 + INSTR_TIME_GET_MILLISEC(elapsed);
+}
+
+typedef struct PgTraceWorkerCounts
+{
+    int planned;
+    int launched;
+} PgTraceWorkerCounts;
+
+/*
+ * A Gather that is rescanned relaunches its workers, and only the last
+ * launch is still visible here, so this undercounts for such plans.
+ */
+static bool
+count_workers_walker(PlanState *planstate, void *context)
+{
+    PgTraceWorkerCounts *counts = (PgTraceWorkerCounts *)context;
+
+    if (planstate == NULL)
+        return false;
+
+    if (IsA(planstate, GatherState))
+    {
+        counts->planned += ((Gather *)planstate->plan)->num_workers;
+        counts->launched += ((GatherState *)planstate)->nworkers_launched;
+    }
+    else if (IsA(planstate, GatherMergeState))
+    {
+        counts->planned += ((GatherMerge *)planstate->plan)->num_workers;
+        counts->launched += ((GatherMergeState *)planstate)->nworkers_launched;
+    }
+
+    return planstate_tree_walker(planstate, count_workers_walker, context);
+}
+
+static void
+exec_record_parallel(QueryDesc *queryDesc)
+{
+    PgTraceWorkerCounts counts = {0, 0};
+
+    if (!queryDesc->plannedstmt->parallelModeNeeded || !queryDesc->planstate)
+        return;
+
+    count_workers_walker(queryDesc->planstate, &counts);
+    if (counts.planned > 0)
+        pgtrace_record_parallel(counts.planned, counts.launched);
+}
+
+static void
+exec_record(PgTraceExecState *state, double ms, bool failed, int sqlerrcode)
+{
+    QueryDesc *queryDesc = state->queryDesc;
+    const char *app_name = application_name ? application_name : "";
+    const char *req_id = pgtrace_request_id ? pgtrace_request_id : "";
+    int64 rows_returned = queryDesc->estate ? queryDesc->estate->es_processed : 0;
+    int64 rows_scanned = rows_returned;
+
+    if (queryDesc->estate && queryDesc->planstate && queryDesc->planstate->instrument)
+        rows_scanned = queryDesc->planstate->instrument->tuplecount;
+
+    state->recorded = true;
+
+    pgtrace_record_query(ms, failed, sqlerrcode == ERRCODE_QUERY_CANCELED);
+
+    pgtrace_hash_record(state->fingerprint, ms, failed,
+                        app_name, cached_user_name, cached_db_name,
+                        cached_user_id, MyDatabaseId, req_id,
+                        rows_scanned, rows_returned);
+
+    pgtrace_plan_record(state->fingerprint, state->plan_hash, ms, failed);
+
+    if (exec_current == NULL)
+        pgtrace_xact_statement(state->fingerprint, ms);
+
+    pgtrace_request_log_record(req_id, state->fingerprint, ms, rows_returned, failed, exec_current != NULL);
+
+    if (state->trace.valid)
+        pgtrace_span_record(&state->trace, state->span_id, state->fingerprint,
+                            queryDesc->operation, cached_db_name, ms, rows_returned,
+                            failed ? sqlerrcode : 0);
+
+    if (failed)
+    {
+        pgtrace_error_record(state->fingerprint, (uint32)sqlerrcode);
+        return;
+    }
+
+    pgtrace_activity_progress(rows_returned);
+    exec_record_parallel(queryDesc);
+
+    if (ms > pgtrace_slow_query_ms)
+    {
+        pgtrace_slow_query_record(state->fingerprint, ms,
+                                  app_name, cached_user_name, rows_returned);
+        pgtrace_slow_capture(queryDesc, state->fingerprint, ms);
+    }
+
+    if (pgtrace_audit)
+    {
+        AuditOpType op_type = AUDIT_UNKNOWN;
+
+        switch (queryDesc->operation)
+        {
+        case CMD_SELECT:
+            op_type = AUDIT_SELECT;
+            break;
+        case CMD_INSERT:
+            op_type = AUDIT_INSERT;
+            break;
+        case CMD_UPDATE:
+            op_type = AUDIT_UPDATE;
+            break;
+        case CMD_DELETE:
+            op_type = AUDIT_DELETE;
+            break;
+        default:
+            op_type = AUDIT_UNKNOWN;
+            break;
+        }
+
+        pgtrace_audit_record(state->fingerprint, op_type,
+                             cached_user_name, cached_db_name, rows_returned, ms);
+    }
+}
+
+/*
+ * Called from PG_CATCH while an error propagates out of the executor. The
+ * error is still on the error stack, so geterrcode() reports its SQLSTATE;
+ * nothing here may throw.
+ */
+static void
+exec_record_failure(QueryDesc *queryDesc)
 {
-    TimestampTz end;
-    long secs;
-    int usecs;
-    long ms;
-    const char *app_name;
-    const char *user_name;
-    const char *db_name;
-    const char *req_id;
-    int64 rows_returned;
-    int64 rows_scanned;
-    PlanState *plan_state;
+    PgTraceExecState *state = exec_state_find(queryDesc);
+    instr_time start;
 
-    end = GetCurrentTimestamp();
+    if (!state || state->recorded)
+        return;
 
-    TimestampDifference(query_start_time, end, &secs, &usecs);
-    ms = secs * 1000 + usecs / 1000;
+    INSTR_TIME_SET_CURRENT(start);
+    exec_record(state, exec_elapsed_ms(queryDesc), true, geterrcode());
+    pgtrace_hook_done(PGTRACE_HOOK_EXECUTOR_ERROR, pgtrace_elapsed_ns(start));
+}
 
-    pgtrace_record_query(ms, false);
+/*
+ * A traceparent comment on the statement wins; a nested statement is a
+ * child span of the one running it; otherwise pgtrace.traceparent applies.
+ */
+static void
+exec_trace_context(PgTraceExecState *pending)
+{
+    PgTraceContext *trace = &pending->trace;
 
-    if (current_fingerprint != 0)
+    if (!pgtrace_trace_from_query(pending->queryDesc->sourceText, trace))
     {
-        app_name = application_name ? application_name : "";
-        user_name = GetUserNameFromId(GetUserId(), false);
-        db_name = get_database_name(MyDatabaseId);
-        req_id = pgtrace_request_id ? pgtrace_request_id : "";
-        rows_returned = (queryDesc->estate && queryDesc->estate->es_processed) ? queryDesc->estate->es_processed : 0;
+        if (exec_current && exec_current->trace.valid)
+        {
+            *trace = exec_current->trace;
+            trace->parent_span_id = exec_current->span_id;
+        }
+        else if (!pgtrace_trace_from_guc(trace))
+            return;
+    }
+
+    pending->span_id = pgtrace_trace_new_span_id();
+}
 
-        rows_scanned = rows_returned;
-        if (queryDesc->estate && queryDesc->planstate)
+static void
+pgtrace_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+    PgTraceExecState pending = {.queryDesc = queryDesc};
+    uint64 own_ns = 0;
+    instr_time start;
+
+    /*
+     * Parallel workers run these hooks for their share of the plan. Their
+     * time, rows and buffer usage are already folded into the leader's
+     * instrumentation when the Gather finishes, so only the leader records,
+     * once per statement and without workers contending for our locks.
+     */
+    if (pgtrace_enabled && queryDesc->sourceText && !(eflags & EXEC_FLAG_EXPLAIN_ONLY) &&
+        !IsParallelWorker())
+    {
+        INSTR_TIME_SET_CURRENT(start);
+        pending.fingerprint = pgtrace_compute_fingerprint(queryDesc->sourceText);
+        if (pending.fingerprint != 0)
         {
-            plan_state = queryDesc->planstate;
-
-                       if (plan_state->instrument)
-            {
-                rows_scanned = plan_state->instrument->tuplecount;
-            }
-            else
-            {
-                rows_scanned = rows_returned;
-            }
+            pending.plan_hash = pgtrace_plan_hash(queryDesc->plannedstmt);
+            exec_trace_context(&pending);
         }
+        refresh_names();
+        own_ns = pgtrace_elapsed_ns(start);
+    }
 
-        pgtrace_hash_record(current_fingerprint, (double)ms, false,
-                            app_name, user_name, db_name, req_id,
-                            rows_scanned, rows_returned);
+    if (pending.fingerprint != 0 && pgtrace_slow_capture_wants_instrumentation())
+        queryDesc->instrument_options |= INSTRUMENT_ROWS;
 
-        if (ms > pgtrace_slow_query_ms)
+    PG_TRY();
+    {
+        if (prev_ExecutorStart)
+            prev_ExecutorStart(queryDesc, eflags);
+        else
+            standard_ExecutorStart(queryDesc, eflags);
+    }
+    PG_CATCH();
+    {
+        /* Permission checks and plan initialization fail before any state exists. */
+        if (pending.fingerprint != 0)
         {
-            pgtrace_slow_query_record(current_fingerprint, (double)ms,
-                                      app_name, user_name, rows_returned);
+            INSTR_TIME_SET_CURRENT(start);
+            exec_record(&pending, 0.0, true, geterrcode());
+            pgtrace_hook_done(PGTRACE_HOOK_EXECUTOR_ERROR, pgtrace_elapsed_ns(start));
         }
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
 
-        if (pgtrace_enabled)
+    if (pending.fingerprint != 0)
+    {
+        if (queryDesc->estate)
         {
-            AuditOpType op_type = AUDIT_UNKNOWN;
-
-            switch (queryDesc->operation)
-            {
-            case CMD_SELECT:
-                op_type = AUDIT_SELECT;
-                break;
-            case CMD_INSERT:
-                op_type = AUDIT_INSERT;
-                break;
-            case CMD_UPDATE:
-                op_type = AUDIT_UPDATE;
-                break;
-            case CMD_DELETE:
-                op_type = AUDIT_DELETE;
-                break;
-            default:
-                op_type = AUDIT_UNKNOWN;
-                break;
-            }
-
-            pgtrace_audit_record(current_fingerprint, op_type,
-                                 user_name, db_name, rows_returned, (double)ms);
+            INSTR_TIME_SET_CURRENT(start);
+            exec_state_attach(&pending);
+            own_ns += pgtrace_elapsed_ns(start);
         }
+        pgtrace_hook_done(PGTRACE_HOOK_EXECUTOR_START, own_ns);
+    }
+}
+
+/*
+ * While Run and Finish execute, the statement is published as in flight
+ * and, with ASH on, its fingerprint is published for the sampler. Calls
+ * nest strictly, so both are undone on the way out, including when an
+ * error unwinds through us.
+ */
+static void
+exec_enter(QueryDesc *queryDesc, PgTraceExecFrame *frame)
+{
+    PgTraceExecState *state = exec_state_find(queryDesc);
+
+    frame->state = state;
+    frame->outer = exec_current;
+    frame->ash_outer = 0;
+
+    if (state)
+    {
+        exec_current = state;
+        pgtrace_activity_enter(state->fingerprint);
+        if (pgtrace_ash_state)
+            frame->ash_outer = pgtrace_ash_push(state->fingerprint);
+    }
+}
+
+static void
+exec_leave(PgTraceExecFrame *frame)
+{
+    if (!frame->state)
+        return;
+
+    if (pgtrace_ash_state)
+        pgtrace_ash_pop(frame->ash_outer);
+    pgtrace_activity_leave();
+    exec_current = frame->outer;
+}
+
+static void
+pgtrace_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+                    bool execute_once)
+{
+    PgTraceExecFrame frame;
+
+    exec_enter(queryDesc, &frame);
+
+    PG_TRY();
+    {
+        if (prev_ExecutorRun)
+            prev_ExecutorRun(queryDesc, direction, count, execute_once);
+        else
+            standard_ExecutorRun(queryDesc, direction, count, execute_once);
+    }
+    PG_CATCH();
+    {
+        exec_leave(&frame);
+        exec_record_failure(queryDesc);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    exec_leave(&frame);
+}
+
+static void
+pgtrace_ExecutorFinish(QueryDesc *queryDesc)
+{
+    PgTraceExecFrame frame;
+
+    exec_enter(queryDesc, &frame);
+
+    PG_TRY();
+    {
+        if (prev_ExecutorFinish)
+            prev_ExecutorFinish(queryDesc);
+        else
+            standard_ExecutorFinish(queryDesc);
+    }
+    PG_CATCH();
+    {
+        exec_leave(&frame);
+        exec_record_failure(queryDesc);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    exec_leave(&frame);
+}
+
+static void
+pgtrace_ExecutorEnd(QueryDesc *queryDesc)
+{
+    PgTraceExecState *state = exec_state_find(queryDesc);
+
+    if (state && !state->recorded && queryDesc->totaltime)
+    {
+        instr_time start;
+
+        INSTR_TIME_SET_CURRENT(start);
+        InstrEndLoop(queryDesc->totaltime);
+        exec_record(state, queryDesc->totaltime->total * 1000.0, false, 0);
+        pgtrace_hook_done(PGTRACE_HOOK_EXECUTOR_END, pgtrace_elapsed_ns(start));
     }
 
     if (prev_ExecutorEnd)
@@ -120,11 +486,18 @@ pgtrace_ExecutorEnd(QueryDesc *queryDesc)
     else
         standard_ExecutorEnd(queryDesc);
 }
+
 void pgtrace_init_hooks(void)
 {
     prev_ExecutorStart = ExecutorStart_hook;
     ExecutorStart_hook = pgtrace_ExecutorStart;
 
+    prev_ExecutorRun = ExecutorRun_hook;
+    ExecutorRun_hook = pgtrace_ExecutorRun;
+
+    prev_ExecutorFinish = ExecutorFinish_hook;
+    ExecutorFinish_hook = pgtrace_ExecutorFinish;
+
     prev_ExecutorEnd = ExecutorEnd_hook;
     ExecutorEnd_hook = pgtrace_ExecutorEnd;
 }
@@ -132,5 +505,7 @@ void pgtrace_init_hooks(void)
 void pgtrace_remove_hooks(void)
 {
     ExecutorStart_hook = prev_ExecutorStart;
+    ExecutorRun_hook = prev_ExecutorRun;
+    ExecutorFinish_hook = prev_ExecutorFinish;
     ExecutorEnd_hook = prev_ExecutorEnd;
 }
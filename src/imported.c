@@ -0,0 +1,654 @@
+#include <postgres.h>
+#include <math.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <access/xlog.h>
+#include <common/hashfn.h>
+#include <libpq/pqformat.h>
+#include <mb/pg_wchar.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+PgTraceImportedTable *pgtrace_imported_table = NULL;
+
+/* Bytes of one entry in a dump */
+#define STATE_ENTRY_BYTES ((9 + PGTRACE_WINDOW_LATENCY_BUCKETS) * 8)
+
+/* A dump, parsed and checked before anything is merged */
+typedef struct StateDump
+{
+    uint64 node_id;
+    uint64 system_identifier;
+    char name[NAMEDATALEN];
+    TimestampTz dumped_at;
+    int32 count;
+    PgTraceImportedEntry *entries;
+} StateDump;
+
+/* One fingerprint summed over the nodes it was imported from */
+typedef struct ImportedRow
+{
+    PgTraceImportedEntry sum;
+    uint32 nodes;
+} ImportedRow;
+
+void pgtrace_imported_request_shmem(void)
+{
+    RequestAddinShmemSpace(sizeof(PgTraceImportedTable));
+    RequestNamedLWLockTranche("pgtrace_imported", 1);
+}
+
+void pgtrace_imported_startup(void)
+{
+    bool found;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    pgtrace_imported_table = ShmemInitStruct(
+        "pgtrace_imported",
+        sizeof(PgTraceImportedTable),
+        &found);
+
+    if (!found)
+    {
+        uint64 node_id = 0;
+
+        memset(pgtrace_imported_table, 0, sizeof(PgTraceImportedTable));
+
+        if (!pg_strong_random(&node_id, sizeof(node_id)))
+            node_id = hash_combine64((uint64)GetCurrentTimestamp(), (uint64)MyProcPid);
+        pgtrace_imported_table->node_id = node_id != 0 ? node_id : 1;
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/* Clear what was merged; the local node id stays. */
+void pgtrace_imported_reset(void)
+{
+    LWLockPadded *lock;
+
+    if (!pgtrace_imported_table)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_imported");
+    pgtrace_lock_acquire(PGTRACE_LOCK_IMPORTED, &lock->lock, LW_EXCLUSIVE);
+    pgtrace_imported_table->num_entries = 0;
+    pgtrace_imported_table->num_nodes = 0;
+    memset(pgtrace_imported_table->nodes, 0, sizeof(pgtrace_imported_table->nodes));
+    memset(pgtrace_imported_table->entries, 0, sizeof(pgtrace_imported_table->entries));
+    LWLockRelease(&lock->lock);
+}
+
+/* Add the counts of src to dst, as if both had recorded into one entry. */
+static void
+imported_combine(PgTraceImportedEntry *dst, const PgTraceImportedEntry *src)
+{
+    int i;
+
+    if (dst->first_seen == 0 || src->first_seen < dst->first_seen)
+        dst->first_seen = src->first_seen;
+    if (src->last_seen > dst->last_seen)
+        dst->last_seen = src->last_seen;
+    if (src->max_time_ms > dst->max_time_ms)
+        dst->max_time_ms = src->max_time_ms;
+
+    dst->calls += src->calls;
+    dst->errors += src->errors;
+    dst->total_time_ms += src->total_time_ms;
+    dst->rows_scanned += src->rows_scanned;
+    dst->rows_returned += src->rows_returned;
+    for (i = 0; i < PGTRACE_WINDOW_LATENCY_BUCKETS; i++)
+        dst->latency[i] += src->latency[i];
+}
+
+static inline uint64
+imported_home(uint64 node_id, uint64 fingerprint)
+{
+    return hash_combine64(node_id, fingerprint) % PGTRACE_IMPORTED_HASH_SIZE;
+}
+
+/* Caller holds the lock exclusively. */
+static PgTraceImportedEntry *
+imported_find_or_create(uint64 node_id, uint64 fingerprint)
+{
+    uint64 bucket = imported_home(node_id, fingerprint);
+    uint64 i;
+
+    for (i = 0; i < PGTRACE_IMPORTED_HASH_SIZE; i++)
+    {
+        PgTraceImportedEntry *entry =
+            &pgtrace_imported_table->entries[(bucket + i) % PGTRACE_IMPORTED_HASH_SIZE];
+
+        if (!entry->valid)
+        {
+            if (pgtrace_imported_table->num_entries >= PGTRACE_IMPORTED_ENTRIES)
+                break;
+
+            memset(entry, 0, sizeof(PgTraceImportedEntry));
+            entry->node_id = node_id;
+            entry->fingerprint = fingerprint;
+            entry->valid = true;
+            pgtrace_imported_table->num_entries++;
+            return entry;
+        }
+
+        if (entry->node_id == node_id && entry->fingerprint == fingerprint)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Backward-shift deletion, as in the query hash. Caller holds the lock. */
+static void
+imported_delete_entry(uint64 idx)
+{
+    uint64 hole = idx;
+    uint64 next = (idx + 1) % PGTRACE_IMPORTED_HASH_SIZE;
+
+    for (;;)
+    {
+        PgTraceImportedEntry *entry = &pgtrace_imported_table->entries[next];
+        uint64 home;
+        bool movable;
+
+        if (!entry->valid)
+            break;
+
+        home = imported_home(entry->node_id, entry->fingerprint);
+        if (hole < next)
+            movable = (home <= hole || home > next);
+        else
+            movable = (home <= hole && home > next);
+
+        if (movable)
+        {
+            pgtrace_imported_table->entries[hole] = *entry;
+            hole = next;
+        }
+
+        next = (next + 1) % PGTRACE_IMPORTED_HASH_SIZE;
+    }
+
+    memset(&pgtrace_imported_table->entries[hole], 0, sizeof(PgTraceImportedEntry));
+    pgtrace_imported_table->num_entries--;
+}
+
+/* Drop every entry of a node. Caller holds the lock exclusively. */
+static void
+imported_delete_node_entries(uint64 node_id)
+{
+    uint64 i = 0;
+
+    while (i < PGTRACE_IMPORTED_HASH_SIZE)
+    {
+        PgTraceImportedEntry *entry = &pgtrace_imported_table->entries[i];
+
+        /* A deletion may shift a later entry into slot i, so look again. */
+        if (entry->valid && entry->node_id == node_id)
+        {
+            imported_delete_entry(i);
+            continue;
+        }
+        i++;
+    }
+}
+
+/* The node whose dump was merged least recently. Caller holds the lock. */
+static PgTraceImportedNode *
+imported_oldest_node(void)
+{
+    PgTraceImportedNode *oldest = &pgtrace_imported_table->nodes[0];
+    uint32 i;
+
+    for (i = 1; i < pgtrace_imported_table->num_nodes; i++)
+    {
+        if (pgtrace_imported_table->nodes[i].merged_at < oldest->merged_at)
+            oldest = &pgtrace_imported_table->nodes[i];
+    }
+
+    return oldest;
+}
+
+static void state_invalid(const char *detail) pg_attribute_noreturn();
+
+static void
+state_invalid(const char *detail)
+{
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+             errmsg("invalid pgtrace state dump"),
+             errdetail_internal("%s", detail)));
+}
+
+static void
+state_need(StringInfo buf, int bytes)
+{
+    if (bytes < 0 || buf->len - buf->cursor < bytes)
+        state_invalid("The dump is truncated.");
+}
+
+static void
+state_parse(bytea *data, StateDump *dump)
+{
+    StringInfoData buf;
+    int32 version;
+    int32 name_len;
+    int32 buckets;
+    int32 i;
+
+    buf.data = VARDATA_ANY(data);
+    buf.len = VARSIZE_ANY_EXHDR(data);
+    buf.maxlen = buf.len;
+    buf.cursor = 0;
+
+    state_need(&buf, 8 + 4);
+    if (memcmp(pq_getmsgbytes(&buf, 8), PGTRACE_STATE_MAGIC, 8) != 0)
+        state_invalid("The dump does not start with the pgtrace state magic.");
+    version = pq_getmsgint(&buf, 4);
+    if (version != PGTRACE_STATE_VERSION)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("invalid pgtrace state dump"),
+                 errdetail("Dump format version %d is not supported; this pgtrace reads version %d.",
+                           version, PGTRACE_STATE_VERSION)));
+
+    state_need(&buf, 8 + 8 + 4);
+    dump->node_id = (uint64)pq_getmsgint64(&buf);
+    dump->system_identifier = (uint64)pq_getmsgint64(&buf);
+    name_len = pq_getmsgint(&buf, 4);
+    if (dump->node_id == 0)
+        state_invalid("The dump has no node id.");
+    if (name_len < 0 || name_len >= NAMEDATALEN)
+        state_invalid("The node name is too long.");
+
+    state_need(&buf, name_len + 8 + 4 + 4);
+    memcpy(dump->name, pq_getmsgbytes(&buf, name_len), name_len);
+    dump->name[name_len] = '\0';
+    pg_verifymbstr(dump->name, name_len, false);
+    dump->dumped_at = pq_getmsgint64(&buf);
+    buckets = pq_getmsgint(&buf, 4);
+    dump->count = pq_getmsgint(&buf, 4);
+
+    if (buckets != PGTRACE_WINDOW_LATENCY_BUCKETS)
+        state_invalid("The dump has a different number of latency buckets.");
+    if (dump->count < 0 || (int64)dump->count * STATE_ENTRY_BYTES != buf.len - buf.cursor)
+        state_invalid("The entry count does not match the length of the dump.");
+
+    dump->entries = palloc0(Max(dump->count, 1) * sizeof(PgTraceImportedEntry));
+    for (i = 0; i < dump->count; i++)
+    {
+        PgTraceImportedEntry *entry = &dump->entries[i];
+        int j;
+
+        entry->node_id = dump->node_id;
+        entry->fingerprint = (uint64)pq_getmsgint64(&buf);
+        entry->valid = true;
+        entry->calls = (uint64)pq_getmsgint64(&buf);
+        entry->errors = (uint64)pq_getmsgint64(&buf);
+        entry->total_time_ms = pq_getmsgfloat8(&buf);
+        entry->max_time_ms = pq_getmsgfloat8(&buf);
+        entry->first_seen = pq_getmsgint64(&buf);
+        entry->last_seen = pq_getmsgint64(&buf);
+        entry->rows_scanned = (uint64)pq_getmsgint64(&buf);
+        entry->rows_returned = (uint64)pq_getmsgint64(&buf);
+        for (j = 0; j < PGTRACE_WINDOW_LATENCY_BUCKETS; j++)
+            entry->latency[j] = (uint64)pq_getmsgint64(&buf);
+    }
+
+    pq_getmsgend(&buf);
+}
+
+/*
+ * The tracked fingerprints of this node, in the format described in
+ * imported.h. Entries are copied without the query table lock, as for the
+ * views.
+ */
+PG_FUNCTION_INFO_V1(pgtrace_dump_state);
+
+PGDLLEXPORT Datum pgtrace_dump_state(PG_FUNCTION_ARGS)
+{
+    QueryStats *rows;
+    uint32 count;
+    const char *name = cluster_name ? cluster_name : "";
+    int name_len = Min((int)strlen(name), NAMEDATALEN - 1);
+    StringInfoData buf;
+    uint32 i;
+
+    if (!pgtrace_imported_table || !pgtrace_query_hash)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pgtrace must be loaded via shared_preload_libraries")));
+
+    rows = palloc(PGTRACE_MAX_QUERIES * sizeof(QueryStats));
+    count = pgtrace_hash_snapshot(rows, PGTRACE_MAX_QUERIES);
+
+    pq_begintypsend(&buf);
+    pq_sendbytes(&buf, PGTRACE_STATE_MAGIC, 8);
+    pq_sendint32(&buf, PGTRACE_STATE_VERSION);
+    pq_sendint64(&buf, (int64)pgtrace_imported_table->node_id);
+    pq_sendint64(&buf, (int64)GetSystemIdentifier());
+    pq_sendint32(&buf, name_len);
+    pq_sendbytes(&buf, name, name_len);
+    pq_sendint64(&buf, GetCurrentTimestamp());
+    pq_sendint32(&buf, PGTRACE_WINDOW_LATENCY_BUCKETS);
+    pq_sendint32(&buf, count);
+
+    for (i = 0; i < count; i++)
+    {
+        const QueryStats *entry = &rows[i];
+        int j;
+
+        pq_sendint64(&buf, (int64)entry->fingerprint);
+        pq_sendint64(&buf, (int64)entry->calls);
+        pq_sendint64(&buf, (int64)entry->errors);
+        pq_sendfloat8(&buf, entry->total_time_ms);
+        pq_sendfloat8(&buf, entry->max_time_ms);
+        pq_sendint64(&buf, entry->first_seen);
+        pq_sendint64(&buf, entry->last_seen);
+        pq_sendint64(&buf, (int64)entry->total_rows_scanned);
+        pq_sendint64(&buf, (int64)entry->total_rows_returned);
+        for (j = 0; j < PGTRACE_WINDOW_LATENCY_BUCKETS; j++)
+            pq_sendint64(&buf, (int64)entry->latency_hist[j]);
+    }
+
+    pfree(rows);
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * Replace what was imported from the dump's node with the dump. A dump
+ * older than the one last merged from its node is refused, so a late
+ * retry cannot roll a node back. Returns the number of fingerprints
+ * imported.
+ */
+PG_FUNCTION_INFO_V1(pgtrace_merge_state);
+
+PGDLLEXPORT Datum pgtrace_merge_state(PG_FUNCTION_ARGS)
+{
+    StateDump dump;
+    PgTraceImportedNode *node = NULL;
+    LWLockPadded *lock;
+    uint32 imported = 0;
+    uint32 dropped = 0;
+    uint32 i;
+
+    if (!pgtrace_imported_table)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pgtrace must be loaded via shared_preload_libraries")));
+
+    state_parse(PG_GETARG_BYTEA_PP(0), &dump);
+
+    lock = GetNamedLWLockTranche("pgtrace_imported");
+    pgtrace_lock_acquire(PGTRACE_LOCK_IMPORTED, &lock->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < pgtrace_imported_table->num_nodes; i++)
+    {
+        if (pgtrace_imported_table->nodes[i].node_id == dump.node_id)
+        {
+            node = &pgtrace_imported_table->nodes[i];
+            break;
+        }
+    }
+
+    if (node && dump.dumped_at < node->dumped_at)
+    {
+        TimestampTz merged_dumped_at = node->dumped_at;
+
+        LWLockRelease(&lock->lock);
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pgtrace state dump is older than the one already merged from node \"%s\"",
+                        dump.name[0] ? dump.name : "(unnamed)"),
+                 errdetail("The dump was taken at %s, the merged one at %s.",
+                           timestamptz_to_str(dump.dumped_at),
+                           timestamptz_to_str(merged_dumped_at))));
+    }
+
+    if (!node)
+    {
+        if (pgtrace_imported_table->num_nodes < PGTRACE_IMPORTED_NODES)
+            node = &pgtrace_imported_table->nodes[pgtrace_imported_table->num_nodes++];
+        else
+        {
+            node = imported_oldest_node();
+            imported_delete_node_entries(node->node_id);
+        }
+        memset(node, 0, sizeof(PgTraceImportedNode));
+        node->node_id = dump.node_id;
+    }
+    else
+        imported_delete_node_entries(dump.node_id);
+
+    for (i = 0; i < (uint32)dump.count; i++)
+    {
+        uint32 num_entries = pgtrace_imported_table->num_entries;
+        PgTraceImportedEntry *entry;
+
+        if (dump.entries[i].fingerprint == 0)
+            continue;
+
+        entry = imported_find_or_create(dump.node_id, dump.entries[i].fingerprint);
+        if (!entry)
+        {
+            dropped++;
+            continue;
+        }
+
+        /* A well-formed dump lists each fingerprint once; add up repeats anyway. */
+        if (pgtrace_imported_table->num_entries != num_entries)
+            imported++;
+        imported_combine(entry, &dump.entries[i]);
+    }
+
+    node->system_identifier = dump.system_identifier;
+    strlcpy(node->name, dump.name, NAMEDATALEN);
+    node->dumped_at = dump.dumped_at;
+    node->merged_at = GetCurrentTimestamp();
+    node->queries = imported;
+    node->dropped = dropped;
+
+    LWLockRelease(&lock->lock);
+
+    pfree(dump.entries);
+
+    PG_RETURN_INT32((int32)imported);
+}
+
+static int
+imported_cmp(const void *a, const void *b)
+{
+    uint64 fa = ((const PgTraceImportedEntry *)a)->fingerprint;
+    uint64 fb = ((const PgTraceImportedEntry *)b)->fingerprint;
+
+    if (fa < fb)
+        return -1;
+    return fa > fb ? 1 : 0;
+}
+
+/* Copy the imported entries and sum them per fingerprint. */
+static uint32
+imported_aggregate(ImportedRow **dst)
+{
+    PgTraceImportedEntry *snapshot;
+    ImportedRow *rows;
+    uint32 count = 0;
+    uint32 nrows = 0;
+    uint32 i;
+
+    snapshot = palloc(PGTRACE_IMPORTED_ENTRIES * sizeof(PgTraceImportedEntry));
+
+    if (pgtrace_imported_table)
+    {
+        LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_imported");
+
+        pgtrace_lock_acquire(PGTRACE_LOCK_IMPORTED, &lock->lock, LW_SHARED);
+        for (i = 0; i < PGTRACE_IMPORTED_HASH_SIZE && count < PGTRACE_IMPORTED_ENTRIES; i++)
+        {
+            if (pgtrace_imported_table->entries[i].valid)
+                snapshot[count++] = pgtrace_imported_table->entries[i];
+        }
+        LWLockRelease(&lock->lock);
+    }
+
+    qsort(snapshot, count, sizeof(PgTraceImportedEntry), imported_cmp);
+
+    rows = palloc0(Max(count, 1) * sizeof(ImportedRow));
+    for (i = 0; i < count; i++)
+    {
+        if (nrows == 0 || rows[nrows - 1].sum.fingerprint != snapshot[i].fingerprint)
+            rows[nrows++].sum.fingerprint = snapshot[i].fingerprint;
+
+        imported_combine(&rows[nrows - 1].sum, &snapshot[i]);
+        rows[nrows - 1].nodes++;
+    }
+
+    pfree(snapshot);
+
+    *dst = rows;
+    return nrows;
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_imported_stats);
+
+PGDLLEXPORT Datum pgtrace_internal_imported_stats(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    ImportedRow *rows;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_imported_stats must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        funcctx->max_calls = imported_aggregate(&rows);
+        funcctx->user_fctx = rows;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    rows = (ImportedRow *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[13];
+        bool nulls[13] = {false, false, false, false, false, false, false,
+                          false, false, false, false, false, false};
+        ImportedRow *row = &rows[funcctx->call_cntr];
+        PgTraceImportedEntry *sum = &row->sum;
+        double latency[PGTRACE_WINDOW_LATENCY_BUCKETS];
+        double p95_ms;
+        double p99_ms;
+        HeapTuple tuple;
+        int i;
+
+        for (i = 0; i < PGTRACE_WINDOW_LATENCY_BUCKETS; i++)
+            latency[i] = (double)sum->latency[i];
+        p95_ms = pgtrace_window_latency_quantile(latency, sum->max_time_ms, 0.95);
+        p99_ms = pgtrace_window_latency_quantile(latency, sum->max_time_ms, 0.99);
+
+        values[0] = UInt64GetDatum(sum->fingerprint);
+        values[1] = Int32GetDatum((int32)row->nodes);
+        values[2] = UInt64GetDatum(sum->calls);
+        values[3] = UInt64GetDatum(sum->errors);
+        values[4] = Float8GetDatum(sum->total_time_ms);
+        values[5] = Float8GetDatum(sum->calls > 0 ? sum->total_time_ms / sum->calls : 0.0);
+        values[6] = Float8GetDatum(sum->max_time_ms);
+        values[7] = Float8GetDatum(p95_ms);
+        values[8] = Float8GetDatum(p99_ms);
+        nulls[7] = isnan(p95_ms);
+        nulls[8] = isnan(p99_ms);
+        values[9] = TimestampTzGetDatum(sum->first_seen);
+        values[10] = TimestampTzGetDatum(sum->last_seen);
+        values[11] = UInt64GetDatum(sum->rows_scanned);
+        values[12] = UInt64GetDatum(sum->rows_returned);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_imported_nodes);
+
+PGDLLEXPORT Datum pgtrace_internal_imported_nodes(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceImportedNode *nodes;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_imported_nodes must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        nodes = palloc(PGTRACE_IMPORTED_NODES * sizeof(PgTraceImportedNode));
+
+        if (pgtrace_imported_table)
+        {
+            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_imported");
+
+            pgtrace_lock_acquire(PGTRACE_LOCK_IMPORTED, &lock->lock, LW_SHARED);
+            count = pgtrace_imported_table->num_nodes;
+            memcpy(nodes, pgtrace_imported_table->nodes, count * sizeof(PgTraceImportedNode));
+            LWLockRelease(&lock->lock);
+        }
+
+        funcctx->user_fctx = nodes;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    nodes = (PgTraceImportedNode *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[8];
+        bool nulls[8] = {false, false, false, false, false, false, false, false};
+        PgTraceImportedNode *node = &nodes[funcctx->call_cntr];
+        HeapTuple tuple;
+
+        values[0] = UInt64GetDatum(node->node_id);
+        values[1] = UInt64GetDatum(node->system_identifier);
+        values[2] = CStringGetTextDatum(node->name);
+        values[3] = BoolGetDatum(node->node_id == pgtrace_imported_table->node_id);
+        values[4] = TimestampTzGetDatum(node->dumped_at);
+        values[5] = TimestampTzGetDatum(node->merged_at);
+        values[6] = Int64GetDatum((int64)node->queries);
+        values[7] = Int64GetDatum((int64)node->dropped);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
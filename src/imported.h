@@ -0,0 +1,91 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <utils/timestamp.h>
+#include "window.h"
+
+/*
+ * Statistics of other nodes, merged in from their pgtrace_dump_state() so
+ * that one node can answer fleet-wide questions. Entries are kept per
+ * (node, fingerprint) and only summed when read: a node's next dump then
+ * replaces its previous one instead of being added to it, which makes a
+ * repeated merge harmless and copes with the node resetting its counters.
+ *
+ * Nodes are told apart by a random id drawn when the node's shared memory
+ * is set up. The system identifier is not enough: physical replicas share
+ * it with their primary. A restarted node starts from zero under a new id,
+ * so its earlier dump stays valid next to the new one.
+ *
+ * Restarts therefore keep adding nodes. When all PGTRACE_IMPORTED_NODES
+ * slots are taken, a dump from a new node evicts the node merged least
+ * recently, along with its entries: a node that restarted has stopped
+ * sending dumps under its old id, so its merged_at only falls behind.
+ *
+ * Dump layout (network byte order, as written by pqformat):
+ *
+ *   header    "PGTRSTA1" magic, int32 format version, int64 node id,
+ *             int64 system identifier, int32 name length, name bytes
+ *             (cluster_name), int64 dump time (TimestampTz),
+ *             int32 latency bucket count, int32 entry count
+ *   entry*    int64 fingerprint, calls, errors, float8 total and max time
+ *             in ms, int64 first and last seen (TimestampTz), rows
+ *             scanned, rows returned, then one int64 count per latency
+ *             bucket (see window.h for the bucket bounds)
+ *
+ * The latency buckets are cumulative since the fingerprint was first seen,
+ * so adding them across nodes gives the fleet's latency distribution.
+ */
+#define PGTRACE_STATE_MAGIC "PGTRSTA1"
+#define PGTRACE_STATE_VERSION 1
+
+typedef struct PgTraceImportedEntry
+{
+    uint64 node_id;
+    uint64 fingerprint;
+    bool valid;
+    uint64 calls;
+    uint64 errors;
+    double total_time_ms;
+    double max_time_ms;
+    TimestampTz first_seen;
+    TimestampTz last_seen;
+    uint64 rows_scanned;
+    uint64 rows_returned;
+    uint64 latency[PGTRACE_WINDOW_LATENCY_BUCKETS];
+} PgTraceImportedEntry;
+
+typedef struct PgTraceImportedNode
+{
+    uint64 node_id;
+    uint64 system_identifier;
+    char name[NAMEDATALEN];
+    TimestampTz dumped_at;
+    TimestampTz merged_at;
+    uint32 queries;
+    uint32 dropped; /* entries of its last dump that found no slot */
+} PgTraceImportedNode;
+
+#define PGTRACE_IMPORTED_NODES 64
+#define PGTRACE_IMPORTED_ENTRIES 32768
+#define PGTRACE_IMPORTED_HASH_SIZE (PGTRACE_IMPORTED_ENTRIES * 2)
+
+typedef struct PgTraceImportedTable
+{
+    uint64 node_id; /* this node's id in its own dumps */
+    uint32 num_entries;
+    uint32 num_nodes;
+    PgTraceImportedNode nodes[PGTRACE_IMPORTED_NODES];
+    PgTraceImportedEntry entries[PGTRACE_IMPORTED_HASH_SIZE];
+} PgTraceImportedTable;
+
+extern PgTraceImportedTable *pgtrace_imported_table;
+
+void pgtrace_imported_request_shmem(void);
+void pgtrace_imported_startup(void);
+void pgtrace_imported_reset(void);
+
+PGDLLEXPORT Datum pgtrace_dump_state(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_merge_state(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_imported_stats(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_imported_nodes(PG_FUNCTION_ARGS);
@@ -1,7 +1,11 @@
 #include <postgres.h>
 #include <funcapi.h>
+#include <math.h>
 #include <stdlib.h>
+#include <miscadmin.h>
+#include <commands/dbcommands.h>
 #include <utils/builtins.h>
+#include <utils/float.h>
 #include "pgtrace.h"
 
 static double
@@ -33,40 +37,99 @@ compare_doubles(const void *a, const void *b)
     return 0;
 }
 
-static int
-bucket_for_latency(long ms)
+/* p95 and p99 of the latency samples kept for a query, 0 when there are none. */
+void pgtrace_query_percentiles(const QueryStats *entry, double *p95_ms, double *p99_ms)
 {
-    if (ms <= 5)
-        return 0;
-    if (ms <= 10)
-        return 1;
-    if (ms <= 50)
-        return 2;
-    if (ms <= 100)
-        return 3;
-    if (ms <= 500)
-        return 4;
-    return 5;
+    uint32 sample_count = entry->sample_count;
+    double samples[PGTRACE_LATENCY_BUCKETS];
+
+    *p95_ms = 0.0;
+    *p99_ms = 0.0;
+
+    if (sample_count == 0)
+        return;
+
+    memcpy(samples, entry->latency_samples, sizeof(double) * sample_count);
+    qsort(samples, sample_count, sizeof(double), compare_doubles);
+    *p95_ms = calculate_percentile(samples, sample_count, 95.0);
+    *p99_ms = calculate_percentile(samples, sample_count, 99.0);
+}
+
+/*
+ * A backend stays connected to one database, so its histogram slot is
+ * looked up once. The first backend of a database claims a free slot with
+ * a compare-and-swap; once all slots are taken, further databases share
+ * the overflow histogram.
+ */
+static PgTraceHistogram *my_database_histogram = NULL;
+
+static PgTraceHistogram *
+database_histogram(void)
+{
+    int i;
+
+    if (my_database_histogram)
+        return my_database_histogram;
+
+    if (!OidIsValid(MyDatabaseId))
+        return &pgtrace_metrics->other_databases;
+
+    my_database_histogram = &pgtrace_metrics->other_databases;
+
+    for (i = 0; i < PGTRACE_HIST_DATABASES; i++)
+    {
+        PgTraceDbHistogram *slot = &pgtrace_metrics->databases[i];
+        uint32 dbid = pg_atomic_read_u32(&slot->dbid);
+
+        if (dbid == InvalidOid)
+        {
+            /* On failure dbid receives the value another backend installed. */
+            if (pg_atomic_compare_exchange_u32(&slot->dbid, &dbid, MyDatabaseId))
+                dbid = MyDatabaseId;
+        }
+
+        if (dbid == MyDatabaseId)
+        {
+            my_database_histogram = &slot->hist;
+            break;
+        }
+    }
+
+    return my_database_histogram;
 }
 
-void pgtrace_record_query(long duration_ms, bool failed)
+void pgtrace_record_query(double duration_ms, bool failed, bool cancelled)
 {
+    uint64 us;
+
     if (!pgtrace_enabled || !pgtrace_metrics)
         return;
 
-    LWLockAcquire(&pgtrace_metrics->lock, LW_EXCLUSIVE);
-
-    pgtrace_metrics->queries_total++;
+    pg_atomic_fetch_add_u64(&pgtrace_metrics->queries_total, 1);
 
     if (failed)
-        pgtrace_metrics->queries_failed++;
+        pg_atomic_fetch_add_u64(&pgtrace_metrics->queries_failed, 1);
+
+    if (cancelled)
+        pg_atomic_fetch_add_u64(&pgtrace_metrics->queries_cancelled, 1);
 
     if (duration_ms > pgtrace_slow_query_ms)
-        pgtrace_metrics->slow_queries++;
+        pg_atomic_fetch_add_u64(&pgtrace_metrics->slow_queries, 1);
+
+    us = (duration_ms > 0) ? (uint64)(duration_ms * 1000.0) : 0;
+    pgtrace_histogram_add(&pgtrace_metrics->latency, us);
+    pgtrace_histogram_add(database_histogram(), us);
+}
 
-    pgtrace_metrics->latency_buckets[bucket_for_latency(duration_ms)]++;
+/* A statement that ran Gather or Gather Merge nodes has ended. */
+void pgtrace_record_parallel(int workers_planned, int workers_launched)
+{
+    if (!pgtrace_enabled || !pgtrace_metrics)
+        return;
 
-    LWLockRelease(&pgtrace_metrics->lock);
+    pg_atomic_fetch_add_u64(&pgtrace_metrics->parallel_queries, 1);
+    pg_atomic_fetch_add_u64(&pgtrace_metrics->workers_planned, (uint64)workers_planned);
+    pg_atomic_fetch_add_u64(&pgtrace_metrics->workers_launched, (uint64)workers_launched);
 }
 
 PG_FUNCTION_INFO_V1(pgtrace_internal_metrics);
@@ -74,11 +137,15 @@ PG_FUNCTION_INFO_V1(pgtrace_internal_metrics);
 PGDLLEXPORT Datum pgtrace_internal_metrics(PG_FUNCTION_ARGS)
 {
     TupleDesc tupdesc;
-    Datum values[3];
-    bool nulls[3] = {false, false, false};
+    Datum values[7];
+    bool nulls[7] = {false, false, false, false, false, false, false};
     uint64 queries_total = 0;
     uint64 queries_failed = 0;
     uint64 slow_queries = 0;
+    uint64 queries_cancelled = 0;
+    uint64 parallel_queries = 0;
+    uint64 workers_planned = 0;
+    uint64 workers_launched = 0;
 
     if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
         ereport(ERROR,
@@ -87,38 +154,81 @@ PGDLLEXPORT Datum pgtrace_internal_metrics(PG_FUNCTION_ARGS)
 
     if (pgtrace_metrics)
     {
-        LWLockAcquire(&pgtrace_metrics->lock, LW_SHARED);
-        queries_total = pgtrace_metrics->queries_total;
-        queries_failed = pgtrace_metrics->queries_failed;
-        slow_queries = pgtrace_metrics->slow_queries;
-        LWLockRelease(&pgtrace_metrics->lock);
+        queries_total = pg_atomic_read_u64(&pgtrace_metrics->queries_total);
+        queries_failed = pg_atomic_read_u64(&pgtrace_metrics->queries_failed);
+        slow_queries = pg_atomic_read_u64(&pgtrace_metrics->slow_queries);
+        queries_cancelled = pg_atomic_read_u64(&pgtrace_metrics->queries_cancelled);
+        parallel_queries = pg_atomic_read_u64(&pgtrace_metrics->parallel_queries);
+        workers_planned = pg_atomic_read_u64(&pgtrace_metrics->workers_planned);
+        workers_launched = pg_atomic_read_u64(&pgtrace_metrics->workers_launched);
     }
 
     values[0] = UInt64GetDatum(queries_total);
     values[1] = UInt64GetDatum(queries_failed);
     values[2] = UInt64GetDatum(slow_queries);
+    values[3] = UInt64GetDatum(queries_cancelled);
+    values[4] = UInt64GetDatum(parallel_queries);
+    values[5] = UInt64GetDatum(workers_planned);
+    values[6] = UInt64GetDatum(workers_launched);
 
     PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
-typedef struct PgTraceLatencyState
+/* One cumulative ("le") histogram row. */
+typedef struct PgTraceLatencyRow
 {
-    uint64 counts[PGTRACE_BUCKETS];
-    int32 upper_ms[PGTRACE_BUCKETS];
-} PgTraceLatencyState;
+    Oid datid;
+    char *datname;
+    double le_ms;
+    uint64 queries;
+    uint64 bucket_queries;
+} PgTraceLatencyRow;
+
+/*
+ * Append the non-empty buckets of a histogram, plus the +Infinity bucket
+ * that always closes it, as cumulative rows. Returns the number added.
+ */
+static int
+latency_rows(PgTraceHistogram *hist, Oid datid, char *datname, PgTraceLatencyRow *rows)
+{
+    PgTraceHistogramSnapshot snap;
+    uint64 cumulative = 0;
+    int count = 0;
+    int i;
+
+    pgtrace_histogram_read(hist, &snap);
+
+    for (i = 0; i < PGTRACE_HIST_BUCKETS; i++)
+    {
+        bool last = (i == PGTRACE_HIST_BUCKETS - 1);
+
+        cumulative += snap.buckets[i];
+        if (snap.buckets[i] == 0 && !last)
+            continue;
+
+        rows[count].datid = datid;
+        rows[count].datname = datname;
+        rows[count].le_ms = last ? get_float8_infinity()
+                                 : (double)pgtrace_histogram_upper_us(i) / 1000.0;
+        rows[count].queries = cumulative;
+        rows[count].bucket_queries = snap.buckets[i];
+        count++;
+    }
+
+    return count;
+}
 
 PG_FUNCTION_INFO_V1(pgtrace_internal_latency);
 
 PGDLLEXPORT Datum pgtrace_internal_latency(PG_FUNCTION_ARGS)
 {
     FuncCallContext *funcctx;
-    PgTraceLatencyState *state;
+    PgTraceLatencyRow *rows;
 
     if (SRF_IS_FIRSTCALL())
     {
         MemoryContext oldcontext;
         TupleDesc tupdesc;
-        static const int32 upper_ms[PGTRACE_BUCKETS] = {5, 10, 50, 100, 500, -1};
 
         funcctx = SRF_FIRSTCALL_INIT();
         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
@@ -130,38 +240,107 @@ PGDLLEXPORT Datum pgtrace_internal_latency(PG_FUNCTION_ARGS)
 
         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
-        state = palloc0(sizeof(PgTraceLatencyState));
-        memcpy(state->upper_ms, upper_ms, sizeof(upper_ms));
+        rows = palloc(PGTRACE_HIST_BUCKETS * sizeof(PgTraceLatencyRow));
+        funcctx->max_calls = 0;
+        if (pgtrace_metrics)
+            funcctx->max_calls = latency_rows(&pgtrace_metrics->latency, InvalidOid, NULL, rows);
+        funcctx->user_fctx = rows;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    rows = (PgTraceLatencyRow *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[3];
+        bool nulls[3] = {false, false, false};
+        PgTraceLatencyRow *row = &rows[funcctx->call_cntr];
+        HeapTuple tuple;
+
+        values[0] = Float8GetDatum(row->le_ms);
+        values[1] = UInt64GetDatum(row->queries);
+        values[2] = UInt64GetDatum(row->bucket_queries);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_latency_by_database);
+
+PGDLLEXPORT Datum pgtrace_internal_latency_by_database(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceLatencyRow *rows;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint64 count = 0;
+        int i;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_latency_by_database must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        rows = palloc((PGTRACE_HIST_DATABASES + 1) * PGTRACE_HIST_BUCKETS * sizeof(PgTraceLatencyRow));
 
         if (pgtrace_metrics)
         {
-            LWLockAcquire(&pgtrace_metrics->lock, LW_SHARED);
-            memcpy(state->counts, pgtrace_metrics->latency_buckets, sizeof(state->counts));
-            LWLockRelease(&pgtrace_metrics->lock);
+            for (i = 0; i < PGTRACE_HIST_DATABASES; i++)
+            {
+                PgTraceDbHistogram *slot = &pgtrace_metrics->databases[i];
+                Oid datid = pg_atomic_read_u32(&slot->dbid);
+
+                if (!OidIsValid(datid))
+                    continue;
+
+                count += latency_rows(&slot->hist, datid, get_database_name(datid), rows + count);
+            }
+
+            count += latency_rows(&pgtrace_metrics->other_databases, InvalidOid, NULL, rows + count);
         }
 
-        funcctx->user_fctx = state;
-        funcctx->max_calls = PGTRACE_BUCKETS;
+        funcctx->max_calls = count;
+        funcctx->user_fctx = rows;
 
         MemoryContextSwitchTo(oldcontext);
     }
 
     funcctx = SRF_PERCALL_SETUP();
-    state = (PgTraceLatencyState *)funcctx->user_fctx;
+    rows = (PgTraceLatencyRow *)funcctx->user_fctx;
 
     if (funcctx->call_cntr < funcctx->max_calls)
     {
-        Datum values[2];
-        bool nulls[2] = {false, false};
-        int i = funcctx->call_cntr;
+        Datum values[5];
+        bool nulls[5] = {false, false, false, false, false};
+        PgTraceLatencyRow *row = &rows[funcctx->call_cntr];
         HeapTuple tuple;
 
-        if (state->upper_ms[i] < 0)
+        if (OidIsValid(row->datid))
+            values[0] = ObjectIdGetDatum(row->datid);
+        else
             nulls[0] = true;
+
+        if (row->datname)
+            values[1] = PointerGetDatum(cstring_to_text(row->datname));
         else
-            values[0] = Int32GetDatum(state->upper_ms[i]);
+            nulls[1] = true;
 
-        values[1] = UInt64GetDatum(state->counts[i]);
+        values[2] = Float8GetDatum(row->le_ms);
+        values[3] = UInt64GetDatum(row->queries);
+        values[4] = UInt64GetDatum(row->bucket_queries);
 
         tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
         SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
@@ -170,6 +349,59 @@ PGDLLEXPORT Datum pgtrace_internal_latency(PG_FUNCTION_ARGS)
     SRF_RETURN_DONE(funcctx);
 }
 
+PG_FUNCTION_INFO_V1(pgtrace_latency_quantile);
+
+/*
+ * pgtrace_latency_quantile(q [, datid]) - interpolated latency quantile in
+ * milliseconds over all databases, or over one database with its own
+ * histogram. NULL when there is no data.
+ */
+PGDLLEXPORT Datum pgtrace_latency_quantile(PG_FUNCTION_ARGS)
+{
+    double q = PG_GETARG_FLOAT8(0);
+    PgTraceHistogram *hist = NULL;
+    PgTraceHistogramSnapshot snap;
+    double us;
+
+    if (q < 0.0 || q > 1.0 || isnan(q))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("quantile must be between 0 and 1")));
+
+    if (!pgtrace_metrics)
+        PG_RETURN_NULL();
+
+    if (PG_NARGS() > 1)
+    {
+        Oid datid = PG_GETARG_OID(1);
+        int i;
+
+        for (i = 0; i < PGTRACE_HIST_DATABASES; i++)
+        {
+            if (pg_atomic_read_u32(&pgtrace_metrics->databases[i].dbid) == datid)
+            {
+                hist = &pgtrace_metrics->databases[i].hist;
+                break;
+            }
+        }
+    }
+    else
+        hist = &pgtrace_metrics->latency;
+
+    if (!hist)
+        PG_RETURN_NULL();
+
+    pgtrace_histogram_read(hist, &snap);
+    us = pgtrace_histogram_quantile(&snap, q);
+    if (us < 0)
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(us / 1000.0);
+}
+
+/* Sliding windows reported by pgtrace_query_stats, in minutes. */
+static const int query_windows[] = {1, 5, 15};
+
 PG_FUNCTION_INFO_V1(pgtrace_internal_query_stats);
 
 PGDLLEXPORT Datum pgtrace_internal_query_stats(PG_FUNCTION_ARGS)
@@ -182,7 +414,7 @@ PGDLLEXPORT Datum pgtrace_internal_query_stats(PG_FUNCTION_ARGS)
     {
         MemoryContext oldcontext;
         TupleDesc tupdesc;
-        uint64 i, j, count;
+        uint64 count;
 
         funcctx = SRF_FIRSTCALL_INIT();
         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
@@ -194,27 +426,8 @@ PGDLLEXPORT Datum pgtrace_internal_query_stats(PG_FUNCTION_ARGS)
 
         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
-        count = 0;
         snapshot = palloc0(PGTRACE_MAX_QUERIES * sizeof(QueryStats));
-
-        if (pgtrace_query_hash)
-        {
-            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_query_hash");
-            LWLockAcquire(&lock->lock, LW_SHARED);
-
-            for (i = 0, j = 0; i < PGTRACE_HASH_TABLE_SIZE && j < PGTRACE_MAX_QUERIES; i++)
-            {
-                QueryStats *entry = &pgtrace_query_hash->entries[i];
-                if (entry->valid)
-                {
-                    memcpy(&snapshot[j], entry, sizeof(QueryStats));
-                    j++;
-                    count++;
-                }
-            }
-
-            LWLockRelease(&lock->lock);
-        }
+        count = pgtrace_hash_snapshot(snapshot, PGTRACE_MAX_QUERIES);
 
         funcctx->user_fctx = snapshot;
         num_entries_ptr = palloc(sizeof(uint64));
@@ -229,15 +442,16 @@ PGDLLEXPORT Datum pgtrace_internal_query_stats(PG_FUNCTION_ARGS)
 
     if (funcctx->call_cntr < funcctx->max_calls)
     {
-        Datum values[19];
-        bool nulls[19] = {false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false};
+        Datum values[34];
+        bool nulls[34] = {false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false, false};
         HeapTuple tuple;
         QueryStats *entry = &snapshot[funcctx->call_cntr];
+        TimestampTz now = GetCurrentTimestamp();
         double avg_time_ms;
         double scan_ratio;
-        double p95_ms = 0.0;
-        double p99_ms = 0.0;
-        uint32 sample_count = entry->sample_count;
+        double p95_ms;
+        double p99_ms;
+        int i;
 
         values[0] = UInt64GetDatum(entry->fingerprint);
         values[1] = UInt64GetDatum(entry->calls);
@@ -269,19 +483,184 @@ PGDLLEXPORT Datum pgtrace_internal_query_stats(PG_FUNCTION_ARGS)
         values[16] = PointerGetDatum(cstring_to_text(entry->last_request_id));
         MemoryContextSwitchTo(oldcxt);
 
-        if (sample_count > 0)
-        {
-            double *samples = palloc(sizeof(double) * sample_count);
-            memcpy(samples, entry->latency_samples, sizeof(double) * sample_count);
-            qsort(samples, sample_count, sizeof(double), compare_doubles);
-            p95_ms = calculate_percentile(samples, sample_count, 95.0);
-            p99_ms = calculate_percentile(samples, sample_count, 99.0);
-            pfree(samples);
-        }
+        pgtrace_query_percentiles(entry, &p95_ms, &p99_ms);
 
         values[17] = Float8GetDatum(p95_ms);
         values[18] = Float8GetDatum(p99_ms);
 
+        values[19] = Float8GetDatum(entry->baseline_mean_ms);
+        values[20] = Float8GetDatum(sqrt(entry->baseline_var));
+        values[21] = UInt64GetDatum(entry->anomalous_calls);
+
+        for (i = 0; i < lengthof(query_windows); i++)
+        {
+            QueryWindowStats window;
+            int col = 22 + 4 * i;
+
+            pgtrace_window_read(&entry->window, now, query_windows[i], &window);
+
+            values[col] = Float8GetDatum(window.calls_per_sec);
+            values[col + 1] = Float8GetDatum(window.errors_per_sec);
+            values[col + 2] = Float8GetDatum(window.mean_ms);
+            values[col + 3] = Float8GetDatum(window.p99_ms);
+            nulls[col + 2] = isnan(window.mean_ms);
+            nulls[col + 3] = isnan(window.p99_ms);
+        }
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_query_breakdown);
+
+PGDLLEXPORT Datum pgtrace_internal_query_breakdown(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    QueryBreakdownRow *snapshot;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_query_breakdown must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        funcctx->max_calls = pgtrace_hash_breakdown_snapshot(&snapshot);
+        funcctx->user_fctx = snapshot;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    snapshot = (QueryBreakdownRow *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[8];
+        bool nulls[8] = {false, false, false, false, false, false, false, false};
+        HeapTuple tuple;
+        QueryBreakdownRow *row = &snapshot[funcctx->call_cntr];
+        char *user_name;
+        char *db_name;
+
+        /* Names are resolved here so the hot path only stores OIDs. */
+        user_name = OidIsValid(row->slot.userid) ? GetUserNameFromId(row->slot.userid, true) : NULL;
+        db_name = OidIsValid(row->slot.dbid) ? get_database_name(row->slot.dbid) : NULL;
+
+        values[0] = UInt64GetDatum(row->fingerprint);
+
+        if (user_name)
+            values[1] = PointerGetDatum(cstring_to_text(user_name));
+        else
+            nulls[1] = true;
+
+        if (db_name)
+            values[2] = PointerGetDatum(cstring_to_text(db_name));
+        else
+            nulls[2] = true;
+
+        values[3] = PointerGetDatum(cstring_to_text(row->slot.app_name));
+        values[4] = UInt64GetDatum(row->slot.calls);
+        values[5] = UInt64GetDatum(row->slot.calls_error);
+        values[6] = Float8GetDatum(row->slot.total_time_ms);
+        values[7] = Float8GetDatum(row->slot.time_error_ms);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_capacity);
+
+PGDLLEXPORT Datum pgtrace_internal_capacity(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[10];
+    bool nulls[10] = {false, false, false, false, false, false, false, false, false, false};
+    QueryCapacityStats stats;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("pgtrace_internal_capacity must be called in a context that accepts a record")));
+
+    pgtrace_hash_capacity_stats(&stats);
+
+    values[0] = UInt64GetDatum(stats.tracked);
+    values[1] = Int64GetDatum(PGTRACE_MAX_QUERIES);
+    values[2] = UInt64GetDatum(stats.total_calls);
+    values[3] = Float8GetDatum(stats.total_time_ms);
+    values[4] = UInt64GetDatum(stats.untracked_calls);
+    values[5] = Float8GetDatum(stats.untracked_time_ms);
+
+    if (stats.total_time_ms > 0)
+        values[6] = Float8GetDatum(100.0 * stats.untracked_time_ms / stats.total_time_ms);
+    else
+        values[6] = Float8GetDatum(0.0);
+
+    values[7] = UInt64GetDatum(stats.promotions);
+    values[8] = UInt64GetDatum(stats.sketch_agings);
+    values[9] = TimestampTzGetDatum(stats.stats_since);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_untracked_queries);
+
+PGDLLEXPORT Datum pgtrace_internal_untracked_queries(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    QueryCandidate *snapshot;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_untracked_queries must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        snapshot = palloc(PGTRACE_CANDIDATES * sizeof(QueryCandidate));
+        funcctx->max_calls = pgtrace_hash_candidates_snapshot(snapshot);
+        funcctx->user_fctx = snapshot;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    snapshot = (QueryCandidate *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[3];
+        bool nulls[3] = {false, false, false};
+        HeapTuple tuple;
+        QueryCandidate *entry = &snapshot[funcctx->call_cntr];
+
+        values[0] = UInt64GetDatum(entry->fingerprint);
+        values[1] = UInt64GetDatum(entry->est_calls);
+        values[2] = Float8GetDatum(entry->est_time_ms);
+
         tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
         SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
     }
@@ -297,27 +676,176 @@ PGDLLEXPORT Datum pgtrace_query_count(PG_FUNCTION_ARGS)
     PG_RETURN_INT64(count);
 }
 
+PG_FUNCTION_INFO_V1(pgtrace_fingerprint);
+
+PGDLLEXPORT Datum pgtrace_fingerprint(PG_FUNCTION_ARGS)
+{
+    char *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+    PG_RETURN_INT64((int64)pgtrace_compute_fingerprint(query));
+}
+
+static const char *const component_names[PGTRACE_NUM_COMPONENTS] = {
+    "metrics",
+    "queries",
+    "errors",
+    "slow_queries",
+    "audit",
+    "ash",
+    "plans",
+    "xact",
+    "imported",
+};
+
+static void
+metrics_reset(void)
+{
+    int i;
+
+    pg_atomic_write_u64(&pgtrace_metrics->queries_total, 0);
+    pg_atomic_write_u64(&pgtrace_metrics->queries_failed, 0);
+    pg_atomic_write_u64(&pgtrace_metrics->slow_queries, 0);
+    pg_atomic_write_u64(&pgtrace_metrics->queries_cancelled, 0);
+    pg_atomic_write_u64(&pgtrace_metrics->parallel_queries, 0);
+    pg_atomic_write_u64(&pgtrace_metrics->workers_planned, 0);
+    pg_atomic_write_u64(&pgtrace_metrics->workers_launched, 0);
+    pgtrace_histogram_reset(&pgtrace_metrics->latency);
+    for (i = 0; i < PGTRACE_HIST_DATABASES; i++)
+        pgtrace_histogram_reset(&pgtrace_metrics->databases[i].hist);
+    pgtrace_histogram_reset(&pgtrace_metrics->other_databases);
+    pgtrace_metrics->start_time = GetCurrentTimestamp();
+}
+
+/*
+ * Clear one component. Each table that statements record into either swaps
+ * in a new generation or is small enough to clear under its lock, so
+ * recording backends wait for at most a few hundred kilobytes of memset.
+ * The imported table is the exception at about 10 MB, but only merges and
+ * its own views take that lock, never a statement being recorded.
+ */
+static void
+reset_component(PgTraceComponent component)
+{
+    if (!pgtrace_metrics)
+        return;
+
+    switch (component)
+    {
+    case PGTRACE_COMPONENT_METRICS:
+        metrics_reset();
+        break;
+    case PGTRACE_COMPONENT_QUERIES:
+        pgtrace_hash_reset();
+        break;
+    case PGTRACE_COMPONENT_ERRORS:
+        pgtrace_error_reset();
+        break;
+    case PGTRACE_COMPONENT_SLOW_QUERIES:
+        if (pgtrace_slow_query_buffer)
+            pgtrace_ring_reset(&pgtrace_slow_query_buffer->ring);
+        pgtrace_slow_capture_reset();
+        break;
+    case PGTRACE_COMPONENT_AUDIT:
+        if (pgtrace_audit_buffer)
+            pgtrace_ring_reset(&pgtrace_audit_buffer->ring);
+        break;
+    case PGTRACE_COMPONENT_ASH:
+        pgtrace_ash_reset();
+        break;
+    case PGTRACE_COMPONENT_PLANS:
+        pgtrace_plans_reset();
+        break;
+    case PGTRACE_COMPONENT_XACT:
+        pgtrace_xact_reset();
+        break;
+    case PGTRACE_COMPONENT_IMPORTED:
+        pgtrace_imported_reset();
+        break;
+    case PGTRACE_NUM_COMPONENTS:
+        return;
+    }
+
+    SpinLockAcquire(&pgtrace_metrics->reset_mutex);
+    pgtrace_metrics->stats_since[component] = GetCurrentTimestamp();
+    pgtrace_metrics->resets[component]++;
+    SpinLockRelease(&pgtrace_metrics->reset_mutex);
+}
+
 PG_FUNCTION_INFO_V1(pgtrace_reset);
 
 PGDLLEXPORT Datum pgtrace_reset(PG_FUNCTION_ARGS)
 {
-    pgtrace_hash_reset();
+    int i;
+
+    for (i = 0; i < PGTRACE_NUM_COMPONENTS; i++)
+        reset_component((PgTraceComponent)i);
     PG_RETURN_VOID();
 }
 
-PG_FUNCTION_INFO_V1(pgtrace_internal_failing_queries);
+PG_FUNCTION_INFO_V1(pgtrace_reset_component);
 
-PGDLLEXPORT Datum pgtrace_internal_failing_queries(PG_FUNCTION_ARGS)
+PGDLLEXPORT Datum pgtrace_reset_component(PG_FUNCTION_ARGS)
+{
+    char *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    int i;
+
+    for (i = 0; i < PGTRACE_NUM_COMPONENTS; i++)
+    {
+        if (strcmp(name, component_names[i]) == 0)
+        {
+            reset_component((PgTraceComponent)i);
+            PG_RETURN_VOID();
+        }
+    }
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("unknown pgtrace component \"%s\"", name),
+             errhint("Valid components are metrics, queries, errors, slow_queries, audit, ash, plans, xact and imported.")));
+    PG_RETURN_VOID();
+}
+
+/*
+ * Forget one fingerprint's statistics, errors, plans and slow-query sample,
+ * so its rates restart from a fresh first_seen. Returns whether anything
+ * was tracked.
+ */
+PG_FUNCTION_INFO_V1(pgtrace_reset_query);
+
+PGDLLEXPORT Datum pgtrace_reset_query(PG_FUNCTION_ARGS)
+{
+    uint64 fingerprint = (uint64)PG_GETARG_INT64(0);
+    bool found = false;
+
+    if (pgtrace_hash_reset_entry(fingerprint))
+        found = true;
+    if (pgtrace_error_reset_fingerprint(fingerprint) > 0)
+        found = true;
+    if (pgtrace_plans_reset_fingerprint(fingerprint) > 0)
+        found = true;
+    if (pgtrace_slow_capture_reset_fingerprint(fingerprint))
+        found = true;
+
+    PG_RETURN_BOOL(found);
+}
+
+typedef struct PgTraceResetRow
+{
+    TimestampTz stats_since;
+    uint64 resets;
+} PgTraceResetRow;
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_stats_resets);
+
+PGDLLEXPORT Datum pgtrace_internal_stats_resets(PG_FUNCTION_ARGS)
 {
     FuncCallContext *funcctx;
-    ErrorTrackEntry *snapshot;
-    uint32 *num_entries_ptr;
+    PgTraceResetRow *rows;
 
     if (SRF_IS_FIRSTCALL())
     {
         MemoryContext oldcontext;
         TupleDesc tupdesc;
-        uint32 i, j, count;
 
         funcctx = SRF_FIRSTCALL_INIT();
         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
@@ -325,32 +853,78 @@ PGDLLEXPORT Datum pgtrace_internal_failing_queries(PG_FUNCTION_ARGS)
         if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
             ereport(ERROR,
                     (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                     errmsg("pgtrace_internal_failing_queries must be called in a context that accepts a record")));
+                     errmsg("pgtrace_internal_stats_resets must be called in a context that accepts a record")));
 
         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
-        count = 0;
-        snapshot = palloc0(PGTRACE_ERROR_BUFFER_SIZE * sizeof(ErrorTrackEntry));
+        rows = palloc0(PGTRACE_NUM_COMPONENTS * sizeof(PgTraceResetRow));
 
-        if (pgtrace_error_buffer)
+        if (pgtrace_metrics)
         {
-            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_error_track");
-            LWLockAcquire(&lock->lock, LW_SHARED);
+            int i;
 
-            for (i = 0, j = 0; i < pgtrace_error_buffer->num_entries; i++)
+            SpinLockAcquire(&pgtrace_metrics->reset_mutex);
+            for (i = 0; i < PGTRACE_NUM_COMPONENTS; i++)
             {
-                ErrorTrackEntry *entry = &pgtrace_error_buffer->entries[i];
-                if (entry->valid)
-                {
-                    memcpy(&snapshot[j], entry, sizeof(ErrorTrackEntry));
-                    j++;
-                    count++;
-                }
+                rows[i].stats_since = pgtrace_metrics->stats_since[i];
+                rows[i].resets = pgtrace_metrics->resets[i];
             }
-
-            LWLockRelease(&lock->lock);
+            SpinLockRelease(&pgtrace_metrics->reset_mutex);
+            funcctx->max_calls = PGTRACE_NUM_COMPONENTS;
         }
 
+        funcctx->user_fctx = rows;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    rows = (PgTraceResetRow *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[3];
+        bool nulls[3] = {false, false, false};
+        HeapTuple tuple;
+        uint64 i = funcctx->call_cntr;
+
+        values[0] = CStringGetTextDatum(component_names[i]);
+        values[1] = TimestampTzGetDatum(rows[i].stats_since);
+        values[2] = UInt64GetDatum(rows[i].resets);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_failing_queries);
+
+PGDLLEXPORT Datum pgtrace_internal_failing_queries(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    ErrorTrackEntry *snapshot;
+    uint32 *num_entries_ptr;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_failing_queries must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        snapshot = palloc0(PGTRACE_ERROR_BUFFER_SIZE * sizeof(ErrorTrackEntry));
+        count = pgtrace_error_snapshot(snapshot, PGTRACE_ERROR_BUFFER_SIZE);
+
         funcctx->user_fctx = snapshot;
         num_entries_ptr = palloc(sizeof(uint32));
         *num_entries_ptr = count;
@@ -369,15 +943,12 @@ PGDLLEXPORT Datum pgtrace_internal_failing_queries(PG_FUNCTION_ARGS)
         bool nulls[4] = {false, false, false, false};
         HeapTuple tuple;
         ErrorTrackEntry *entry = &snapshot[funcctx->call_cntr];
-        char sqlstate_str[6];
         MemoryContext oldcxt;
 
         values[0] = UInt64GetDatum(entry->fingerprint);
 
-        snprintf(sqlstate_str, sizeof(sqlstate_str), "%05u", entry->sqlstate);
-
         oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-        values[1] = PointerGetDatum(cstring_to_text(sqlstate_str));
+        values[1] = PointerGetDatum(cstring_to_text(unpack_sql_state((int)entry->sqlstate)));
         MemoryContextSwitchTo(oldcxt);
 
         values[2] = UInt64GetDatum(entry->error_count);
@@ -402,7 +973,7 @@ PGDLLEXPORT Datum pgtrace_internal_slow_queries(PG_FUNCTION_ARGS)
     {
         MemoryContext oldcontext;
         TupleDesc tupdesc;
-        uint32 i, j, count;
+        uint32 count;
 
         funcctx = SRF_FIRSTCALL_INIT();
         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
@@ -414,27 +985,8 @@ PGDLLEXPORT Datum pgtrace_internal_slow_queries(PG_FUNCTION_ARGS)
 
         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
-        count = 0;
         snapshot = palloc0(PGTRACE_SLOW_QUERY_BUFFER_SIZE * sizeof(SlowQueryEntry));
-
-        if (pgtrace_slow_query_buffer)
-        {
-            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_slow_query");
-            LWLockAcquire(&lock->lock, LW_SHARED);
-
-            for (i = 0, j = 0; i < PGTRACE_SLOW_QUERY_BUFFER_SIZE; i++)
-            {
-                SlowQueryEntry *entry = &pgtrace_slow_query_buffer->entries[i];
-                if (entry->valid)
-                {
-                    memcpy(&snapshot[j], entry, sizeof(SlowQueryEntry));
-                    j++;
-                    count++;
-                }
-            }
-
-            LWLockRelease(&lock->lock);
-        }
+        count = pgtrace_slow_query_snapshot(snapshot, PGTRACE_SLOW_QUERY_BUFFER_SIZE);
 
         funcctx->user_fctx = snapshot;
         num_entries_ptr = palloc(sizeof(uint32));
@@ -450,16 +1002,21 @@ PGDLLEXPORT Datum pgtrace_internal_slow_queries(PG_FUNCTION_ARGS)
 
     if (funcctx->call_cntr < funcctx->max_calls)
     {
-        Datum values[7];
-        bool nulls[7] = {false, false, false, false, false, false, false};
+        Datum values[6];
+        bool nulls[6] = {false, false, false, false, false, false};
         HeapTuple tuple;
         SlowQueryEntry *entry = &snapshot[funcctx->call_cntr];
+        MemoryContext oldcxt;
 
         values[0] = UInt64GetDatum(entry->fingerprint);
         values[1] = Float8GetDatum(entry->duration_ms);
         values[2] = TimestampTzGetDatum(entry->timestamp);
-        values[3] = CStringGetDatum(entry->application_name);
-        values[4] = CStringGetDatum(entry->user);
+
+        oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        values[3] = PointerGetDatum(cstring_to_text(entry->application_name));
+        values[4] = PointerGetDatum(cstring_to_text(entry->user));
+        MemoryContextSwitchTo(oldcxt);
+
         values[5] = Int64GetDatum(entry->rows_processed);
 
         tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
@@ -469,6 +1026,72 @@ PGDLLEXPORT Datum pgtrace_internal_slow_queries(PG_FUNCTION_ARGS)
     SRF_RETURN_DONE(funcctx);
 }
 
+PG_FUNCTION_INFO_V1(pgtrace_internal_slow_query_samples);
+
+PGDLLEXPORT Datum pgtrace_internal_slow_query_samples(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    SlowQueryCapture *snapshot;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_slow_query_samples must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        funcctx->max_calls = pgtrace_slow_capture_snapshot(&snapshot);
+        funcctx->user_fctx = snapshot;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    snapshot = (SlowQueryCapture *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[9];
+        bool nulls[9] = {false, false, false, false, false, false, false, false, false};
+        HeapTuple tuple;
+        SlowQueryCapture *entry = &snapshot[funcctx->call_cntr];
+        const char *text_start = entry->text;
+        MemoryContext oldcxt;
+
+        values[0] = UInt64GetDatum(entry->fingerprint);
+        values[1] = TimestampTzGetDatum(entry->captured_at);
+        values[2] = Float8GetDatum(entry->duration_ms);
+        values[3] = UInt64GetDatum(entry->captures);
+        values[4] = UInt64GetDatum(entry->suppressed);
+
+        oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        values[5] = PointerGetDatum(cstring_to_text_with_len(text_start, entry->normalized_len));
+        text_start += entry->normalized_len;
+        values[6] = PointerGetDatum(cstring_to_text_with_len(text_start, entry->example_len));
+        text_start += entry->example_len;
+        if (entry->plan_len > 0)
+            values[7] = PointerGetDatum(cstring_to_text_with_len(text_start, entry->plan_len));
+        else
+            nulls[7] = true;
+        MemoryContextSwitchTo(oldcxt);
+
+        values[8] = BoolGetDatum(entry->plan_analyzed);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
 PG_FUNCTION_INFO_V1(pgtrace_internal_audit_events);
 
 PGDLLEXPORT Datum pgtrace_internal_audit_events(PG_FUNCTION_ARGS)
@@ -481,7 +1104,7 @@ PGDLLEXPORT Datum pgtrace_internal_audit_events(PG_FUNCTION_ARGS)
     {
         MemoryContext oldcontext;
         TupleDesc tupdesc;
-        uint32 i, j, count;
+        uint32 count;
 
         funcctx = SRF_FIRSTCALL_INIT();
         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
@@ -493,27 +1116,8 @@ PGDLLEXPORT Datum pgtrace_internal_audit_events(PG_FUNCTION_ARGS)
 
         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
-        count = 0;
         snapshot = palloc0(PGTRACE_AUDIT_BUFFER_SIZE * sizeof(AuditEvent));
-
-        if (pgtrace_audit_buffer)
-        {
-            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_audit");
-            LWLockAcquire(&lock->lock, LW_SHARED);
-
-            for (i = 0, j = 0; i < PGTRACE_AUDIT_BUFFER_SIZE; i++)
-            {
-                AuditEvent *entry = &pgtrace_audit_buffer->entries[i];
-                if (entry->valid)
-                {
-                    memcpy(&snapshot[j], entry, sizeof(AuditEvent));
-                    j++;
-                    count++;
-                }
-            }
-
-            LWLockRelease(&lock->lock);
-        }
+        count = pgtrace_audit_snapshot(snapshot, PGTRACE_AUDIT_BUFFER_SIZE);
 
         funcctx->user_fctx = snapshot;
         num_entries_ptr = palloc(sizeof(uint32));
@@ -533,34 +1137,12 @@ PGDLLEXPORT Datum pgtrace_internal_audit_events(PG_FUNCTION_ARGS)
         bool nulls[7] = {false, false, false, false, false, false, false};
         HeapTuple tuple;
         AuditEvent *entry = &snapshot[funcctx->call_cntr];
-        char op_type_str[32];
         MemoryContext oldcxt;
 
         values[0] = UInt64GetDatum(entry->fingerprint);
 
-        switch (entry->op_type)
-        {
-        case AUDIT_SELECT:
-            snprintf(op_type_str, sizeof(op_type_str), "SELECT");
-            break;
-        case AUDIT_INSERT:
-            snprintf(op_type_str, sizeof(op_type_str), "INSERT");
-            break;
-        case AUDIT_UPDATE:
-            snprintf(op_type_str, sizeof(op_type_str), "UPDATE");
-            break;
-        case AUDIT_DELETE:
-            snprintf(op_type_str, sizeof(op_type_str), "DELETE");
-            break;
-        case AUDIT_DDL:
-            snprintf(op_type_str, sizeof(op_type_str), "DDL");
-            break;
-        default:
-            snprintf(op_type_str, sizeof(op_type_str), "UNKNOWN");
-        }
-
         oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-        values[1] = PointerGetDatum(cstring_to_text(op_type_str));
+        values[1] = PointerGetDatum(cstring_to_text(pgtrace_audit_op_name(entry->op_type)));
         values[2] = PointerGetDatum(cstring_to_text(entry->user));
         values[3] = PointerGetDatum(cstring_to_text(entry->database));
         MemoryContextSwitchTo(oldcxt);
@@ -575,3 +1157,152 @@ PGDLLEXPORT Datum pgtrace_internal_audit_events(PG_FUNCTION_ARGS)
 
     SRF_RETURN_DONE(funcctx);
 }
+
+typedef struct PgTraceRingStat
+{
+    const char *name;
+    uint64 capacity;
+    uint64 written;
+    uint64 overwritten;
+    uint64 dropped;
+} PgTraceRingStat;
+
+#define PGTRACE_NUM_RINGS 4
+
+static void
+fill_ring_stat(PgTraceRingStat *stat, const char *name, PgTraceRing *ring)
+{
+    stat->name = name;
+    stat->capacity = ring->capacity;
+    stat->written = pgtrace_ring_written(ring);
+    stat->overwritten = pgtrace_ring_overwritten(ring);
+    stat->dropped = pgtrace_ring_dropped(ring);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_ring_stats);
+
+PGDLLEXPORT Datum pgtrace_internal_ring_stats(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceRingStat *stats;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_ring_stats must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        stats = palloc0(PGTRACE_NUM_RINGS * sizeof(PgTraceRingStat));
+
+        if (pgtrace_audit_buffer)
+        {
+            /* Audit blocks are reused whole, so the ring head says nothing about overwrites. */
+            fill_ring_stat(&stats[count], "audit", &pgtrace_audit_buffer->ring);
+            stats[count++].overwritten = pgtrace_audit_overwritten();
+        }
+        if (pgtrace_slow_query_buffer)
+            fill_ring_stat(&stats[count++], "slow_query", &pgtrace_slow_query_buffer->ring);
+        if (pgtrace_xact_state)
+            fill_ring_stat(&stats[count++], "xact_spans", &pgtrace_xact_state->ring);
+        if (pgtrace_span_buffer)
+            fill_ring_stat(&stats[count++], "spans", &pgtrace_span_buffer->ring);
+
+        funcctx->user_fctx = stats;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    stats = (PgTraceRingStat *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[5];
+        bool nulls[5] = {false, false, false, false, false};
+        HeapTuple tuple;
+        PgTraceRingStat *stat = &stats[funcctx->call_cntr];
+        MemoryContext oldcxt;
+
+        oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        values[0] = PointerGetDatum(cstring_to_text(stat->name));
+        MemoryContextSwitchTo(oldcxt);
+
+        values[1] = UInt64GetDatum(stat->capacity);
+        values[2] = UInt64GetDatum(stat->written);
+        values[3] = UInt64GetDatum(stat->overwritten);
+        values[4] = UInt64GetDatum(stat->dropped);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_audit_log_stats);
+
+PGDLLEXPORT Datum pgtrace_internal_audit_log_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[8];
+    bool nulls[8] = {false, false, false, false, false, false, false, false};
+    uint64 events_logged = 0;
+    uint64 events_lost = 0;
+    uint64 backlog = 0;
+    uint64 files_written = 0;
+    uint64 bytes_written = 0;
+    TimestampTz last_flush = 0;
+    char current_file[MAXPGPATH] = "";
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("pgtrace_internal_audit_log_stats must be called in a context that accepts a record")));
+
+    if (pgtrace_audit_buffer)
+    {
+        AuditLogState *log = &pgtrace_audit_buffer->log;
+
+        events_lost = pg_atomic_read_u64(&log->lost);
+        if (pgtrace_audit_log)
+            backlog = pgtrace_audit_backlog();
+
+        SpinLockAcquire(&log->mutex);
+        events_logged = log->events_logged;
+        files_written = log->files_written;
+        bytes_written = log->bytes_written;
+        last_flush = log->last_flush;
+        strlcpy(current_file, log->current_file, sizeof(current_file));
+        SpinLockRelease(&log->mutex);
+    }
+
+    values[0] = BoolGetDatum(pgtrace_audit_log);
+    values[1] = UInt64GetDatum(events_logged);
+    values[2] = UInt64GetDatum(events_lost);
+    values[3] = UInt64GetDatum(backlog);
+    values[4] = UInt64GetDatum(files_written);
+    values[5] = UInt64GetDatum(bytes_written);
+
+    if (current_file[0] != '\0')
+        values[6] = PointerGetDatum(cstring_to_text(current_file));
+    else
+        nulls[6] = true;
+
+    if (last_flush != 0)
+        values[7] = TimestampTzGetDatum(last_flush);
+    else
+        nulls[7] = true;
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,469 @@
+#include <postgres.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <lib/stringinfo.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+#define OPENMETRICS_REQUEST_MAX 4096
+#define OPENMETRICS_IO_TIMEOUT_MS 1000
+#define OPENMETRICS_BACKLOG 16
+
+typedef struct OpenMetricsServer
+{
+    pgsocket listen_fd;
+    bool unix_socket;
+    StringInfoData cache;
+    TimestampTz rendered_at;
+    uint64 renders;
+    uint64 scrapes;
+} OpenMetricsServer;
+
+static OpenMetricsServer server = {.listen_fd = PGINVALID_SOCKET};
+
+void pgtrace_openmetrics_register(void)
+{
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgtrace");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgtrace_openmetrics_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pgtrace metrics exporter");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pgtrace metrics exporter");
+
+    RegisterBackgroundWorker(&worker);
+}
+
+static void
+openmetrics_listen(void)
+{
+    pgsocket fd;
+
+    if (pgtrace_metrics_socket && pgtrace_metrics_socket[0] != '\0')
+    {
+        struct sockaddr_un addr;
+
+        if (strlen(pgtrace_metrics_socket) >= sizeof(addr.sun_path))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("metrics socket path \"%s\" is too long", pgtrace_metrics_socket)));
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strlcpy(addr.sun_path, pgtrace_metrics_socket, sizeof(addr.sun_path));
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == PGINVALID_SOCKET)
+            ereport(ERROR,
+                    (errcode_for_socket_access(),
+                     errmsg("could not create metrics socket: %m")));
+
+        /* A socket file left behind by a previous worker would make bind fail. */
+        (void)unlink(pgtrace_metrics_socket);
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            ereport(ERROR,
+                    (errcode_for_socket_access(),
+                     errmsg("could not bind metrics socket \"%s\": %m", pgtrace_metrics_socket)));
+
+        if (chmod(pgtrace_metrics_socket, 0770) < 0)
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not set permissions of metrics socket \"%s\": %m",
+                            pgtrace_metrics_socket)));
+
+        server.unix_socket = true;
+    }
+    else
+    {
+        struct sockaddr_in addr;
+        int one = 1;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16)pgtrace_metrics_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == PGINVALID_SOCKET)
+            ereport(ERROR,
+                    (errcode_for_socket_access(),
+                     errmsg("could not create metrics socket: %m")));
+
+        (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            ereport(ERROR,
+                    (errcode_for_socket_access(),
+                     errmsg("could not bind metrics port %d on 127.0.0.1: %m", pgtrace_metrics_port)));
+    }
+
+    if (listen(fd, OPENMETRICS_BACKLOG) < 0)
+        ereport(ERROR,
+                (errcode_for_socket_access(),
+                 errmsg("could not listen on metrics socket: %m")));
+
+    if (!pg_set_noblock(fd))
+        ereport(ERROR,
+                (errcode_for_socket_access(),
+                 errmsg("could not set metrics socket to nonblocking mode: %m")));
+
+    server.listen_fd = fd;
+}
+
+static void
+openmetrics_close(int code, Datum arg)
+{
+    if (server.listen_fd != PGINVALID_SOCKET)
+    {
+        closesocket(server.listen_fd);
+        server.listen_fd = PGINVALID_SOCKET;
+
+        if (server.unix_socket)
+            (void)unlink(pgtrace_metrics_socket);
+    }
+}
+
+static void
+render_counter(StringInfo buf, const char *name, const char *help, uint64 value)
+{
+    appendStringInfo(buf, "# TYPE %s counter\n# HELP %s %s\n%s_total " UINT64_FORMAT "\n",
+                     name, name, help, name, value);
+}
+
+static void
+render_gauge(StringInfo buf, const char *name, const char *help, double value)
+{
+    appendStringInfo(buf, "# TYPE %s gauge\n# HELP %s %s\n%s %.6f\n",
+                     name, name, help, name, value);
+}
+
+/*
+ * One histogram series. Only power-of-two boundaries are exported, which
+ * keeps a scrape to 32 buckets per series; the SQL views have the full
+ * resolution.
+ */
+static void
+render_histogram_series(StringInfo buf, const char *name, const char *labels,
+                        PgTraceHistogram *hist)
+{
+    PgTraceHistogramSnapshot snap;
+    const char *sep = labels[0] != '\0' ? "," : "";
+    uint64 cumulative = 0;
+    int i;
+
+    pgtrace_histogram_read(hist, &snap);
+
+    for (i = 0; i < PGTRACE_HIST_BUCKETS - 1; i++)
+    {
+        cumulative += snap.buckets[i];
+
+        if ((i + 1) % PGTRACE_HIST_SUB_BUCKETS != 0)
+            continue;
+
+        appendStringInfo(buf, "%s_bucket{%s%sle=\"%.6f\"} " UINT64_FORMAT "\n",
+                         name, labels, sep,
+                         (double)pgtrace_histogram_upper_us(i) / 1000000.0, cumulative);
+    }
+
+    appendStringInfo(buf, "%s_bucket{%s%sle=\"+Inf\"} " UINT64_FORMAT "\n",
+                     name, labels, sep, snap.count);
+
+    if (labels[0] != '\0')
+    {
+        appendStringInfo(buf, "%s_count{%s} " UINT64_FORMAT "\n", name, labels, snap.count);
+        appendStringInfo(buf, "%s_sum{%s} %.6f\n", name, labels, (double)snap.sum_us / 1000000.0);
+    }
+    else
+    {
+        appendStringInfo(buf, "%s_count " UINT64_FORMAT "\n", name, snap.count);
+        appendStringInfo(buf, "%s_sum %.6f\n", name, (double)snap.sum_us / 1000000.0);
+    }
+}
+
+static void
+render_ring(StringInfo buf, const char *ring_name, PgTraceRing *ring, bool dropped)
+{
+    appendStringInfo(buf, "%s{ring=\"%s\"} " UINT64_FORMAT "\n",
+                     dropped ? "pgtrace_ring_events_dropped_total" : "pgtrace_ring_events_total",
+                     ring_name,
+                     dropped ? pgtrace_ring_dropped(ring) : pgtrace_ring_written(ring));
+}
+
+static void
+openmetrics_render(StringInfo buf)
+{
+    QueryCapacityStats capacity;
+    int i;
+
+    resetStringInfo(buf);
+
+    if (pgtrace_metrics)
+    {
+        render_counter(buf, "pgtrace_queries", "Statements executed",
+                       pg_atomic_read_u64(&pgtrace_metrics->queries_total));
+        render_counter(buf, "pgtrace_queries_failed", "Statements that raised an error",
+                       pg_atomic_read_u64(&pgtrace_metrics->queries_failed));
+        render_counter(buf, "pgtrace_queries_cancelled", "Statements cancelled by timeout or request",
+                       pg_atomic_read_u64(&pgtrace_metrics->queries_cancelled));
+        render_counter(buf, "pgtrace_slow_queries", "Statements slower than pgtrace.slow_query_ms",
+                       pg_atomic_read_u64(&pgtrace_metrics->slow_queries));
+        render_counter(buf, "pgtrace_parallel_queries", "Statements that ran a Gather or Gather Merge",
+                       pg_atomic_read_u64(&pgtrace_metrics->parallel_queries));
+        render_counter(buf, "pgtrace_parallel_workers_planned", "Parallel workers requested by plans",
+                       pg_atomic_read_u64(&pgtrace_metrics->workers_planned));
+        render_counter(buf, "pgtrace_parallel_workers_launched", "Parallel workers actually launched",
+                       pg_atomic_read_u64(&pgtrace_metrics->workers_launched));
+
+        appendStringInfoString(buf,
+                               "# TYPE pgtrace_query_duration_seconds histogram\n"
+                               "# HELP pgtrace_query_duration_seconds Executor time per statement\n");
+        render_histogram_series(buf, "pgtrace_query_duration_seconds", "", &pgtrace_metrics->latency);
+
+        appendStringInfoString(buf,
+                               "# TYPE pgtrace_database_query_duration_seconds histogram\n"
+                               "# HELP pgtrace_database_query_duration_seconds Executor time per statement by database OID\n");
+        for (i = 0; i < PGTRACE_HIST_DATABASES; i++)
+        {
+            PgTraceDbHistogram *slot = &pgtrace_metrics->databases[i];
+            uint32 dbid = pg_atomic_read_u32(&slot->dbid);
+            char labels[32];
+
+            if (dbid == InvalidOid)
+                continue;
+
+            snprintf(labels, sizeof(labels), "datid=\"%u\"", dbid);
+            render_histogram_series(buf, "pgtrace_database_query_duration_seconds", labels, &slot->hist);
+        }
+        render_histogram_series(buf, "pgtrace_database_query_duration_seconds", "datid=\"other\"",
+                                &pgtrace_metrics->other_databases);
+
+        render_gauge(buf, "pgtrace_start_time_seconds", "Time statistics collection started",
+                     (double)timestamptz_to_time_t(pgtrace_metrics->start_time));
+    }
+
+    pgtrace_hash_capacity_stats(&capacity);
+    render_gauge(buf, "pgtrace_tracked_queries", "Fingerprints in the query table",
+                 (double)capacity.tracked);
+    render_gauge(buf, "pgtrace_max_queries", "Capacity of the query table",
+                 (double)PGTRACE_MAX_QUERIES);
+    appendStringInfo(buf,
+                     "# TYPE pgtrace_untracked_queries counter\n"
+                     "# HELP pgtrace_untracked_queries Statements whose fingerprint did not fit the query table\n"
+                     "pgtrace_untracked_queries_total " UINT64_FORMAT "\n"
+                     "# TYPE pgtrace_untracked_query_seconds counter\n"
+                     "# HELP pgtrace_untracked_query_seconds Executor time of statements outside the query table\n"
+                     "pgtrace_untracked_query_seconds_total %.6f\n",
+                     capacity.untracked_calls, capacity.untracked_time_ms / 1000.0);
+
+    appendStringInfoString(buf,
+                           "# TYPE pgtrace_ring_events counter\n"
+                           "# HELP pgtrace_ring_events Events written to an event ring\n");
+    if (pgtrace_audit_buffer)
+        render_ring(buf, "audit", &pgtrace_audit_buffer->ring, false);
+    if (pgtrace_slow_query_buffer)
+        render_ring(buf, "slow_query", &pgtrace_slow_query_buffer->ring, false);
+
+    appendStringInfoString(buf,
+                           "# TYPE pgtrace_ring_events_dropped counter\n"
+                           "# HELP pgtrace_ring_events_dropped Events dropped because their ring slot was busy\n");
+    if (pgtrace_audit_buffer)
+        render_ring(buf, "audit", &pgtrace_audit_buffer->ring, true);
+    if (pgtrace_slow_query_buffer)
+        render_ring(buf, "slow_query", &pgtrace_slow_query_buffer->ring, true);
+
+    server.renders++;
+    render_counter(buf, "pgtrace_exporter_renders", "Times the exporter rebuilt its output",
+                   server.renders);
+    render_counter(buf, "pgtrace_exporter_scrapes", "Requests served by the exporter",
+                   server.scrapes);
+
+    appendStringInfoString(buf, "# EOF\n");
+}
+
+static bool
+openmetrics_send(pgsocket client, const char *data, Size len)
+{
+    int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+
+    while (len > 0)
+    {
+        ssize_t sent = send(client, data, len, flags);
+
+        if (sent <= 0)
+            return false;
+
+        data += sent;
+        len -= sent;
+    }
+
+    return true;
+}
+
+static void
+openmetrics_respond(pgsocket client, const char *status, const char *content_type,
+                    const char *body, Size body_len)
+{
+    char header[256];
+    int header_len;
+
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: %s\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n"
+                          "\r\n",
+                          status, content_type, body_len);
+
+    if (openmetrics_send(client, header, header_len) && body_len > 0)
+        (void)openmetrics_send(client, body, body_len);
+}
+
+/*
+ * Serve one request. Clients are local scrapers, so the request is handled
+ * inline with socket timeouts bounding how long a stalled client can hold
+ * the worker.
+ */
+static void
+openmetrics_serve(pgsocket client)
+{
+    char request[OPENMETRICS_REQUEST_MAX];
+    struct timeval timeout;
+    Size len = 0;
+    char *path;
+    char *path_end;
+    TimestampTz now;
+
+    timeout.tv_sec = OPENMETRICS_IO_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (OPENMETRICS_IO_TIMEOUT_MS % 1000) * 1000;
+    (void)setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    (void)setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    while (len < sizeof(request) - 1)
+    {
+        ssize_t n = recv(client, request + len, sizeof(request) - 1 - len, 0);
+
+        if (n <= 0)
+            return;
+
+        len += n;
+        request[len] = '\0';
+
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            break;
+    }
+    request[len] = '\0';
+
+    if (strncmp(request, "GET ", 4) != 0)
+    {
+        openmetrics_respond(client, "405 Method Not Allowed", "text/plain", "", 0);
+        return;
+    }
+
+    path = request + 4;
+    path_end = path + strcspn(path, " ?\r\n");
+
+    if (path_end - path != 8 || strncmp(path, "/metrics", 8) != 0)
+    {
+        openmetrics_respond(client, "404 Not Found", "text/plain", "", 0);
+        return;
+    }
+
+    server.scrapes++;
+
+    now = GetCurrentTimestamp();
+    if (server.renders == 0 ||
+        TimestampDifferenceExceeds(server.rendered_at, now, pgtrace_metrics_cache_ttl))
+    {
+        openmetrics_render(&server.cache);
+        server.rendered_at = now;
+    }
+
+    openmetrics_respond(client, "200 OK", PGTRACE_OPENMETRICS_CONTENT_TYPE,
+                        server.cache.data, server.cache.len);
+}
+
+void pgtrace_openmetrics_main(Datum main_arg)
+{
+    MemoryContext oldcxt;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+    BackgroundWorkerUnblockSignals();
+
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    initStringInfo(&server.cache);
+    MemoryContextSwitchTo(oldcxt);
+
+    on_proc_exit(openmetrics_close, (Datum)0);
+    openmetrics_listen();
+
+    ereport(LOG,
+            (errmsg("pgtrace metrics exporter listening on %s%s",
+                    server.unix_socket ? "" : "127.0.0.1:",
+                    server.unix_socket ? pgtrace_metrics_socket
+                                       : psprintf("%d", pgtrace_metrics_port))));
+
+    while (!ShutdownRequestPending)
+    {
+        int rc;
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        rc = WaitLatchOrSocket(MyLatch,
+                               WL_LATCH_SET | WL_SOCKET_READABLE | WL_EXIT_ON_PM_DEATH,
+                               server.listen_fd, -1L,
+                               PG_WAIT_EXTENSION);
+
+        if (rc & WL_LATCH_SET)
+            ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (rc & WL_SOCKET_READABLE)
+        {
+            for (;;)
+            {
+                pgsocket client = accept(server.listen_fd, NULL, NULL);
+
+                if (client == PGINVALID_SOCKET)
+                    break;
+
+                /* Some platforms hand out sockets that inherit O_NONBLOCK. */
+                if (pg_set_block(client))
+                    openmetrics_serve(client);
+
+                closesocket(client);
+
+                if (ShutdownRequestPending)
+                    break;
+            }
+        }
+    }
+
+    proc_exit(0);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+
+/*
+ * OpenMetrics exporter. A background worker answers "GET /metrics" on
+ * 127.0.0.1:pgtrace.metrics_port, or on the Unix socket
+ * pgtrace.metrics_socket, with text rendered directly from shared memory.
+ * A render is reused for pgtrace.metrics_cache_ttl so that several
+ * scrapers cost one render.
+ */
+#define PGTRACE_OPENMETRICS_CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+void pgtrace_openmetrics_register(void);
+PGDLLEXPORT void pgtrace_openmetrics_main(Datum main_arg);
@@ -39,11 +39,25 @@ void _PG_init(void)
     prev_shmem_startup_hook = shmem_startup_hook;
     shmem_startup_hook = pgtrace_shmem_startup_hook;
     pgtrace_init_hooks();
+    pgtrace_xact_init();
+
+    if (pgtrace_audit_log)
+        pgtrace_audit_log_register();
+
+    if (pgtrace_metrics_port > 0 || (pgtrace_metrics_socket && pgtrace_metrics_socket[0] != '\0'))
+        pgtrace_openmetrics_register();
+
+    if (pgtrace_ash)
+        pgtrace_ash_register();
+
+    if (pgtrace_span_export)
+        pgtrace_span_export_register();
 }
 
 void _PG_fini(void)
 {
     pgtrace_remove_hooks();
+    pgtrace_xact_fini();
 
     shmem_request_hook = prev_shmem_request_hook;
     shmem_startup_hook = prev_shmem_startup_hook;
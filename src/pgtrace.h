@@ -4,17 +4,44 @@
 #include <fmgr.h>
 #include <utils/timestamp.h>
 #include <storage/lwlock.h>
+#include <port/atomics.h>
+#include <storage/spin.h>
+#include "histogram.h"
 
-#define PGTRACE_BUCKETS 6
+/* Statistics that pgtrace_reset(component) clears independently. */
+typedef enum PgTraceComponent
+{
+    PGTRACE_COMPONENT_METRICS = 0,
+    PGTRACE_COMPONENT_QUERIES,
+    PGTRACE_COMPONENT_ERRORS,
+    PGTRACE_COMPONENT_SLOW_QUERIES,
+    PGTRACE_COMPONENT_AUDIT,
+    PGTRACE_COMPONENT_ASH,
+    PGTRACE_COMPONENT_PLANS,
+    PGTRACE_COMPONENT_XACT,
+    PGTRACE_COMPONENT_IMPORTED,
+    PGTRACE_NUM_COMPONENTS
+} PgTraceComponent;
 
+/* Global counters, updated with atomics so recording takes no lock. */
 typedef struct PgTraceMetrics
 {
-    uint64 queries_total;
-    uint64 queries_failed;
-    uint64 slow_queries;
-    uint64 latency_buckets[PGTRACE_BUCKETS];
+    pg_atomic_uint64 queries_total;
+    pg_atomic_uint64 queries_failed;
+    pg_atomic_uint64 slow_queries;
+    pg_atomic_uint64 queries_cancelled;
+    pg_atomic_uint64 parallel_queries;
+    pg_atomic_uint64 workers_planned;
+    pg_atomic_uint64 workers_launched;
+    PgTraceHistogram latency;
+    PgTraceDbHistogram databases[PGTRACE_HIST_DATABASES];
+    PgTraceHistogram other_databases;
     TimestampTz start_time;
-    LWLock lock;
+
+    /* When each component last started counting from zero, and how often. */
+    slock_t reset_mutex;
+    TimestampTz stats_since[PGTRACE_NUM_COMPONENTS];
+    uint64 resets[PGTRACE_NUM_COMPONENTS];
 } PgTraceMetrics;
 
 extern PgTraceMetrics *pgtrace_metrics;
@@ -22,12 +49,55 @@ extern PgTraceMetrics *pgtrace_metrics;
 #include "fingerprint.h"
 #include "query_hash.h"
 #include "slow_query.h"
+#include "slow_capture.h"
 #include "error_track.h"
 #include "audit.h"
+#include "audit_log.h"
+#include "openmetrics.h"
+#include "bench.h"
+#include "self_stats.h"
+#include "ash.h"
+#include "activity.h"
+#include "plans.h"
+#include "xact.h"
+#include "request_log.h"
+#include "trace.h"
+#include "export.h"
+#include "imported.h"
 
 extern bool pgtrace_enabled;
 extern int pgtrace_slow_query_ms;
 extern char *pgtrace_request_id;
+extern int pgtrace_request_log_window;
+extern char *pgtrace_traceparent;
+extern bool pgtrace_audit;
+extern bool pgtrace_xact_spans;
+
+typedef enum PgTraceFsyncMode
+{
+    PGTRACE_FSYNC_OFF = 0,
+    PGTRACE_FSYNC_ROTATE,
+    PGTRACE_FSYNC_BATCH
+} PgTraceFsyncMode;
+
+extern bool pgtrace_audit_log;
+extern int pgtrace_audit_log_rotation_size;
+extern int pgtrace_audit_log_rotation_age;
+extern int pgtrace_audit_log_flush_ms;
+extern int pgtrace_audit_log_fsync;
+extern int pgtrace_slow_query_capture;
+extern bool pgtrace_slow_query_capture_analyze;
+extern int pgtrace_slow_query_capture_interval;
+extern double pgtrace_anomaly_sigma;
+extern int pgtrace_anomaly_warmup;
+extern double pgtrace_anomaly_alpha;
+extern int pgtrace_metrics_port;
+extern char *pgtrace_metrics_socket;
+extern int pgtrace_metrics_cache_ttl;
+extern bool pgtrace_ash;
+extern int pgtrace_ash_sample_rate;
+extern bool pgtrace_span_export;
+extern int pgtrace_span_export_interval;
 
 void pgtrace_init_guc(void);
 void pgtrace_shmem_request(void);
@@ -35,19 +105,30 @@ void pgtrace_shmem_startup(void);
 void pgtrace_init_hooks(void);
 void pgtrace_remove_hooks(void);
 
-void pgtrace_record_query(long duration_ms, bool failed);
+void pgtrace_record_query(double duration_ms, bool failed, bool cancelled);
+void pgtrace_record_parallel(int workers_planned, int workers_launched);
+void pgtrace_query_percentiles(const QueryStats *entry, double *p95_ms, double *p99_ms);
 PGDLLEXPORT Datum pgtrace_internal_metrics(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum pgtrace_internal_latency(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_latency_by_database(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_latency_quantile(PG_FUNCTION_ARGS);
 
 PGDLLEXPORT Datum pgtrace_internal_query_stats(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_query_breakdown(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_capacity(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_untracked_queries(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum pgtrace_reset(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_reset_component(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_reset_query(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_stats_resets(PG_FUNCTION_ARGS);
 PGDLLEXPORT Datum pgtrace_query_count(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_fingerprint(PG_FUNCTION_ARGS);
 
 PGDLLEXPORT Datum pgtrace_internal_slow_queries(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_slow_query_samples(PG_FUNCTION_ARGS);
 
-void pgtrace_set_current_fingerprint(uint64 fingerprint);
-void pgtrace_init_error_hook(void);
-void pgtrace_remove_error_hook(void);
 PGDLLEXPORT Datum pgtrace_internal_failing_queries(PG_FUNCTION_ARGS);
 
 PGDLLEXPORT Datum pgtrace_internal_audit_events(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_audit_log_stats(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_ring_stats(PG_FUNCTION_ARGS);
@@ -0,0 +1,401 @@
+#include <postgres.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <common/hashfn.h>
+#include <nodes/nodeFuncs.h>
+#include <parser/parsetree.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+PgTracePlanTable *pgtrace_plan_table = NULL;
+
+void pgtrace_plans_request_shmem(void)
+{
+    RequestAddinShmemSpace(sizeof(PgTracePlanTable));
+    RequestNamedLWLockTranche("pgtrace_plans", 1);
+}
+
+void pgtrace_plans_startup(void)
+{
+    bool found;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    pgtrace_plan_table = ShmemInitStruct(
+        "pgtrace_plans",
+        sizeof(PgTracePlanTable),
+        &found);
+
+    if (!found)
+        memset(pgtrace_plan_table, 0, sizeof(PgTracePlanTable));
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+static inline uint64
+plan_hash_add(uint64 hash, uint32 value)
+{
+    return hash_combine64(hash, hash_bytes_uint32_extended(value, 0));
+}
+
+static uint64 plan_hash_walk(Plan *plan, PlannedStmt *stmt, uint64 hash);
+
+static uint64
+plan_hash_list(List *plans, PlannedStmt *stmt, uint64 hash)
+{
+    ListCell *lc;
+
+    hash = plan_hash_add(hash, (uint32)list_length(plans));
+    foreach (lc, plans)
+        hash = plan_hash_walk((Plan *)lfirst(lc), stmt, hash);
+
+    return hash;
+}
+
+/* OID of the relation a scan reads, or InvalidOid for non-relation scans. */
+static Oid
+scan_relid(Plan *plan, PlannedStmt *stmt)
+{
+    Index scanrelid = ((Scan *)plan)->scanrelid;
+    RangeTblEntry *rte;
+
+    if (scanrelid == 0 || scanrelid > (Index)list_length(stmt->rtable))
+        return InvalidOid;
+
+    rte = rt_fetch(scanrelid, stmt->rtable);
+    return rte->rtekind == RTE_RELATION ? rte->relid : InvalidOid;
+}
+
+/*
+ * Pre-order walk. A missing child is hashed too, so trees that differ only
+ * in which side a child hangs from get different hashes.
+ */
+static uint64
+plan_hash_walk(Plan *plan, PlannedStmt *stmt, uint64 hash)
+{
+    if (plan == NULL)
+        return plan_hash_add(hash, 0);
+
+    check_stack_depth();
+
+    hash = plan_hash_add(hash, (uint32)nodeTag(plan));
+
+    switch (nodeTag(plan))
+    {
+    case T_SeqScan:
+    case T_SampleScan:
+    case T_BitmapHeapScan:
+    case T_TidScan:
+    case T_TidRangeScan:
+    case T_ForeignScan:
+    case T_CustomScan:
+        hash = plan_hash_add(hash, scan_relid(plan, stmt));
+        break;
+    case T_IndexScan:
+        hash = plan_hash_add(hash, scan_relid(plan, stmt));
+        hash = plan_hash_add(hash, ((IndexScan *)plan)->indexid);
+        break;
+    case T_IndexOnlyScan:
+        hash = plan_hash_add(hash, scan_relid(plan, stmt));
+        hash = plan_hash_add(hash, ((IndexOnlyScan *)plan)->indexid);
+        break;
+    case T_BitmapIndexScan:
+        hash = plan_hash_add(hash, ((BitmapIndexScan *)plan)->indexid);
+        break;
+    case T_NestLoop:
+    case T_MergeJoin:
+    case T_HashJoin:
+        hash = plan_hash_add(hash, (uint32)((Join *)plan)->jointype);
+        break;
+    case T_Agg:
+        hash = plan_hash_add(hash, (uint32)((Agg *)plan)->aggstrategy);
+        break;
+    case T_Append:
+        hash = plan_hash_list(((Append *)plan)->appendplans, stmt, hash);
+        break;
+    case T_MergeAppend:
+        hash = plan_hash_list(((MergeAppend *)plan)->mergeplans, stmt, hash);
+        break;
+    case T_BitmapAnd:
+        hash = plan_hash_list(((BitmapAnd *)plan)->bitmapplans, stmt, hash);
+        break;
+    case T_BitmapOr:
+        hash = plan_hash_list(((BitmapOr *)plan)->bitmapplans, stmt, hash);
+        break;
+    case T_SubqueryScan:
+        hash = plan_hash_walk(((SubqueryScan *)plan)->subplan, stmt, hash);
+        break;
+    default:
+        break;
+    }
+
+    if (IsA(plan, CustomScan))
+        hash = plan_hash_list(((CustomScan *)plan)->custom_plans, stmt, hash);
+
+    hash = plan_hash_walk(outerPlan(plan), stmt, hash);
+    hash = plan_hash_walk(innerPlan(plan), stmt, hash);
+
+    return hash;
+}
+
+/* Shape hash of a planned statement, subplans included. Never 0. */
+uint64
+pgtrace_plan_hash(PlannedStmt *stmt)
+{
+    uint64 hash;
+
+    if (!stmt || !stmt->planTree)
+        return 0;
+
+    hash = plan_hash_walk(stmt->planTree, stmt, (uint64)stmt->commandType);
+    hash = plan_hash_list(stmt->subplans, stmt, hash);
+
+    return hash != 0 ? hash : 1;
+}
+
+/* Backward-shift deletion, as in the query hash. Caller holds the lock. */
+static void
+plan_delete_entry(uint64 idx)
+{
+    uint64 hole = idx;
+    uint64 next = (idx + 1) % PGTRACE_PLAN_HASH_SIZE;
+
+    for (;;)
+    {
+        PgTracePlanEntry *entry = &pgtrace_plan_table->entries[next];
+        uint64 home;
+        bool movable;
+
+        if (!entry->valid)
+            break;
+
+        home = hash_combine64(entry->fingerprint, entry->plan_hash) % PGTRACE_PLAN_HASH_SIZE;
+        if (hole < next)
+            movable = (home <= hole || home > next);
+        else
+            movable = (home <= hole && home > next);
+
+        if (movable)
+        {
+            pgtrace_plan_table->entries[hole] = *entry;
+            hole = next;
+        }
+
+        next = (next + 1) % PGTRACE_PLAN_HASH_SIZE;
+    }
+
+    memset(&pgtrace_plan_table->entries[hole], 0, sizeof(PgTracePlanEntry));
+    pgtrace_plan_table->num_entries--;
+}
+
+/*
+ * Make room in a full table: sample entries from the clock hand and delete
+ * the least recently seen. Caller holds the lock exclusively.
+ */
+static bool
+plan_evict(void)
+{
+    PgTracePlanEntry *victim = NULL;
+    int sampled = 0;
+    uint64 i;
+
+    for (i = 0; i < PGTRACE_PLAN_HASH_SIZE && sampled < PGTRACE_EVICTION_SAMPLE; i++)
+    {
+        PgTracePlanEntry *entry = &pgtrace_plan_table->entries[pgtrace_plan_table->evict_hand];
+
+        pgtrace_plan_table->evict_hand = (pgtrace_plan_table->evict_hand + 1) % PGTRACE_PLAN_HASH_SIZE;
+
+        if (entry->valid)
+        {
+            if (victim == NULL || entry->last_seen < victim->last_seen)
+                victim = entry;
+            sampled++;
+        }
+    }
+
+    if (victim == NULL)
+        return false;
+
+    plan_delete_entry(victim - pgtrace_plan_table->entries);
+    pgtrace_plan_table->evictions++;
+    return true;
+}
+
+static PgTracePlanEntry *
+plan_find_or_create(uint64 fingerprint, uint64 plan_hash)
+{
+    uint64 bucket = hash_combine64(fingerprint, plan_hash) % PGTRACE_PLAN_HASH_SIZE;
+    uint64 i;
+
+    for (i = 0; i < PGTRACE_PLAN_HASH_SIZE; i++)
+    {
+        PgTracePlanEntry *entry = &pgtrace_plan_table->entries[(bucket + i) % PGTRACE_PLAN_HASH_SIZE];
+
+        if (!entry->valid)
+        {
+            if (pgtrace_plan_table->num_entries >= PGTRACE_PLAN_ENTRIES)
+                break;
+
+            memset(entry, 0, sizeof(PgTracePlanEntry));
+            entry->fingerprint = fingerprint;
+            entry->plan_hash = plan_hash;
+            entry->valid = true;
+            entry->first_seen = GetCurrentTimestamp();
+            pgtrace_plan_table->num_entries++;
+            return entry;
+        }
+
+        if (entry->fingerprint == fingerprint && entry->plan_hash == plan_hash)
+            return entry;
+    }
+
+    return NULL;
+}
+
+void pgtrace_plan_record(uint64 fingerprint, uint64 plan_hash, double duration_ms, bool failed)
+{
+    PgTracePlanEntry *entry;
+    LWLockPadded *lock;
+
+    if (!pgtrace_plan_table || fingerprint == 0 || plan_hash == 0)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_plans");
+    pgtrace_lock_acquire(PGTRACE_LOCK_PLANS, &lock->lock, LW_EXCLUSIVE);
+
+    entry = plan_find_or_create(fingerprint, plan_hash);
+    if (!entry && plan_evict())
+        entry = plan_find_or_create(fingerprint, plan_hash);
+
+    if (!entry)
+        pgtrace_plan_table->dropped++;
+    else
+    {
+        entry->calls++;
+        if (failed)
+            entry->errors++;
+        entry->total_time_ms += duration_ms;
+        entry->last_seen = GetCurrentTimestamp();
+    }
+
+    LWLockRelease(&lock->lock);
+}
+
+void pgtrace_plans_reset(void)
+{
+    LWLockPadded *lock;
+
+    if (!pgtrace_plan_table)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_plans");
+    pgtrace_lock_acquire(PGTRACE_LOCK_PLANS, &lock->lock, LW_EXCLUSIVE);
+    memset(pgtrace_plan_table, 0, sizeof(PgTracePlanTable));
+    LWLockRelease(&lock->lock);
+}
+
+/* Remove every plan recorded for a fingerprint. Returns how many. */
+uint32
+pgtrace_plans_reset_fingerprint(uint64 fingerprint)
+{
+    LWLockPadded *lock;
+    uint32 removed = 0;
+    uint64 i = 0;
+
+    if (!pgtrace_plan_table)
+        return 0;
+
+    lock = GetNamedLWLockTranche("pgtrace_plans");
+    pgtrace_lock_acquire(PGTRACE_LOCK_PLANS, &lock->lock, LW_EXCLUSIVE);
+
+    while (i < PGTRACE_PLAN_HASH_SIZE)
+    {
+        PgTracePlanEntry *entry = &pgtrace_plan_table->entries[i];
+
+        /* A deletion may shift a later entry into slot i, so look again. */
+        if (entry->valid && entry->fingerprint == fingerprint)
+        {
+            plan_delete_entry(i);
+            removed++;
+            continue;
+        }
+        i++;
+    }
+
+    LWLockRelease(&lock->lock);
+
+    return removed;
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_query_plans);
+
+PGDLLEXPORT Datum pgtrace_internal_query_plans(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTracePlanEntry *snapshot;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+        uint32 i;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_query_plans must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        snapshot = palloc(PGTRACE_PLAN_ENTRIES * sizeof(PgTracePlanEntry));
+
+        if (pgtrace_plan_table)
+        {
+            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_plans");
+
+            pgtrace_lock_acquire(PGTRACE_LOCK_PLANS, &lock->lock, LW_SHARED);
+            for (i = 0; i < PGTRACE_PLAN_HASH_SIZE && count < PGTRACE_PLAN_ENTRIES; i++)
+            {
+                if (pgtrace_plan_table->entries[i].valid)
+                    snapshot[count++] = pgtrace_plan_table->entries[i];
+            }
+            LWLockRelease(&lock->lock);
+        }
+
+        funcctx->user_fctx = snapshot;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    snapshot = (PgTracePlanEntry *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[8];
+        bool nulls[8] = {false, false, false, false, false, false, false, false};
+        PgTracePlanEntry *entry = &snapshot[funcctx->call_cntr];
+        HeapTuple tuple;
+
+        values[0] = UInt64GetDatum(entry->fingerprint);
+        values[1] = UInt64GetDatum(entry->plan_hash);
+        values[2] = UInt64GetDatum(entry->calls);
+        values[3] = UInt64GetDatum(entry->errors);
+        values[4] = Float8GetDatum(entry->total_time_ms);
+        values[5] = Float8GetDatum(entry->calls > 0 ? entry->total_time_ms / entry->calls : 0.0);
+        values[6] = TimestampTzGetDatum(entry->first_seen);
+        values[7] = TimestampTzGetDatum(entry->last_seen);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <nodes/plannodes.h>
+#include <utils/timestamp.h>
+
+/*
+ * Plan-shape statistics. At ExecutorStart the PlannedStmt tree is hashed
+ * from what decides its shape: node types, scanned relations, indexes,
+ * join types, and the order of children (and so of joins). Calls and time
+ * are kept per (fingerprint, plan hash), so a fingerprint whose plan
+ * flipped shows up with two entries and the latency of each.
+ */
+typedef struct PgTracePlanEntry
+{
+    uint64 fingerprint;
+    uint64 plan_hash;
+    bool valid;
+    uint64 calls;
+    uint64 errors;
+    double total_time_ms;
+    TimestampTz first_seen;
+    TimestampTz last_seen;
+} PgTracePlanEntry;
+
+#define PGTRACE_PLAN_ENTRIES 4096
+#define PGTRACE_PLAN_HASH_SIZE (PGTRACE_PLAN_ENTRIES * 2)
+
+/*
+ * When the table is full, a new pair evicts the least recently seen of a
+ * few entries sampled from evict_hand, the way the query table does.
+ */
+typedef struct PgTracePlanTable
+{
+    uint32 num_entries;
+    uint64 dropped;
+    uint64 evictions;
+    uint64 evict_hand;
+    PgTracePlanEntry entries[PGTRACE_PLAN_HASH_SIZE];
+} PgTracePlanTable;
+
+extern PgTracePlanTable *pgtrace_plan_table;
+
+void pgtrace_plans_request_shmem(void);
+void pgtrace_plans_startup(void);
+uint64 pgtrace_plan_hash(PlannedStmt *stmt);
+void pgtrace_plan_record(uint64 fingerprint, uint64 plan_hash, double duration_ms, bool failed);
+void pgtrace_plans_reset(void);
+uint32 pgtrace_plans_reset_fingerprint(uint64 fingerprint);
+
+PGDLLEXPORT Datum pgtrace_internal_query_plans(PG_FUNCTION_ARGS);
@@ -2,7 +2,7 @@
 #include <storage/shmem.h>
 #include <storage/lwlock.h>
 #include <utils/timestamp.h>
-#include "query_hash.h"
+#include "pgtrace.h"
 
 PgTraceQueryHash *pgtrace_query_hash = NULL;
 
@@ -26,6 +26,7 @@ void pgtrace_hash_startup(void)
     if (!found)
     {
         memset(pgtrace_query_hash, 0, sizeof(PgTraceQueryHash));
+        pgtrace_query_hash->stats_since = GetCurrentTimestamp();
     }
 
     LWLockRelease(AddinShmemInitLock);
@@ -37,8 +38,9 @@ hash_bucket(uint64 fingerprint)
     return fingerprint % PGTRACE_HASH_TABLE_SIZE;
 }
 
-static QueryStats *
-find_entry(uint64 fingerprint)
+/* Slot holding a fingerprint, or -1. */
+static int64
+find_index(uint64 fingerprint)
 {
     uint64 bucket = hash_bucket(fingerprint);
     uint64 i;
@@ -48,16 +50,43 @@ find_entry(uint64 fingerprint)
         uint64 idx = (bucket + i) % PGTRACE_HASH_TABLE_SIZE;
         QueryStats *entry = &pgtrace_query_hash->entries[idx];
 
-        if (!entry->valid)
-            return NULL;
+        if (!pgtrace_hash_entry_live(entry))
+            return -1;
 
         if (entry->fingerprint == fingerprint)
-            return entry;
+            return (int64)idx;
     }
 
-    return NULL;
+    return -1;
+}
+
+static inline uint32 *
+entry_changecount(QueryStats *entry)
+{
+    return &pgtrace_query_hash->changecount[entry - pgtrace_query_hash->entries];
+}
+
+static void
+init_entry(QueryStats *entry, uint64 fingerprint)
+{
+    uint32 *count = entry_changecount(entry);
+    TimestampTz now = GetCurrentTimestamp();
+
+    PGTRACE_SEQ_BEGIN_WRITE(*count);
+    memset(entry, 0, sizeof(QueryStats));
+    entry->fingerprint = fingerprint;
+    entry->valid = true;
+    entry->generation = pgtrace_query_hash->generation;
+    entry->first_seen = now;
+    entry->last_seen = now;
+    PGTRACE_SEQ_END_WRITE(*count);
+    pgtrace_query_hash->num_entries++;
 }
 
+/*
+ * Returns NULL once PGTRACE_MAX_QUERIES fingerprints are tracked, which
+ * keeps the load factor at or below one half so probes stay short.
+ */
 static QueryStats *
 find_or_create_entry(uint64 fingerprint)
 {
@@ -69,14 +98,14 @@ find_or_create_entry(uint64 fingerprint)
         uint64 idx = (bucket + i) % PGTRACE_HASH_TABLE_SIZE;
         QueryStats *entry = &pgtrace_query_hash->entries[idx];
 
-        if (!entry->valid)
+        if (!pgtrace_hash_entry_live(entry))
         {
-            memset(entry, 0, sizeof(QueryStats));
-            entry->fingerprint = fingerprint;
-            entry->valid = true;
-            entry->first_seen = GetCurrentTimestamp();
-            entry->last_seen = entry->first_seen;
-            pgtrace_query_hash->num_entries++;
+            pgtrace_count_probes(i + 1);
+
+            if (pgtrace_query_hash->num_entries >= PGTRACE_MAX_QUERIES)
+                return NULL;
+
+            init_entry(entry, fingerprint);
 
             if (i > 0)
                 pgtrace_query_hash->collisions++;
@@ -85,36 +114,299 @@ find_or_create_entry(uint64 fingerprint)
         }
 
         if (entry->fingerprint == fingerprint)
+        {
+            pgtrace_count_probes(i + 1);
             return entry;
+        }
     }
 
+    pgtrace_count_probes(PGTRACE_HASH_TABLE_SIZE);
     return NULL;
 }
 
+/*
+ * Remove the entry at idx with backward-shift deletion: later entries of
+ * the same probe run move up into the hole, so lookups never need
+ * tombstones.
+ */
+static void
+delete_entry(uint64 idx)
+{
+    uint64 hole = idx;
+    uint64 next = (idx + 1) % PGTRACE_HASH_TABLE_SIZE;
+
+    PGTRACE_DELETION_BEGIN(pgtrace_query_hash->deletions);
+
+    for (;;)
+    {
+        QueryStats *entry = &pgtrace_query_hash->entries[next];
+        uint64 home;
+        bool movable;
+
+        if (!pgtrace_hash_entry_live(entry))
+            break;
+
+        /* The entry may fill the hole unless its home lies in (hole, next]. */
+        home = hash_bucket(entry->fingerprint);
+        if (hole < next)
+            movable = (home <= hole || home > next);
+        else
+            movable = (home <= hole && home > next);
+
+        if (movable)
+        {
+            PGTRACE_SEQ_BEGIN_WRITE(pgtrace_query_hash->changecount[hole]);
+            memcpy(&pgtrace_query_hash->entries[hole], entry, sizeof(QueryStats));
+            PGTRACE_SEQ_END_WRITE(pgtrace_query_hash->changecount[hole]);
+            hole = next;
+        }
+
+        next = (next + 1) % PGTRACE_HASH_TABLE_SIZE;
+    }
+
+    PGTRACE_SEQ_BEGIN_WRITE(pgtrace_query_hash->changecount[hole]);
+    memset(&pgtrace_query_hash->entries[hole], 0, sizeof(QueryStats));
+    PGTRACE_SEQ_END_WRITE(pgtrace_query_hash->changecount[hole]);
+    pgtrace_query_hash->num_entries--;
+    PGTRACE_DELETION_END(pgtrace_query_hash->deletions);
+}
+
+/*
+ * Sample tracked entries from the clock hand and return the one with the
+ * least recent time in the sketch, if it is colder than time_ms.
+ */
+static bool
+find_eviction_victim(double time_ms, uint64 *victim)
+{
+    double victim_time = time_ms;
+    bool found = false;
+    int sampled = 0;
+    uint64 i;
+
+    for (i = 0; i < PGTRACE_HASH_TABLE_SIZE && sampled < PGTRACE_EVICTION_SAMPLE; i++)
+    {
+        uint64 idx = pgtrace_query_hash->evict_hand;
+        QueryStats *entry = &pgtrace_query_hash->entries[idx];
+
+        pgtrace_query_hash->evict_hand = (idx + 1) % PGTRACE_HASH_TABLE_SIZE;
+
+        if (pgtrace_hash_entry_live(entry))
+        {
+            uint64 est_calls;
+            double est_time;
+
+            pgtrace_sketch_estimate(&pgtrace_query_hash->sketch, entry->fingerprint,
+                                    &est_calls, &est_time);
+            if (est_time < victim_time)
+            {
+                victim_time = est_time;
+                *victim = idx;
+                found = true;
+            }
+            sampled++;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Called for a fingerprint that missed a full table. Keep it in the
+ * candidate list if it ranks among the hottest untracked fingerprints, and
+ * promote it into the table when it has become hotter than a sampled
+ * tracked entry.
+ */
+static QueryStats *
+promote_candidate(uint64 fingerprint)
+{
+    QueryCandidate *candidate = NULL;
+    QueryCandidate *weakest = NULL;
+    uint64 est_calls;
+    double est_time;
+    uint64 victim;
+    int i;
+
+    pgtrace_sketch_estimate(&pgtrace_query_hash->sketch, fingerprint, &est_calls, &est_time);
+
+    for (i = 0; i < PGTRACE_CANDIDATES; i++)
+    {
+        QueryCandidate *c = &pgtrace_query_hash->candidates[i];
+
+        if (c->est_calls > 0 && c->fingerprint == fingerprint)
+        {
+            candidate = c;
+            break;
+        }
+
+        if (weakest == NULL || c->est_time_ms < weakest->est_time_ms)
+            weakest = c;
+    }
+
+    if (candidate == NULL)
+    {
+        if (weakest->est_calls > 0 && weakest->est_time_ms >= est_time)
+            return NULL;
+
+        candidate = weakest;
+        candidate->fingerprint = fingerprint;
+    }
+
+    candidate->est_calls = est_calls;
+    candidate->est_time_ms = est_time;
+
+    if (!find_eviction_victim(est_time, &victim))
+        return NULL;
+
+    delete_entry(victim);
+    memset(candidate, 0, sizeof(QueryCandidate));
+    pgtrace_query_hash->promotions++;
+
+    return find_or_create_entry(fingerprint);
+}
+
+/*
+ * Executions must also be this much slower than the baseline, so that
+ * jitter on sub-millisecond queries with a tiny variance is not flagged.
+ */
+#define PGTRACE_ANOMALY_MIN_DELTA_MS 1.0
+
+/*
+ * Fold one execution into the fingerprint's latency baseline and report
+ * whether it lies more than pgtrace.anomaly_sigma standard deviations above
+ * the baseline as it stood before. With alpha = max(1/n, anomaly_alpha) the
+ * first 1/alpha calls give the exact Welford mean and variance, and later
+ * calls an exponentially weighted one that follows gradual drift.
+ */
+static bool
+baseline_update(QueryStats *entry, double duration_ms)
+{
+    double alpha = Max(1.0 / (double)entry->calls, pgtrace_anomaly_alpha);
+    double diff = duration_ms - entry->baseline_mean_ms;
+    double incr = alpha * diff;
+    bool anomalous = false;
+
+    if (entry->calls > (uint64)pgtrace_anomaly_warmup &&
+        diff > PGTRACE_ANOMALY_MIN_DELTA_MS &&
+        diff * diff > pgtrace_anomaly_sigma * pgtrace_anomaly_sigma * entry->baseline_var)
+        anomalous = true;
+
+    entry->baseline_mean_ms += incr;
+    entry->baseline_var = (1.0 - alpha) * (entry->baseline_var + diff * incr);
+
+    return anomalous;
+}
+
+static void
+breakdown_record(QueryStats *entry, Oid userid, Oid dbid, const char *app_name,
+                 double duration_ms)
+{
+    QueryBreakdownSlot *victim = NULL;
+    QueryBreakdownSlot *slot;
+    int i;
+
+    if (app_name == NULL)
+        app_name = "";
+
+    for (i = 0; i < PGTRACE_BREAKDOWN_SLOTS; i++)
+    {
+        slot = &entry->breakdown[i];
+
+        if (slot->calls == 0)
+        {
+            victim = slot;
+            break;
+        }
+
+        if (slot->userid == userid && slot->dbid == dbid &&
+            strncmp(slot->app_name, app_name, NAMEDATALEN - 1) == 0)
+        {
+            slot->calls++;
+            slot->total_time_ms += duration_ms;
+            return;
+        }
+
+        if (victim == NULL || slot->total_time_ms < victim->total_time_ms)
+            victim = slot;
+    }
+
+    /* Space-Saving: the newcomer takes over the lightest slot's counts as its error. */
+    slot = victim;
+    slot->calls_error = slot->calls;
+    slot->time_error_ms = slot->total_time_ms;
+    slot->userid = userid;
+    slot->dbid = dbid;
+    strlcpy(slot->app_name, app_name, NAMEDATALEN);
+    slot->calls++;
+    slot->total_time_ms += duration_ms;
+}
+
 void pgtrace_hash_record(uint64 fingerprint, double duration_ms, bool failed,
                          const char *app_name, const char *user_name, const char *db_name,
+                         Oid userid, Oid dbid,
                          const char *req_id, uint64 rows_scanned, uint64 rows_returned)
 {
-    QueryStats *entry;
-    double baseline_latency;
-    bool is_first_call;
+    LWLockPadded *lock;
 
     if (!pgtrace_query_hash)
         return;
 
-    baseline_latency = pgtrace_hash_get_baseline_latency();
+    lock = GetNamedLWLockTranche("pgtrace_query_hash");
+    pgtrace_lock_acquire(PGTRACE_LOCK_QUERY_HASH, &lock->lock, LW_EXCLUSIVE);
+    pgtrace_hash_record_locked(fingerprint, duration_ms, failed, app_name, user_name, db_name,
+                               userid, dbid, req_id, rows_scanned, rows_returned);
+    LWLockRelease(&lock->lock);
+}
 
-    LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_query_hash");
-    LWLockAcquire(&lock->lock, LW_EXCLUSIVE);
+/*
+ * Body of pgtrace_hash_record. The caller holds the query table lock
+ * exclusively, or owns pgtrace_query_hash outright, as pgtrace_bench does
+ * with its scratch copy.
+ */
+void pgtrace_hash_record_locked(uint64 fingerprint, double duration_ms, bool failed,
+                                const char *app_name, const char *user_name, const char *db_name,
+                                Oid userid, Oid dbid,
+                                const char *req_id, uint64 rows_scanned, uint64 rows_returned)
+{
+    QueryStats *entry;
+    bool is_first_call;
+    uint64 agings;
+
+    pgtrace_query_hash->total_calls++;
+    pgtrace_query_hash->total_time_ms += duration_ms;
+
+    agings = pgtrace_query_hash->sketch.agings;
+    pgtrace_sketch_add(&pgtrace_query_hash->sketch, fingerprint, duration_ms);
+    if (pgtrace_query_hash->sketch.agings != agings)
+    {
+        int i;
+
+        /* A sweep has halved every cell; keep candidate scores on the same scale. */
+        for (i = 0; i < PGTRACE_CANDIDATES; i++)
+            pgtrace_query_hash->candidates[i].est_time_ms *= 0.5;
+    }
 
     entry = find_or_create_entry(fingerprint);
-    if (entry)
+    if (!entry)
+        entry = promote_candidate(fingerprint);
+
+    if (!entry)
+    {
+        pgtrace_backend_stats()->dropped_inserts++;
+        pgtrace_query_hash->untracked_calls++;
+        pgtrace_query_hash->untracked_time_ms += duration_ms;
+    }
+    else
     {
+        uint32 *count = entry_changecount(entry);
+        TimestampTz now = GetCurrentTimestamp();
+
+        PGTRACE_SEQ_BEGIN_WRITE(*count);
+
         is_first_call = (entry->calls == 0);
 
         entry->calls++;
         entry->total_time_ms += duration_ms;
-        entry->last_seen = GetCurrentTimestamp();
+        entry->last_seen = now;
 
         if (failed)
             entry->errors++;
@@ -139,57 +431,87 @@ void pgtrace_hash_record(uint64 fingerprint, double duration_ms, bool failed,
         if (req_id)
             snprintf(entry->last_request_id, sizeof(entry->last_request_id), "%s", req_id);
 
+        breakdown_record(entry, userid, dbid, app_name, duration_ms);
+
         entry->latency_samples[entry->sample_pos] = duration_ms;
         entry->sample_pos = (entry->sample_pos + 1) % PGTRACE_LATENCY_BUCKETS;
         if (entry->sample_count < PGTRACE_LATENCY_BUCKETS)
             entry->sample_count++;
 
-        entry->is_anomalous = false;
-
-        if (baseline_latency > 0 && duration_ms > (baseline_latency * 3.0))
-            entry->is_anomalous = true;
+        entry->is_anomalous = baseline_update(entry, duration_ms);
+        if (entry->is_anomalous)
+            entry->anomalous_calls++;
 
         if (rows_returned > 0 && ((double)rows_scanned / (double)rows_returned) > 100.0)
             entry->is_anomalous = true;
+
+        pgtrace_window_add(&entry->window, now, duration_ms, failed);
+        entry->latency_hist[pgtrace_window_latency_bucket(duration_ms)]++;
+
+        PGTRACE_SEQ_END_WRITE(*count);
     }
+}
 
-    LWLockRelease(&lock->lock);
+/* Consistent copy of the entry in slot idx, if it holds a live fingerprint. */
+static bool
+read_entry(uint64 idx, QueryStats *dst)
+{
+    if (!pgtrace_seq_read(&pgtrace_query_hash->changecount[idx],
+                          &pgtrace_query_hash->entries[idx], dst, sizeof(QueryStats)))
+        return false;
+
+    return pgtrace_hash_entry_live(dst);
 }
 
-QueryStats *
-pgtrace_hash_get(uint64 fingerprint)
+static inline uint64
+read_deletions(void)
 {
-    QueryStats *entry;
-    LWLockPadded *lock;
+    pg_read_barrier();
+    return ((volatile PgTraceQueryHash *)pgtrace_query_hash)->deletions;
+}
+
+/* Copy the tracked entries without taking the lock. */
+uint32
+pgtrace_hash_snapshot(QueryStats *dst, uint32 max_entries)
+{
+    uint32 count = 0;
+    int attempt;
 
     if (!pgtrace_query_hash)
-        return NULL;
+        return 0;
 
-    lock = GetNamedLWLockTranche("pgtrace_query_hash");
-    LWLockAcquire(&lock->lock, LW_SHARED);
-    entry = find_entry(fingerprint);
-    LWLockRelease(&lock->lock);
+    for (attempt = 0; attempt < PGTRACE_SEQ_SCAN_RETRIES; attempt++)
+    {
+        uint64 deletions = read_deletions();
+        uint64 i;
+
+        count = 0;
+        for (i = 0; i < PGTRACE_HASH_TABLE_SIZE && count < max_entries; i++)
+        {
+            if (read_entry(i, &dst[count]))
+                count++;
+        }
+
+        if ((deletions & 1) == 0 && read_deletions() == deletions)
+            break;
+    }
 
-    return entry;
+    return count;
 }
 
 uint64
 pgtrace_hash_count(void)
 {
-    uint64 count;
-    LWLockPadded *lock;
-
     if (!pgtrace_query_hash)
         return 0;
 
-    lock = GetNamedLWLockTranche("pgtrace_query_hash");
-    LWLockAcquire(&lock->lock, LW_SHARED);
-    count = pgtrace_query_hash->num_entries;
-    LWLockRelease(&lock->lock);
-
-    return count;
+    return ((volatile PgTraceQueryHash *)pgtrace_query_hash)->num_entries;
 }
 
+/*
+ * Retire every entry by bumping the generation; only the table-wide
+ * counters and the sketch are cleared here.
+ */
 void pgtrace_hash_reset(void)
 {
     LWLockPadded *lock;
@@ -198,37 +520,134 @@ void pgtrace_hash_reset(void)
         return;
 
     lock = GetNamedLWLockTranche("pgtrace_query_hash");
-    LWLockAcquire(&lock->lock, LW_EXCLUSIVE);
-    memset(pgtrace_query_hash->entries, 0, sizeof(pgtrace_query_hash->entries));
+    pgtrace_lock_acquire(PGTRACE_LOCK_QUERY_HASH, &lock->lock, LW_EXCLUSIVE);
+    pgtrace_query_hash->generation++;
     pgtrace_query_hash->num_entries = 0;
     pgtrace_query_hash->collisions = 0;
+    memset(&pgtrace_query_hash->sketch, 0, sizeof(PgTraceSketch));
+    memset(pgtrace_query_hash->candidates, 0, sizeof(pgtrace_query_hash->candidates));
+    pgtrace_query_hash->evict_hand = 0;
+    pgtrace_query_hash->total_calls = 0;
+    pgtrace_query_hash->total_time_ms = 0.0;
+    pgtrace_query_hash->untracked_calls = 0;
+    pgtrace_query_hash->untracked_time_ms = 0.0;
+    pgtrace_query_hash->promotions = 0;
+    pgtrace_query_hash->stats_since = GetCurrentTimestamp();
     LWLockRelease(&lock->lock);
 }
 
-double pgtrace_hash_get_baseline_latency(void)
+/* Forget one fingerprint. Returns whether it was tracked. */
+bool pgtrace_hash_reset_entry(uint64 fingerprint)
 {
-    double sum = 0.0;
-    uint64 count = 0;
-    uint64 i;
     LWLockPadded *lock;
+    int64 idx;
 
     if (!pgtrace_query_hash)
-        return 0.0;
+        return false;
 
     lock = GetNamedLWLockTranche("pgtrace_query_hash");
-    LWLockAcquire(&lock->lock, LW_SHARED);
+    pgtrace_lock_acquire(PGTRACE_LOCK_QUERY_HASH, &lock->lock, LW_EXCLUSIVE);
+    idx = find_index(fingerprint);
+    if (idx >= 0)
+        delete_entry((uint64)idx);
+    LWLockRelease(&lock->lock);
 
-    for (i = 0; i < PGTRACE_HASH_TABLE_SIZE; i++)
+    return idx >= 0;
+}
+
+uint32
+pgtrace_hash_breakdown_snapshot(QueryBreakdownRow **dst)
+{
+    QueryStats *entry;
+    uint32 count = 0;
+    uint64 i;
+    int attempt;
+    int k;
+
+    *dst = NULL;
+
+    if (!pgtrace_query_hash)
+        return 0;
+
+    *dst = palloc(PGTRACE_MAX_QUERIES * PGTRACE_BREAKDOWN_SLOTS * sizeof(QueryBreakdownRow));
+    entry = palloc(sizeof(QueryStats));
+
+    for (attempt = 0; attempt < PGTRACE_SEQ_SCAN_RETRIES; attempt++)
     {
-        QueryStats *entry = &pgtrace_query_hash->entries[i];
-        if (entry->valid && entry->calls > 0)
+        uint64 deletions = read_deletions();
+
+        count = 0;
+        for (i = 0; i < PGTRACE_HASH_TABLE_SIZE; i++)
         {
-            sum += (entry->total_time_ms / entry->calls);
-            count++;
+            if (!read_entry(i, entry))
+                continue;
+
+            for (k = 0; k < PGTRACE_BREAKDOWN_SLOTS; k++)
+            {
+                if (entry->breakdown[k].calls == 0)
+                    break;
+
+                if (count >= PGTRACE_MAX_QUERIES * PGTRACE_BREAKDOWN_SLOTS)
+                    break;
+
+                (*dst)[count].fingerprint = entry->fingerprint;
+                memcpy(&(*dst)[count].slot, &entry->breakdown[k], sizeof(QueryBreakdownSlot));
+                count++;
+            }
         }
+
+        if ((deletions & 1) == 0 && read_deletions() == deletions)
+            break;
+    }
+
+    pfree(entry);
+
+    return count;
+}
+
+void pgtrace_hash_capacity_stats(QueryCapacityStats *stats)
+{
+    LWLockPadded *lock;
+
+    memset(stats, 0, sizeof(QueryCapacityStats));
+
+    if (!pgtrace_query_hash)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_query_hash");
+    pgtrace_lock_acquire(PGTRACE_LOCK_QUERY_HASH, &lock->lock, LW_SHARED);
+    stats->tracked = pgtrace_query_hash->num_entries;
+    stats->total_calls = pgtrace_query_hash->total_calls;
+    stats->total_time_ms = pgtrace_query_hash->total_time_ms;
+    stats->untracked_calls = pgtrace_query_hash->untracked_calls;
+    stats->untracked_time_ms = pgtrace_query_hash->untracked_time_ms;
+    stats->promotions = pgtrace_query_hash->promotions;
+    stats->sketch_agings = pgtrace_query_hash->sketch.agings;
+    stats->collisions = pgtrace_query_hash->collisions;
+    stats->stats_since = pgtrace_query_hash->stats_since;
+    LWLockRelease(&lock->lock);
+}
+
+uint32
+pgtrace_hash_candidates_snapshot(QueryCandidate *dst)
+{
+    LWLockPadded *lock;
+    uint32 count = 0;
+    int i;
+
+    if (!pgtrace_query_hash)
+        return 0;
+
+    lock = GetNamedLWLockTranche("pgtrace_query_hash");
+    pgtrace_lock_acquire(PGTRACE_LOCK_QUERY_HASH, &lock->lock, LW_SHARED);
+
+    for (i = 0; i < PGTRACE_CANDIDATES; i++)
+    {
+        if (pgtrace_query_hash->candidates[i].est_calls > 0)
+            dst[count++] = pgtrace_query_hash->candidates[i];
     }
 
     LWLockRelease(&lock->lock);
 
-    return (count > 0) ? (sum / count) : 0.0;
+    return count;
 }
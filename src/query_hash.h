@@ -2,10 +2,40 @@
 
 #include <postgres.h>
 #include <utils/timestamp.h>
+#include "seqlock.h"
+#include "sketch.h"
+#include "window.h"
 
 #define PGTRACE_REQUEST_ID_LEN 64
 #define PGTRACE_LATENCY_BUCKETS 100
 
+/*
+ * Per-fingerprint breakdown by (role, database, application). A fixed set
+ * of Space-Saving counters weighted by execution time: a combination
+ * without a slot replaces the one with the least time and inherits its
+ * counts, which are kept as the error bound. Any combination holding more
+ * than 1/PGTRACE_BREAKDOWN_SLOTS of the fingerprint's time is guaranteed a
+ * slot.
+ */
+#define PGTRACE_BREAKDOWN_SLOTS 4
+
+typedef struct QueryBreakdownSlot
+{
+    Oid userid;
+    Oid dbid;
+    uint64 calls;
+    uint64 calls_error;
+    double total_time_ms;
+    double time_error_ms;
+    char app_name[NAMEDATALEN];
+} QueryBreakdownSlot;
+
+typedef struct QueryBreakdownRow
+{
+    uint64 fingerprint;
+    QueryBreakdownSlot slot;
+} QueryBreakdownRow;
+
 typedef struct QueryStats
 {
     uint64 fingerprint;
@@ -16,6 +46,7 @@ typedef struct QueryStats
     TimestampTz first_seen;
     TimestampTz last_seen;
     bool valid;
+    uint64 generation;
 
     bool is_new;
     bool is_anomalous;
@@ -31,27 +62,107 @@ typedef struct QueryStats
     double latency_samples[PGTRACE_LATENCY_BUCKETS];
     uint32 sample_pos;
     uint32 sample_count;
+
+    /* Latency baseline: exponentially weighted mean and variance */
+    double baseline_mean_ms;
+    double baseline_var;
+    uint64 anomalous_calls;
+
+    QueryBreakdownSlot breakdown[PGTRACE_BREAKDOWN_SLOTS];
+
+    /* Calls, errors and latencies of the last minutes */
+    QueryWindow window;
+
+    /* Latencies since the entry was created, in the window's buckets */
+    uint64 latency_hist[PGTRACE_WINDOW_LATENCY_BUCKETS];
 } QueryStats;
 
 #define PGTRACE_MAX_QUERIES 10000
 #define PGTRACE_HASH_TABLE_SIZE (PGTRACE_MAX_QUERIES * 2)
 
+/*
+ * Fingerprints that miss a full table but rank high in the sketch. A
+ * candidate whose recent time exceeds that of a sampled tracked entry
+ * replaces it.
+ */
+#define PGTRACE_CANDIDATES 64
+#define PGTRACE_EVICTION_SAMPLE 8
+
+typedef struct QueryCandidate
+{
+    uint64 fingerprint;
+    uint64 est_calls;
+    double est_time_ms;
+} QueryCandidate;
+
+/*
+ * An entry is live only while its generation matches the table's. A reset
+ * bumps the table's generation instead of clearing 50 MB under the lock:
+ * every entry turns stale at once, and stale slots are treated as free and
+ * overwritten on the next insert that probes them.
+ *
+ * Writers hold the lock exclusively. Readers of entries take no lock and
+ * copy each entry under its change count (seqlock.h), and rescan when the
+ * deletion count moved under them.
+ */
 typedef struct PgTraceQueryHash
 {
     QueryStats entries[PGTRACE_HASH_TABLE_SIZE];
+    uint32 changecount[PGTRACE_HASH_TABLE_SIZE];
+    uint64 generation;
+    uint64 deletions;
     uint64 num_entries;
     uint64 collisions;
+
+    /* Workload outside the table */
+    PgTraceSketch sketch;
+    QueryCandidate candidates[PGTRACE_CANDIDATES];
+    uint64 evict_hand;
+    uint64 total_calls;
+    double total_time_ms;
+    uint64 untracked_calls;
+    double untracked_time_ms;
+    uint64 promotions;
+    TimestampTz stats_since;
 } PgTraceQueryHash;
 
+typedef struct QueryCapacityStats
+{
+    uint64 tracked;
+    uint64 total_calls;
+    double total_time_ms;
+    uint64 untracked_calls;
+    double untracked_time_ms;
+    uint64 promotions;
+    uint64 sketch_agings;
+    uint64 collisions;
+    TimestampTz stats_since;
+} QueryCapacityStats;
+
 extern PgTraceQueryHash *pgtrace_query_hash;
 
+/* Caller holds the query hash lock, or looks at a consistent copy of the entry. */
+static inline bool
+pgtrace_hash_entry_live(const QueryStats *entry)
+{
+    return entry->valid && entry->generation == pgtrace_query_hash->generation;
+}
+
 void pgtrace_hash_init(void);
 void pgtrace_hash_request_shmem(void);
 void pgtrace_hash_startup(void);
 void pgtrace_hash_record(uint64 fingerprint, double duration_ms, bool failed,
                          const char *app_name, const char *user_name, const char *db_name,
+                         Oid userid, Oid dbid,
                          const char *req_id, uint64 rows_scanned, uint64 rows_returned);
-QueryStats *pgtrace_hash_get(uint64 fingerprint);
+void pgtrace_hash_record_locked(uint64 fingerprint, double duration_ms, bool failed,
+                                const char *app_name, const char *user_name, const char *db_name,
+                                Oid userid, Oid dbid,
+                                const char *req_id, uint64 rows_scanned, uint64 rows_returned);
+uint32 pgtrace_hash_snapshot(QueryStats *dst, uint32 max_entries);
 uint64 pgtrace_hash_count(void);
 void pgtrace_hash_reset(void);
-double pgtrace_hash_get_baseline_latency(void);
+bool pgtrace_hash_reset_entry(uint64 fingerprint);
+uint32 pgtrace_hash_breakdown_snapshot(QueryBreakdownRow **dst);
+void pgtrace_hash_capacity_stats(QueryCapacityStats *stats);
+uint32 pgtrace_hash_candidates_snapshot(QueryCandidate *dst);
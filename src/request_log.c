@@ -0,0 +1,217 @@
+#include <postgres.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <common/hashfn.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+PgTraceRequestLog *pgtrace_request_log = NULL;
+
+void pgtrace_request_log_request_shmem(void)
+{
+    RequestAddinShmemSpace(sizeof(PgTraceRequestLog));
+    RequestNamedLWLockTranche("pgtrace_request_log", 1);
+}
+
+void pgtrace_request_log_startup(void)
+{
+    bool found;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    pgtrace_request_log = ShmemInitStruct(
+        "pgtrace_request_log",
+        sizeof(PgTraceRequestLog),
+        &found);
+
+    if (!found)
+    {
+        memset(pgtrace_request_log, 0, sizeof(PgTraceRequestLog));
+        pgtrace_request_log->next_pos = 1;
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Copy a request id as it is stored, cut to PGTRACE_REQUEST_ID_LEN - 1
+ * bytes, and hash that copy, so that recording and lookup agree on ids
+ * longer than the log keeps.
+ */
+static uint32
+request_key(const char *request_id, char *key)
+{
+    strlcpy(key, request_id, PGTRACE_REQUEST_ID_LEN);
+    return hash_bytes((const unsigned char *)key, (int)strlen(key));
+}
+
+/* Entry at a position, or NULL once the log has overwritten it. Caller holds the lock. */
+static inline PgTraceRequestEntry *
+request_entry(uint64 pos)
+{
+    PgTraceRequestEntry *entry;
+
+    if (pos == 0 || pgtrace_request_log->next_pos - pos > PGTRACE_REQUEST_LOG_SIZE)
+        return NULL;
+
+    entry = &pgtrace_request_log->entries[(pos - 1) % PGTRACE_REQUEST_LOG_SIZE];
+    return entry->pos == pos ? entry : NULL;
+}
+
+void pgtrace_request_log_record(const char *request_id, uint64 fingerprint, double duration_ms,
+                                int64 rows, bool failed, bool nested)
+{
+    PgTraceRequestEntry *entry;
+    LWLockPadded *lock;
+    TimestampTz now;
+    char key[PGTRACE_REQUEST_ID_LEN];
+    uint32 hash;
+    uint32 bucket;
+    uint64 pos;
+
+    if (!pgtrace_request_log || pgtrace_request_log_window <= 0 ||
+        !request_id || request_id[0] == '\0')
+        return;
+
+    hash = request_key(request_id, key);
+    bucket = hash % PGTRACE_REQUEST_BUCKETS;
+    now = GetCurrentTimestamp();
+
+    lock = GetNamedLWLockTranche("pgtrace_request_log");
+    pgtrace_lock_acquire(PGTRACE_LOCK_REQUEST_LOG, &lock->lock, LW_EXCLUSIVE);
+
+    pos = pgtrace_request_log->next_pos++;
+    entry = &pgtrace_request_log->entries[(pos - 1) % PGTRACE_REQUEST_LOG_SIZE];
+
+    entry->pos = pos;
+    entry->prev = pgtrace_request_log->buckets[bucket];
+    entry->request_hash = hash;
+    entry->pid = MyProcPid;
+    entry->failed = failed;
+    entry->nested = nested;
+    entry->fingerprint = fingerprint;
+    entry->end_time = now;
+    entry->duration_ms = duration_ms;
+    entry->rows = rows;
+    strlcpy(entry->request_id, key, sizeof(entry->request_id));
+
+    pgtrace_request_log->buckets[bucket] = pos;
+
+    LWLockRelease(&lock->lock);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_request);
+
+PGDLLEXPORT Datum pgtrace_request(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceRequestEntry *found;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        char key[PGTRACE_REQUEST_ID_LEN];
+        uint32 hash;
+        uint32 count = 0;
+        uint32 capacity = 16;
+        uint32 i;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_request must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        hash = request_key(text_to_cstring(PG_GETARG_TEXT_PP(0)), key);
+
+        found = palloc(capacity * sizeof(PgTraceRequestEntry));
+
+        if (pgtrace_request_log && pgtrace_request_log_window > 0)
+        {
+            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_request_log");
+            TimestampTz cutoff = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                             -(int64)pgtrace_request_log_window * 1000);
+
+            /*
+             * Walk the chain into what fits. If the request has more
+             * executions, grow the array without the lock and walk again.
+             */
+            for (;;)
+            {
+                PgTraceRequestEntry *entry;
+                bool overflow = false;
+
+                count = 0;
+                pgtrace_lock_acquire(PGTRACE_LOCK_REQUEST_LOG, &lock->lock, LW_SHARED);
+
+                entry = request_entry(pgtrace_request_log->buckets[hash % PGTRACE_REQUEST_BUCKETS]);
+                while (entry && entry->end_time >= cutoff)
+                {
+                    if (entry->request_hash == hash && strcmp(entry->request_id, key) == 0)
+                    {
+                        if (count == capacity)
+                        {
+                            overflow = true;
+                            break;
+                        }
+                        found[count++] = *entry;
+                    }
+                    entry = request_entry(entry->prev);
+                }
+
+                LWLockRelease(&lock->lock);
+
+                if (!overflow)
+                    break;
+
+                capacity *= 2;
+                found = repalloc(found, capacity * sizeof(PgTraceRequestEntry));
+            }
+        }
+
+        /* The chain runs newest first; return the request in execution order. */
+        for (i = 0; i < count / 2; i++)
+        {
+            PgTraceRequestEntry tmp = found[i];
+
+            found[i] = found[count - 1 - i];
+            found[count - 1 - i] = tmp;
+        }
+
+        funcctx->user_fctx = found;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    found = (PgTraceRequestEntry *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[7];
+        bool nulls[7] = {false, false, false, false, false, false, false};
+        PgTraceRequestEntry *entry = &found[funcctx->call_cntr];
+        HeapTuple tuple;
+
+        values[0] = TimestampTzGetDatum(entry->end_time);
+        values[1] = Int32GetDatum(entry->pid);
+        values[2] = UInt64GetDatum(entry->fingerprint);
+        values[3] = Float8GetDatum(entry->duration_ms);
+        values[4] = Int64GetDatum(entry->rows);
+        values[5] = BoolGetDatum(entry->failed);
+        values[6] = BoolGetDatum(!entry->nested);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
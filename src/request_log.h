@@ -0,0 +1,49 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <utils/timestamp.h>
+#include "query_hash.h"
+
+/*
+ * Recent executions by request id. Executions that ran with
+ * pgtrace.request_id set are appended to a fixed log, overwriting the
+ * oldest. An index of hash buckets points at the newest execution in each
+ * bucket, and every execution links to the one before it in its bucket, so
+ * a lookup walks only that chain: the request's own executions plus the
+ * few others that share its bucket. Positions only grow, so a link to a
+ * position the log has since overwritten ends the chain.
+ */
+typedef struct PgTraceRequestEntry
+{
+    uint64 pos;  /* 1-based log position, 0 if never written */
+    uint64 prev; /* previous position in the same bucket, 0 if none */
+    uint32 request_hash;
+    int pid;
+    bool failed;
+    bool nested;
+    uint64 fingerprint;
+    TimestampTz end_time;
+    double duration_ms;
+    int64 rows;
+    char request_id[PGTRACE_REQUEST_ID_LEN];
+} PgTraceRequestEntry;
+
+#define PGTRACE_REQUEST_LOG_SIZE 16384
+#define PGTRACE_REQUEST_BUCKETS 16384
+
+typedef struct PgTraceRequestLog
+{
+    uint64 next_pos;
+    uint64 buckets[PGTRACE_REQUEST_BUCKETS];
+    PgTraceRequestEntry entries[PGTRACE_REQUEST_LOG_SIZE];
+} PgTraceRequestLog;
+
+extern PgTraceRequestLog *pgtrace_request_log;
+
+void pgtrace_request_log_request_shmem(void);
+void pgtrace_request_log_startup(void);
+void pgtrace_request_log_record(const char *request_id, uint64 fingerprint, double duration_ms,
+                                int64 rows, bool failed, bool nested);
+
+PGDLLEXPORT Datum pgtrace_request(PG_FUNCTION_ARGS);
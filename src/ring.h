@@ -0,0 +1,145 @@
+#pragma once
+
+#include <postgres.h>
+#include <port/atomics.h>
+
+/*
+ * Lock-free multi-producer ring shared by the event buffers.
+ *
+ * Writers reserve a position with an atomic fetch-add on the head and
+ * publish their slot through a per-slot sequence number:
+ *
+ *   0            slot never written
+ *   2 * pos + 1  slot being written for ring position pos
+ *   2 * pos + 2  slot holds the published event for position pos
+ *
+ * Readers use the sequence as a seqlock: a slot is copied only when its
+ * sequence is even and unchanged across the copy. A writer that finds its
+ * slot still owned by a writer from the previous lap gives up instead of
+ * waiting, so writers never block.
+ *
+ * A reset only moves the ring's reset position up to the head: views skip
+ * events written before it, while writers and in-order consumers (the
+ * audit log writer, the span exporter) carry on unaffected.
+ */
+
+#define PGTRACE_RING_READ_RETRIES 3
+
+typedef struct PgTraceRing
+{
+    pg_atomic_uint64 head;
+    pg_atomic_uint64 dropped;
+    pg_atomic_uint64 reset;
+    uint32 capacity;
+} PgTraceRing;
+
+static inline void
+pgtrace_ring_init(PgTraceRing *ring, uint32 capacity)
+{
+    pg_atomic_init_u64(&ring->head, 0);
+    pg_atomic_init_u64(&ring->dropped, 0);
+    pg_atomic_init_u64(&ring->reset, 0);
+    ring->capacity = capacity;
+}
+
+static inline uint64
+pgtrace_ring_reserve(PgTraceRing *ring)
+{
+    return pg_atomic_fetch_add_u64(&ring->head, 1);
+}
+
+static inline bool
+pgtrace_ring_begin_write(PgTraceRing *ring, pg_atomic_uint64 *seq, uint64 pos)
+{
+    uint64 old = pg_atomic_read_u64(seq);
+
+    /* Busy with an older lap, or already overtaken by a newer one. */
+    if ((old & 1) || old > 2 * pos)
+    {
+        pg_atomic_fetch_add_u64(&ring->dropped, 1);
+        return false;
+    }
+
+    /* The compare-exchange is a full barrier, so no payload store can move above it. */
+    if (!pg_atomic_compare_exchange_u64(seq, &old, 2 * pos + 1))
+    {
+        pg_atomic_fetch_add_u64(&ring->dropped, 1);
+        return false;
+    }
+
+    return true;
+}
+
+static inline void
+pgtrace_ring_end_write(pg_atomic_uint64 *seq, uint64 pos)
+{
+    pg_write_barrier();
+    pg_atomic_write_u64(seq, 2 * pos + 2);
+}
+
+static inline uint64
+pgtrace_ring_read_begin(pg_atomic_uint64 *seq)
+{
+    uint64 s = pg_atomic_read_u64(seq);
+
+    pg_read_barrier();
+    return s;
+}
+
+static inline bool
+pgtrace_ring_read_valid(pg_atomic_uint64 *seq, uint64 s)
+{
+    pg_read_barrier();
+    return s != 0 && (s & 1) == 0 && pg_atomic_read_u64(seq) == s;
+}
+
+/* Ring position a published sequence number belongs to. */
+static inline uint64
+pgtrace_ring_seq_pos(uint64 s)
+{
+    return (s - 2) / 2;
+}
+
+static inline uint64
+pgtrace_ring_written(PgTraceRing *ring)
+{
+    return pg_atomic_read_u64(&ring->head);
+}
+
+/* Events no longer retained because a later lap replaced them. */
+static inline uint64
+pgtrace_ring_overwritten(PgTraceRing *ring)
+{
+    uint64 head = pg_atomic_read_u64(&ring->head);
+
+    return (head > ring->capacity) ? head - ring->capacity : 0;
+}
+
+static inline uint64
+pgtrace_ring_dropped(PgTraceRing *ring)
+{
+    return pg_atomic_read_u64(&ring->dropped);
+}
+
+static inline void
+pgtrace_ring_reset(PgTraceRing *ring)
+{
+    pg_atomic_write_u64(&ring->reset, pg_atomic_read_u64(&ring->head));
+}
+
+/* Whether a published sequence number belongs to an event written since the last reset. */
+static inline bool
+pgtrace_ring_visible(PgTraceRing *ring, uint64 s)
+{
+    return pgtrace_ring_seq_pos(s) >= pg_atomic_read_u64(&ring->reset);
+}
+
+/* Events a view can still show: written since the last reset and not overwritten. */
+static inline uint64
+pgtrace_ring_retained(PgTraceRing *ring)
+{
+    uint64 head = pg_atomic_read_u64(&ring->head);
+    uint64 reset = pg_atomic_read_u64(&ring->reset);
+
+    return Min(head - Min(reset, head), (uint64)ring->capacity);
+}
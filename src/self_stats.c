@@ -0,0 +1,326 @@
+#include <postgres.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <storage/proc.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include "pgtrace.h"
+
+PgTraceBackendStats *pgtrace_my_backend_stats = NULL;
+
+static PgTraceBackendSlot *backend_slots = NULL;
+static int num_backend_slots = 0;
+
+/* Counters of processes without a slot, never reported. */
+static PgTraceBackendStats unattached_stats;
+
+static const char *const hook_names[PGTRACE_NUM_HOOKS] = {
+    "executor_start",
+    "executor_end",
+    "executor_error",
+};
+
+static const char *const lock_names[PGTRACE_NUM_LOCKS] = {
+    "pgtrace_query_hash",
+    "pgtrace_error_track",
+    "pgtrace_slow_capture",
+    "pgtrace_ash",
+    "pgtrace_plans",
+    "pgtrace_xact",
+    "pgtrace_request_log",
+    "pgtrace_imported",
+};
+
+static const char *const probe_bucket_names[PGTRACE_PROBE_BUCKETS] = {
+    "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64-127", "128-255", "256-511", "512+",
+};
+
+void pgtrace_self_stats_request_shmem(void)
+{
+    RequestAddinShmemSpace(mul_size(MaxBackends, sizeof(PgTraceBackendSlot)));
+}
+
+void pgtrace_self_stats_startup(void)
+{
+    bool found;
+    Size size = mul_size(MaxBackends, sizeof(PgTraceBackendSlot));
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    backend_slots = ShmemInitStruct("pgtrace_self_stats", size, &found);
+    num_backend_slots = MaxBackends;
+
+    if (!found)
+        memset(backend_slots, 0, size);
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Index of this process in per-backend arrays of MaxBackends entries, or
+ * -1. Regular backends and background workers have PGPROC numbers below
+ * MaxBackends; auxiliary processes, and any process before its PGPROC
+ * exists, have none.
+ */
+int
+pgtrace_my_procno(void)
+{
+    int procno;
+
+    if (!MyProc)
+        return -1;
+
+#if PG_VERSION_NUM >= 170000
+    procno = MyProcNumber;
+#else
+    procno = MyProc->pgprocno;
+#endif
+
+    if (procno < 0 || procno >= MaxBackends)
+        return -1;
+
+    return procno;
+}
+
+/*
+ * Processes without a slot count into a local struct and retry next time.
+ */
+PgTraceBackendStats *
+pgtrace_backend_stats_attach(void)
+{
+    int procno = pgtrace_my_procno();
+
+    if (!backend_slots || procno < 0)
+        return &unattached_stats;
+
+    pgtrace_my_backend_stats = &backend_slots[procno].stats;
+    return pgtrace_my_backend_stats;
+}
+
+/*
+ * LWLockAcquire that counts the acquisition and, only when the lock is
+ * not free, the time spent waiting. The uncontended path reads no clock.
+ */
+void pgtrace_lock_acquire(PgTraceLockId id, LWLock *lock, LWLockMode mode)
+{
+    PgTraceBackendStats *stats = pgtrace_backend_stats();
+    instr_time start;
+
+    stats->lock_acquisitions[id]++;
+
+    if (LWLockConditionalAcquire(lock, mode))
+        return;
+
+    INSTR_TIME_SET_CURRENT(start);
+    LWLockAcquire(lock, mode);
+    stats->lock_waits[id]++;
+    stats->lock_wait_ns[id] += pgtrace_elapsed_ns(start);
+}
+
+/* Sum of all backend slots; counters may be mid-update, never torn on 64-bit platforms. */
+static void
+sum_backend_stats(PgTraceBackendStats *total)
+{
+    int slot;
+    int i;
+
+    memset(total, 0, sizeof(PgTraceBackendStats));
+
+    for (slot = 0; slot < num_backend_slots; slot++)
+    {
+        volatile PgTraceBackendStats *stats = &backend_slots[slot].stats;
+
+        for (i = 0; i < PGTRACE_NUM_HOOKS; i++)
+        {
+            total->hook_calls[i] += stats->hook_calls[i];
+            total->hook_time_ns[i] += stats->hook_time_ns[i];
+        }
+        for (i = 0; i < PGTRACE_NUM_LOCKS; i++)
+        {
+            total->lock_acquisitions[i] += stats->lock_acquisitions[i];
+            total->lock_waits[i] += stats->lock_waits[i];
+            total->lock_wait_ns[i] += stats->lock_wait_ns[i];
+        }
+        for (i = 0; i < PGTRACE_PROBE_BUCKETS; i++)
+            total->probe_lengths[i] += stats->probe_lengths[i];
+        total->dropped_inserts += stats->dropped_inserts;
+    }
+}
+
+typedef struct PgTraceSelfStatRow
+{
+    const char *category;
+    const char *name;
+    double value;
+    double time_ms;
+    bool has_time;
+} PgTraceSelfStatRow;
+
+#define PGTRACE_SELF_STAT_ROWS \
+    (PGTRACE_NUM_HOOKS + 2 * PGTRACE_NUM_LOCKS + PGTRACE_PROBE_BUCKETS + 32)
+
+static void
+add_row(PgTraceSelfStatRow *rows, uint32 *count, const char *category, const char *name,
+        double value)
+{
+    PgTraceSelfStatRow *row = &rows[(*count)++];
+
+    row->category = category;
+    row->name = name;
+    row->value = value;
+    row->has_time = false;
+}
+
+static void
+add_timed_row(PgTraceSelfStatRow *rows, uint32 *count, const char *category, const char *name,
+              double value, uint64 time_ns)
+{
+    PgTraceSelfStatRow *row = &rows[*count];
+
+    add_row(rows, count, category, name, value);
+    row->time_ms = (double)time_ns / 1000000.0;
+    row->has_time = true;
+}
+
+static uint32
+self_stat_rows(PgTraceSelfStatRow *rows)
+{
+    PgTraceBackendStats total;
+    QueryCapacityStats capacity;
+    uint32 count = 0;
+    int i;
+
+    if (!backend_slots)
+        return 0;
+
+    sum_backend_stats(&total);
+
+    for (i = 0; i < PGTRACE_NUM_HOOKS; i++)
+        add_timed_row(rows, &count, "hook", hook_names[i],
+                      (double)total.hook_calls[i], total.hook_time_ns[i]);
+
+    for (i = 0; i < PGTRACE_NUM_LOCKS; i++)
+    {
+        add_row(rows, &count, "lock_acquisitions", lock_names[i],
+                (double)total.lock_acquisitions[i]);
+        add_timed_row(rows, &count, "lock_waits", lock_names[i],
+                      (double)total.lock_waits[i], total.lock_wait_ns[i]);
+    }
+
+    for (i = 0; i < PGTRACE_PROBE_BUCKETS; i++)
+        add_row(rows, &count, "probe_length", probe_bucket_names[i],
+                (double)total.probe_lengths[i]);
+
+    pgtrace_hash_capacity_stats(&capacity);
+    add_row(rows, &count, "query_hash", "entries", (double)capacity.tracked);
+    add_row(rows, &count, "query_hash", "slots", (double)PGTRACE_HASH_TABLE_SIZE);
+    add_row(rows, &count, "query_hash", "fill_factor",
+            (double)capacity.tracked / (double)PGTRACE_HASH_TABLE_SIZE);
+    add_row(rows, &count, "query_hash", "collisions", (double)capacity.collisions);
+    add_row(rows, &count, "query_hash", "dropped_inserts", (double)total.dropped_inserts);
+    add_row(rows, &count, "error_track", "dropped_inserts", (double)pgtrace_error_dropped());
+    if (pgtrace_plan_table)
+    {
+        add_row(rows, &count, "plans", "entries", (double)pgtrace_plan_table->num_entries);
+        add_row(rows, &count, "plans", "dropped_inserts", (double)pgtrace_plan_table->dropped);
+        add_row(rows, &count, "plans", "evictions", (double)pgtrace_plan_table->evictions);
+    }
+    if (pgtrace_ash_state)
+    {
+        add_row(rows, &count, "ash", "entries", (double)pgtrace_ash_state->num_entries);
+        add_row(rows, &count, "ash", "dropped_inserts", (double)pgtrace_ash_state->dropped);
+        add_row(rows, &count, "ash", "evictions", (double)pgtrace_ash_state->evictions);
+    }
+    if (pgtrace_xact_state)
+    {
+        add_row(rows, &count, "xact_shapes", "entries", (double)pgtrace_xact_state->num_shapes);
+        add_row(rows, &count, "xact_shapes", "dropped_inserts", (double)pgtrace_xact_state->dropped_shapes);
+        add_row(rows, &count, "xact_shapes", "evictions", (double)pgtrace_xact_state->evictions);
+    }
+
+    if (pgtrace_audit_buffer)
+    {
+        add_row(rows, &count, "ring_overwritten", "audit",
+                (double)pgtrace_audit_overwritten());
+        add_row(rows, &count, "ring_dropped", "audit",
+                (double)pgtrace_ring_dropped(&pgtrace_audit_buffer->ring));
+    }
+    if (pgtrace_slow_query_buffer)
+    {
+        add_row(rows, &count, "ring_overwritten", "slow_query",
+                (double)pgtrace_ring_overwritten(&pgtrace_slow_query_buffer->ring));
+        add_row(rows, &count, "ring_dropped", "slow_query",
+                (double)pgtrace_ring_dropped(&pgtrace_slow_query_buffer->ring));
+    }
+    if (pgtrace_xact_state)
+    {
+        add_row(rows, &count, "ring_overwritten", "xact_spans",
+                (double)pgtrace_ring_overwritten(&pgtrace_xact_state->ring));
+        add_row(rows, &count, "ring_dropped", "xact_spans",
+                (double)pgtrace_ring_dropped(&pgtrace_xact_state->ring));
+    }
+    if (pgtrace_span_buffer)
+    {
+        add_row(rows, &count, "ring_overwritten", "spans",
+                (double)pgtrace_ring_overwritten(&pgtrace_span_buffer->ring));
+        add_row(rows, &count, "ring_dropped", "spans",
+                (double)pgtrace_ring_dropped(&pgtrace_span_buffer->ring));
+    }
+
+    Assert(count <= PGTRACE_SELF_STAT_ROWS);
+    return count;
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_self_stats);
+
+PGDLLEXPORT Datum pgtrace_internal_self_stats(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceSelfStatRow *rows;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_self_stats must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        rows = palloc0(PGTRACE_SELF_STAT_ROWS * sizeof(PgTraceSelfStatRow));
+        funcctx->max_calls = self_stat_rows(rows);
+        funcctx->user_fctx = rows;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    rows = (PgTraceSelfStatRow *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[4];
+        bool nulls[4] = {false, false, false, false};
+        PgTraceSelfStatRow *row = &rows[funcctx->call_cntr];
+        HeapTuple tuple;
+
+        values[0] = CStringGetTextDatum(row->category);
+        values[1] = CStringGetTextDatum(row->name);
+        values[2] = Float8GetDatum(row->value);
+        if (row->has_time)
+            values[3] = Float8GetDatum(row->time_ms);
+        else
+            nulls[3] = true;
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <port/pg_bitutils.h>
+#include <portability/instr_time.h>
+#include <storage/lwlock.h>
+
+/*
+ * pgtrace's own cost: time spent in its hooks, waits on its locks, probe
+ * lengths and dropped inserts. Every backend writes only to its own slot,
+ * indexed by its PGPROC number, with plain increments; readers sum all
+ * slots. Slots are cache-line sized so neighbours never share a line.
+ * Counters accumulate from server start and survive backend exit, since a
+ * new backend simply continues the slot of the one before it.
+ */
+
+typedef enum PgTraceHook
+{
+    PGTRACE_HOOK_EXECUTOR_START = 0,
+    PGTRACE_HOOK_EXECUTOR_END,
+    PGTRACE_HOOK_EXECUTOR_ERROR,
+    PGTRACE_NUM_HOOKS
+} PgTraceHook;
+
+typedef enum PgTraceLockId
+{
+    PGTRACE_LOCK_QUERY_HASH = 0,
+    PGTRACE_LOCK_ERROR_TRACK,
+    PGTRACE_LOCK_SLOW_CAPTURE,
+    PGTRACE_LOCK_ASH,
+    PGTRACE_LOCK_PLANS,
+    PGTRACE_LOCK_XACT,
+    PGTRACE_LOCK_REQUEST_LOG,
+    PGTRACE_LOCK_IMPORTED,
+    PGTRACE_NUM_LOCKS
+} PgTraceLockId;
+
+/* Probe lengths 1, 2-3, 4-7, ... 256-511, 512 and more. */
+#define PGTRACE_PROBE_BUCKETS 10
+
+typedef struct PgTraceBackendStats
+{
+    uint64 hook_calls[PGTRACE_NUM_HOOKS];
+    uint64 hook_time_ns[PGTRACE_NUM_HOOKS];
+    uint64 lock_acquisitions[PGTRACE_NUM_LOCKS];
+    uint64 lock_waits[PGTRACE_NUM_LOCKS];
+    uint64 lock_wait_ns[PGTRACE_NUM_LOCKS];
+    uint64 probe_lengths[PGTRACE_PROBE_BUCKETS];
+    uint64 dropped_inserts;
+} PgTraceBackendStats;
+
+typedef union PgTraceBackendSlot
+{
+    PgTraceBackendStats stats;
+    char pad[TYPEALIGN(PG_CACHE_LINE_SIZE, sizeof(PgTraceBackendStats))];
+} PgTraceBackendSlot;
+
+extern PgTraceBackendStats *pgtrace_my_backend_stats;
+
+void pgtrace_self_stats_request_shmem(void);
+void pgtrace_self_stats_startup(void);
+int pgtrace_my_procno(void);
+PgTraceBackendStats *pgtrace_backend_stats_attach(void);
+void pgtrace_lock_acquire(PgTraceLockId id, LWLock *lock, LWLockMode mode);
+
+PGDLLEXPORT Datum pgtrace_internal_self_stats(PG_FUNCTION_ARGS);
+
+static inline PgTraceBackendStats *
+pgtrace_backend_stats(void)
+{
+    if (likely(pgtrace_my_backend_stats != NULL))
+        return pgtrace_my_backend_stats;
+
+    return pgtrace_backend_stats_attach();
+}
+
+static inline uint64
+pgtrace_elapsed_ns(instr_time start)
+{
+    instr_time now;
+
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_SUBTRACT(now, start);
+    return (uint64)(INSTR_TIME_GET_DOUBLE(now) * 1e9);
+}
+
+static inline void
+pgtrace_hook_done(PgTraceHook hook, uint64 elapsed_ns)
+{
+    PgTraceBackendStats *stats = pgtrace_backend_stats();
+
+    stats->hook_calls[hook]++;
+    stats->hook_time_ns[hook] += elapsed_ns;
+}
+
+static inline void
+pgtrace_count_probes(uint64 probes)
+{
+    int bucket = probes > 1 ? pg_leftmost_one_pos64(probes) : 0;
+
+    pgtrace_backend_stats()->probe_lengths[Min(bucket, PGTRACE_PROBE_BUCKETS - 1)]++;
+}
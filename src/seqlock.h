@@ -0,0 +1,85 @@
+#pragma once
+
+#include <postgres.h>
+#include <miscadmin.h>
+#include <port/atomics.h>
+
+/*
+ * Per-entry change counts for shared tables whose writers serialize on an
+ * LWLock while readers take no lock at all; the protocol of
+ * pgstat_begin_write_activity(). A writer makes an entry's count odd before
+ * touching the entry and even again afterwards. A reader copies the entry
+ * and keeps the copy only if the count was even and unchanged across it.
+ *
+ * Counts live in an array beside the entries rather than inside them, so
+ * that moving or clearing an entry never clobbers its own count. The
+ * critical section turns an error between the two increments into a PANIC,
+ * so a count is never left odd.
+ */
+#define PGTRACE_SEQ_BEGIN_WRITE(count) \
+    do { \
+        START_CRIT_SECTION(); \
+        (count)++; \
+        pg_write_barrier(); \
+    } while (0)
+
+#define PGTRACE_SEQ_END_WRITE(count) \
+    do { \
+        pg_write_barrier(); \
+        (count)++; \
+        Assert(((count) & 1) == 0); \
+        END_CRIT_SECTION(); \
+    } while (0)
+
+#define PGTRACE_SEQ_READ_RETRIES 1000
+
+/*
+ * Tables that delete by backward shift also count deletions: a scan that
+ * overlapped one may have seen a moved entry twice or missed it, so it
+ * starts over, up to this many times. The count is bumped before and after
+ * the entries move, like a change count, so it is odd while they do; a scan
+ * is good if the count was even when it started and has not moved since.
+ */
+#define PGTRACE_SEQ_SCAN_RETRIES 3
+
+#define PGTRACE_DELETION_BEGIN(count) \
+    do { \
+        (count)++; \
+        pg_write_barrier(); \
+    } while (0)
+
+#define PGTRACE_DELETION_END(count) \
+    do { \
+        pg_write_barrier(); \
+        (count)++; \
+    } while (0)
+
+/*
+ * Consistent copy of an entry, or false if it kept changing. Writers hold
+ * an entry for a microsecond or so, so giving up means the entry is being
+ * rewritten faster than it can be copied.
+ */
+static inline bool
+pgtrace_seq_read(volatile uint32 *count, const volatile void *src, void *dst, Size size)
+{
+    int attempt;
+
+    for (attempt = 0; attempt < PGTRACE_SEQ_READ_RETRIES; attempt++)
+    {
+        uint32 before = *count;
+
+        if ((before & 1) == 0)
+        {
+            pg_read_barrier();
+            memcpy(dst, (const void *)src, size);
+            pg_read_barrier();
+
+            if (*count == before)
+                return true;
+        }
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    return false;
+}
@@ -7,15 +7,27 @@ PgTraceMetrics *pgtrace_metrics = NULL;
 void pgtrace_shmem_request(void)
 {
     RequestAddinShmemSpace(sizeof(PgTraceMetrics));
-    RequestNamedLWLockTranche("pgtrace", 1);
 
     pgtrace_hash_request_shmem();
 
     pgtrace_slow_query_request_shmem();
 
+    pgtrace_slow_capture_request_shmem();
+
     pgtrace_error_request_shmem();
 
     pgtrace_audit_request_shmem();
+
+    pgtrace_self_stats_request_shmem();
+
+    pgtrace_ash_request_shmem();
+
+    pgtrace_activity_request_shmem();
+    pgtrace_plans_request_shmem();
+    pgtrace_xact_request_shmem();
+    pgtrace_request_log_request_shmem();
+    pgtrace_trace_request_shmem();
+    pgtrace_imported_request_shmem();
 }
 
 void pgtrace_shmem_startup(void)
@@ -31,8 +43,27 @@ void pgtrace_shmem_startup(void)
 
     if (!found)
     {
+        int i;
+
         memset(pgtrace_metrics, 0, sizeof(PgTraceMetrics));
+        pg_atomic_init_u64(&pgtrace_metrics->queries_total, 0);
+        pg_atomic_init_u64(&pgtrace_metrics->queries_failed, 0);
+        pg_atomic_init_u64(&pgtrace_metrics->slow_queries, 0);
+        pg_atomic_init_u64(&pgtrace_metrics->queries_cancelled, 0);
+        pg_atomic_init_u64(&pgtrace_metrics->parallel_queries, 0);
+        pg_atomic_init_u64(&pgtrace_metrics->workers_planned, 0);
+        pg_atomic_init_u64(&pgtrace_metrics->workers_launched, 0);
+        pgtrace_histogram_init(&pgtrace_metrics->latency);
+        for (i = 0; i < PGTRACE_HIST_DATABASES; i++)
+        {
+            pg_atomic_init_u32(&pgtrace_metrics->databases[i].dbid, InvalidOid);
+            pgtrace_histogram_init(&pgtrace_metrics->databases[i].hist);
+        }
+        pgtrace_histogram_init(&pgtrace_metrics->other_databases);
         pgtrace_metrics->start_time = GetCurrentTimestamp();
+        SpinLockInit(&pgtrace_metrics->reset_mutex);
+        for (i = 0; i < PGTRACE_NUM_COMPONENTS; i++)
+            pgtrace_metrics->stats_since[i] = pgtrace_metrics->start_time;
     }
 
     LWLockRelease(AddinShmemInitLock);
@@ -41,7 +72,20 @@ void pgtrace_shmem_startup(void)
 
     pgtrace_slow_query_startup();
 
+    pgtrace_slow_capture_startup();
+
     pgtrace_error_startup();
 
     pgtrace_audit_startup();
+
+    pgtrace_self_stats_startup();
+
+    pgtrace_ash_startup();
+
+    pgtrace_activity_startup();
+    pgtrace_plans_startup();
+    pgtrace_xact_startup();
+    pgtrace_request_log_startup();
+    pgtrace_trace_startup();
+    pgtrace_imported_startup();
 }
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <postgres.h>
+#include <float.h>
+#include <common/hashfn.h>
+
+/*
+ * Count-min sketch of calls and execution time per fingerprint.
+ *
+ * Every statement increments one cell in each row; a fingerprint's
+ * estimate is the minimum over its cells, which never undercounts and
+ * overcounts by at most e/WIDTH of the total with high probability.
+ * Counters are halved every PGTRACE_SKETCH_AGING_INTERVAL updates so the
+ * estimates follow recent load rather than all-time totals, which lets a
+ * fingerprint that turns hot outrank one that was busy long ago. Aging is
+ * spread over the updates: every PGTRACE_SKETCH_AGING_STRIDE-th one halves
+ * the next column, so no single update walks the whole sketch under the
+ * caller's lock. agings counts completed sweeps.
+ *
+ * The sketch has no lock of its own; callers hold the owning structure's
+ * lock.
+ */
+
+#define PGTRACE_SKETCH_DEPTH 4
+#define PGTRACE_SKETCH_WIDTH 4096
+#define PGTRACE_SKETCH_AGING_INTERVAL 65536
+#define PGTRACE_SKETCH_AGING_STRIDE (PGTRACE_SKETCH_AGING_INTERVAL / PGTRACE_SKETCH_WIDTH)
+
+typedef struct PgTraceSketch
+{
+    uint64 calls[PGTRACE_SKETCH_DEPTH][PGTRACE_SKETCH_WIDTH];
+    double time_ms[PGTRACE_SKETCH_DEPTH][PGTRACE_SKETCH_WIDTH];
+    uint64 updates;
+    uint32 aging_col; /* next column to halve */
+    uint64 agings;
+} PgTraceSketch;
+
+static inline uint32
+pgtrace_sketch_cell(uint64 fingerprint, int row)
+{
+    uint32 key = (uint32)(fingerprint ^ (fingerprint >> 32));
+
+    return hash_bytes_uint32_extended(key, (uint64)row) & (PGTRACE_SKETCH_WIDTH - 1);
+}
+
+static inline void
+pgtrace_sketch_age_column(PgTraceSketch *sketch)
+{
+    uint32 col = sketch->aging_col;
+    int row;
+
+    for (row = 0; row < PGTRACE_SKETCH_DEPTH; row++)
+    {
+        sketch->calls[row][col] >>= 1;
+        sketch->time_ms[row][col] *= 0.5;
+    }
+
+    if (++sketch->aging_col == PGTRACE_SKETCH_WIDTH)
+    {
+        sketch->aging_col = 0;
+        sketch->agings++;
+    }
+}
+
+static inline void
+pgtrace_sketch_add(PgTraceSketch *sketch, uint64 fingerprint, double duration_ms)
+{
+    int row;
+
+    for (row = 0; row < PGTRACE_SKETCH_DEPTH; row++)
+    {
+        uint32 col = pgtrace_sketch_cell(fingerprint, row);
+
+        sketch->calls[row][col]++;
+        sketch->time_ms[row][col] += duration_ms;
+    }
+
+    if (++sketch->updates % PGTRACE_SKETCH_AGING_STRIDE == 0)
+        pgtrace_sketch_age_column(sketch);
+}
+
+static inline void
+pgtrace_sketch_estimate(PgTraceSketch *sketch, uint64 fingerprint,
+                        uint64 *calls, double *time_ms)
+{
+    int row;
+
+    *calls = PG_UINT64_MAX;
+    *time_ms = DBL_MAX;
+
+    for (row = 0; row < PGTRACE_SKETCH_DEPTH; row++)
+    {
+        uint32 col = pgtrace_sketch_cell(fingerprint, row);
+
+        *calls = Min(*calls, sketch->calls[row][col]);
+        *time_ms = Min(*time_ms, sketch->time_ms[row][col]);
+    }
+}
@@ -0,0 +1,277 @@
+#include <postgres.h>
+#include <commands/explain.h>
+#include <executor/instrument.h>
+#include <mb/pg_wchar.h>
+#include <storage/shmem.h>
+#include <storage/lwlock.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+SlowQueryCaptureArena *pgtrace_capture_arena = NULL;
+
+void pgtrace_slow_capture_request_shmem(void)
+{
+    RequestAddinShmemSpace(sizeof(SlowQueryCaptureArena));
+    RequestNamedLWLockTranche("pgtrace_slow_capture", 1);
+}
+
+void pgtrace_slow_capture_startup(void)
+{
+    bool found;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    pgtrace_capture_arena = ShmemInitStruct(
+        "pgtrace_capture_arena",
+        sizeof(SlowQueryCaptureArena),
+        &found);
+
+    if (!found)
+    {
+        memset(pgtrace_capture_arena, 0, sizeof(SlowQueryCaptureArena));
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+bool pgtrace_slow_capture_wants_instrumentation(void)
+{
+    return pgtrace_enabled &&
+           pgtrace_slow_query_capture == PGTRACE_CAPTURE_PLAN &&
+           pgtrace_slow_query_capture_analyze;
+}
+
+/*
+ * Reserve the arena slot for fingerprint, or return -1 if it was captured
+ * less than pgtrace.slow_query_capture_interval ago. A fingerprint without
+ * a slot takes an empty one or evicts the least recently captured.
+ */
+static int
+capture_claim(uint64 fingerprint, TimestampTz now)
+{
+    LWLockPadded *lock;
+    int slot = -1;
+    int victim = 0;
+    int i;
+
+    lock = GetNamedLWLockTranche("pgtrace_slow_capture");
+    pgtrace_lock_acquire(PGTRACE_LOCK_SLOW_CAPTURE, &lock->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < PGTRACE_CAPTURE_ENTRIES; i++)
+    {
+        if (pgtrace_capture_arena->fingerprints[i] == fingerprint)
+        {
+            slot = i;
+            break;
+        }
+
+        if (pgtrace_capture_arena->last_capture[i] < pgtrace_capture_arena->last_capture[victim])
+            victim = i;
+    }
+
+    if (slot >= 0)
+    {
+        if (!TimestampDifferenceExceeds(pgtrace_capture_arena->last_capture[slot], now,
+                                        pgtrace_slow_query_capture_interval * 1000))
+        {
+            pgtrace_capture_arena->entries[slot].suppressed++;
+            slot = -1;
+        }
+    }
+    else
+    {
+        slot = victim;
+        pgtrace_capture_arena->fingerprints[slot] = fingerprint;
+        memset(&pgtrace_capture_arena->entries[slot], 0, offsetof(SlowQueryCapture, text));
+    }
+
+    if (slot >= 0)
+        pgtrace_capture_arena->last_capture[slot] = now;
+
+    LWLockRelease(&lock->lock);
+
+    return slot;
+}
+
+static uint32
+capture_append(char *dst, uint32 space, const char *src, uint32 max_len)
+{
+    uint32 len;
+
+    if (!src)
+        return 0;
+
+    len = pg_mbcliplen(src, strlen(src), Min(space, max_len));
+    memcpy(dst, src, len);
+
+    return len;
+}
+
+static char *
+capture_plan(QueryDesc *queryDesc, bool *analyzed)
+{
+    ExplainState *es = NewExplainState();
+
+    es->analyze = (queryDesc->instrument_options & INSTRUMENT_ROWS) != 0 &&
+                  queryDesc->planstate && queryDesc->planstate->instrument;
+    es->timing = false;
+    es->summary = false;
+    es->format = EXPLAIN_FORMAT_TEXT;
+
+    ExplainBeginOutput(es);
+    ExplainPrintPlan(es, queryDesc);
+    ExplainEndOutput(es);
+
+    /* Drop the trailing newline */
+    if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
+        es->str->data[--es->str->len] = '\0';
+
+    *analyzed = es->analyze;
+    return es->str->data;
+}
+
+void pgtrace_slow_capture(QueryDesc *queryDesc, uint64 fingerprint, double duration_ms)
+{
+    TimestampTz now;
+    LWLockPadded *lock;
+    SlowQueryCapture *entry;
+    char *normalized;
+    char *plan = NULL;
+    bool analyzed = false;
+    int slot;
+
+    if (!pgtrace_capture_arena || pgtrace_slow_query_capture == PGTRACE_CAPTURE_OFF ||
+        !queryDesc->sourceText)
+        return;
+
+    now = GetCurrentTimestamp();
+    slot = capture_claim(fingerprint, now);
+    if (slot < 0)
+        return;
+
+    /* Build everything outside the lock; only the copy happens under it. */
+    normalized = pgtrace_normalize_query(queryDesc->sourceText);
+    if (pgtrace_slow_query_capture == PGTRACE_CAPTURE_PLAN && queryDesc->planstate)
+        plan = capture_plan(queryDesc, &analyzed);
+
+    lock = GetNamedLWLockTranche("pgtrace_slow_capture");
+    pgtrace_lock_acquire(PGTRACE_LOCK_SLOW_CAPTURE, &lock->lock, LW_EXCLUSIVE);
+
+    /* Another fingerprint may have evicted us while the plan was built. */
+    if (pgtrace_capture_arena->fingerprints[slot] == fingerprint)
+    {
+        uint32 used = 0;
+
+        entry = &pgtrace_capture_arena->entries[slot];
+        entry->fingerprint = fingerprint;
+        entry->captured_at = now;
+        entry->duration_ms = duration_ms;
+        entry->captures++;
+        entry->plan_analyzed = analyzed;
+
+        entry->normalized_len = capture_append(entry->text, PGTRACE_CAPTURE_TEXT_SIZE,
+                                               normalized, PGTRACE_CAPTURE_QUERY_MAX);
+        used += entry->normalized_len;
+
+        entry->example_len = capture_append(entry->text + used, PGTRACE_CAPTURE_TEXT_SIZE - used,
+                                            queryDesc->sourceText, PGTRACE_CAPTURE_QUERY_MAX);
+        used += entry->example_len;
+
+        entry->plan_len = capture_append(entry->text + used, PGTRACE_CAPTURE_TEXT_SIZE - used,
+                                         plan, PGTRACE_CAPTURE_TEXT_SIZE);
+        entry->valid = true;
+    }
+
+    LWLockRelease(&lock->lock);
+
+    if (normalized)
+        pfree(normalized);
+    if (plan)
+        pfree(plan);
+}
+
+uint32
+pgtrace_slow_capture_snapshot(SlowQueryCapture **dst)
+{
+    LWLockPadded *lock;
+    uint32 count = 0;
+    uint32 i;
+
+    *dst = NULL;
+
+    if (!pgtrace_capture_arena)
+        return 0;
+
+    *dst = palloc(PGTRACE_CAPTURE_ENTRIES * sizeof(SlowQueryCapture));
+
+    lock = GetNamedLWLockTranche("pgtrace_slow_capture");
+    pgtrace_lock_acquire(PGTRACE_LOCK_SLOW_CAPTURE, &lock->lock, LW_SHARED);
+
+    for (i = 0; i < PGTRACE_CAPTURE_ENTRIES; i++)
+    {
+        SlowQueryCapture *entry = &pgtrace_capture_arena->entries[i];
+
+        if (entry->valid)
+            memcpy(&(*dst)[count++], entry, sizeof(SlowQueryCapture));
+    }
+
+    LWLockRelease(&lock->lock);
+
+    return count;
+}
+
+/*
+ * Empty every slot. A capture whose plan is being built when this runs
+ * finds its fingerprint gone and drops the sample.
+ */
+void pgtrace_slow_capture_reset(void)
+{
+    LWLockPadded *lock;
+    int i;
+
+    if (!pgtrace_capture_arena)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_slow_capture");
+    pgtrace_lock_acquire(PGTRACE_LOCK_SLOW_CAPTURE, &lock->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < PGTRACE_CAPTURE_ENTRIES; i++)
+    {
+        pgtrace_capture_arena->fingerprints[i] = 0;
+        pgtrace_capture_arena->last_capture[i] = 0;
+        memset(&pgtrace_capture_arena->entries[i], 0, offsetof(SlowQueryCapture, text));
+    }
+
+    LWLockRelease(&lock->lock);
+}
+
+/* Empty fingerprint's slot, if it has one. */
+bool
+pgtrace_slow_capture_reset_fingerprint(uint64 fingerprint)
+{
+    LWLockPadded *lock;
+    bool found = false;
+    int i;
+
+    if (!pgtrace_capture_arena)
+        return false;
+
+    lock = GetNamedLWLockTranche("pgtrace_slow_capture");
+    pgtrace_lock_acquire(PGTRACE_LOCK_SLOW_CAPTURE, &lock->lock, LW_EXCLUSIVE);
+
+    for (i = 0; i < PGTRACE_CAPTURE_ENTRIES; i++)
+    {
+        if (pgtrace_capture_arena->fingerprints[i] == fingerprint)
+        {
+            pgtrace_capture_arena->fingerprints[i] = 0;
+            pgtrace_capture_arena->last_capture[i] = 0;
+            memset(&pgtrace_capture_arena->entries[i], 0, offsetof(SlowQueryCapture, text));
+            found = true;
+            break;
+        }
+    }
+
+    LWLockRelease(&lock->lock);
+
+    return found;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <postgres.h>
+#include <executor/execdesc.h>
+#include <utils/timestamp.h>
+
+/*
+ * Slow-query samples: normalized text, one literal-bearing example and the
+ * plan of a recent slow execution per fingerprint. The arena has a fixed
+ * number of fixed-size slots; the least recently captured fingerprint is
+ * evicted, and each fingerprint is captured at most once per
+ * pgtrace.slow_query_capture_interval.
+ */
+#define PGTRACE_CAPTURE_ENTRIES 256
+#define PGTRACE_CAPTURE_TEXT_SIZE 16384
+#define PGTRACE_CAPTURE_QUERY_MAX (PGTRACE_CAPTURE_TEXT_SIZE / 4)
+
+typedef enum PgTraceCaptureMode
+{
+    PGTRACE_CAPTURE_OFF = 0,
+    PGTRACE_CAPTURE_TEXT,
+    PGTRACE_CAPTURE_PLAN
+} PgTraceCaptureMode;
+
+typedef struct SlowQueryCapture
+{
+    uint64 fingerprint;
+    TimestampTz captured_at;
+    double duration_ms;
+    uint64 captures;
+    uint64 suppressed;
+    uint32 normalized_len;
+    uint32 example_len;
+    uint32 plan_len;
+    bool plan_analyzed;
+    bool valid;
+    char text[PGTRACE_CAPTURE_TEXT_SIZE];
+} SlowQueryCapture;
+
+typedef struct SlowQueryCaptureArena
+{
+    uint64 fingerprints[PGTRACE_CAPTURE_ENTRIES];
+    TimestampTz last_capture[PGTRACE_CAPTURE_ENTRIES];
+    SlowQueryCapture entries[PGTRACE_CAPTURE_ENTRIES];
+} SlowQueryCaptureArena;
+
+extern SlowQueryCaptureArena *pgtrace_capture_arena;
+
+void pgtrace_slow_capture_request_shmem(void);
+void pgtrace_slow_capture_startup(void);
+bool pgtrace_slow_capture_wants_instrumentation(void);
+void pgtrace_slow_capture(QueryDesc *queryDesc, uint64 fingerprint, double duration_ms);
+uint32 pgtrace_slow_capture_snapshot(SlowQueryCapture **dst);
+void pgtrace_slow_capture_reset(void);
+bool pgtrace_slow_capture_reset_fingerprint(uint64 fingerprint);
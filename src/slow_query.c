@@ -10,12 +10,12 @@ SlowQueryRingBuffer *pgtrace_slow_query_buffer = NULL;
 void pgtrace_slow_query_request_shmem(void)
 {
     RequestAddinShmemSpace(sizeof(SlowQueryRingBuffer));
-    RequestNamedLWLockTranche("pgtrace_slow_query", 1);
 }
 
 void pgtrace_slow_query_startup(void)
 {
     bool found;
+    uint32 i;
 
     LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
@@ -27,6 +27,9 @@ void pgtrace_slow_query_startup(void)
     if (!found)
     {
         memset(pgtrace_slow_query_buffer, 0, sizeof(SlowQueryRingBuffer));
+        pgtrace_ring_init(&pgtrace_slow_query_buffer->ring, PGTRACE_SLOW_QUERY_BUFFER_SIZE);
+        for (i = 0; i < PGTRACE_SLOW_QUERY_BUFFER_SIZE; i++)
+            pg_atomic_init_u64(&pgtrace_slow_query_buffer->entries[i].seq, 0);
     }
 
     LWLockRelease(AddinShmemInitLock);
@@ -36,22 +39,24 @@ void pgtrace_slow_query_record(uint64 fingerprint, double duration_ms,
                                const char *app_name, const char *user,
                                int64 rows_processed)
 {
+    SlowQuerySlot *slot;
     SlowQueryEntry *entry;
-    LWLockPadded *lock;
+    uint64 pos;
 
     if (!pgtrace_slow_query_buffer)
         return;
 
-    lock = GetNamedLWLockTranche("pgtrace_slow_query");
-    LWLockAcquire(&lock->lock, LW_EXCLUSIVE);
+    pos = pgtrace_ring_reserve(&pgtrace_slow_query_buffer->ring);
+    slot = &pgtrace_slow_query_buffer->entries[pos % PGTRACE_SLOW_QUERY_BUFFER_SIZE];
 
-    entry = &pgtrace_slow_query_buffer->entries[pgtrace_slow_query_buffer->write_pos];
+    if (!pgtrace_ring_begin_write(&pgtrace_slow_query_buffer->ring, &slot->seq, pos))
+        return;
 
+    entry = &slot->entry;
     entry->fingerprint = fingerprint;
     entry->duration_ms = duration_ms;
     entry->timestamp = GetCurrentTimestamp();
     entry->rows_processed = rows_processed;
-    entry->valid = true;
 
     if (app_name)
         snprintf(entry->application_name, sizeof(entry->application_name), "%s", app_name);
@@ -63,34 +68,48 @@ void pgtrace_slow_query_record(uint64 fingerprint, double duration_ms,
     else
         entry->user[0] = '\0';
 
-    pgtrace_slow_query_buffer->total_slow_queries++;
-
-    pgtrace_slow_query_buffer->write_pos =
-        (pgtrace_slow_query_buffer->write_pos + 1) % PGTRACE_SLOW_QUERY_BUFFER_SIZE;
-
-    LWLockRelease(&lock->lock);
+    pgtrace_ring_end_write(&slot->seq, pos);
 }
 
 uint32
-pgtrace_slow_query_count(void)
+pgtrace_slow_query_snapshot(SlowQueryEntry *dst, uint32 max_entries)
 {
     uint32 count = 0;
     uint32 i;
-    LWLockPadded *lock;
 
     if (!pgtrace_slow_query_buffer)
         return 0;
 
-    lock = GetNamedLWLockTranche("pgtrace_slow_query");
-    LWLockAcquire(&lock->lock, LW_SHARED);
-
-    for (i = 0; i < PGTRACE_SLOW_QUERY_BUFFER_SIZE; i++)
+    for (i = 0; i < PGTRACE_SLOW_QUERY_BUFFER_SIZE && count < max_entries; i++)
     {
-        if (pgtrace_slow_query_buffer->entries[i].valid)
-            count++;
-    }
+        SlowQuerySlot *slot = &pgtrace_slow_query_buffer->entries[i];
+        int attempt;
+
+        for (attempt = 0; attempt < PGTRACE_RING_READ_RETRIES; attempt++)
+        {
+            uint64 seq = pgtrace_ring_read_begin(&slot->seq);
 
-    LWLockRelease(&lock->lock);
+            if (seq == 0 || !pgtrace_ring_visible(&pgtrace_slow_query_buffer->ring, seq))
+                break;
+
+            memcpy(&dst[count], &slot->entry, sizeof(SlowQueryEntry));
+
+            if (pgtrace_ring_read_valid(&slot->seq, seq))
+            {
+                count++;
+                break;
+            }
+        }
+    }
 
     return count;
 }
+
+uint32
+pgtrace_slow_query_count(void)
+{
+    if (!pgtrace_slow_query_buffer)
+        return 0;
+
+    return (uint32)pgtrace_ring_retained(&pgtrace_slow_query_buffer->ring);
+}
@@ -2,6 +2,7 @@
 
 #include <postgres.h>
 #include <utils/timestamp.h>
+#include "ring.h"
 
 typedef struct SlowQueryEntry
 {
@@ -11,16 +12,20 @@ typedef struct SlowQueryEntry
     char application_name[64];
     char user[32];
     int64 rows_processed;
-    bool valid;
 } SlowQueryEntry;
 
+typedef struct SlowQuerySlot
+{
+    pg_atomic_uint64 seq;
+    SlowQueryEntry entry;
+} SlowQuerySlot;
+
 #define PGTRACE_SLOW_QUERY_BUFFER_SIZE 1000
 
 typedef struct SlowQueryRingBuffer
 {
-    SlowQueryEntry entries[PGTRACE_SLOW_QUERY_BUFFER_SIZE];
-    uint32 write_pos;
-    uint64 total_slow_queries;
+    PgTraceRing ring;
+    SlowQuerySlot entries[PGTRACE_SLOW_QUERY_BUFFER_SIZE];
 } SlowQueryRingBuffer;
 
 extern SlowQueryRingBuffer *pgtrace_slow_query_buffer;
@@ -30,4 +35,5 @@ void pgtrace_slow_query_startup(void);
 void pgtrace_slow_query_record(uint64 fingerprint, double duration_ms,
                                const char *app_name, const char *user,
                                int64 rows_processed);
+uint32 pgtrace_slow_query_snapshot(SlowQueryEntry *dst, uint32 max_entries);
 uint32 pgtrace_slow_query_count(void);
@@ -0,0 +1,470 @@
+#include <postgres.h>
+#include <ctype.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <common/pg_prng.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+PgTraceSpanBuffer *pgtrace_span_buffer = NULL;
+
+/* pgtrace.traceparent, parsed when it is assigned. */
+static PgTraceContext guc_trace;
+
+void pgtrace_trace_request_shmem(void)
+{
+    RequestAddinShmemSpace(sizeof(PgTraceSpanBuffer));
+}
+
+void pgtrace_trace_startup(void)
+{
+    bool found;
+    uint32 i;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    pgtrace_span_buffer = ShmemInitStruct(
+        "pgtrace_span_buffer",
+        sizeof(PgTraceSpanBuffer),
+        &found);
+
+    if (!found)
+    {
+        memset(pgtrace_span_buffer, 0, sizeof(PgTraceSpanBuffer));
+        pgtrace_ring_init(&pgtrace_span_buffer->ring, PGTRACE_SPAN_BUFFER_SIZE);
+        pg_atomic_init_u64(&pgtrace_span_buffer->exporter.exported, 0);
+        pg_atomic_init_u64(&pgtrace_span_buffer->exporter.lost, 0);
+        SpinLockInit(&pgtrace_span_buffer->exporter.mutex);
+        for (i = 0; i < PGTRACE_SPAN_BUFFER_SIZE; i++)
+            pg_atomic_init_u64(&pgtrace_span_buffer->entries[i].seq, 0);
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+static inline int
+hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Decode 2 * nbytes hex digits; false on a non-hex digit. */
+static bool
+parse_hex(const char *src, int nbytes, uint8 *dst)
+{
+    int i;
+
+    for (i = 0; i < nbytes; i++)
+    {
+        int hi = hex_value(src[2 * i]);
+        int lo = hex_value(src[2 * i + 1]);
+
+        if (hi < 0 || lo < 0)
+            return false;
+        dst[i] = (uint8)((hi << 4) | lo);
+    }
+
+    return true;
+}
+
+static bool
+all_zero(const uint8 *bytes, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (bytes[i] != 0)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Parse "version-traceid-parentid-flags". Version 00 has exactly these
+ * four fields; later versions may append more, which are ignored.
+ */
+bool
+pgtrace_trace_parse(const char *traceparent, size_t len, PgTraceContext *ctx)
+{
+    uint8 version;
+    uint8 parent[8];
+    int i;
+
+    if (len < 55 || traceparent[2] != '-' || traceparent[35] != '-' || traceparent[52] != '-')
+        return false;
+
+    if (!parse_hex(traceparent, 1, &version) || version == 0xff)
+        return false;
+
+    if ((version == 0 && len != 55) || (len > 55 && traceparent[55] != '-'))
+        return false;
+
+    memset(ctx, 0, sizeof(PgTraceContext));
+
+    if (!parse_hex(traceparent + 3, 16, ctx->trace_id) || all_zero(ctx->trace_id, 16) ||
+        !parse_hex(traceparent + 36, 8, parent) || all_zero(parent, 8) ||
+        !parse_hex(traceparent + 53, 1, &ctx->flags))
+        return false;
+
+    for (i = 0; i < 8; i++)
+        ctx->parent_span_id = (ctx->parent_span_id << 8) | parent[i];
+
+    ctx->valid = true;
+    return true;
+}
+
+/*
+ * Value of key=value in a sqlcommenter comment body, percent-decoded. The
+ * value may be quoted; unquoted values end at a comma or space.
+ */
+static bool
+comment_value(const char *start, const char *end, const char *key, char *dst, size_t dstlen)
+{
+    size_t keylen = strlen(key);
+    const char *p;
+
+    for (p = start; p + keylen <= end; p++)
+    {
+        const char *v;
+        char quote = '\0';
+        size_t n = 0;
+
+        if (strncmp(p, key, keylen) != 0)
+            continue;
+        if (p > start && (isalnum((unsigned char)p[-1]) || p[-1] == '_'))
+            continue;
+
+        v = p + keylen;
+        while (v < end && *v == ' ')
+            v++;
+        if (v >= end || *v != '=')
+            continue;
+        v++;
+        while (v < end && *v == ' ')
+            v++;
+        if (v < end && (*v == '\'' || *v == '"'))
+            quote = *v++;
+
+        while (v < end && n + 1 < dstlen)
+        {
+            char c = *v;
+
+            if (quote ? c == quote : (c == ',' || c == ' '))
+                break;
+
+            if (c == '%' && v + 2 < end && hex_value(v[1]) >= 0 && hex_value(v[2]) >= 0)
+            {
+                c = (char)((hex_value(v[1]) << 4) | hex_value(v[2]));
+                v += 2;
+            }
+
+            dst[n++] = c;
+            v++;
+        }
+
+        dst[n] = '\0';
+        return true;
+    }
+
+    return false;
+}
+
+static bool
+trace_from_comment(const char *start, const char *end, PgTraceContext *ctx)
+{
+    char value[PGTRACE_TRACESTATE_LEN];
+
+    if (!comment_value(start, end, "traceparent", value, sizeof(value)) ||
+        !pgtrace_trace_parse(value, strlen(value), ctx))
+        return false;
+
+    comment_value(start, end, "tracestate", ctx->tracestate, sizeof(ctx->tracestate));
+    return true;
+}
+
+/* Trace context from the first comment of the query that carries one. */
+bool
+pgtrace_trace_from_query(const char *query_text, PgTraceContext *ctx)
+{
+    const char *p;
+    bool in_string = false;
+
+    /* Nearly every statement lacks one, and strstr is much cheaper than the scan. */
+    if (!query_text || !strstr(query_text, "traceparent"))
+        return false;
+
+    p = query_text;
+    while (*p)
+    {
+        const char *start;
+        const char *end;
+
+        if (*p == '\'')
+            in_string = !in_string;
+
+        if (in_string || !((p[0] == '/' && p[1] == '*') || (p[0] == '-' && p[1] == '-')))
+        {
+            p++;
+            continue;
+        }
+
+        start = p + 2;
+        if (p[0] == '/')
+        {
+            end = strstr(start, "*/");
+            if (!end)
+                end = start + strlen(start);
+            p = *end ? end + 2 : end;
+        }
+        else
+        {
+            end = strchr(start, '\n');
+            if (!end)
+                end = start + strlen(start);
+            p = end;
+        }
+
+        if (trace_from_comment(start, end, ctx))
+            return true;
+    }
+
+    return false;
+}
+
+bool
+pgtrace_trace_from_guc(PgTraceContext *ctx)
+{
+    if (!guc_trace.valid)
+        return false;
+
+    *ctx = guc_trace;
+    return true;
+}
+
+bool
+pgtrace_traceparent_check(char **newval, void **extra, GucSource source)
+{
+    PgTraceContext ctx;
+
+    if (*newval == NULL || (*newval)[0] == '\0')
+        return true;
+
+    if (!pgtrace_trace_parse(*newval, strlen(*newval), &ctx))
+    {
+        GUC_check_errdetail("Expected a W3C traceparent such as \"00-<32 hex digits>-<16 hex digits>-01\".");
+        return false;
+    }
+
+    return true;
+}
+
+void pgtrace_traceparent_assign(const char *newval, void *extra)
+{
+    memset(&guc_trace, 0, sizeof(guc_trace));
+
+    if (newval && newval[0] != '\0')
+        pgtrace_trace_parse(newval, strlen(newval), &guc_trace);
+}
+
+uint64
+pgtrace_trace_new_span_id(void)
+{
+    uint64 id;
+
+    do
+        id = pg_prng_uint64(&pg_global_prng_state);
+    while (id == 0);
+
+    return id;
+}
+
+void pgtrace_trace_format_id(char *dst, const uint8 *id, int len)
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        dst[2 * i] = digits[id[i] >> 4];
+        dst[2 * i + 1] = digits[id[i] & 0x0f];
+    }
+    dst[2 * len] = '\0';
+}
+
+void pgtrace_trace_format_span_id(char *dst, uint64 span_id)
+{
+    uint8 bytes[8];
+    int i;
+
+    for (i = 7; i >= 0; i--)
+    {
+        bytes[i] = (uint8)(span_id & 0xff);
+        span_id >>= 8;
+    }
+
+    pgtrace_trace_format_id(dst, bytes, 8);
+}
+
+const char *
+pgtrace_span_operation_name(uint8 operation)
+{
+    switch ((CmdType)operation)
+    {
+    case CMD_SELECT:
+        return "SELECT";
+    case CMD_INSERT:
+        return "INSERT";
+    case CMD_UPDATE:
+        return "UPDATE";
+    case CMD_DELETE:
+        return "DELETE";
+    case CMD_MERGE:
+        return "MERGE";
+    case CMD_UTILITY:
+        return "UTILITY";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+void pgtrace_span_record(const PgTraceContext *ctx, uint64 span_id, uint64 fingerprint,
+                         CmdType operation, const char *database, double duration_ms,
+                         int64 rows, int sqlerrcode)
+{
+    PgTraceSpanSlot *slot;
+    PgTraceSpan *span;
+    uint64 pos;
+
+    if (!pgtrace_span_buffer || !ctx->valid || !(ctx->flags & PGTRACE_TRACE_SAMPLED))
+        return;
+
+    pos = pgtrace_ring_reserve(&pgtrace_span_buffer->ring);
+    slot = &pgtrace_span_buffer->entries[pos % PGTRACE_SPAN_BUFFER_SIZE];
+
+    if (!pgtrace_ring_begin_write(&pgtrace_span_buffer->ring, &slot->seq, pos))
+        return;
+
+    span = &slot->span;
+    memcpy(span->trace_id, ctx->trace_id, sizeof(span->trace_id));
+    span->span_id = span_id;
+    span->parent_span_id = ctx->parent_span_id;
+    span->fingerprint = fingerprint;
+    span->end_time = GetCurrentTimestamp();
+    span->start_time = span->end_time - (TimestampTz)(duration_ms * 1000.0);
+    span->rows = rows;
+    span->pid = MyProcPid;
+    span->sqlerrcode = sqlerrcode;
+    span->operation = (uint8)operation;
+    strlcpy(span->database, database ? database : "", sizeof(span->database));
+    strlcpy(span->tracestate, ctx->tracestate, sizeof(span->tracestate));
+
+    pgtrace_ring_end_write(&slot->seq, pos);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_spans);
+
+PGDLLEXPORT Datum pgtrace_internal_spans(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceSpan *spans;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+        uint32 i;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_spans must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        spans = palloc(PGTRACE_SPAN_BUFFER_SIZE * sizeof(PgTraceSpan));
+
+        for (i = 0; pgtrace_span_buffer && i < PGTRACE_SPAN_BUFFER_SIZE; i++)
+        {
+            PgTraceSpanSlot *slot = &pgtrace_span_buffer->entries[i];
+            int attempt;
+
+            for (attempt = 0; attempt < PGTRACE_RING_READ_RETRIES; attempt++)
+            {
+                uint64 seq = pgtrace_ring_read_begin(&slot->seq);
+
+                if (seq == 0)
+                    break;
+
+                memcpy(&spans[count], &slot->span, sizeof(PgTraceSpan));
+
+                if (pgtrace_ring_read_valid(&slot->seq, seq))
+                {
+                    count++;
+                    break;
+                }
+            }
+        }
+
+        funcctx->user_fctx = spans;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    spans = (PgTraceSpan *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[13];
+        bool nulls[13] = {false, false, false, false, false, false, false,
+                          false, false, false, false, false, false};
+        PgTraceSpan *span = &spans[funcctx->call_cntr];
+        char trace_id[33];
+        char span_id[17];
+        char parent_span_id[17];
+        HeapTuple tuple;
+
+        pgtrace_trace_format_id(trace_id, span->trace_id, 16);
+        pgtrace_trace_format_span_id(span_id, span->span_id);
+        pgtrace_trace_format_span_id(parent_span_id, span->parent_span_id);
+
+        values[0] = CStringGetTextDatum(trace_id);
+        values[1] = CStringGetTextDatum(span_id);
+        values[2] = CStringGetTextDatum(parent_span_id);
+        values[3] = UInt64GetDatum(span->fingerprint);
+        values[4] = CStringGetTextDatum(pgtrace_span_operation_name(span->operation));
+        values[5] = TimestampTzGetDatum(span->start_time);
+        values[6] = TimestampTzGetDatum(span->end_time);
+        values[7] = Float8GetDatum((double)(span->end_time - span->start_time) / 1000.0);
+        values[8] = Int64GetDatum(span->rows);
+        values[9] = Int32GetDatum(span->pid);
+        values[10] = CStringGetTextDatum(span->sqlerrcode ? unpack_sql_state(span->sqlerrcode) : "");
+        values[11] = CStringGetTextDatum(span->database);
+        values[12] = CStringGetTextDatum(span->tracestate);
+
+        if (span->sqlerrcode == 0)
+            nulls[10] = true;
+        if (span->tracestate[0] == '\0')
+            nulls[12] = true;
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <nodes/nodes.h>
+#include <storage/spin.h>
+#include <utils/guc.h>
+#include <utils/timestamp.h>
+#include "ring.h"
+
+/*
+ * W3C trace context. A statement carries one when its text has a
+ * sqlcommenter-style comment with traceparent='...' (and optionally
+ * tracestate='...'), when it runs nested in a statement that has one, or
+ * when pgtrace.traceparent is set. Comments are left out of fingerprints,
+ * so the per-request ids do not split a query into many fingerprints.
+ *
+ * Every sampled statement with a context becomes a span in a ring, which
+ * an optional background worker exports as OTLP/JSON files to
+ * $PGDATA/pg_pgtrace/spans.
+ */
+#define PGTRACE_TRACESTATE_LEN 128
+
+typedef struct PgTraceContext
+{
+    bool valid;
+    uint8 flags;
+    uint8 trace_id[16];
+    uint64 parent_span_id;
+    char tracestate[PGTRACE_TRACESTATE_LEN];
+} PgTraceContext;
+
+#define PGTRACE_TRACE_SAMPLED 0x01
+
+typedef struct PgTraceSpan
+{
+    uint8 trace_id[16];
+    uint64 span_id;
+    uint64 parent_span_id;
+    uint64 fingerprint;
+    TimestampTz start_time;
+    TimestampTz end_time;
+    int64 rows;
+    int pid;
+    int sqlerrcode; /* 0 when the statement succeeded */
+    uint8 operation; /* CmdType */
+    char database[NAMEDATALEN];
+    char tracestate[PGTRACE_TRACESTATE_LEN];
+} PgTraceSpan;
+
+typedef struct PgTraceSpanSlot
+{
+    pg_atomic_uint64 seq;
+    PgTraceSpan span;
+} PgTraceSpanSlot;
+
+/* Progress of the exporter, which consumes the ring in order. */
+typedef struct PgTraceSpanExportState
+{
+    pg_atomic_uint64 exported; /* next ring position to export */
+    pg_atomic_uint64 lost;
+    slock_t mutex;
+    uint64 files_written;
+    uint64 spans_written;
+    TimestampTz last_export;
+} PgTraceSpanExportState;
+
+#define PGTRACE_SPAN_BUFFER_SIZE 8192
+
+typedef struct PgTraceSpanBuffer
+{
+    PgTraceRing ring;
+    PgTraceSpanExportState exporter;
+    PgTraceSpanSlot entries[PGTRACE_SPAN_BUFFER_SIZE];
+} PgTraceSpanBuffer;
+
+extern PgTraceSpanBuffer *pgtrace_span_buffer;
+
+void pgtrace_trace_request_shmem(void);
+void pgtrace_trace_startup(void);
+bool pgtrace_trace_parse(const char *traceparent, size_t len, PgTraceContext *ctx);
+bool pgtrace_trace_from_query(const char *query_text, PgTraceContext *ctx);
+bool pgtrace_trace_from_guc(PgTraceContext *ctx);
+uint64 pgtrace_trace_new_span_id(void);
+void pgtrace_span_record(const PgTraceContext *ctx, uint64 span_id, uint64 fingerprint,
+                         CmdType operation, const char *database, double duration_ms,
+                         int64 rows, int sqlerrcode);
+const char *pgtrace_span_operation_name(uint8 operation);
+void pgtrace_trace_format_id(char *dst, const uint8 *id, int len);
+void pgtrace_trace_format_span_id(char *dst, uint64 span_id);
+
+bool pgtrace_traceparent_check(char **newval, void **extra, GucSource source);
+void pgtrace_traceparent_assign(const char *newval, void *extra);
+
+void pgtrace_span_export_register(void);
+PGDLLEXPORT void pgtrace_span_export_main(Datum main_arg);
+
+PGDLLEXPORT Datum pgtrace_internal_spans(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_span_export_stats(PG_FUNCTION_ARGS);
@@ -0,0 +1,369 @@
+#include <postgres.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <pgtime.h>
+#include <datatype/timestamp.h>
+#include <lib/stringinfo.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/fd.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/json.h>
+#include <utils/memutils.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+/*
+ * Each pass writes the spans published since the previous one to a new
+ * file, as a single OTLP/JSON ExportTraceServiceRequest on one line, the
+ * format the collector's otlpjsonfile receiver reads. Files are written
+ * under a temporary name, fsynced and renamed, so a reader never sees a
+ * partial one. The collector is expected to delete files it has shipped; past
+ * SPAN_EXPORT_MAX_FILES pending files, new spans are dropped rather than
+ * filling the disk.
+ */
+#define PGTRACE_SPAN_EXPORT_DIR PGTRACE_DATA_DIR "/spans"
+#define SPAN_EXPORT_MAX_FILES 1000
+#define SPAN_EXPORT_STALL_PASSES 3
+
+static uint64 stall_pos = 0;
+static int stall_passes = 0;
+
+void pgtrace_span_export_register(void)
+{
+    BackgroundWorker worker;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgtrace");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgtrace_span_export_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pgtrace span exporter");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pgtrace span exporter");
+
+    RegisterBackgroundWorker(&worker);
+}
+
+static void
+span_export_ensure_dir(const char *path)
+{
+    if (MakePGDirectory(path) < 0 && errno != EEXIST)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create directory \"%s\": %m", path)));
+}
+
+static int
+span_export_pending_files(void)
+{
+    DIR *dir;
+    struct dirent *de;
+    int count = 0;
+
+    dir = AllocateDir(PGTRACE_SPAN_EXPORT_DIR);
+    while ((de = ReadDir(dir, PGTRACE_SPAN_EXPORT_DIR)) != NULL)
+    {
+        if (strncmp(de->d_name, "spans-", 6) == 0)
+            count++;
+    }
+    FreeDir(dir);
+
+    return count;
+}
+
+static int64
+unix_nanos(TimestampTz ts)
+{
+    return (ts + (int64)(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC) * 1000;
+}
+
+static void
+append_string_attribute(StringInfo buf, const char *key, const char *value, bool first)
+{
+    appendStringInfo(buf, "%s{\"key\":\"%s\",\"value\":{\"stringValue\":", first ? "" : ",", key);
+    escape_json(buf, value);
+    appendStringInfoString(buf, "}}");
+}
+
+static void
+append_int_attribute(StringInfo buf, const char *key, int64 value)
+{
+    appendStringInfo(buf, ",{\"key\":\"%s\",\"value\":{\"intValue\":\"" INT64_FORMAT "\"}}", key, value);
+}
+
+static void
+span_export_append(StringInfo buf, const PgTraceSpan *span, bool first)
+{
+    char trace_id[33];
+    char span_id[17];
+    char parent_span_id[17];
+
+    pgtrace_trace_format_id(trace_id, span->trace_id, 16);
+    pgtrace_trace_format_span_id(span_id, span->span_id);
+    pgtrace_trace_format_span_id(parent_span_id, span->parent_span_id);
+
+    appendStringInfo(buf, "%s{\"traceId\":\"%s\",\"spanId\":\"%s\",\"parentSpanId\":\"%s\"",
+                     first ? "" : ",", trace_id, span_id, parent_span_id);
+
+    if (span->tracestate[0] != '\0')
+    {
+        appendStringInfoString(buf, ",\"traceState\":");
+        escape_json(buf, span->tracestate);
+    }
+
+    /* kind 2 is SPAN_KIND_SERVER: the database serving the client's call. */
+    appendStringInfo(buf, ",\"name\":\"%s\",\"kind\":2,\"startTimeUnixNano\":\"" INT64_FORMAT
+                          "\",\"endTimeUnixNano\":\"" INT64_FORMAT "\",\"attributes\":[",
+                     pgtrace_span_operation_name(span->operation),
+                     unix_nanos(span->start_time), unix_nanos(span->end_time));
+
+    append_string_attribute(buf, "db.system.name", "postgresql", true);
+    append_string_attribute(buf, "db.namespace", span->database, false);
+    append_string_attribute(buf, "db.operation.name", pgtrace_span_operation_name(span->operation), false);
+    append_int_attribute(buf, "pgtrace.fingerprint", (int64)span->fingerprint);
+    append_int_attribute(buf, "db.response.returned_rows", span->rows);
+    append_int_attribute(buf, "process.pid", span->pid);
+
+    if (span->sqlerrcode != 0)
+    {
+        append_string_attribute(buf, "db.response.status_code", unpack_sql_state(span->sqlerrcode), false);
+        appendStringInfoString(buf, "],\"status\":{\"code\":2}}");
+    }
+    else
+        appendStringInfoString(buf, "]}");
+}
+
+static void
+span_export_write(StringInfo buf, uint64 first_pos, uint64 spans)
+{
+    PgTraceSpanExportState *progress = &pgtrace_span_buffer->exporter;
+    char path[MAXPGPATH];
+    char tmppath[MAXPGPATH];
+    char timestr[32];
+    pg_time_t now = (pg_time_t)time(NULL);
+    int fd;
+
+    if (span_export_pending_files() >= SPAN_EXPORT_MAX_FILES)
+    {
+        pg_atomic_fetch_add_u64(&progress->lost, spans);
+        return;
+    }
+
+    pg_strftime(timestr, sizeof(timestr), "%Y%m%d-%H%M%S",
+                pg_localtime(&now, log_timezone));
+    snprintf(path, sizeof(path), "%s/spans-%s-" UINT64_FORMAT ".json",
+             PGTRACE_SPAN_EXPORT_DIR, timestr, first_pos);
+    snprintf(tmppath, sizeof(tmppath), "%s/.tmp-" UINT64_FORMAT ".json",
+             PGTRACE_SPAN_EXPORT_DIR, first_pos);
+
+    fd = OpenTransientFile(tmppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+    if (fd < 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open span export file \"%s\": %m", tmppath)));
+
+    errno = 0;
+    if (write(fd, buf->data, buf->len) != buf->len)
+    {
+        /* if write didn't set errno, assume problem is no disk space */
+        if (errno == 0)
+            errno = ENOSPC;
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write span export file \"%s\": %m", tmppath)));
+    }
+
+    CloseTransientFile(fd);
+
+    /*
+     * Flush the file and the directory entry before the spans count as
+     * exported, so a crash cannot leave a collector an empty or missing file.
+     */
+    (void)durable_rename(tmppath, path, ERROR);
+
+    SpinLockAcquire(&progress->mutex);
+    progress->files_written++;
+    progress->spans_written += spans;
+    progress->last_export = GetCurrentTimestamp();
+    SpinLockRelease(&progress->mutex);
+}
+
+/*
+ * Same consumption rules as the audit log writer: overwritten positions
+ * count as lost, and an unpublished position stalls the pass for a few
+ * rounds before it is skipped and counted as lost too.
+ */
+static void
+span_export_drain(StringInfo buf)
+{
+    PgTraceSpanExportState *progress = &pgtrace_span_buffer->exporter;
+    uint64 pos = pg_atomic_read_u64(&progress->exported);
+    uint64 head = pgtrace_ring_written(&pgtrace_span_buffer->ring);
+    uint64 first_pos = 0;
+    uint64 spans = 0;
+
+    if (head - pos > PGTRACE_SPAN_BUFFER_SIZE)
+    {
+        pg_atomic_fetch_add_u64(&progress->lost, head - pos - PGTRACE_SPAN_BUFFER_SIZE);
+        pos = head - PGTRACE_SPAN_BUFFER_SIZE;
+    }
+
+    resetStringInfo(buf);
+
+    while (pos < head)
+    {
+        PgTraceSpanSlot *slot = &pgtrace_span_buffer->entries[pos % PGTRACE_SPAN_BUFFER_SIZE];
+        uint64 seq = pgtrace_ring_read_begin(&slot->seq);
+        PgTraceSpan span;
+
+        if (seq < 2 * pos + 2)
+        {
+            if (stall_pos != pos)
+            {
+                stall_pos = pos;
+                stall_passes = 0;
+            }
+
+            if (++stall_passes < SPAN_EXPORT_STALL_PASSES)
+                break;
+
+            /* Never published; it will not be exported even if it is later. */
+            pg_atomic_fetch_add_u64(&progress->lost, 1);
+            pos++;
+            continue;
+        }
+
+        if (seq == 2 * pos + 2)
+        {
+            memcpy(&span, &slot->span, sizeof(PgTraceSpan));
+
+            if (pgtrace_ring_read_valid(&slot->seq, seq))
+            {
+                if (spans == 0)
+                {
+                    first_pos = pos;
+                    appendStringInfoString(buf, "{\"resourceSpans\":[{\"resource\":{\"attributes\":[");
+                    append_string_attribute(buf, "service.name",
+                                            cluster_name && cluster_name[0] ? cluster_name : "postgresql",
+                                            true);
+                    appendStringInfoString(buf, "]},\"scopeSpans\":[{\"scope\":{\"name\":\"pgtrace\"},\"spans\":[");
+                }
+
+                span_export_append(buf, &span, spans == 0);
+                spans++;
+                pos++;
+                continue;
+            }
+        }
+
+        /* Replaced by a later lap before we got to it. */
+        pg_atomic_fetch_add_u64(&progress->lost, 1);
+        pos++;
+    }
+
+    if (spans > 0)
+    {
+        appendStringInfoString(buf, "]}]}]}\n");
+        span_export_write(buf, first_pos, spans);
+    }
+
+    pg_atomic_write_u64(&progress->exported, pos);
+}
+
+void pgtrace_span_export_main(Datum main_arg)
+{
+    StringInfoData buf;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+    BackgroundWorkerUnblockSignals();
+
+    if (!pgtrace_span_buffer)
+        proc_exit(0);
+
+    span_export_ensure_dir(PGTRACE_DATA_DIR);
+    span_export_ensure_dir(PGTRACE_SPAN_EXPORT_DIR);
+
+    initStringInfo(&buf);
+
+    while (!ShutdownRequestPending)
+    {
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        span_export_drain(&buf);
+
+        (void)WaitLatch(MyLatch,
+                        WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                        pgtrace_span_export_interval,
+                        PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    span_export_drain(&buf);
+
+    proc_exit(0);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_span_export_stats);
+
+PGDLLEXPORT Datum pgtrace_internal_span_export_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[6];
+    bool nulls[6] = {false, false, false, false, false, false};
+    uint64 spans_written = 0;
+    uint64 spans_lost = 0;
+    uint64 backlog = 0;
+    uint64 files_written = 0;
+    TimestampTz last_export = 0;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("pgtrace_internal_span_export_stats must be called in a context that accepts a record")));
+
+    if (pgtrace_span_buffer)
+    {
+        PgTraceSpanExportState *progress = &pgtrace_span_buffer->exporter;
+        uint64 head = pgtrace_ring_written(&pgtrace_span_buffer->ring);
+        uint64 exported = pg_atomic_read_u64(&progress->exported);
+
+        spans_lost = pg_atomic_read_u64(&progress->lost);
+        if (pgtrace_span_export && head > exported)
+            backlog = Min(head - exported, (uint64)PGTRACE_SPAN_BUFFER_SIZE);
+
+        SpinLockAcquire(&progress->mutex);
+        spans_written = progress->spans_written;
+        files_written = progress->files_written;
+        last_export = progress->last_export;
+        SpinLockRelease(&progress->mutex);
+    }
+
+    values[0] = BoolGetDatum(pgtrace_span_export);
+    values[1] = UInt64GetDatum(spans_written);
+    values[2] = UInt64GetDatum(spans_lost);
+    values[3] = UInt64GetDatum(backlog);
+    values[4] = UInt64GetDatum(files_written);
+
+    if (last_export != 0)
+        values[5] = TimestampTzGetDatum(last_export);
+    else
+        nulls[5] = true;
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,148 @@
+#include <postgres.h>
+#include <math.h>
+#include <port/pg_bitutils.h>
+#include "window.h"
+
+static inline int32
+window_minute(TimestampTz now)
+{
+    return (int32)(now / USECS_PER_MINUTE);
+}
+
+int
+pgtrace_window_latency_bucket(double duration_ms)
+{
+    uint64 us = (duration_ms > 0.0) ? (uint64)(duration_ms * 1000.0) : 0;
+    int bucket;
+
+    if (us < ((uint64)1 << PGTRACE_WINDOW_LATENCY_SHIFT))
+        return 0;
+
+    bucket = (pg_leftmost_one_pos64(us) - PGTRACE_WINDOW_LATENCY_SHIFT) / PGTRACE_WINDOW_LATENCY_STEP + 1;
+    return Min(bucket, PGTRACE_WINDOW_LATENCY_BUCKETS - 1);
+}
+
+static double
+window_latency_lower_ms(int bucket)
+{
+    if (bucket == 0)
+        return 0.0;
+
+    return (double)((uint64)1 << (PGTRACE_WINDOW_LATENCY_SHIFT + (bucket - 1) * PGTRACE_WINDOW_LATENCY_STEP)) / 1000.0;
+}
+
+void pgtrace_window_add(QueryWindow *window, TimestampTz now, double duration_ms, bool failed)
+{
+    int32 minute = window_minute(now);
+    QueryWindowBucket *bucket = &window->buckets[minute % PGTRACE_WINDOW_MINUTES];
+
+    if (bucket->minute != minute)
+    {
+        memset(bucket, 0, sizeof(QueryWindowBucket));
+        bucket->minute = minute;
+    }
+
+    bucket->calls++;
+    if (failed)
+        bucket->errors++;
+    bucket->total_time_ms += duration_ms;
+    if (duration_ms > bucket->max_time_ms)
+    {
+        /* Round down, so the cap never exceeds the latency it came from */
+        float max_ms = (float)duration_ms;
+
+        if (max_ms > duration_ms)
+            max_ms = nextafterf(max_ms, 0.0f);
+        bucket->max_time_ms = max_ms;
+    }
+    bucket->latency[pgtrace_window_latency_bucket(duration_ms)]++;
+}
+
+/*
+ * Quantile of a latency histogram with PGTRACE_WINDOW_LATENCY_BUCKETS
+ * counts, interpolated linearly within its bucket. max_ms caps the top
+ * bucket; NaN for an empty histogram.
+ */
+double
+pgtrace_window_latency_quantile(const double *counts, double max_ms, double q)
+{
+    double total = 0.0;
+    double rank;
+    double seen = 0.0;
+    int i;
+
+    for (i = 0; i < PGTRACE_WINDOW_LATENCY_BUCKETS; i++)
+        total += counts[i];
+
+    if (total <= 0.0)
+        return NAN;
+
+    rank = q * total;
+    for (i = 0; i < PGTRACE_WINDOW_LATENCY_BUCKETS; i++)
+    {
+        if (counts[i] > 0.0 && seen + counts[i] >= rank)
+        {
+            double lower = window_latency_lower_ms(i);
+            double upper = (i < PGTRACE_WINDOW_LATENCY_BUCKETS - 1) ? window_latency_lower_ms(i + 1)
+                                                                    : max_ms;
+
+            upper = Max(Min(upper, max_ms), lower);
+            return lower + (upper - lower) * (rank - seen) / counts[i];
+        }
+        seen += counts[i];
+    }
+
+    return max_ms;
+}
+
+/*
+ * Estimate rates, mean and p99 over the last `minutes` minutes, which must
+ * be less than PGTRACE_WINDOW_MINUTES.
+ */
+void pgtrace_window_read(const QueryWindow *window, TimestampTz now, int minutes,
+                         QueryWindowStats *stats)
+{
+    int32 current = window_minute(now);
+    double elapsed = (double)(now % USECS_PER_MINUTE) / USECS_PER_MINUTE;
+    double latency[PGTRACE_WINDOW_LATENCY_BUCKETS] = {0};
+    double calls = 0.0;
+    double errors = 0.0;
+    double total_time_ms = 0.0;
+    double max_time_ms = 0.0;
+    int i;
+
+    Assert(minutes > 0 && minutes < PGTRACE_WINDOW_MINUTES);
+
+    for (i = 0; i <= minutes; i++)
+    {
+        const QueryWindowBucket *bucket;
+        double weight = (i == minutes) ? 1.0 - elapsed : 1.0;
+        int j;
+
+        if (current - i <= 0)
+            break;
+
+        bucket = &window->buckets[(current - i) % PGTRACE_WINDOW_MINUTES];
+        if (bucket->minute != current - i || weight <= 0.0)
+            continue;
+
+        calls += weight * bucket->calls;
+        errors += weight * bucket->errors;
+        total_time_ms += weight * bucket->total_time_ms;
+        max_time_ms = Max(max_time_ms, bucket->max_time_ms);
+        for (j = 0; j < PGTRACE_WINDOW_LATENCY_BUCKETS; j++)
+            latency[j] += weight * bucket->latency[j];
+    }
+
+    stats->calls_per_sec = calls / (minutes * 60.0);
+    stats->errors_per_sec = errors / (minutes * 60.0);
+    stats->mean_ms = NAN;
+    stats->p99_ms = NAN;
+
+    if (calls <= 0.0)
+        return;
+
+    stats->mean_ms = total_time_ms / calls;
+
+    stats->p99_ms = pgtrace_window_latency_quantile(latency, max_time_ms, 0.99);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <postgres.h>
+#include <utils/timestamp.h>
+
+/*
+ * Per-fingerprint sliding-window counters: one bucket per wall-clock
+ * minute, in a ring indexed by minute number. A bucket still holding an
+ * older minute is cleared by the next update that lands in it, so nothing
+ * has to rotate the ring in the background.
+ *
+ * A window of N minutes sums the current, partial minute, the N - 1 before
+ * it, and the minute before those weighted by the part of it still inside
+ * the window. Rates are therefore per N * 60 seconds, smoothed across
+ * minute boundaries rather than jumping at them.
+ *
+ * Latencies go into a coarse histogram of eight buckets, each four times
+ * as wide as the one before: under 64us, then 64-256us, 256us-1ms and so
+ * on up to 2^18us (about a quarter of a second), and the last bucket above
+ * that, capped by the largest latency seen in the window.
+ *
+ * Every query table slot carries a window, so a bucket is kept to 56 bytes:
+ * 32-bit counts, and a float for the largest latency, which only caps the
+ * top histogram bucket. The total stays a double so means do not drift on
+ * busy minutes.
+ */
+#define PGTRACE_WINDOW_MINUTES 16
+#define PGTRACE_WINDOW_LATENCY_BUCKETS 8
+#define PGTRACE_WINDOW_LATENCY_SHIFT 6 /* log2 of the first bound, in us */
+#define PGTRACE_WINDOW_LATENCY_STEP 2  /* log2 of the bucket growth */
+
+typedef struct QueryWindowBucket
+{
+    double total_time_ms;
+    int32 minute; /* minutes since the PostgreSQL epoch; 0 when unused */
+    uint32 calls;
+    uint32 errors;
+    float max_time_ms;
+    uint32 latency[PGTRACE_WINDOW_LATENCY_BUCKETS];
+} QueryWindowBucket;
+
+typedef struct QueryWindow
+{
+    QueryWindowBucket buckets[PGTRACE_WINDOW_MINUTES];
+} QueryWindow;
+
+/* Rates and latencies over one window; the latencies are NaN without calls. */
+typedef struct QueryWindowStats
+{
+    double calls_per_sec;
+    double errors_per_sec;
+    double mean_ms;
+    double p99_ms;
+} QueryWindowStats;
+
+int pgtrace_window_latency_bucket(double duration_ms);
+double pgtrace_window_latency_quantile(const double *counts, double max_ms, double q);
+void pgtrace_window_add(QueryWindow *window, TimestampTz now, double duration_ms, bool failed);
+void pgtrace_window_read(const QueryWindow *window, TimestampTz now, int minutes,
+                         QueryWindowStats *stats);
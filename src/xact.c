@@ -0,0 +1,497 @@
+#include <postgres.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <access/xact.h>
+#include <catalog/pg_type.h>
+#include <common/hashfn.h>
+#include <storage/shmem.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/timestamp.h>
+#include "pgtrace.h"
+
+PgTraceXactState *pgtrace_xact_state = NULL;
+
+/* Distinct fingerprints a transaction's shape is built from. */
+#define XACT_MAX_DISTINCT 64
+
+/* The current transaction of this backend, empty until a statement ends. */
+static struct
+{
+    uint32 statements;
+    bool explicit_block;
+    double statement_time_ms;
+    TimestampTz xact_start;
+    uint64 shape;
+    uint32 num_fingerprints;
+    uint64 fingerprints[XACT_MAX_DISTINCT];
+    char request_id[PGTRACE_REQUEST_ID_LEN];
+} my_xact;
+
+void pgtrace_xact_request_shmem(void)
+{
+    RequestAddinShmemSpace(sizeof(PgTraceXactState));
+    RequestNamedLWLockTranche("pgtrace_xact", 1);
+}
+
+void pgtrace_xact_startup(void)
+{
+    bool found;
+    uint32 i;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    pgtrace_xact_state = ShmemInitStruct(
+        "pgtrace_xact",
+        sizeof(PgTraceXactState),
+        &found);
+
+    if (!found)
+    {
+        memset(pgtrace_xact_state, 0, sizeof(PgTraceXactState));
+        pgtrace_ring_init(&pgtrace_xact_state->ring, PGTRACE_XACT_SPANS);
+        for (i = 0; i < PGTRACE_XACT_SPANS; i++)
+            pg_atomic_init_u64(&pgtrace_xact_state->spans[i].seq, 0);
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/* A top-level statement of the current transaction has ended. */
+void pgtrace_xact_statement(uint64 fingerprint, double duration_ms)
+{
+    uint32 i;
+
+    if (!pgtrace_xact_spans || !pgtrace_xact_state || fingerprint == 0)
+        return;
+
+    if (my_xact.statements == 0)
+    {
+        my_xact.xact_start = GetCurrentTransactionStartTimestamp();
+        my_xact.request_id[0] = '\0';
+    }
+
+    if (my_xact.request_id[0] == '\0' && pgtrace_request_id)
+        strlcpy(my_xact.request_id, pgtrace_request_id, sizeof(my_xact.request_id));
+
+    my_xact.statements++;
+    my_xact.statement_time_ms += duration_ms;
+    if (IsTransactionBlock())
+        my_xact.explicit_block = true;
+
+    for (i = 0; i < my_xact.num_fingerprints; i++)
+    {
+        if (my_xact.fingerprints[i] == fingerprint)
+            return;
+    }
+
+    if (my_xact.num_fingerprints < XACT_MAX_DISTINCT)
+    {
+        my_xact.fingerprints[my_xact.num_fingerprints++] = fingerprint;
+        my_xact.shape = hash_combine64(my_xact.shape, fingerprint);
+    }
+}
+
+static PgTraceXactShape *
+shape_find_or_create(uint64 shape)
+{
+    uint64 bucket = shape % PGTRACE_XACT_SHAPE_HASH_SIZE;
+    uint64 i;
+
+    for (i = 0; i < PGTRACE_XACT_SHAPE_HASH_SIZE; i++)
+    {
+        PgTraceXactShape *entry = &pgtrace_xact_state->shapes[(bucket + i) % PGTRACE_XACT_SHAPE_HASH_SIZE];
+
+        if (!entry->valid)
+        {
+            if (pgtrace_xact_state->num_shapes >= PGTRACE_XACT_SHAPES)
+                break;
+
+            memset(entry, 0, sizeof(PgTraceXactShape));
+            entry->shape = shape;
+            entry->valid = true;
+            entry->num_fingerprints = my_xact.num_fingerprints;
+            memcpy(entry->fingerprints, my_xact.fingerprints,
+                   Min(my_xact.num_fingerprints, PGTRACE_XACT_FINGERPRINTS) * sizeof(uint64));
+            pgtrace_xact_state->num_shapes++;
+            return entry;
+        }
+
+        if (entry->shape == shape)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Deletes the shape at idx, shifting later entries of its cluster back. */
+static void
+shape_delete(uint64 idx)
+{
+    uint64 hole = idx;
+    uint64 next = (idx + 1) % PGTRACE_XACT_SHAPE_HASH_SIZE;
+
+    for (;;)
+    {
+        PgTraceXactShape *entry = &pgtrace_xact_state->shapes[next];
+        uint64 home;
+        bool movable;
+
+        if (!entry->valid)
+            break;
+
+        home = entry->shape % PGTRACE_XACT_SHAPE_HASH_SIZE;
+        if (hole < next)
+            movable = (home <= hole || home > next);
+        else
+            movable = (home <= hole && home > next);
+
+        if (movable)
+        {
+            pgtrace_xact_state->shapes[hole] = *entry;
+            hole = next;
+        }
+
+        next = (next + 1) % PGTRACE_XACT_SHAPE_HASH_SIZE;
+    }
+
+    memset(&pgtrace_xact_state->shapes[hole], 0, sizeof(PgTraceXactShape));
+    pgtrace_xact_state->num_shapes--;
+}
+
+/* Evicts the least recently seen of a few shapes sampled from evict_hand. */
+static bool
+shape_evict(void)
+{
+    PgTraceXactShape *victim = NULL;
+    int sampled = 0;
+    uint64 i;
+
+    for (i = 0; i < PGTRACE_XACT_SHAPE_HASH_SIZE && sampled < PGTRACE_EVICTION_SAMPLE; i++)
+    {
+        PgTraceXactShape *entry = &pgtrace_xact_state->shapes[pgtrace_xact_state->evict_hand];
+
+        pgtrace_xact_state->evict_hand = (pgtrace_xact_state->evict_hand + 1) % PGTRACE_XACT_SHAPE_HASH_SIZE;
+
+        if (entry->valid)
+        {
+            if (victim == NULL || entry->last_seen < victim->last_seen)
+                victim = entry;
+            sampled++;
+        }
+    }
+
+    if (victim == NULL)
+        return false;
+
+    shape_delete(victim - pgtrace_xact_state->shapes);
+    pgtrace_xact_state->evictions++;
+    return true;
+}
+
+static void
+xact_publish(PgTraceXactSpan *span, bool aggregate)
+{
+    PgTraceXactSlot *slot;
+    PgTraceXactShape *shape;
+    LWLockPadded *lock;
+    uint64 pos;
+
+    pos = pgtrace_ring_reserve(&pgtrace_xact_state->ring);
+    slot = &pgtrace_xact_state->spans[pos % PGTRACE_XACT_SPANS];
+
+    if (pgtrace_ring_begin_write(&pgtrace_xact_state->ring, &slot->seq, pos))
+    {
+        memcpy(&slot->span, span, sizeof(PgTraceXactSpan));
+        pgtrace_ring_end_write(&slot->seq, pos);
+    }
+
+    if (!aggregate)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_xact");
+    pgtrace_lock_acquire(PGTRACE_LOCK_XACT, &lock->lock, LW_EXCLUSIVE);
+
+    shape = shape_find_or_create(span->shape);
+    if (!shape && shape_evict())
+        shape = shape_find_or_create(span->shape);
+    if (!shape)
+        pgtrace_xact_state->dropped_shapes++;
+    else
+    {
+        long secs;
+        int usecs;
+
+        TimestampDifference(span->xact_start, span->xact_end, &secs, &usecs);
+
+        if (span->committed)
+            shape->commits++;
+        else
+            shape->aborts++;
+        shape->statements += span->statements;
+        shape->total_time_ms += (double)secs * 1000.0 + (double)usecs / 1000.0;
+        shape->statement_time_ms += span->statement_time_ms;
+        shape->last_seen = span->xact_end;
+    }
+
+    LWLockRelease(&lock->lock);
+}
+
+/*
+ * Runs at commit and abort. LWLocks held by the transaction have already
+ * been released at this point, and nothing here may throw.
+ */
+static void
+xact_end(bool committed)
+{
+    PgTraceXactSpan span;
+
+    if (my_xact.statements == 0)
+        return;
+
+    if (pgtrace_xact_state)
+    {
+        memset(&span, 0, sizeof(span));
+        span.xact_start = my_xact.xact_start;
+        span.xact_end = GetCurrentTimestamp();
+        span.pid = MyProcPid;
+        span.committed = committed;
+        span.statements = my_xact.statements;
+        span.statement_time_ms = my_xact.statement_time_ms;
+        span.shape = my_xact.shape;
+        span.num_fingerprints = my_xact.num_fingerprints;
+        memcpy(span.fingerprints, my_xact.fingerprints,
+               Min(my_xact.num_fingerprints, PGTRACE_XACT_FINGERPRINTS) * sizeof(uint64));
+        strlcpy(span.request_id, my_xact.request_id, sizeof(span.request_id));
+
+        /* An autocommit statement's shape is its own query stats entry. */
+        xact_publish(&span, my_xact.statements > 1 || my_xact.explicit_block);
+    }
+
+    memset(&my_xact, 0, sizeof(my_xact));
+}
+
+static void
+xact_callback(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+    case XACT_EVENT_COMMIT:
+    case XACT_EVENT_PREPARE:
+        xact_end(true);
+        break;
+    case XACT_EVENT_ABORT:
+        xact_end(false);
+        break;
+    default:
+        break;
+    }
+}
+
+void pgtrace_xact_init(void)
+{
+    RegisterXactCallback(xact_callback, NULL);
+}
+
+void pgtrace_xact_fini(void)
+{
+    UnregisterXactCallback(xact_callback, NULL);
+}
+
+void pgtrace_xact_reset(void)
+{
+    LWLockPadded *lock;
+
+    if (!pgtrace_xact_state)
+        return;
+
+    lock = GetNamedLWLockTranche("pgtrace_xact");
+    pgtrace_lock_acquire(PGTRACE_LOCK_XACT, &lock->lock, LW_EXCLUSIVE);
+    memset(pgtrace_xact_state->shapes, 0, sizeof(pgtrace_xact_state->shapes));
+    pgtrace_xact_state->num_shapes = 0;
+    pgtrace_xact_state->dropped_shapes = 0;
+    pgtrace_xact_state->evictions = 0;
+    pgtrace_xact_state->evict_hand = 0;
+    LWLockRelease(&lock->lock);
+
+    pgtrace_ring_reset(&pgtrace_xact_state->ring);
+}
+
+static Datum
+fingerprint_array(const uint64 *fingerprints, uint32 count)
+{
+    Datum elems[PGTRACE_XACT_FINGERPRINTS];
+    uint32 n = Min(count, PGTRACE_XACT_FINGERPRINTS);
+    uint32 i;
+
+    for (i = 0; i < n; i++)
+        elems[i] = Int64GetDatum((int64)fingerprints[i]);
+
+    return PointerGetDatum(construct_array(elems, (int)n, INT8OID, 8, FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_xact_spans);
+
+PGDLLEXPORT Datum pgtrace_internal_xact_spans(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceXactSpan *spans;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+        uint32 i;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_xact_spans must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        spans = palloc(PGTRACE_XACT_SPANS * sizeof(PgTraceXactSpan));
+
+        for (i = 0; pgtrace_xact_state && i < PGTRACE_XACT_SPANS; i++)
+        {
+            PgTraceXactSlot *slot = &pgtrace_xact_state->spans[i];
+            int attempt;
+
+            for (attempt = 0; attempt < PGTRACE_RING_READ_RETRIES; attempt++)
+            {
+                uint64 seq = pgtrace_ring_read_begin(&slot->seq);
+
+                if (seq == 0 || !pgtrace_ring_visible(&pgtrace_xact_state->ring, seq))
+                    break;
+
+                memcpy(&spans[count], &slot->span, sizeof(PgTraceXactSpan));
+
+                if (pgtrace_ring_read_valid(&slot->seq, seq))
+                {
+                    count++;
+                    break;
+                }
+            }
+        }
+
+        funcctx->user_fctx = spans;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    spans = (PgTraceXactSpan *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[11];
+        bool nulls[11] = {false, false, false, false, false, false, false, false, false, false, false};
+        PgTraceXactSpan *span = &spans[funcctx->call_cntr];
+        double duration_ms;
+        long secs;
+        int usecs;
+        HeapTuple tuple;
+
+        TimestampDifference(span->xact_start, span->xact_end, &secs, &usecs);
+        duration_ms = (double)secs * 1000.0 + (double)usecs / 1000.0;
+
+        values[0] = Int32GetDatum(span->pid);
+        values[1] = CStringGetTextDatum(span->request_id);
+        values[2] = TimestampTzGetDatum(span->xact_start);
+        values[3] = TimestampTzGetDatum(span->xact_end);
+        values[4] = Float8GetDatum(duration_ms);
+        values[5] = Int32GetDatum((int32)span->statements);
+        values[6] = Float8GetDatum(span->statement_time_ms);
+        values[7] = Float8GetDatum(Max(duration_ms - span->statement_time_ms, 0.0));
+        values[8] = BoolGetDatum(span->committed);
+        values[9] = UInt64GetDatum(span->shape);
+        values[10] = fingerprint_array(span->fingerprints, span->num_fingerprints);
+
+        if (span->request_id[0] == '\0')
+            nulls[1] = true;
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(pgtrace_internal_xact_shapes);
+
+PGDLLEXPORT Datum pgtrace_internal_xact_shapes(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    PgTraceXactShape *snapshot;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        uint32 count = 0;
+        uint32 i;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("pgtrace_internal_xact_shapes must be called in a context that accepts a record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        snapshot = palloc(PGTRACE_XACT_SHAPES * sizeof(PgTraceXactShape));
+
+        if (pgtrace_xact_state)
+        {
+            LWLockPadded *lock = GetNamedLWLockTranche("pgtrace_xact");
+
+            pgtrace_lock_acquire(PGTRACE_LOCK_XACT, &lock->lock, LW_SHARED);
+            for (i = 0; i < PGTRACE_XACT_SHAPE_HASH_SIZE && count < PGTRACE_XACT_SHAPES; i++)
+            {
+                if (pgtrace_xact_state->shapes[i].valid)
+                    snapshot[count++] = pgtrace_xact_state->shapes[i];
+            }
+            LWLockRelease(&lock->lock);
+        }
+
+        funcctx->user_fctx = snapshot;
+        funcctx->max_calls = count;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    snapshot = (PgTraceXactShape *)funcctx->user_fctx;
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[10];
+        bool nulls[10] = {false, false, false, false, false, false, false, false, false, false};
+        PgTraceXactShape *shape = &snapshot[funcctx->call_cntr];
+        uint64 xacts = shape->commits + shape->aborts;
+        HeapTuple tuple;
+
+        values[0] = UInt64GetDatum(shape->shape);
+        values[1] = UInt64GetDatum(shape->commits);
+        values[2] = UInt64GetDatum(shape->aborts);
+        values[3] = Float8GetDatum(xacts > 0 ? (double)shape->statements / xacts : 0.0);
+        values[4] = Float8GetDatum(shape->total_time_ms);
+        values[5] = Float8GetDatum(xacts > 0 ? shape->total_time_ms / xacts : 0.0);
+        values[6] = Float8GetDatum(shape->statement_time_ms);
+        values[7] = Float8GetDatum(Max(shape->total_time_ms - shape->statement_time_ms, 0.0));
+        values[8] = TimestampTzGetDatum(shape->last_seen);
+        values[9] = fingerprint_array(shape->fingerprints, shape->num_fingerprints);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <utils/timestamp.h>
+#include "query_hash.h"
+#include "ring.h"
+
+/*
+ * Transaction spans. Each backend accumulates the top-level statements of
+ * its current transaction and, from a transaction callback, publishes one
+ * span per transaction that ran any: timing, statement count, time spent
+ * in statements and the fingerprints involved. Spans go to a ring for
+ * recent history; per-shape totals go to a bounded table, where the shape
+ * is the sequence of distinct fingerprints in order of first execution.
+ * Single-statement implicit transactions only reach the ring: their shape
+ * would repeat pgtrace_query_stats. When the shape table is full, a new
+ * shape evicts the least recently seen of a few shapes sampled from
+ * evict_hand, the way the plan table does.
+ */
+#define PGTRACE_XACT_FINGERPRINTS 8
+
+typedef struct PgTraceXactSpan
+{
+    TimestampTz xact_start;
+    TimestampTz xact_end;
+    int pid;
+    bool committed;
+    uint32 statements;
+    double statement_time_ms;
+    uint64 shape;
+    uint32 num_fingerprints; /* distinct; only the first few are kept */
+    uint64 fingerprints[PGTRACE_XACT_FINGERPRINTS];
+    char request_id[PGTRACE_REQUEST_ID_LEN];
+} PgTraceXactSpan;
+
+typedef struct PgTraceXactSlot
+{
+    pg_atomic_uint64 seq;
+    PgTraceXactSpan span;
+} PgTraceXactSlot;
+
+typedef struct PgTraceXactShape
+{
+    uint64 shape;
+    bool valid;
+    uint64 commits;
+    uint64 aborts;
+    uint64 statements;
+    double total_time_ms;
+    double statement_time_ms;
+    TimestampTz last_seen;
+    uint32 num_fingerprints;
+    uint64 fingerprints[PGTRACE_XACT_FINGERPRINTS];
+} PgTraceXactShape;
+
+#define PGTRACE_XACT_SPANS 4096
+#define PGTRACE_XACT_SHAPES 1024
+#define PGTRACE_XACT_SHAPE_HASH_SIZE (PGTRACE_XACT_SHAPES * 2)
+
+typedef struct PgTraceXactState
+{
+    PgTraceRing ring;
+    PgTraceXactSlot spans[PGTRACE_XACT_SPANS];
+    uint32 num_shapes;
+    uint64 dropped_shapes;
+    uint64 evictions;
+    uint64 evict_hand;
+    PgTraceXactShape shapes[PGTRACE_XACT_SHAPE_HASH_SIZE];
+} PgTraceXactState;
+
+extern PgTraceXactState *pgtrace_xact_state;
+
+void pgtrace_xact_request_shmem(void);
+void pgtrace_xact_startup(void);
+void pgtrace_xact_init(void);
+void pgtrace_xact_fini(void);
+void pgtrace_xact_statement(uint64 fingerprint, double duration_ms);
+void pgtrace_xact_reset(void);
+
+PGDLLEXPORT Datum pgtrace_internal_xact_spans(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum pgtrace_internal_xact_shapes(PG_FUNCTION_ARGS);
@@ -0,0 +1,106 @@
+#!/usr/bin/env bash
+#
+# End-to-end check that idle connections do not pin audit blocks. Opens
+# more connections than there are audit blocks, has each audit one
+# statement and then sit idle, and checks that another session can still
+# store its events and that the audit log writer keeps up.
+#
+# Usage: test/audit_blocks_test.sh    (after "make install")
+#
+# Environment: PG_CONFIG (default pg_config), PGPORT (default 54333),
+# BACKENDS (default 700, more than the 640 audit blocks).
+
+set -euo pipefail
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$("$PG_CONFIG" --bindir)
+PGPORT=${PGPORT:-54333}
+BACKENDS=${BACKENDS:-700}
+STATEMENTS=2000
+
+WORKDIR=$(mktemp -d -t pgtrace-audit-blocks.XXXXXX)
+PGDATA="$WORKDIR/data"
+FAILED=0
+IDLE_PIDS=()
+
+cleanup()
+{
+    local pid
+    for pid in "${IDLE_PIDS[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    "$BINDIR/pg_ctl" -D "$PGDATA" -m immediate stop >/dev/null 2>&1 || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+sql()
+{
+    "$BINDIR/psql" -X -q -A -t -h "$WORKDIR" -p "$PGPORT" -d postgres -c "$1"
+}
+
+"$BINDIR/initdb" -D "$PGDATA" -A trust >/dev/null
+cat >>"$PGDATA/postgresql.conf" <<EOF
+shared_preload_libraries = 'pgtrace'
+max_connections = $((BACKENDS + 20))
+shared_buffers = 16MB
+pgtrace.audit_log = on
+EOF
+"$BINDIR/pg_ctl" -D "$PGDATA" -l "$WORKDIR/server.log" -w \
+    -o "-p $PGPORT -k $WORKDIR -c listen_addresses=''" start >/dev/null
+sql "CREATE EXTENSION pgtrace" >/dev/null
+
+# Each connection audits one statement, then stays open and idle.
+for i in $(seq 1 "$BACKENDS"); do
+    { echo "SELECT count(*) FROM pg_class;"; sleep 600; } |
+        "$BINDIR/psql" -X -q -h "$WORKDIR" -p "$PGPORT" -d postgres >/dev/null &
+    IDLE_PIDS+=($!)
+done
+
+for i in $(seq 1 300); do
+    idle=$(sql "SELECT count(*) FROM pg_stat_activity
+                WHERE state = 'idle' AND query LIKE 'SELECT count(*) FROM pg_class%'")
+    [ "$idle" -ge "$BACKENDS" ] && break
+    sleep 0.2
+done
+[ "$idle" -ge "$BACKENDS" ] || fail "only $idle of $BACKENDS connections went idle"
+
+# Give the idle connections time to hand their blocks back.
+sleep 2
+
+dropped_before=$(sql "SELECT dropped FROM pgtrace_ring_stats WHERE ring = 'audit'")
+
+for i in $(seq 1 "$STATEMENTS"); do
+    echo "SELECT $i AS audited;"
+done | "$BINDIR/psql" -X -q -h "$WORKDIR" -p "$PGPORT" -d postgres >/dev/null
+
+dropped=$(sql "SELECT dropped - $dropped_before FROM pgtrace_ring_stats WHERE ring = 'audit'")
+[ "$dropped" = 0 ] || fail "$dropped audit events dropped with $BACKENDS idle connections"
+
+stored=$(sql "SELECT count(*) FROM pgtrace_audit_events
+              WHERE fingerprint = pgtrace_fingerprint('SELECT 1 AS audited')")
+[ "$stored" = "$STATEMENTS" ] || fail "$stored of $STATEMENTS audited statements stored"
+
+# The writer must not stall on the blocks the idle connections held.
+for i in $(seq 1 50); do
+    backlog=$(sql "SELECT backlog FROM pgtrace_audit_log_stats")
+    [ "$backlog" = 0 ] && break
+    sleep 0.2
+done
+[ "$backlog" = 0 ] || fail "audit log writer still has a backlog of $backlog events"
+lost=$(sql "SELECT events_lost FROM pgtrace_audit_log_stats")
+[ "$lost" = 0 ] || fail "audit log writer lost $lost events"
+
+if [ "$FAILED" -ne 0 ]; then
+    echo "audit blocks test failed; server log:"
+    cat "$WORKDIR/server.log"
+    exit 1
+fi
+
+echo "audit blocks test passed"
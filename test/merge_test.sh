@@ -0,0 +1,135 @@
+#!/usr/bin/env bash
+#
+# End-to-end check of state dumps across clusters. Starts two throwaway
+# clusters with pgtrace preloaded, runs the same statement a different
+# number of times on each, and merges both dumps into the first one.
+#
+# Usage: test/merge_test.sh    (after "make install")
+#
+# Environment: PG_CONFIG (default pg_config), PGPORT (default 54331; the
+# second cluster uses PGPORT + 1).
+
+set -euo pipefail
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$("$PG_CONFIG" --bindir)
+PGPORT=${PGPORT:-54331}
+
+WORKDIR=$(mktemp -d -t pgtrace-merge.XXXXXX)
+FAILED=0
+
+STATEMENT="SELECT count(*) FROM pg_class WHERE relpages > 0"
+
+cleanup()
+{
+    local node
+    for node in a b; do
+        "$BINDIR/pg_ctl" -D "$WORKDIR/$node" -m immediate stop >/dev/null 2>&1 || true
+    done
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+port_of()
+{
+    if [ "$1" = a ]; then echo "$PGPORT"; else echo $((PGPORT + 1)); fi
+}
+
+start_node()
+{
+    "$BINDIR/initdb" -D "$WORKDIR/$1" -A trust >/dev/null
+    cat >>"$WORKDIR/$1/postgresql.conf" <<EOF
+shared_preload_libraries = 'pgtrace'
+cluster_name = 'node_$1'
+EOF
+    "$BINDIR/pg_ctl" -D "$WORKDIR/$1" -l "$WORKDIR/$1.log" -w \
+        -o "-p $(port_of "$1") -k $WORKDIR -c listen_addresses=''" start >/dev/null
+    sql "$1" "CREATE EXTENSION pgtrace" >/dev/null
+}
+
+sql()
+{
+    "$BINDIR/psql" -X -q -A -t -h "$WORKDIR" -p "$(port_of "$1")" -d postgres -c "$2"
+}
+
+run_statement()
+{
+    local i
+    for i in $(seq 1 "$2"); do
+        sql "$1" "$STATEMENT" >/dev/null
+    done
+}
+
+# Dump node $1 into $WORKDIR/$1.dump, as hex text.
+dump()
+{
+    sql "$1" "SELECT pgtrace_dump_state()" >"$WORKDIR/$1.dump"
+}
+
+# Merge dump file $2 into node $1; prints the number of fingerprints.
+merge()
+{
+    "$BINDIR/psql" -X -q -A -t -h "$WORKDIR" -p "$(port_of "$1")" -d postgres \
+        -v ON_ERROR_STOP=1 -v dump="$(cat "$2")" <<<"SELECT pgtrace_merge_state(:'dump');"
+}
+
+imported()
+{
+    sql a "SELECT $1 FROM pgtrace_imported_stats
+           WHERE fingerprint = pgtrace_fingerprint('$STATEMENT')"
+}
+
+start_node a
+start_node b
+
+run_statement a 3
+run_statement b 5
+
+dump a
+dump b
+cp "$WORKDIR/b.dump" "$WORKDIR/b.old.dump"
+
+merge a "$WORKDIR/a.dump" >/dev/null || fail "merging node a into itself failed"
+merge a "$WORKDIR/b.dump" >/dev/null || fail "merging node b into node a failed"
+
+[ "$(imported calls)" = 8 ] || fail "imported calls are $(imported calls), expected 8"
+[ "$(imported nodes)" = 2 ] || fail "imported from $(imported nodes) nodes, expected 2"
+[ "$(imported "p99_ms IS NOT NULL AND p99_ms <= max_time_ms")" = t ] ||
+    fail "imported p99 is missing or above the maximum"
+
+names=$(sql a "SELECT string_agg(node_name || ':' || local, ',' ORDER BY node_name)
+               FROM pgtrace_imported_nodes")
+[ "$names" = "node_a:true,node_b:false" ] || fail "imported nodes are $names"
+
+# A repeated merge replaces the node's previous dump instead of adding to it.
+merge a "$WORKDIR/b.dump" >/dev/null || fail "merging node b again failed"
+[ "$(imported calls)" = 8 ] || fail "calls after a repeated merge are $(imported calls), expected 8"
+
+# A later dump replaces the earlier one, an older one is refused.
+run_statement b 2
+dump b
+merge a "$WORKDIR/b.dump" >/dev/null || fail "merging the later dump of node b failed"
+[ "$(imported calls)" = 10 ] || fail "calls after a later dump are $(imported calls), expected 10"
+
+if merge a "$WORKDIR/b.old.dump" >/dev/null 2>&1; then
+    fail "an older dump of node b was merged"
+fi
+[ "$(imported calls)" = 10 ] || fail "calls after a refused merge are $(imported calls), expected 10"
+
+sql a "SELECT pgtrace_reset('imported')" >/dev/null
+[ "$(sql a "SELECT count(*) FROM pgtrace_imported_nodes")" = 0 ] ||
+    fail "imported nodes left after pgtrace_reset('imported')"
+
+if [ "$FAILED" -ne 0 ]; then
+    echo "merge test failed; server logs:"
+    cat "$WORKDIR/a.log" "$WORKDIR/b.log"
+    exit 1
+fi
+
+echo "merge test passed"
@@ -0,0 +1,130 @@
+#!/usr/bin/env bash
+#
+# End-to-end check of the OpenMetrics exporter. Starts a throwaway cluster
+# with pgtrace preloaded, runs a few statements and scrapes the endpoint
+# with curl, over TCP and over a Unix socket.
+#
+# Usage: test/openmetrics_test.sh    (after "make install")
+#
+# Environment: PG_CONFIG (default pg_config), PGPORT (default 54329),
+# METRICS_PORT (default 59187).
+
+set -euo pipefail
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$("$PG_CONFIG" --bindir)
+PGPORT=${PGPORT:-54329}
+METRICS_PORT=${METRICS_PORT:-59187}
+
+WORKDIR=$(mktemp -d -t pgtrace-openmetrics.XXXXXX)
+PGDATA="$WORKDIR/data"
+SOCKET="$WORKDIR/metrics.sock"
+BODY="$WORKDIR/body"
+FAILED=0
+
+cleanup()
+{
+    "$BINDIR/pg_ctl" -D "$PGDATA" -m immediate stop >/dev/null 2>&1 || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+start_cluster()
+{
+    "$BINDIR/pg_ctl" -D "$PGDATA" -l "$WORKDIR/server.log" -w \
+        -o "-p $PGPORT -k $WORKDIR -c listen_addresses=''" start >/dev/null
+}
+
+stop_cluster()
+{
+    "$BINDIR/pg_ctl" -D "$PGDATA" -w stop >/dev/null
+}
+
+wait_for_exporter()
+{
+    local i
+    for i in $(seq 1 50); do
+        if curl -sf "$@" -o /dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+"$BINDIR/initdb" -D "$PGDATA" -A trust >/dev/null
+cat >>"$PGDATA/postgresql.conf" <<EOF
+shared_preload_libraries = 'pgtrace'
+pgtrace.metrics_port = $METRICS_PORT
+pgtrace.metrics_cache_ttl = 5000
+EOF
+
+start_cluster
+URL="http://127.0.0.1:$METRICS_PORT/metrics"
+
+wait_for_exporter "$URL" || fail "exporter did not come up on port $METRICS_PORT"
+
+"$BINDIR/psql" -X -q -h "$WORKDIR" -p "$PGPORT" -d postgres \
+    -c "SELECT 1" -c "SELECT pg_sleep(0.01)" -c "SELECT count(*) FROM pg_class" >/dev/null
+
+# The exporter already rendered while we waited for it, so this response
+# may predate the statements above; counts are checked with TTL 0 below.
+headers=$(curl -sf -D - -o "$BODY" "$URL") || fail "GET /metrics failed"
+
+grep -qi '^content-type: application/openmetrics-text' <<<"$headers" ||
+    fail "wrong content type"
+tail -n 1 "$BODY" | grep -qx '# EOF' || fail "body does not end with # EOF"
+grep -q '^pgtrace_queries_total ' "$BODY" || fail "missing pgtrace_queries_total"
+grep -q '^pgtrace_query_duration_seconds_bucket{le="+Inf"} ' "$BODY" ||
+    fail "missing +Inf histogram bucket"
+grep -q '^pgtrace_query_duration_seconds_count ' "$BODY" || fail "missing histogram count"
+grep -q '^pgtrace_ring_events_total{ring="audit"} ' "$BODY" || fail "missing ring counters"
+
+# Within the TTL a second scrape must be served from the cache.
+first=$(grep '^pgtrace_exporter_renders_total ' "$BODY")
+curl -sf -o "$BODY" "$URL" || fail "second GET /metrics failed"
+second=$(grep '^pgtrace_exporter_renders_total ' "$BODY")
+[ "$first" = "$second" ] || fail "second scrape within TTL was re-rendered"
+
+status=$(curl -s -o /dev/null -w '%{http_code}' "http://127.0.0.1:$METRICS_PORT/other")
+[ "$status" = "404" ] || fail "unknown path returned $status instead of 404"
+
+status=$(curl -s -o /dev/null -w '%{http_code}' -X POST "$URL")
+[ "$status" = "405" ] || fail "POST returned $status instead of 405"
+
+stop_cluster
+
+# Unix socket, no cache: counts must reflect statements run just before.
+cat >>"$PGDATA/postgresql.conf" <<EOF
+pgtrace.metrics_socket = '$SOCKET'
+pgtrace.metrics_cache_ttl = 0
+EOF
+
+start_cluster
+wait_for_exporter --unix-socket "$SOCKET" http://localhost/metrics ||
+    fail "exporter did not come up on $SOCKET"
+
+"$BINDIR/psql" -X -q -h "$WORKDIR" -p "$PGPORT" -d postgres -c "SELECT 1" >/dev/null
+curl -sf --unix-socket "$SOCKET" -o "$BODY" http://localhost/metrics ||
+    fail "GET /metrics over Unix socket failed"
+total=$(awk '/^pgtrace_queries_total /{print $2}' "$BODY")
+[ "${total:-0}" -ge 1 ] || fail "pgtrace_queries_total is ${total:-missing} after running a statement"
+grep -q '^pgtrace_database_query_duration_seconds_count{datid="[0-9]*"} ' "$BODY" ||
+    fail "missing per-database histogram"
+
+stop_cluster
+[ ! -e "$SOCKET" ] || fail "socket file left behind after shutdown"
+
+if [ "$FAILED" -ne 0 ]; then
+    echo "openmetrics test failed; server log:"
+    cat "$WORKDIR/server.log"
+    exit 1
+fi
+
+echo "openmetrics test passed"
@@ -0,0 +1,217 @@
+--
+-- pgtrace views under a known workload
+--
+CREATE EXTENSION pgtrace;
+CREATE TABLE regress_items (id int PRIMARY KEY, label text);
+INSERT INTO regress_items SELECT g, 'item ' || g FROM generate_series(1, 100) g;
+SELECT pgtrace_reset() IS NOT NULL AS t;
+SELECT queries_total AS total_before, queries_failed AS failed_before,
+       queries_cancelled AS cancelled_before
+FROM pgtrace_metrics \gset
+-- five executions of one fingerprint that differ only in literals
+SELECT label AS item_label FROM regress_items WHERE id = 1;
+SELECT label AS item_label FROM regress_items WHERE id = 2;
+SELECT label AS item_label FROM regress_items WHERE id = 3;
+SELECT label AS item_label FROM regress_items WHERE id = 4;
+SELECT label AS item_label FROM regress_items WHERE id = 5;
+SELECT calls, errors, total_rows_returned AS rows_out
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS item_label FROM regress_items WHERE id = 0;');
+-- failures are recorded against their fingerprint with their SQLSTATE
+SELECT 1 / (id - id) AS boom FROM regress_items WHERE id = 1;
+SELECT 1 / (id - id) AS boom FROM regress_items WHERE id = 1;
+SELECT calls, errors
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT 1 / (id - id) AS boom FROM regress_items WHERE id = 1;');
+-- sliding windows count the same calls as the totals
+SELECT round(calls_per_sec_15m * 900) AS calls_15m, round(errors_per_sec_15m * 900) AS errors_15m,
+       abs(mean_ms_15m - avg_time_ms) < 1e-6 AS mean_ok, p99_ms_15m <= max_time_ms AS p99_ok
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT 1 / (id - id) AS boom FROM regress_items WHERE id = 1;');
+SELECT error_code, error_count
+FROM pgtrace_failing_queries
+WHERE fingerprint = pgtrace_fingerprint('SELECT 1 / (id - id) AS boom FROM regress_items WHERE id = 1;');
+-- cancellation
+SET statement_timeout = '100ms';
+SELECT pg_sleep(5);
+RESET statement_timeout;
+SELECT queries_failed - :failed_before AS failed,
+       queries_cancelled - :cancelled_before AS cancelled,
+       queries_total - :total_before >= 8 AS total_ok
+FROM pgtrace_metrics;
+-- nothing is recorded while disabled
+SET pgtrace.enabled = off;
+SELECT label AS item_label FROM regress_items WHERE id = 6;
+RESET pgtrace.enabled;
+SELECT calls
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS item_label FROM regress_items WHERE id = 0;');
+-- breakdown by role and database
+SELECT db_user = current_user AS user_ok, database = current_database() AS db_ok, calls
+FROM pgtrace_query_breakdown
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS item_label FROM regress_items WHERE id = 0;');
+-- audit events, and the pgtrace.audit switch
+SELECT count(*) AS audited
+FROM pgtrace_audit_events
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS item_label FROM regress_items WHERE id = 0;');
+SET pgtrace.audit = off;
+SELECT label AS item_label FROM regress_items WHERE id = 7;
+RESET pgtrace.audit;
+SELECT count(*) AS audited
+FROM pgtrace_audit_events
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS item_label FROM regress_items WHERE id = 0;');
+SELECT operation, db_user = current_user AS user_ok, database = current_database() AS db_ok,
+       rows_affected, duration_ms >= 0 AS duration_ok
+FROM pgtrace_audit_events
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS item_label FROM regress_items WHERE id = 0;')
+LIMIT 1;
+SELECT calls
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS item_label FROM regress_items WHERE id = 0;');
+-- latency histogram and quantiles
+SELECT count(*) FILTER (WHERE le_ms = 'Infinity') AS inf_rows,
+       max(queries) = (SELECT queries_total FROM pgtrace_metrics) AS consistent
+FROM pgtrace_latency_histogram;
+SELECT pgtrace_latency_quantile(0.99) >= pgtrace_latency_quantile(0.5) AS monotonic,
+       pgtrace_latency_quantile(0.99, oid) IS NOT NULL AS per_db
+FROM pg_database WHERE datname = current_database();
+SELECT pgtrace_latency_quantile(1.5);
+-- parallel workers leave the recording to the leader
+SELECT parallel_queries AS parallel_before FROM pgtrace_metrics \gset
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT count(*) AS parallel_count FROM regress_items;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+SELECT calls
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT count(*) AS parallel_count FROM regress_items;');
+SELECT parallel_queries - :parallel_before AS parallel, workers_planned > 0 AS planned
+FROM pgtrace_metrics;
+-- trace context from a sqlcommenter comment, which the fingerprint ignores
+/*traceparent='00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01'*/ SELECT count(*) AS traced_count FROM regress_items;
+SET pgtrace.traceparent = '00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-00';
+SELECT count(*) AS unsampled_count FROM regress_items;
+RESET pgtrace.traceparent;
+SET pgtrace.traceparent = 'not-a-traceparent';
+SELECT trace_id, parent_span_id, operation, rows
+FROM pgtrace_spans
+WHERE trace_id IN ('4bf92f3577b34da6a3ce929d0e0e4736', '0af7651916cd43dd8448eb211c80319c');
+SELECT calls
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT count(*) AS traced_count FROM regress_items;');
+
+-- executions by request id, including ids longer than the log keeps
+SET pgtrace.request_id = 'regress-request-1';
+SELECT count(*) AS request_count FROM regress_items;
+RESET pgtrace.request_id;
+SELECT count(*) AS executions, bool_and(toplevel) AS toplevel, bool_and(NOT failed) AS succeeded
+FROM pgtrace_request('regress-request-1');
+SELECT repeat('r', 100) AS long_request_id \gset
+SET pgtrace.request_id = :'long_request_id';
+SELECT count(*) AS request_count FROM regress_items;
+RESET pgtrace.request_id;
+SELECT count(*) AS executions, bool_and(toplevel) AS toplevel, bool_and(NOT failed) AS succeeded
+FROM pgtrace_request(:'long_request_id');
+-- state dumps merge into the imported table, replacing the node's previous dump
+SELECT pgtrace_dump_state() AS old_dump \gset
+SELECT pgtrace_merge_state(pgtrace_dump_state()) > 0 AS merged;
+SELECT pgtrace_merge_state(pgtrace_dump_state()) > 0 AS merged_again;
+SELECT nodes, calls, errors, p99_ms <= max_time_ms AS p99_ok
+FROM pgtrace_imported_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT 1 / (id - id) AS boom FROM regress_items WHERE id = 1;');
+SELECT count(*) AS nodes, bool_and(local) AS local, bool_and(queries > 0) AS has_queries
+FROM pgtrace_imported_nodes;
+\set VERBOSITY terse
+SELECT pgtrace_merge_state(:'old_dump');
+\set VERBOSITY default
+SELECT pgtrace_merge_state('\x00'::bytea);
+-- microbenchmarks, one row per kernel and fill level
+SELECT kernel, fill_factor, ops, ns_min <= ns_p50 AND ns_p50 <= ns_p99 AND ns_p99 <= ns_max AS ordered
+FROM pgtrace_bench('all', 200);
+SELECT * FROM pgtrace_bench('bogus');
+-- columnar export: magic and row count in the header (read little-endian)
+SELECT substring(b from 1 for 8) = 'PGTRCOL1'::bytea AS magic,
+       (SELECT sum(get_byte(b, 16 + i)::bigint << (8 * i)) FROM generate_series(0, 7) i) = q.n AS row_count
+FROM pgtrace_export_bytea('queries') b, (SELECT count(*) AS n FROM pgtrace_query_stats) q;
+SELECT pgtrace_export_bytea('bogus');
+-- plans per fingerprint: a sequential scan, then an index scan
+SET enable_indexscan = off;
+SET enable_bitmapscan = off;
+SELECT label AS planned_label FROM regress_items WHERE id = 7;
+SELECT label AS planned_label FROM regress_items WHERE id = 8;
+RESET enable_indexscan;
+RESET enable_bitmapscan;
+SET enable_seqscan = off;
+SELECT label AS planned_label FROM regress_items WHERE id = 9;
+RESET enable_seqscan;
+SELECT count(*) AS plans, sum(calls) AS calls
+FROM pgtrace_query_plans
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS planned_label FROM regress_items WHERE id = 0;');
+SELECT plan_count, previous_calls, current_calls, previous_plan_hash <> current_plan_hash AS changed
+FROM pgtrace_plan_changes
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS planned_label FROM regress_items WHERE id = 0;');
+-- transaction spans and shapes, for a committed and an aborted transaction
+SET pgtrace.request_id = 'regress-xact-commit';
+BEGIN;
+SELECT count(*) AS xact_items FROM regress_items;
+SELECT label AS xact_label FROM regress_items WHERE id = 3;
+COMMIT;
+SET pgtrace.request_id = 'regress-xact-abort';
+BEGIN;
+SELECT count(*) AS xact_items FROM regress_items;
+SELECT 1 / (id - id) AS xact_boom FROM regress_items WHERE id = 1;
+ROLLBACK;
+RESET pgtrace.request_id;
+SELECT request_id, statements, committed, cardinality(fingerprints) AS fingerprints
+FROM pgtrace_xact_spans
+WHERE request_id LIKE 'regress-xact-%'
+ORDER BY xact_end;
+SELECT commits, aborts, mean_statements
+FROM pgtrace_xact_shapes
+WHERE fingerprints[2] IN (pgtrace_fingerprint('SELECT label AS xact_label FROM regress_items WHERE id = 0;'),
+                          pgtrace_fingerprint('SELECT 1 / (id - id) AS xact_boom FROM regress_items WHERE id = 1;'))
+ORDER BY commits DESC;
+-- pgtrace's own cost: one row per hook, lock, probe bucket, table and ring
+SELECT category, count(*) AS names, bool_and(value >= 0) AS non_negative
+FROM pgtrace_self_stats
+GROUP BY category
+ORDER BY category;
+SELECT value > 0 AS called, time_ms > 0 AS timed
+FROM pgtrace_self_stats
+WHERE category = 'hook' AND name = 'executor_end';
+-- active session history samples a statement that waits longer than the sample interval
+SELECT pg_sleep(0.5) AS ash_sleep;
+SELECT sum(samples) > 0 AS sampled, bool_and(wait_event_type = 'Timeout') AS timeout_wait
+FROM pgtrace_ash
+WHERE fingerprint = pgtrace_fingerprint('SELECT pg_sleep(0.5) AS ash_sleep;') AND wait_event = 'PgSleep';
+-- the running statement shows up in pgtrace_active_queries
+SET pgtrace.request_id = 'regress-active';
+SELECT fingerprint = pgtrace_fingerprint(current_query()) AS own_statement, request_id,
+       concurrent_executions, elapsed_ms >= 0 AS elapsed_ok
+FROM pgtrace_active_queries
+WHERE pid = pg_backend_pid();
+RESET pgtrace.request_id;
+-- capacity
+SELECT tracked_queries > 0 AS tracked, untracked_calls, untracked_time_pct AS untracked_pct
+FROM pgtrace_capacity;
+-- resets by fingerprint and by component
+SELECT pgtrace_reset_query(pgtrace_fingerprint('SELECT count(*) AS traced_count FROM regress_items;')) AS found;
+SELECT count(*) AS remaining
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT count(*) AS traced_count FROM regress_items;');
+SELECT pgtrace_reset('slow_queries') IS NOT NULL AS t;
+SELECT count(*) AS slow_remaining FROM pgtrace_slow_queries;
+SELECT pgtrace_reset('bogus');
+SELECT count(*) AS components, bool_and(resets > 0) AS all_reset FROM pgtrace_stats_resets;
+-- reset
+SELECT pgtrace_reset() IS NOT NULL AS t;
+SELECT count(*) AS remaining
+FROM pgtrace_query_stats
+WHERE fingerprint = pgtrace_fingerprint('SELECT label AS item_label FROM regress_items WHERE id = 0;');
+DROP TABLE regress_items;
+DROP EXTENSION pgtrace;